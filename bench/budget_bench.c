@@ -0,0 +1,73 @@
+/*
+    Budget benchmark. Runs a loop of calls with no budget and then in slices of a few sizes, resuming after every
+    one, to see what checking and stopping cost. Then it runs `while (true) {}` with no budget at all and has
+    a timer signal interrupt it, to see how soon it stops.
+
+    Build and run with `make bench && ./bench/budget_bench [iterations]`
+*/
+
+#include <signal.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/time.h>
+#include <time.h>
+
+#include "vm.h"
+
+static double now() {
+    struct timespec time;
+    clock_gettime(CLOCK_MONOTONIC, &time);
+    return time.tv_sec + time.tv_nsec / 1e9;
+}
+
+static volatile double interruptedAt;
+
+static void onAlarm(int signal) {
+    interruptedAt = now();
+    interruptVM(&vm);
+}
+
+/* Returns the number of slices it took */
+static long runSliced(const char* source) {
+    long slices = 1;
+    InterpretResult result = interpret(source);
+    while (result == INTERPRET_YIELD) {
+        ++slices;
+        result = resumeVM();
+    }
+    if (result != INTERPRET_OK) exit(1);
+    return slices;
+}
+
+int main(int argc, char* argv[]) {
+    int iterations = argc > 1 ? atoi(argv[1]) : 5000000;
+    char source[256];
+    snprintf(source, sizeof(source),
+             "fun f(x) { return x + 1; } var t = 0; for (var i = 0; i < %d; i = i + 1) t = f(t);", iterations);
+
+    initVM();
+    printf("%d iterations of a loop with a call\n", iterations);
+    printf("budget     slices       ms\n");
+    long budgets[] = {0, 1000000, 10000, 100};
+    for (int i = 0; i < (int)(sizeof(budgets) / sizeof(budgets[0])); ++i) {
+        setBudget(budgets[i]);
+        double start = now();
+        long slices = runSliced(source);
+        printf("%7ld  %8ld  %7.1f\n", budgets[i], slices, (now() - start) * 1e3);
+    }
+
+    setBudget(0);
+    signal(SIGALRM, onAlarm);
+    struct itimerval timer;
+    memset(&timer, 0, sizeof(timer));
+    timer.it_value.tv_usec = 100000;
+    setitimer(ITIMER_REAL, &timer, NULL);
+
+    InterpretResult result = interpret("while (true) {}");
+    double stopped = now();
+    printf("while (true) {} %s %.1f us after the interrupt\n",
+           result == INTERPRET_YIELD ? "stopped" : "did not stop", (stopped - interruptedAt) * 1e6);
+    freeVM();
+    return 0;
+}
@@ -0,0 +1,102 @@
+/*
+    Compiler throughput benchmark. It generates a large script in memory, the way our code generators do,
+    and reports how fast it gets scanned and compiled.
+
+    Build and run with `make bench && ./bench/compile_bench [megabytes]`
+*/
+
+#include <stdarg.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include "compiler.h"
+#include "scanner.h"
+#include "vm.h"
+
+typedef struct {
+    char* chars;
+    size_t length;
+    size_t capacity;
+    long statements;
+} Script;
+
+static void append(Script* script, int statements, const char* format, ...) {
+    char line[512];
+    va_list args;
+    va_start(args, format);
+    int length = vsnprintf(line, sizeof(line), format, args);
+    va_end(args);
+
+    if (script->length + length + 1 > script->capacity) {
+        script->capacity = script->capacity * 2 + length + 1;
+        script->chars = realloc(script->chars, script->capacity);
+    }
+    memcpy(script->chars + script->length, line, length + 1);
+    script->length += length;
+    script->statements += statements;
+}
+
+/*
+    A mix of the statements our generators emit: globals, arithmetic, branches, loops and blocks. Every function
+    takes a constant of its own in the script's chunk, so those are only declared up front.
+*/
+static void generate(Script* script, size_t size) {
+    for (int i = 0; i < 32; ++i) {
+        append(script, 5, "fun h%d(x, y) { var s = x; for (var i = 0; i < y; i = i + 1) { s = s + i; } return s; }\n", i);
+    }
+
+    for (int i = 0; script->length < size; ++i) {
+        int g = i % 64;
+        switch (i % 5) {
+            case 0: append(script, 1, "var g%d = %d;\n", g, i % 100); break;
+            case 1: append(script, 1, "g%d = g%d + %d * g%d;\n", g, (g + 1) % 64, i % 10, (g + 2) % 64); break;
+            case 2: append(script, 5, "if (g%d < %d) { var a = g%d; a = a + 1; g%d = a; } else { g%d = g%d - 1; }\n",
+                           g, i % 50, g, g, g, g); break;
+            case 3: append(script, 2, "while (g%d > 100) { g%d = h%d(g%d, 2) \\ 2; }\n", g, g, i % 32, g); break;
+            case 4: append(script, 6, "{ var p = %d; var q = p * 2; { var r = q + p; q = r; } }\n", i % 7); break;
+        }
+    }
+}
+
+static double now() {
+    struct timespec time;
+    clock_gettime(CLOCK_MONOTONIC, &time);
+    return time.tv_sec + time.tv_nsec / 1e9;
+}
+
+int main(int argc, const char* argv[]) {
+    size_t megabytes = argc > 1 ? (size_t)atol(argv[1]) : 10;
+    Script script = {NULL, 0, 0, 0};
+    generate(&script, megabytes * 1024 * 1024);
+
+    /* Scanning on its own, which also gives us the token count */
+    double start = now();
+    long tokens = 0;
+    initScanner(script.chars, script.length);
+    while (scanToken().type != TOKEN_EOF) ++tokens;
+    double scanTime = now() - start;
+
+    initVM();
+    start = now();
+    ObjFunction* function = compile(script.chars);
+    double compileTime = now() - start;
+
+    if (function == NULL) {
+        fprintf(stderr, "The generated script failed to compile.\n");
+        return 1;
+    }
+
+    double size = script.length / (1024.0 * 1024.0);
+    printf("script:      %.1f MB, %ld tokens, %ld statements, %d bytes of bytecode\n",
+           size, tokens, script.statements, function->chunk.count);
+    printf("scan:        %.3f s (%.1f MB/s)\n", scanTime, size / scanTime);
+    printf("compile:     %.3f s (%.1f MB/s)\n", compileTime, size / compileTime);
+    printf("tokens:      %.0f tokens/s\n", tokens / compileTime);
+    printf("statements:  %.0f statements/s\n", script.statements / compileTime);
+
+    freeVM();
+    free(script.chars);
+    return 0;
+}
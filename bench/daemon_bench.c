@@ -0,0 +1,117 @@
+/*
+    Daemon benchmark. Times a tiny script that calls into a prelude, run by starting `./qamar` for every run
+    and run by a daemon's warm workers through the client call the `--connect` mode makes. The prelude is
+    compiled for every process start, the daemon only did it once.
+
+    Build and run from the repository with `make && make bench && ./bench/daemon_bench [runs] [prelude functions]`
+*/
+
+#include <fcntl.h>
+#include <signal.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <sys/wait.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "daemon.h"
+#include "source.h"
+#include "vm.h"
+
+static char directory[] = "/tmp/qamar_daemon_bench_XXXXXX";
+
+static double now() {
+    struct timespec time;
+    clock_gettime(CLOCK_MONOTONIC, &time);
+    return time.tv_sec + time.tv_nsec / 1e9;
+}
+
+static void writeFile(const char* path, const char* format, int count) {
+    FILE* file = fopen(path, "w");
+    if (file == NULL) {
+        perror(path);
+        exit(1);
+    }
+    for (int i = 0; i < count; ++i) fprintf(file, format, i, i);
+    fclose(file);
+}
+
+/* The daemon's child for a request runs the script the way the interpreter would */
+static void serve(const char* socket, const char* prelude) {
+    initVM();
+    const char* path = serveScripts(socket, prelude, 2);
+    Source source;
+    if (!loadSource(path, &source)) exit(74);
+    exit(interpret(source.chars) == INTERPRET_OK ? 0 : 70);
+}
+
+static double timeProcesses(const char* script, int runs) {
+    double start = now();
+    for (int i = 0; i < runs; ++i) {
+        pid_t child = fork();
+        if (child == 0) {
+            execl("./qamar", "./qamar", script, "7", (char*)NULL);
+            _exit(127);
+        }
+        int status;
+        waitpid(child, &status, 0);
+        if (!WIFEXITED(status) || WEXITSTATUS(status) != 0) return -1;
+    }
+    return (now() - start) / runs;
+}
+
+static double timeDaemon(const char* socket, const char* script, int runs) {
+    char* arguments[] = {"7"};
+    double start = now();
+    for (int i = 0; i < runs; ++i) {
+        if (requestScript(socket, script, 1, arguments) != 0) return -1;
+    }
+    return (now() - start) / runs;
+}
+
+int main(int argc, char* argv[]) {
+    int runs = argc > 1 ? atoi(argv[1]) : 200;
+    int functions = argc > 2 ? atoi(argv[2]) : 100;
+    if (mkdtemp(directory) == NULL) {
+        perror(directory);
+        return 1;
+    }
+
+    char prelude[256], script[256], combined[256], socket[256];
+    snprintf(prelude, sizeof(prelude), "%s/prelude.qmr", directory);
+    snprintf(script, sizeof(script), "%s/job.qmr", directory);
+    snprintf(combined, sizeof(combined), "%s/combined.qmr", directory);
+    snprintf(socket, sizeof(socket), "%s/qamar.sock", directory);
+
+    /* The process runs get the prelude as part of the script, they have nothing warm to start from */
+    const char* function = "fun f%d(x) { var total = 0; for (var i = 0; i < x; i = i + 1) total = total + i * %d; return total; }\n";
+    writeFile(prelude, function, functions);
+    writeFile(script, "print f1(num(argument(0)));\n", 1);
+    char command[1024];
+    snprintf(command, sizeof(command), "cat %s %s > %s", prelude, script, combined);
+    if (system(command) != 0) return 1;
+
+    pid_t daemon = fork();
+    if (daemon == 0) serve(socket, prelude);
+    while (requestScript(socket, "/dev/null", 0, NULL) < 0) usleep(1000); /* Until it listens */
+
+    /* The runs print, the numbers are all we want to see */
+    int saved = dup(STDOUT_FILENO);
+    int null = open("/dev/null", O_WRONLY);
+    dup2(null, STDOUT_FILENO);
+    timeDaemon(socket, script, 10);
+    double processes = timeProcesses(combined, runs);
+    double served = timeDaemon(socket, script, runs);
+    dup2(saved, STDOUT_FILENO);
+
+    printf("%d runs, a prelude of %d functions\n", runs, functions);
+    if (processes < 0) printf("process per run:  needs ./qamar built\n");
+    else printf("process per run:  %8.1f us\n", processes * 1e6);
+    printf("daemon:           %8.1f us\n", served * 1e6);
+
+    kill(daemon, SIGTERM);
+    waitpid(daemon, NULL, 0);
+    snprintf(command, sizeof(command), "rm -rf %s", directory);
+    if (system(command) != 0) fprintf(stderr, "Could not remove %s\n", directory);
+    return 0;
+}
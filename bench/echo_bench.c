@@ -0,0 +1,169 @@
+/*
+    Event loop benchmark. A script serves echo over TCP on loopback, one fiber per connection, all on one VM.
+    The clients are plain C on another thread: first a single connection doing round trips one after the
+    other, then lots of connections at once each doing a few, driven by an epoll of their own.
+
+    Build and run with `make bench && ./bench/echo_bench [connections]`
+*/
+
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/epoll.h>
+#include <sys/resource.h>
+#include <sys/socket.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "vm.h"
+
+#define MESSAGE_SIZE 64
+#define LATENCY_ROUNDS 20000
+#define ROUNDS_PER_CONNECTION 20
+
+static const char* serverScript =
+    "fun serve(conn) {\n"
+    "    var chunk;\n"
+    "    while ((chunk = readChunk(conn, 4096)) != nil) write(conn, chunk);\n"
+    "    close(conn); }\n"
+    "fun server(listener, count) {\n"
+    "    for (var i = 0; i < count; i = i + 1) go(serve, accept(listener));\n"
+    "    close(listener); }\n"
+    "go(server, listen(port), count);\n"
+    "runLoop();\n";
+
+typedef struct {
+    int fd;
+    int received;
+    int rounds;
+} Connection;
+
+static int port;
+static int connections;
+static char message[MESSAGE_SIZE];
+
+static double now() {
+    struct timespec time;
+    clock_gettime(CLOCK_MONOTONIC, &time);
+    return time.tv_sec + time.tv_nsec / 1e9;
+}
+
+static void* runServer(void* argument) {
+    char source[1024];
+    snprintf(source, sizeof(source), "var port = %d;\nvar count = %d;\n%s", port, connections + 1, serverScript);
+    initVM();
+    if (interpret(source) != INTERPRET_OK) exit(1);
+    freeVM();
+    return NULL;
+}
+
+static int freePort() {
+    struct sockaddr_in address = {.sin_family = AF_INET, .sin_addr.s_addr = htonl(INADDR_LOOPBACK)};
+    socklen_t length = sizeof(address);
+    int fd = socket(AF_INET, SOCK_STREAM, 0);
+    bind(fd, (struct sockaddr*)&address, length);
+    getsockname(fd, (struct sockaddr*)&address, &length);
+    close(fd);
+    return ntohs(address.sin_port);
+}
+
+/* The server may not be listening yet */
+static int connectToServer() {
+    struct sockaddr_in address = {.sin_family = AF_INET, .sin_port = htons(port),
+                                  .sin_addr.s_addr = htonl(INADDR_LOOPBACK)};
+    for (;;) {
+        int fd = socket(AF_INET, SOCK_STREAM, 0);
+        if (connect(fd, (struct sockaddr*)&address, sizeof(address)) == 0) {
+            int on = 1;
+            setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &on, sizeof(on));
+            return fd;
+        }
+        close(fd);
+        usleep(1000);
+    }
+}
+
+static void roundTrip(int fd) {
+    char buffer[MESSAGE_SIZE];
+    if (write(fd, message, MESSAGE_SIZE) != MESSAGE_SIZE) exit(1);
+    for (int received = 0; received < MESSAGE_SIZE; ) {
+        ssize_t count = read(fd, buffer, MESSAGE_SIZE - received);
+        if (count <= 0) exit(1);
+        received += (int)count;
+    }
+}
+
+/* Every connection sends, waits for its echo and sends again, until each has done its rounds */
+static double runConcurrent() {
+    Connection* all = malloc(sizeof(Connection) * connections);
+    int epoll = epoll_create1(0);
+    for (int i = 0; i < connections; ++i) {
+        all[i] = (Connection){connectToServer(), 0, 0};
+        struct epoll_event event = {.events = EPOLLIN, .data.ptr = &all[i]};
+        epoll_ctl(epoll, EPOLL_CTL_ADD, all[i].fd, &event);
+    }
+
+    double start = now();
+    for (int i = 0; i < connections; ++i) {
+        if (write(all[i].fd, message, MESSAGE_SIZE) != MESSAGE_SIZE) exit(1);
+    }
+
+    char buffer[MESSAGE_SIZE];
+    int open = connections;
+    struct epoll_event events[256];
+    while (open > 0) {
+        int count = epoll_wait(epoll, events, 256, -1);
+        for (int i = 0; i < count; ++i) {
+            Connection* connection = events[i].data.ptr;
+            ssize_t bytes = read(connection->fd, buffer, MESSAGE_SIZE - connection->received);
+            if (bytes <= 0) exit(1);
+            connection->received += (int)bytes;
+            if (connection->received < MESSAGE_SIZE) continue;
+
+            connection->received = 0;
+            if (++connection->rounds < ROUNDS_PER_CONNECTION) {
+                if (write(connection->fd, message, MESSAGE_SIZE) != MESSAGE_SIZE) exit(1);
+            } else {
+                close(connection->fd);
+                --open;
+            }
+        }
+    }
+    double elapsed = now() - start;
+
+    close(epoll);
+    free(all);
+    return elapsed;
+}
+
+int main(int argc, char* argv[]) {
+    connections = argc > 1 ? atoi(argv[1]) : 1000;
+    memset(message, 'x', MESSAGE_SIZE);
+
+    /* Both ends of every connection are in this process */
+    struct rlimit limit;
+    getrlimit(RLIMIT_NOFILE, &limit);
+    limit.rlim_cur = limit.rlim_max;
+    setrlimit(RLIMIT_NOFILE, &limit);
+
+    port = freePort();
+    pthread_t server;
+    pthread_create(&server, NULL, runServer, NULL);
+
+    int fd = connectToServer();
+    double start = now();
+    for (int i = 0; i < LATENCY_ROUNDS; ++i) roundTrip(fd);
+    double elapsed = now() - start;
+    close(fd);
+    printf("1 connection      %.2f us per round trip\n", elapsed / LATENCY_ROUNDS * 1e6);
+
+    elapsed = runConcurrent();
+    long total = (long)connections * ROUNDS_PER_CONNECTION;
+    printf("%d connections  %.3f s, %.0f round trips/s\n", connections, elapsed, total / elapsed);
+
+    pthread_join(server, NULL);
+    return 0;
+}
@@ -0,0 +1,53 @@
+/*
+    Fiber switching benchmark. A producer fiber yields numbers to a consumer on the main fiber, every number
+    costs a `resume` and a `yield`, so two switches. The same loop with a plain function call is timed next
+    to it for comparison.
+
+    Build and run with `make bench && ./bench/fiber_bench [millions]`
+*/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <time.h>
+
+#include "vm.h"
+
+static double now() {
+    struct timespec time;
+    clock_gettime(CLOCK_MONOTONIC, &time);
+    return time.tv_sec + time.tv_nsec / 1e9;
+}
+
+static const char* fiberScript =
+    "fun produce() { var i = 0; while (true) { yield i; i = i + 1; } }\n"
+    "var producer = fiber(produce);\n"
+    "var sum = 0;\n"
+    "for (var i = 0; i < count; i = i + 1) sum = sum + resume(producer);\n";
+
+static const char* callScript =
+    "var next = 0;\n"
+    "fun produce() { next = next + 1; return next; }\n"
+    "var sum = 0;\n"
+    "for (var i = 0; i < count; i = i + 1) sum = sum + produce();\n";
+
+static double run(const char* script, int count) {
+    char source[1024];
+    snprintf(source, sizeof(source), "var count = %d;\n%s", count, script);
+
+    initVM();
+    double start = now();
+    if (interpret(source) != INTERPRET_OK) exit(1);
+    double elapsed = now() - start;
+    freeVM();
+    return elapsed;
+}
+
+int main(int argc, char* argv[]) {
+    int count = (argc > 1 ? atoi(argv[1]) : 10) * 1000000;
+
+    double fibers = run(fiberScript, count);
+    double calls = run(callScript, count);
+    printf("resume/yield %.3f s, %.1f ns per switch\n", fibers, fibers / count / 2 * 1e9);
+    printf("plain call   %.3f s, %.1f ns per call\n", calls, calls / count * 1e9);
+    return 0;
+}
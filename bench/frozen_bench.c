@@ -0,0 +1,60 @@
+/*
+    Frozen value benchmark. Sends a big string to another thread over and over, once as a plain string that
+    gets copied into the receiving VM every time and once frozen, where only a pointer goes through.
+
+    Build and run with `make bench && ./bench/frozen_bench [kilobytes]`
+*/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <time.h>
+
+#include "vm.h"
+
+#define SENDS 1000
+
+static const char* script =
+    "fun consume(inbox, count, done) {\n"
+    "    for (var i = 0; i < count; i = i + 1) recv(inbox);\n"
+    "    send(done, true); }\n"
+    "var data = \"x\";\n"
+    "while (size > 1) { data = data + data; size = size / 2; }\n"
+    "if (frozen) data = freeze(data);\n"
+    "var inbox = channel(16);\n"
+    "var done = channel(1);\n"
+    "spawn(consume, inbox, count, done);\n"
+    "for (var i = 0; i < count; i = i + 1) send(inbox, data);\n"
+    "recv(done);\n";
+
+static double now() {
+    struct timespec time;
+    clock_gettime(CLOCK_MONOTONIC, &time);
+    return time.tv_sec + time.tv_nsec / 1e9;
+}
+
+static double run(long size, int count, bool frozen) {
+    char source[1024];
+    snprintf(source, sizeof(source), "var size = %ld;\nvar count = %d;\nvar frozen = %s;\n%s",
+             size, count, frozen ? "true" : "false", script);
+
+    double start = now();
+    if (interpret(source) != INTERPRET_OK) exit(1);
+    return now() - start;
+}
+
+int main(int argc, char* argv[]) {
+    long kilobytes = argc > 1 ? atol(argv[1]) : 1024;
+    initVM();
+
+    /* The string is built by doubling, so the size is the next power of two */
+    long size = 1;
+    while (size < kilobytes * 1024) size *= 2;
+
+    double copied = run(size, SENDS, false);
+    double frozen = run(size, SENDS, true);
+    printf("%ld KB x %d sends  copied %.2f ms  frozen %.2f ms  (%.1f us vs %.1f us per send)\n",
+           size / 1024, SENDS, copied * 1e3, frozen * 1e3, copied / SENDS * 1e6, frozen / SENDS * 1e6);
+
+    freeVM();
+    return 0;
+}
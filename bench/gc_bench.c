@@ -0,0 +1,74 @@
+/*
+    Garbage collector benchmark. Builds a linked list out of closures that stays live, then for every thread
+    count makes as much garbage again and times one full collection: marking the list and sweeping the garbage.
+    The automatic collections are turned off, so the heap is exactly that big when we collect.
+
+    Build and run with `make bench && ./bench/gc_bench [nodes] [most threads]`
+*/
+
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <time.h>
+
+#include "vm.h"
+
+static const char* buildScript =
+    "fun node(value, next) {\n"
+    "    fun get(first) { if (first) return value; return next; }\n"
+    "    return get; }\n"
+    "var list = nil;\n"
+    "for (var i = 0; i < count; i = i + 1) list = node(i, list);\n";
+
+static const char* garbageScript =
+    "for (var i = 0; i < count; i = i + 1) node(i, nil);\n";
+
+/* Calling nil fails the script, so a list the collector broke fails the benchmark */
+static const char* checkScript =
+    "var length = 0;\n"
+    "for (var p = list; p != nil; p = p(false)) length = length + 1;\n"
+    "if (length != count) nil();\n";
+
+static double now() {
+    struct timespec time;
+    clock_gettime(CLOCK_MONOTONIC, &time);
+    return time.tv_sec + time.tv_nsec / 1e9;
+}
+
+static void run(const char* script) {
+    if (interpret(script) != INTERPRET_OK) exit(1);
+}
+
+int main(int argc, char* argv[]) {
+    long nodes = argc > 1 ? atol(argv[1]) : 500000;
+    int most = argc > 2 ? atoi(argv[2]) : 8;
+    initVM();
+    vm.nextGC = SIZE_MAX;
+
+    char source[64];
+    snprintf(source, sizeof(source), "var count = %ld;\n", nodes);
+    run(source);
+    run(buildScript);
+    collectGarbage();
+    vm.nextGC = SIZE_MAX;
+    size_t live = vm.bytesAllocated;
+
+    printf("%ld nodes, %.1f MB live\n", nodes, live / 1e6);
+    printf("threads  collection ms  freed MB\n");
+    for (int threads = 1; threads <= most; threads *= 2) {
+        setCollectorSize(threads);
+        run(garbageScript);
+        vm.nextGC = SIZE_MAX;
+        size_t before = vm.bytesAllocated;
+
+        double start = now();
+        collectGarbage();
+        double elapsed = now() - start;
+        vm.nextGC = SIZE_MAX;
+        printf("%7d  %13.1f  %8.1f\n", threads, elapsed * 1e3, (before - vm.bytesAllocated) / 1e6);
+    }
+
+    run(checkScript);
+    freeVM();
+    return 0;
+}
@@ -0,0 +1,124 @@
+/*
+    Shared intern table benchmark. 1 to 64 threads create strings the way freeze() does: look the characters
+    up and add them when they're not there. Most are a few thousand keys every thread uses, one in 16 is new.
+    Runs once against the table as it is and once with every call behind a single lock, which is what the
+    table had before it was sharded.
+
+    Build and run with `make bench && ./bench/intern_bench [operations per thread]`
+*/
+
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include "intern.h"
+
+#define MAX_THREADS 64
+#define KEYS 4096
+
+typedef struct {
+    int id;
+    long operations;
+    bool locked;
+} Worker;
+
+static ObjString* keys[KEYS];
+static pthread_mutex_t tableLock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_barrier_t start;
+
+static double now() {
+    struct timespec time;
+    clock_gettime(CLOCK_MONOTONIC, &time);
+    return time.tv_sec + time.tv_nsec / 1e9;
+}
+
+static ObjString* makeString(const char* chars) {
+    ObjString* string = calloc(1, sizeof(ObjString));
+    if (string == NULL) exit(1);
+    string->obj.type = OBJ_STRING;
+    string->obj.frozen = true;
+    string->length = (int)strlen(chars);
+    string->chars = strdup(chars);
+    string->hash = hashString(string->chars, string->length);
+    string->interned = true;
+    string->ownsChars = true;
+    return string;
+}
+
+/* Nothing in here ever goes away */
+static bool claimAny(ObjString* string, void* context) {
+    return true;
+}
+
+static ObjString* intern(ObjString* string, bool locked) {
+    if (locked) pthread_mutex_lock(&tableLock);
+    ObjString* found = findSharedString(string->chars, string->length, string->hash, claimAny, NULL);
+    if (found == NULL) found = addSharedString(string, claimAny, NULL);
+    if (locked) pthread_mutex_unlock(&tableLock);
+    return found;
+}
+
+static void* work(void* argument) {
+    Worker* worker = argument;
+
+    /* The new strings are made up front, so the timing is the table's */
+    long fresh = worker->operations / 16;
+    ObjString** unique = malloc(sizeof(ObjString*) * (fresh + 1));
+    if (unique == NULL) exit(1);
+    for (long i = 0; i < fresh; ++i) {
+        char chars[64];
+        snprintf(chars, sizeof(chars), "%s-%d-%ld", worker->locked ? "locked" : "shared", worker->id, i);
+        unique[i] = makeString(chars);
+    }
+
+    pthread_barrier_wait(&start);
+    uint32_t random = worker->id * 2654435761u + 1;
+    long made = 0;
+    for (long i = 0; i < worker->operations; ++i) {
+        if ((i & 15) == 15 && made < fresh) {
+            intern(unique[made++], worker->locked);
+        } else {
+            random = random * 1664525u + 1013904223u;
+            if (intern(keys[(random >> 8) % KEYS], worker->locked) == NULL) exit(1);
+        }
+    }
+    free(unique); /* The strings stay, the table still has them */
+    return NULL;
+}
+
+static double run(int threads, long operations, bool locked) {
+    pthread_t handles[MAX_THREADS];
+    Worker workers[MAX_THREADS];
+    pthread_barrier_init(&start, NULL, threads + 1);
+    for (int i = 0; i < threads; ++i) {
+        workers[i] = (Worker){threads * MAX_THREADS + i, operations, locked}; /* Fresh strings differ every run */
+        if (pthread_create(&handles[i], NULL, work, &workers[i]) != 0) exit(1);
+    }
+
+    pthread_barrier_wait(&start);
+    double began = now();
+    for (int i = 0; i < threads; ++i) pthread_join(handles[i], NULL);
+    double elapsed = now() - began;
+    pthread_barrier_destroy(&start);
+    return threads * operations / elapsed;
+}
+
+int main(int argc, char* argv[]) {
+    long operations = argc > 1 ? atol(argv[1]) : 1000000;
+
+    for (int i = 0; i < KEYS; ++i) {
+        char chars[32];
+        snprintf(chars, sizeof(chars), "key-%d", i);
+        keys[i] = intern(makeString(chars), false);
+    }
+
+    printf("threads  sharded Mops/s  one lock Mops/s\n");
+    for (int threads = 1; threads <= MAX_THREADS; threads *= 2) {
+        double sharded = run(threads, operations, false);
+        double locked = run(threads, operations, true);
+        printf("%7d  %14.2f  %15.2f\n", threads, sharded / 1e6, locked / 1e6);
+    }
+    return 0;
+}
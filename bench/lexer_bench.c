@@ -0,0 +1,70 @@
+/*
+    Scanner throughput benchmark. It generates a large, indented and commented script in memory and reports
+    how fast `scanToken` gets through it.
+
+    Build and run with `make bench && ./bench/lexer_bench [megabytes] [passes]`
+*/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include "scanner.h"
+
+/* One function's worth of source, the kind of thing people actually write */
+static const char* sample =
+    "// Walks the range and sums up the values that pass the filter\n"
+    "fun sumRange(from, to, step) {\n"
+    "    var total = 0;\n"
+    "    for (var i = from; i < to; i = i + step) {\n"
+    "        // Skip the multiples of seven, nobody likes them\n"
+    "        if (i % 7 == 0) {\n"
+    "            print \"skipping a multiple of seven\";\n"
+    "        } else {\n"
+    "            total = total + i * 2.5;\n"
+    "        }\n"
+    "    }\n"
+    "\n"
+    "    while (total > 1000000 and !false) total = total \\ 2;\n"
+    "    return total;\n"
+    "}\n"
+    "\n";
+
+static double now() {
+    struct timespec time;
+    clock_gettime(CLOCK_MONOTONIC, &time);
+    return time.tv_sec + time.tv_nsec / 1e9;
+}
+
+int main(int argc, const char* argv[]) {
+    size_t megabytes = argc > 1 ? (size_t)atol(argv[1]) : 50;
+    int passes = argc > 2 ? atoi(argv[2]) : 5;
+
+    size_t sampleLength = strlen(sample);
+    size_t copies = megabytes * 1024 * 1024 / sampleLength + 1;
+    size_t length = copies * sampleLength;
+
+    char* source = malloc(length + 1);
+    for (size_t i = 0; i < copies; ++i) memcpy(source + i * sampleLength, sample, sampleLength);
+    source[length] = '\0';
+
+    /* The best of a few passes, so page faults on the first touch don't count */
+    double best = 0;
+    long tokens = 0;
+    for (int pass = 0; pass < passes; ++pass) {
+        double start = now();
+        tokens = 0;
+        initScanner(source, length);
+        while (scanToken().type != TOKEN_EOF) ++tokens;
+        double time = now() - start;
+        if (pass == 0 || time < best) best = time;
+    }
+
+    double size = length / (1024.0 * 1024.0);
+    printf("source:  %.1f MB, %ld tokens\n", size, tokens);
+    printf("scan:    %.3f s (%.1f MB/s, %.0f tokens/s)\n", best, size / best, tokens / best);
+
+    free(source);
+    return 0;
+}
@@ -0,0 +1,75 @@
+/*
+    Script loading benchmark. It writes a large script to disk and measures the time to the first instruction,
+    that is loading, compiling and verifying it, once reading the file into memory and once mapping it.
+
+    Build and run with `make bench && ./bench/load_bench [megabytes]`
+*/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <time.h>
+
+#include "compiler.h"
+#include "source.h"
+#include "verifier.h"
+#include "vm.h"
+
+#define SCRIPT_PATH "/tmp/qamar_load_bench.qmr"
+
+static double now() {
+    struct timespec time;
+    clock_gettime(CLOCK_MONOTONIC, &time);
+    return time.tv_sec + time.tv_nsec / 1e9;
+}
+
+/* Globals, arithmetic and branches, with few enough distinct names and numbers to fit one chunk's constants */
+static void writeScript(size_t size) {
+    FILE* file = fopen(SCRIPT_PATH, "w");
+    if (file == NULL) {
+        perror(SCRIPT_PATH);
+        exit(1);
+    }
+
+    size_t written = 0;
+    for (int i = 0; written < size; ++i) {
+        int g = i % 64;
+        switch (i % 3) {
+            case 0: written += fprintf(file, "var g%d = %d;\n", g, i % 100); break;
+            case 1: written += fprintf(file, "g%d = g%d + %d * g%d;\n", g, (g + 1) % 64, i % 10, (g + 2) % 64); break;
+            case 2: written += fprintf(file, "if (g%d < %d) { var a = g%d; g%d = a + 1; }\n", g, i % 50, g, g); break;
+        }
+    }
+    fclose(file);
+}
+
+static void run(const char* name, bool (*load)(const char*, Source*)) {
+    initVM();
+    Source source;
+
+    double start = now();
+    if (!load(SCRIPT_PATH, &source)) exit(1);
+    double loaded = now();
+    ObjFunction* function = compile(source.chars);
+    if (function == NULL || !verifyFunction(function)) {
+        fprintf(stderr, "The generated script failed to compile.\n");
+        exit(1);
+    }
+    double ready = now();
+
+    printf("%-5s load %.3f s, first instruction after %.3f s\n", name, loaded - start, ready - start);
+    unloadSource(&source);
+    freeVM();
+}
+
+int main(int argc, const char* argv[]) {
+    size_t megabytes = argc > 1 ? (size_t)atol(argv[1]) : 50;
+    writeScript(megabytes * 1024 * 1024);
+
+    run("read", readSource);
+    run("mmap", loadSource);
+    run("read", readSource);
+    run("mmap", loadSource);
+
+    remove(SCRIPT_PATH);
+    return 0;
+}
@@ -0,0 +1,119 @@
+/*
+    Module loading benchmark. Writes a code base of independent modules that all import one shared library,
+    and a main script that imports every module. For every loader size it times the first run, which
+    compiles all of them, in a directory of its own so nothing is cached yet. Then it times a fresh VM on
+    another thread running the same script, which finds every module compiled already.
+
+    Build and run with `make bench && ./bench/module_bench [modules] [functions per module] [most threads]`
+*/
+
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <sys/stat.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "module.h"
+#include "vm.h"
+
+static char directory[] = "/tmp/qamar_module_bench_XXXXXX";
+static char mainSource[1 << 20];
+
+static double now() {
+    struct timespec time;
+    clock_gettime(CLOCK_MONOTONIC, &time);
+    return time.tv_sec + time.tv_nsec / 1e9;
+}
+
+static FILE* create(const char* path) {
+    FILE* file = fopen(path, "w");
+    if (file == NULL) {
+        perror(path);
+        exit(1);
+    }
+    return file;
+}
+
+static void writeModules(const char* round, int modules, int functions) {
+    char path[512];
+    snprintf(path, sizeof(path), "%s/%s", directory, round);
+    mkdir(path, 0700);
+
+    snprintf(path, sizeof(path), "%s/%s/lib.qmr", directory, round);
+    FILE* file = create(path);
+    fprintf(file, "fun clamp(x, low, high) { if (x < low) return low; if (x > high) return high; return x; }\n");
+    fclose(file);
+
+    for (int m = 0; m < modules; ++m) {
+        snprintf(path, sizeof(path), "%s/%s/m%d.qmr", directory, round, m);
+        file = create(path);
+        fprintf(file, "var lib = import \"lib.qmr\";\n");
+        for (int f = 0; f < functions; ++f) {
+            fprintf(file,
+                    "fun f%d(n) {\n"
+                    "    var total = 0;\n"
+                    "    for (var i = 0; i < n; i = i + 1) {\n"
+                    "        if (i %% 2 == 0) total = total + i * %d; else total = total - i;\n"
+                    "    }\n"
+                    "    return lib.clamp(total, 0, %d);\n"
+                    "}\n", f, f, m * 1000 + f);
+        }
+        fclose(file);
+    }
+}
+
+static void* runWarm(void* argument) {
+    initVM();
+    double start = now();
+    if (interpret(mainSource) != INTERPRET_OK) exit(1);
+    *(double*)argument = now() - start;
+    freeVM();
+    return NULL;
+}
+
+int main(int argc, char* argv[]) {
+    int modules = argc > 1 ? atoi(argv[1]) : 64;
+    int functions = argc > 2 ? atoi(argv[2]) : 100;
+    int most = argc > 3 ? atoi(argv[3]) : 8;
+    if (mkdtemp(directory) == NULL) {
+        perror(directory);
+        return 1;
+    }
+
+    printf("%d modules of %d functions\n", modules, functions);
+    printf("threads  first run ms  cached ms\n");
+    for (int threads = 1; threads <= most; threads *= 2) {
+        char round[16];
+        snprintf(round, sizeof(round), "%d", threads);
+        writeModules(round, modules, functions);
+
+        int length = 0;
+        for (int m = 0; m < modules; ++m) {
+            length += snprintf(mainSource + length, sizeof(mainSource) - length,
+                               "var m%d = import \"m%d.qmr\"; m%d.f0(3);\n", m, m, m);
+        }
+
+        char script[512];
+        snprintf(script, sizeof(script), "%s/%s/main.qmr", directory, round);
+        setModuleRoot(script);
+        setLoaderSize(threads);
+
+        initVM();
+        double start = now();
+        if (interpret(mainSource) != INTERPRET_OK) return 1;
+        double cold = now() - start;
+        freeVM();
+
+        double warm;
+        pthread_t thread;
+        pthread_create(&thread, NULL, runWarm, &warm);
+        pthread_join(thread, NULL);
+        printf("%7d  %12.1f  %9.1f\n", threads, cold * 1e3, warm * 1e3);
+    }
+
+    char command[128];
+    snprintf(command, sizeof(command), "rm -rf %s", directory);
+    if (system(command) != 0) fprintf(stderr, "Could not remove %s\n", directory);
+    return 0;
+}
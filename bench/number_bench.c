@@ -0,0 +1,67 @@
+/*
+    Number conversion benchmark. It formats and parses a few million numbers with our routines and with the C
+    library's, the way print and num() used to.
+
+    Build and run with `make bench && ./bench/number_bench [millions]`
+*/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include "number.h"
+
+static double now() {
+    struct timespec time;
+    clock_gettime(CLOCK_MONOTONIC, &time);
+    return time.tv_sec + time.tv_nsec / 1e9;
+}
+
+/* A mix of what scripts print: counters, money-like fractions and the results of divisions */
+static double sample(int i) {
+    switch (i % 3) {
+        case 0:  return i;
+        case 1:  return (i % 100000) / 100.0;
+        default: return i / 7.0;
+    }
+}
+
+int main(int argc, const char* argv[]) {
+    int count = (argc > 1 ? atoi(argv[1]) : 5) * 1000000;
+    char* texts = malloc((size_t)count * NUMBER_BUFFER_SIZE);
+    char buffer[NUMBER_BUFFER_SIZE];
+    double sink = 0;
+
+    double start = now();
+    for (int i = 0; i < count; ++i) sink += snprintf(buffer, sizeof(buffer), "%g", sample(i));
+    double printfTime = now() - start;
+
+    start = now();
+    for (int i = 0; i < count; ++i) sink += formatNumber(sample(i), texts + (size_t)i * NUMBER_BUFFER_SIZE);
+    double formatTime = now() - start;
+
+    start = now();
+    for (int i = 0; i < count; ++i) sink += strtod(texts + (size_t)i * NUMBER_BUFFER_SIZE, NULL);
+    double strtodTime = now() - start;
+
+    start = now();
+    for (int i = 0; i < count; ++i) sink += parseNumber(texts + (size_t)i * NUMBER_BUFFER_SIZE, NULL);
+    double parseTime = now() - start;
+
+    /* Everything we format has to read back as the same number */
+    int mismatches = 0;
+    for (int i = 0; i < count; ++i) {
+        if (parseNumber(texts + (size_t)i * NUMBER_BUFFER_SIZE, NULL) != sample(i)) ++mismatches;
+    }
+
+    printf("numbers:       %d (checksum %g)\n", count, sink);
+    printf("printf %%g:     %.3f s\n", printfTime);
+    printf("formatNumber:  %.3f s (%.1fx)\n", formatTime, printfTime / formatTime);
+    printf("strtod:        %.3f s\n", strtodTime);
+    printf("parseNumber:   %.3f s (%.1fx)\n", parseTime, strtodTime / parseTime);
+    printf("round trip:    %d mismatches\n", mismatches);
+
+    free(texts);
+    return mismatches != 0;
+}
@@ -0,0 +1,66 @@
+/*
+    Worker pool scaling benchmark. It runs the same parallelMap() over uneven work, fib of 0 to 24 over and
+    over, on pools of 1 to N workers, so stealing has something to even out. Every pool size runs in a
+    process of its own since a pool can't be resized once it started.
+
+    Build and run with `make bench && ./bench/pool_bench [workers]`
+*/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <sys/wait.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "output.h"
+#include "pool.h"
+#include "vm.h"
+
+static double now() {
+    struct timespec time;
+    clock_gettime(CLOCK_MONOTONIC, &time);
+    return time.tv_sec + time.tv_nsec / 1e9;
+}
+
+static const char* script =
+    "fun fib(n) { if (n < 2) return n; return fib(n - 1) + fib(n - 2); }\n"
+    "fun work(i) { return fib(i % 25); }\n"
+    "var results = parallelMap(work, 2000);\n"
+    "var total = 0; var value;\n"
+    "while ((value = recv(results)) != nil) total = total + value;\n";
+
+static double run(int workers) {
+    int pipes[2];
+    if (pipe(pipes) != 0) exit(1);
+    fflush(stdout);
+
+    if (fork() == 0) {
+        initVM();
+        initOutput();
+        setPoolSize(workers);
+        double start = now();
+        if (interpret(script) != INTERPRET_OK) exit(1);
+        double elapsed = now() - start;
+        if (write(pipes[1], &elapsed, sizeof(elapsed)) != sizeof(elapsed)) exit(1);
+        exit(0);
+    }
+
+    double elapsed;
+    if (read(pipes[0], &elapsed, sizeof(elapsed)) != sizeof(elapsed)) exit(1);
+    wait(NULL);
+    close(pipes[0]);
+    close(pipes[1]);
+    return elapsed;
+}
+
+int main(int argc, char* argv[]) {
+    int maxWorkers = argc > 1 ? atoi(argv[1]) : 8;
+
+    double single = run(1);
+    printf("%2d worker  %.3f s\n", 1, single);
+    for (int workers = 2; workers <= maxWorkers; workers *= 2) {
+        double elapsed = run(workers);
+        printf("%2d workers %.3f s, %.2fx\n", workers, elapsed, single / elapsed);
+    }
+    return 0;
+}
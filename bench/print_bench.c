@@ -0,0 +1,52 @@
+/*
+    Output benchmark. It runs scripts that print ten million lines, numbers and then strings, with stdout sent
+    to /dev/null so we measure the interpreter rather than the terminal. Results go to stderr.
+
+    Build and run with `make bench && ./bench/print_bench [millions]`
+*/
+
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "output.h"
+#include "vm.h"
+
+static double now() {
+    struct timespec time;
+    clock_gettime(CLOCK_MONOTONIC, &time);
+    return time.tv_sec + time.tv_nsec / 1e9;
+}
+
+static void run(const char* name, const char* format, long lines) {
+    char source[256];
+    snprintf(source, sizeof(source), format, lines);
+
+    double start = now();
+    InterpretResult result = interpret(source);
+    double time = now() - start;
+
+    if (result != INTERPRET_OK) {
+        fprintf(stderr, "%s: the script failed\n", name);
+        exit(1);
+    }
+    fprintf(stderr, "%-8s %ld lines in %.3f s (%.1f M lines/s)\n", name, lines, time, lines / time / 1e6);
+}
+
+int main(int argc, const char* argv[]) {
+    long lines = (argc > 1 ? atol(argv[1]) : 10) * 1000000;
+
+    int devNull = open("/dev/null", O_WRONLY);
+    if (devNull < 0 || dup2(devNull, STDOUT_FILENO) < 0) {
+        perror("/dev/null");
+        return 1;
+    }
+
+    initVM();
+    run("numbers", "for (var i = 0; i < %ld; i = i + 1) print i * 0.5;", lines);
+    run("strings", "var s = \"the quick brown fox\"; for (var i = 0; i < %ld; i = i + 1) print s;", lines);
+    freeVM();
+    return 0;
+}
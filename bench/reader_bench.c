@@ -0,0 +1,104 @@
+/*
+    Reader benchmark. It writes a log file of the given size and has a script count its lines twice, once
+    from the mapped file and once from a pipe, reporting MB/s for both.
+
+    Build and run with `make bench && ./bench/reader_bench [megabytes]`
+*/
+
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <sys/wait.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "vm.h"
+
+#define LOG_PATH "/tmp/qamar_reader_bench.log"
+
+static const char* countFile =
+    "var log = openFile(\"" LOG_PATH "\"); var lines = 0; var line;"
+    "while ((line = readLine(log)) != nil) lines = lines + 1;"
+    "print lines;";
+
+static const char* countStdin =
+    "var log = stdin(); var lines = 0; var line;"
+    "while ((line = readLine(log)) != nil) lines = lines + 1;"
+    "print lines;";
+
+static double now() {
+    struct timespec time;
+    clock_gettime(CLOCK_MONOTONIC, &time);
+    return time.tv_sec + time.tv_nsec / 1e9;
+}
+
+static size_t writeLog(size_t size) {
+    FILE* file = fopen(LOG_PATH, "w");
+    if (file == NULL) {
+        perror(LOG_PATH);
+        exit(1);
+    }
+
+    size_t written = 0;
+    for (long i = 0; written < size; ++i) {
+        written += fprintf(file, "10.0.%ld.%ld - - [17/Oct/2026:10:%02ld:%02ld] \"GET /items/%ld HTTP/1.1\" 200 %ld\n",
+                           i % 256, i % 199, i / 60 % 60, i % 60, i, i % 5000);
+    }
+    fclose(file);
+    return written;
+}
+
+/* Feeds the log into our stdin from a child process */
+static pid_t pipeLog() {
+    int ends[2];
+    if (pipe(ends) != 0) {
+        perror("pipe");
+        exit(1);
+    }
+
+    pid_t child = fork();
+    if (child == 0) {
+        close(ends[0]);
+        int log = open(LOG_PATH, O_RDONLY);
+        char buffer[1 << 16];
+        ssize_t count;
+        while ((count = read(log, buffer, sizeof(buffer))) > 0) {
+            if (write(ends[1], buffer, (size_t)count) != count) break;
+        }
+        _exit(0);
+    }
+
+    close(ends[1]);
+    dup2(ends[0], STDIN_FILENO);
+    close(ends[0]);
+    return child;
+}
+
+static void run(const char* name, const char* source, size_t size) {
+    double start = now();
+    InterpretResult result = interpret(source);
+    double time = now() - start;
+
+    if (result != INTERPRET_OK) {
+        fprintf(stderr, "%s: the script failed\n", name);
+        exit(1);
+    }
+    fflush(stdout);
+    fprintf(stderr, "%-6s %.3f s (%.1f MB/s)\n", name, time, size / time / (1024.0 * 1024.0));
+}
+
+int main(int argc, const char* argv[]) {
+    size_t megabytes = argc > 1 ? (size_t)atol(argv[1]) : 512;
+    size_t size = writeLog(megabytes * 1024 * 1024);
+
+    initVM();
+    run("file", countFile, size);
+
+    pid_t child = pipeLog();
+    run("pipe", countStdin, size);
+    waitpid(child, NULL, 0);
+
+    freeVM();
+    unlink(LOG_PATH);
+    return 0;
+}
@@ -0,0 +1,57 @@
+/*
+    VM reuse benchmark. Runs the same batch of tiny scripts twice in one process: once with a fresh VM for
+    every script, `initVM` and `freeVM` around it, and once in one VM put back with `resetVM` after each.
+
+    Build and run with `make bench && ./bench/reset_bench [scripts]`
+*/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <time.h>
+
+#include "vm.h"
+
+static const char* scripts[] = {
+    "var a = 1; var b = a * 2 + 3;",
+    "fun add(x, y) { return x + y; } var total = add(2, 3);",
+    "var s = \"tiny\" + \" script\"; var t = s + \"!\";",
+    "var n = 0; for (var i = 0; i < 10; i = i + 1) n = n + i;",
+    "fun counter() { var c = 0; fun next() { c = c + 1; return c; } return next; } var next = counter(); next(); next();",
+};
+
+#define SCRIPT_COUNT (int)(sizeof(scripts) / sizeof(scripts[0]))
+
+static double now() {
+    struct timespec time;
+    clock_gettime(CLOCK_MONOTONIC, &time);
+    return time.tv_sec + time.tv_nsec / 1e9;
+}
+
+int main(int argc, char* argv[]) {
+    int count = argc > 1 ? atoi(argv[1]) : 100000;
+
+    double start = now();
+    for (int i = 0; i < count; ++i) {
+        initVM();
+        if (interpret(scripts[i % SCRIPT_COUNT]) != INTERPRET_OK) return 1;
+        freeVM();
+    }
+    double fresh = now() - start;
+
+    initVM();
+    start = now();
+    for (int i = 0; i < count; ++i) {
+        if (interpret(scripts[i % SCRIPT_COUNT]) != INTERPRET_OK) return 1;
+        resetVM();
+    }
+    double reset = now() - start;
+    int globals = vm.globals.capacity;
+    int strings = vm.strings.capacity;
+    freeVM();
+
+    printf("%d scripts\n", count);
+    printf("initVM/freeVM:  %8.0f ms  %6.2f us per script\n", fresh * 1e3, fresh * 1e6 / count);
+    printf("resetVM:        %8.0f ms  %6.2f us per script\n", reset * 1e3, reset * 1e6 / count);
+    printf("tables after the resets: %d globals, %d strings\n", globals, strings);
+    return 0;
+}
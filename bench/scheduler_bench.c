@@ -0,0 +1,70 @@
+/*
+    Task scheduler benchmark. Throughput: 100k tasks that each send one value back to the main script. Latency:
+    round trips between two tasks over a pair of channels, so every message parks one fiber and wakes the other,
+    and the same between the main script and one task.
+
+    Build and run with `make bench && ./bench/scheduler_bench [tasks]`
+*/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <time.h>
+
+#include "vm.h"
+
+#define ROUND_TRIPS 100000
+
+static double now() {
+    struct timespec time;
+    clock_gettime(CLOCK_MONOTONIC, &time);
+    return time.tv_sec + time.tv_nsec / 1e9;
+}
+
+static const char* throughputScript =
+    "fun handle(id, results) { send(results, id); }\n"
+    "var results = channel(1024);\n"
+    "for (var i = 0; i < count; i = i + 1) task(handle, i, results);\n"
+    "var sum = 0;\n"
+    "for (var i = 0; i < count; i = i + 1) sum = sum + recv(results);\n";
+
+static const char* taskLatencyScript =
+    "fun ping(inbox, outbox, rounds, done) {\n"
+    "    for (var i = 0; i < rounds; i = i + 1) { send(outbox, i); recv(inbox); }\n"
+    "    send(done, true); }\n"
+    "fun pong(inbox, outbox, rounds) { for (var i = 0; i < rounds; i = i + 1) send(outbox, recv(inbox)); }\n"
+    "var a = channel(1); var b = channel(1); var done = channel(1);\n"
+    "task(pong, a, b, count);\n"
+    "task(ping, b, a, count, done);\n"
+    "recv(done);\n";
+
+static const char* mainLatencyScript =
+    "fun pong(inbox, outbox, rounds) { for (var i = 0; i < rounds; i = i + 1) send(outbox, recv(inbox)); }\n"
+    "var a = channel(1); var b = channel(1);\n"
+    "task(pong, a, b, count);\n"
+    "for (var i = 0; i < count; i = i + 1) { send(a, i); recv(b); }\n";
+
+static double run(const char* script, int count) {
+    char source[1024];
+    snprintf(source, sizeof(source), "var count = %d;\n%s", count, script);
+
+    double start = now();
+    if (interpret(source) != INTERPRET_OK) exit(1);
+    return now() - start;
+}
+
+int main(int argc, char* argv[]) {
+    int tasks = argc > 1 ? atoi(argv[1]) : 100000;
+    initVM();
+
+    double elapsed = run(throughputScript, tasks);
+    printf("%d tasks       %.3f s, %.0f tasks/s\n", tasks, elapsed, tasks / elapsed);
+
+    elapsed = run(taskLatencyScript, ROUND_TRIPS);
+    printf("task <-> task  %.2f us per round trip\n", elapsed / ROUND_TRIPS * 1e6);
+
+    elapsed = run(mainLatencyScript, ROUND_TRIPS);
+    printf("main <-> task  %.2f us per round trip\n", elapsed / ROUND_TRIPS * 1e6);
+
+    freeVM();
+    return 0;
+}
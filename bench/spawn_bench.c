@@ -0,0 +1,56 @@
+/*
+    Thread scaling benchmark. It splits the same amount of work, a batch of fib(24) calls, over 1 to N
+    spawned threads that hand their results back over a channel, and reports the speedup over one thread.
+
+    Build and run with `make bench && ./bench/spawn_bench [threads]`
+*/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <time.h>
+
+#include "output.h"
+#include "vm.h"
+
+#define CALLS 64
+
+static double now() {
+    struct timespec time;
+    clock_gettime(CLOCK_MONOTONIC, &time);
+    return time.tv_sec + time.tv_nsec / 1e9;
+}
+
+static const char* script =
+    "fun fib(n) { if (n < 2) return n; return fib(n - 1) + fib(n - 2); }\n"
+    "fun worker(calls, results) { var sum = 0;\n"
+    "    for (var i = 0; i < calls; i = i + 1) sum = sum + fib(24);\n"
+    "    send(results, sum); }\n"
+    "var results = channel(64);\n"
+    "for (var i = 0; i < threads; i = i + 1) spawn(worker, calls / threads, results);\n"
+    "var total = 0;\n"
+    "for (var i = 0; i < threads; i = i + 1) total = total + recv(results);\n";
+
+static double run(int threads) {
+    char source[1024];
+    snprintf(source, sizeof(source), "var threads = %d; var calls = %d;\n%s", threads, CALLS, script);
+
+    initVM();
+    double start = now();
+    if (interpret(source) != INTERPRET_OK) exit(1);
+    double elapsed = now() - start;
+    freeVM();
+    return elapsed;
+}
+
+int main(int argc, char* argv[]) {
+    int maxThreads = argc > 1 ? atoi(argv[1]) : 8;
+    initOutput();
+
+    double single = run(1);
+    printf("%2d thread  %.3f s\n", 1, single);
+    for (int threads = 2; threads <= maxThreads; threads *= 2) {
+        double elapsed = run(threads);
+        printf("%2d threads %.3f s, %.2fx\n", threads, elapsed, single / elapsed);
+    }
+    return 0;
+}
@@ -0,0 +1,293 @@
+#include <limits.h>
+#include <linux/futex.h>
+#include <stdatomic.h>
+#include <stdlib.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+
+#include "channel.h"
+#include "message.h"
+#include "scheduler.h"
+#include "vm.h"
+
+/* How many times we retry before going to sleep, a peer on another core usually shows up sooner than that */
+#define SPIN_LIMIT 256
+
+#define CACHE_LINE 64
+
+/*
+    Dmitry Vyukov's bounded MPMC queue. Every cell carries a sequence number that says whose turn it is: a
+    sender may fill cell `i` when its sequence equals the position being written, a receiver may empty it
+    when the sequence is one past the position being read. Senders and receivers claim positions with a
+    compare-and-swap on their own counter, so they only contend with each other when the queue is nearly
+    full or empty.
+
+    The queue needs a power of two cells, and at least two. A channel asked to hold a different number of values
+    gets the next size up, and senders also stop once they are `capacity` ahead of the receivers.
+*/
+typedef struct {
+    atomic_size_t sequence;
+    Message* message;
+} Cell;
+
+struct Channel {
+    atomic_int references;
+    size_t mask;
+    size_t capacity;    /* At most this many values are in it, fewer than `cells` holds when that was rounded up */
+    Cell* cells;
+
+    _Alignas(CACHE_LINE) atomic_size_t sendPosition;
+    _Alignas(CACHE_LINE) atomic_size_t receivePosition;
+
+    /* Sleeping when there's nothing to do: waiters sleep on `changes` and get woken up when it moves */
+    _Alignas(CACHE_LINE) atomic_uint changes;
+    atomic_int waiters;
+    atomic_bool closed;
+};
+
+Channel* newChannel(int capacity) {
+    size_t size = 2;
+    while (size < (size_t)capacity) size *= 2;
+
+    Channel* channel = aligned_alloc(CACHE_LINE, sizeof(Channel));
+    Cell* cells = malloc(sizeof(Cell) * size);
+    if (channel == NULL || cells == NULL) exit(1);
+
+    for (size_t i = 0; i < size; ++i) {
+        atomic_init(&cells[i].sequence, i);
+        cells[i].message = NULL;
+    }
+    atomic_init(&channel->references, 0);
+    channel->mask = size - 1;
+    channel->capacity = (size_t)capacity;
+    channel->cells = cells;
+    atomic_init(&channel->sendPosition, 0);
+    atomic_init(&channel->receivePosition, 0);
+    atomic_init(&channel->changes, 0);
+    atomic_init(&channel->waiters, 0);
+    atomic_init(&channel->closed, false);
+    return channel;
+}
+
+static bool trySend(Channel* channel, Message* message) {
+    size_t position = atomic_load_explicit(&channel->sendPosition, memory_order_relaxed);
+    Cell* cell;
+    for (;;) {
+        cell = &channel->cells[position & channel->mask];
+        size_t sequence = atomic_load_explicit(&cell->sequence, memory_order_acquire);
+        intptr_t difference = (intptr_t)sequence - (intptr_t)position;
+
+        if (difference == 0) {
+            /* A stale receive position only makes us think it's fuller than it is, a receive wakes us to retry */
+            if (channel->capacity <= channel->mask &&
+                position - atomic_load_explicit(&channel->receivePosition, memory_order_relaxed) >= channel->capacity) {
+                return false;
+            }
+            if (atomic_compare_exchange_weak_explicit(&channel->sendPosition, &position, position + 1,
+                                                      memory_order_relaxed, memory_order_relaxed)) break;
+        } else if (difference < 0) {
+            return false; /* Full */
+        } else {
+            position = atomic_load_explicit(&channel->sendPosition, memory_order_relaxed);
+        }
+    }
+
+    cell->message = message;
+    atomic_store_explicit(&cell->sequence, position + 1, memory_order_release);
+    return true;
+}
+
+static bool tryReceive(Channel* channel, Message** message) {
+    size_t position = atomic_load_explicit(&channel->receivePosition, memory_order_relaxed);
+    Cell* cell;
+    for (;;) {
+        cell = &channel->cells[position & channel->mask];
+        size_t sequence = atomic_load_explicit(&cell->sequence, memory_order_acquire);
+        intptr_t difference = (intptr_t)sequence - (intptr_t)(position + 1);
+
+        if (difference == 0) {
+            if (atomic_compare_exchange_weak_explicit(&channel->receivePosition, &position, position + 1,
+                                                      memory_order_relaxed, memory_order_relaxed)) break;
+        } else if (difference < 0) {
+            return false; /* Empty */
+        } else {
+            position = atomic_load_explicit(&channel->receivePosition, memory_order_relaxed);
+        }
+    }
+
+    *message = cell->message;
+    atomic_store_explicit(&cell->sequence, position + channel->mask + 1, memory_order_release);
+    return true;
+}
+
+static void wake(Channel* channel) {
+    atomic_fetch_add(&channel->changes, 1);
+    syscall(SYS_futex, &channel->changes, FUTEX_WAKE_PRIVATE, INT_MAX, NULL, NULL, 0);
+    notifyScheduler(); /* Fibers parked on us sleep with their worker, not on `changes` */
+}
+
+/* Called after every send and receive, it costs a load unless someone is asleep */
+static void notify(Channel* channel) {
+    atomic_thread_fence(memory_order_seq_cst);
+    if (atomic_load_explicit(&channel->waiters, memory_order_relaxed) > 0) wake(channel);
+}
+
+static bool readyToSend(Channel* channel, Message** message) { return trySend(channel, *message); }
+
+static bool readyToReceive(Channel* channel, Message** message) { return tryReceive(channel, message); }
+
+/* What a closed channel still holds can be received, but nothing more can be sent to it */
+static bool readyAfterClose(Channel* channel, bool (*ready)(Channel*, Message**), Message** message) {
+    return ready == readyToReceive && ready(channel, message);
+}
+
+/*
+    Sleeps until the channel changes. `ready` is retried after we announce ourselves as a waiter, so a change
+    that happens in between is never missed: either we see it, or the other side sees us and wakes us.
+*/
+static bool waitFor(Channel* channel, bool (*ready)(Channel*, Message**), Message** message) {
+    /* Closed comes first, room that shows up after the close must not take a send */
+    for (int spin = 0; spin < SPIN_LIMIT; ++spin) {
+        if (atomic_load_explicit(&channel->closed, memory_order_acquire)) return readyAfterClose(channel, ready, message);
+        if (ready(channel, message)) return true;
+    }
+
+    for (;;) {
+        unsigned int changes = atomic_load(&channel->changes);
+        atomic_fetch_add(&channel->waiters, 1);
+        atomic_thread_fence(memory_order_seq_cst);
+
+        if (atomic_load(&channel->closed)) {
+            atomic_fetch_sub(&channel->waiters, 1);
+            return readyAfterClose(channel, ready, message);
+        }
+        if (ready(channel, message)) {
+            atomic_fetch_sub(&channel->waiters, 1);
+            return true;
+        }
+
+        syscall(SYS_futex, &channel->changes, FUTEX_WAIT_PRIVATE, changes, NULL, NULL, 0);
+        atomic_fetch_sub(&channel->waiters, 1);
+    }
+}
+
+typedef enum {
+    WAIT_DONE,
+    WAIT_CLOSED,
+    WAIT_PARKED
+} WaitResult;
+
+/*
+    Like `waitFor`, but a task running on the scheduler parks its fiber instead of putting the whole worker to
+    sleep. The fiber counts as a waiter from before the last try, so whoever changes the channel after that
+    wakes the worker, and the worker sees `changes` moved.
+*/
+static WaitResult waitOrPark(Channel* channel, bool (*ready)(Channel*, Message**), Message** message) {
+    if (ready(channel, message)) return WAIT_DONE;
+    if (!canParkTask()) return waitFor(channel, ready, message) ? WAIT_DONE : WAIT_CLOSED;
+
+    atomic_fetch_add(&channel->waiters, 1);
+    atomic_thread_fence(memory_order_seq_cst);
+    unsigned int changes = atomic_load(&channel->changes);
+
+    if (atomic_load(&channel->closed)) {
+        atomic_fetch_sub(&channel->waiters, 1);
+        return readyAfterClose(channel, ready, message) ? WAIT_DONE : WAIT_CLOSED;
+    }
+    if (ready(channel, message)) {
+        atomic_fetch_sub(&channel->waiters, 1);
+        return WAIT_DONE;
+    }
+
+    parkTask(channel, changes); /* The scheduler drops our waiter count once it resumes the fiber */
+    return WAIT_PARKED;
+}
+
+unsigned int channelChanges(Channel* channel) {
+    return atomic_load(&channel->changes);
+}
+
+void unwatchChannel(Channel* channel) {
+    atomic_fetch_sub(&channel->waiters, 1);
+}
+
+void retainChannel(Channel* channel) {
+    atomic_fetch_add_explicit(&channel->references, 1, memory_order_relaxed);
+}
+
+void releaseChannel(Channel* channel) {
+    if (atomic_fetch_sub_explicit(&channel->references, 1, memory_order_acq_rel) != 1) return;
+
+    Message* message;
+    while (tryReceive(channel, &message)) freeMessage(message);
+    free(channel->cells);
+    free(channel);
+}
+
+void closeChannel(Channel* channel) {
+    atomic_store(&channel->closed, true);
+    wake(channel);
+}
+
+bool sendMessage(Channel* channel, Message* message) {
+    if (atomic_load(&channel->closed) || !waitFor(channel, readyToSend, &message)) return false;
+    notify(channel);
+    return true;
+}
+
+static Value channelNative(int argCount, Value* args) {
+    int capacity = CHANNEL_DEFAULT_CAPACITY;
+    if (argCount == 1) {
+        if (!IS_NUMBER(args[0]) || AS_NUMBER(args[0]) < 1 || AS_NUMBER(args[0]) > (1 << 24)) {
+            return nativeError("channel() expects a capacity between 1 and 16777216.");
+        }
+        capacity = (int)AS_NUMBER(args[0]);
+    } else if (argCount != 0) {
+        return nativeError("channel() expects an optional capacity.");
+    }
+    return OBJ_VAL(newChannelHandle(newChannel(capacity)));
+}
+
+static Value sendNative(int argCount, Value* args) {
+    if (argCount != 2 || !IS_CHANNEL(args[0])) return nativeError("send() expects a channel and a value.");
+    Channel* channel = AS_CHANNEL(args[0]);
+    if (atomic_load(&channel->closed)) return nativeError("send() on a closed channel.");
+
+    const char* error;
+    Message* message = packValues(&args[1], 1, &error);
+    if (message == NULL) return nativeError("%s", error);
+
+    switch (waitOrPark(channel, readyToSend, &message)) {
+        case WAIT_DONE:
+            notify(channel);
+            return NIL_VAL;
+        case WAIT_PARKED:
+            freeMessage(message); /* The retry packs the value again */
+            return NIL_VAL;
+        case WAIT_CLOSED:
+            break;
+    }
+    freeMessage(message);
+    return nativeError("send() on a closed channel.");
+}
+
+static Value recvNative(int argCount, Value* args) {
+    if (argCount != 1 || !IS_CHANNEL(args[0])) return nativeError("recv() expects a channel.");
+    Channel* channel = AS_CHANNEL(args[0]);
+
+    Message* message;
+    WaitResult result = waitOrPark(channel, readyToReceive, &message);
+    if (result != WAIT_DONE) return NIL_VAL; /* Parked, or closed and drained */
+    notify(channel);
+
+    Value value;
+    unpackValues(message, &value);
+    freeMessage(message);
+    return value;
+}
+
+void defineChannelNatives() {
+    defineNative("channel", channelNative);
+    defineNative("send", sendNative);
+    defineNative("recv", recvNative);
+}
@@ -0,0 +1,43 @@
+#ifndef clox_channel_h
+#define clox_channel_h
+
+/*
+    This module implements channels, the way threads talk to each other:
+
+        var results = channel(64);
+        spawn(worker, results);
+        print recv(results);
+
+    A channel is a bounded multi-producer multi-consumer ring buffer that needs no locks. `channel(n)` holds at
+    most n values, 64 by default. `send(channel, value)` waits while the channel is full and `recv(channel)`
+    waits while it's empty, returning nil once the channel is closed and drained. Values are deep copied on the
+    way through (see message.h).
+*/
+
+#include "message.h"
+#include "object.h"
+
+#define CHANNEL_DEFAULT_CAPACITY 64
+
+/* The channel starts out with no references, wrap it in a handle or retain it */
+Channel* newChannel(int capacity);
+
+/* Waits while the channel is full and takes over the message, false if the channel was closed */
+bool sendMessage(Channel* channel, Message* message);
+
+void retainChannel(Channel* channel);
+void releaseChannel(Channel* channel);
+
+/* Wakes up everyone waiting on the channel, further sends fail */
+void closeChannel(Channel* channel);
+
+/*
+    For the scheduler, which keeps track of fibers parked on channels. The count moves whenever a channel with
+    waiters changes, a fiber parked on it is given back its place as a waiter through `unwatchChannel`.
+*/
+unsigned int channelChanges(Channel* channel);
+void unwatchChannel(Channel* channel);
+
+void defineChannelNatives();
+
+#endif
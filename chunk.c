@@ -7,6 +7,9 @@ void initChunk(Chunk* chunk) {
     chunk->capacity = 0;
     chunk->code = NULL;
     chunk->lines = NULL;
+    chunk->handlers = NULL;
+    chunk->handlerCount = 0;
+    chunk->handlerCapacity = 0;
     initValueArray(&chunk->constants);
 }
 
@@ -26,9 +29,23 @@ void writeChunk(Chunk* chunk, uint8_t byte, int line) {
     ++chunk->count;
 }
 
+/*
+    Grows the chunk once so `count` more bytes fit, for when the size is known up front, like a function that
+    arrives in a message.
+*/
+void reserveChunk(Chunk* chunk, int count) {
+    if (chunk->capacity >= chunk->count + count) return;
+
+    int oldCapacity = chunk->capacity;
+    chunk->capacity = chunk->count + count;
+    chunk->code = GROW_ARRAY(uint8_t, chunk->code, oldCapacity, chunk->capacity);
+    chunk->lines = GROW_ARRAY(int, chunk->lines, oldCapacity, chunk->capacity);
+}
+
 void freeChunk(Chunk* chunk) {
     FREE_ARRAY(uint8_t, chunk->code, chunk->capacity);
     FREE_ARRAY(int, chunk->lines, chunk->capacity);
+    FREE_ARRAY(Handler, chunk->handlers, chunk->handlerCapacity);
     freeValueArray(&chunk->constants);
     initChunk(chunk);
 }
@@ -37,3 +54,12 @@ int addConstant(Chunk* chunk, Value value) {
     writeValueArray(&chunk->constants, value);
     return chunk->constants.count - 1; // return the index where the constant was appedned so we can locate it later
 }
+
+void addHandler(Chunk* chunk, Handler handler) {
+    if (chunk->handlerCapacity < chunk->handlerCount + 1) {
+        int oldCapacity = chunk->handlerCapacity;
+        chunk->handlerCapacity = GROW_CAPACITY(oldCapacity);
+        chunk->handlers = GROW_ARRAY(Handler, chunk->handlers, oldCapacity, chunk->handlerCapacity);
+    }
+    chunk->handlers[chunk->handlerCount++] = handler;
+}
@@ -38,6 +38,13 @@ typedef enum {
     OP_MODULUS,         /* modulus operator */
     OP_NOT,             /* logical not (!true == false) */
     OP_NEGATE,          /* Unary negation (a = 12 | -a == -12) */
+    OP_GREATER_NN,      /* The `_NN` variants skip the type checks, the compiler only emits them when both operands are proven numbers */
+    OP_LESS_NN,
+    OP_ADD_NN,
+    OP_ADD_SS,          /* Concatenation of two operands proven to be strings */
+    OP_SUBTRACT_NN,
+    OP_MULTIPLY_NN,
+    OP_DIVIDE_NN,
     OP_PRINT,
     OP_JUMP,            /* Unconditional jump */
     OP_JUMP_IF_FALSE,
@@ -46,8 +53,25 @@ typedef enum {
     OP_CLOSURE,
     OP_CLOSE_UPVALUE,
     OP_RETURN,          /* return instruction*/
+    OP_RESUME,          /* Switches to the fiber below the value on top, handing it that value */
+    OP_YIELD,           /* Switches back to the fiber that resumed the running one */
+    OP_IMPORT,          /* Pushes the module and what running its body returned, nil if it ran before */
+    OP_GET_PROPERTY,    /* Replaces the module on top with one of its globals */
+    OP_THROW,           /* Throws the value on top, see `Handler` */
 } OpCode;
 
+/*
+    A `try` block is an entry in its function's table of these, no instruction enters or leaves one. Only a throw
+    goes looking: the innermost entry whose range holds the instruction that threw, entries for nested blocks
+    come before the ones around them.
+*/
+typedef struct {
+    int start;      /* The try block's code runs from `start` up to `end` */
+    int end;
+    int handler;    /* Where the catch block starts */
+    int depth;      /* The frame's stack height at the `try`, the thrown value goes right on top of it */
+} Handler;
+
 /*
     Bytecode is a series of instructions. Eventually, 
     we’ll store some other data along with the instruction
@@ -58,13 +82,19 @@ typedef struct {
     uint8_t* code;
     int* lines;         /* This array will keep track of line information */
     ValueArray constants;
+    Handler* handlers;
+    int handlerCount;
+    int handlerCapacity;
 } Chunk;
 
 void initChunk(Chunk* chunk);
 void freeChunk(Chunk* chunk);
 void writeChunk(Chunk* chunk, uint8_t byte, int line);
+void reserveChunk(Chunk* chunk, int count);
 
 /* This is a convinence method to add a new constant to the chunk */
 int addConstant(Chunk* chunk, Value value);
 
+void addHandler(Chunk* chunk, Handler handler);
+
 #endif
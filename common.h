@@ -12,6 +12,9 @@
 
 // #define DEBUG_TRACE_EXECUTION 
 
+/* Collects garbage at every safepoint instead of once the heap grew, so a missing root shows up right away */
+// #define DEBUG_STRESS_GC
+
 #define UINT8_COUNT (UINT8_MAX + 1)
 
 #endif
@@ -5,6 +5,8 @@
 
 #include "chunk.h"
 #include "compiler.h"
+#include "memory.h"
+#include "number.h"
 #include "object.h"
 #include "common.h"
 #include "scanner.h"
@@ -45,10 +47,23 @@ typedef struct {
     Precedence precedence;
 } ParseRule;
 
+/*
+    What the compiler can prove about a value at compile time. Anything that isn't proven is `STATIC_UNKNOWN`
+    and keeps the checked instructions.
+*/
+typedef enum {
+    STATIC_UNKNOWN,
+    STATIC_NUMBER,
+    STATIC_STRING,
+    STATIC_BOOL
+} StaticType;
+
 typedef struct {
     Token name;
     int  depth;  /* records the scope depth of the block where the local variable was declared */
     bool isCaptured;    
+    StaticType type;    /* The type every value ever stored in this local is known to have */
+    int next;           /* The previous local whose name landed in the same bucket, -1 if there is none */
 } Local;
 
 typedef struct {
@@ -62,6 +77,12 @@ typedef enum {
     TYPE_SCRIPT
 } FunctionType;
 
+/* Locals are found through buckets keyed by the low bits of their name's hash */
+#define LOCAL_BUCKETS UINT8_COUNT
+
+/* Open-addressed index of the constants a function already has, so equal ones get reused */
+#define CONSTANT_SLOTS (UINT8_COUNT * 2)
+
 typedef struct Compiler {
     struct Compiler* enclosing; /* Each compiler points back to the compiler fo the function that encloses it all the way back to the root Compiler for top-level code */
 
@@ -71,14 +92,39 @@ typedef struct Compiler {
     Local locals[UINT8_COUNT];  /* Simple array of all locals that are in scope during each point in the compilation */
     int localCount;             /* Tracks how many locals are in scope*/
 
+/*
+    Head of a chain of locals per bucket, newest first. Scopes end in the reverse order they were declared in,
+    so popping a local just puts its `next` back as the head.
+*/
+    int localBuckets[LOCAL_BUCKETS];
+
+    uint16_t constantSlots[CONSTANT_SLOTS]; /* Constant index plus one, zero marks an empty slot */
+
     Upvalue upvalues[UINT8_COUNT];
 
     int scopeDepth;             /* The number of bits surrounding the current but we are compiling */
+
+    StaticType exprType;        /* Type of the value the last compiled expression leaves on the stack */
+    int typeEpoch;              /* Bumped every time the known local types are thrown away */
+
+/*
+    Offsets of every unchecked instruction emitted so far. If a local turns out to hold more than one type 
+    (which we can only learn after part of the function was already emitted) these get downgraded again.
+*/
+    int* typedSites;
+    int typedSiteCount;
+    int typedSiteCapacity;
+
+    ObjString** captures;       /* Only set when compiling a lazy body: the names behind its upvalues */
 } Compiler;
 
-Parser parser;
-Compiler* current = NULL;
-Chunk* compilingChunk;
+_Thread_local Parser parser;
+_Thread_local Compiler* current = NULL;
+_Thread_local Chunk* compilingChunk;
+static _Thread_local ValueArray* imports = NULL; /* Where `compileWithImports` collects the paths */
+
+/* When set, function bodies are compiled on their first call instead of up front */
+static bool lazyCompilation = false;
 
 static Chunk* currentChunk() { 
 /* 
@@ -114,6 +160,11 @@ static void advance() {
 
     for (;;) {
         parser.current = scanToken();
+
+        /* Identifiers get hashed exactly once, every scope lookup and the interning below reuse it */
+        if (parser.current.type == TOKEN_IDENTIFIER) {
+            parser.current.hash = hashString(parser.current.start, parser.current.length);
+        }
         if (parser.current.type != TOKEN_ERROR) break;
 
         errorAtCurrent(parser.current.start);
@@ -180,15 +231,96 @@ static void emitReturn() {
     emitByte(OP_RETURN); 
 }
 
+static uint32_t constantHash(Value value) {
+    if (IS_STRING(value)) return AS_STRING(value)->hash;
+
+    uint64_t bits;
+    memcpy(&bits, &AS_NUMBER(value), sizeof(bits));
+    bits ^= bits >> 33;
+    bits *= 0xff51afd7ed558ccdULL;
+    bits ^= bits >> 33;
+    return (uint32_t)bits;
+}
+
+static bool sameConstant(Value a, Value b) {
+    if (IS_STRING(a) || IS_STRING(b)) return valuesEqual(a, b);  /* Strings are interned */
+    if (!IS_NUMBER(a) || !IS_NUMBER(b)) return false;
+    return memcmp(&AS_NUMBER(a), &AS_NUMBER(b), sizeof(double)) == 0;
+}
+
 static uint8_t makeConstant(Value value) {
+/*
+    Numbers and strings are immutable, so every mention of the same name or literal in a function can share one 
+    constant. Without this a long function runs out of its 256 constants just by using a global many times.
+*/
+    bool shareable = IS_NUMBER(value) || IS_STRING(value);
+    uint32_t slot = 0;
+
+    if (shareable) {
+        slot = constantHash(value) & (CONSTANT_SLOTS - 1);
+        for (;;) {
+            int index = current->constantSlots[slot] - 1;
+            if (index == -1) break;
+            if (sameConstant(currentChunk()->constants.values[index], value)) return (uint8_t)index;
+            slot = (slot + 1) & (CONSTANT_SLOTS - 1);
+        }
+    }
+
     int constant = addConstant(currentChunk(), value);
     if (constant > UINT8_MAX) {
         error("Too many constants in one chunk.");
         return 0;
     }
+
+    if (shareable) current->constantSlots[slot] = (uint16_t)(constant + 1);
     return (uint8_t)constant;
 }
 
+/*
+    Emits an unchecked instruction and records its offset so `forgetTypes` can turn it back into the checked one.
+*/
+static void emitTyped(uint8_t instruction) {
+    if (current->typedSiteCapacity < current->typedSiteCount + 1) {
+        int oldCapacity = current->typedSiteCapacity;
+        current->typedSiteCapacity = GROW_CAPACITY(oldCapacity);
+        current->typedSites = GROW_ARRAY(int, current->typedSites, oldCapacity, current->typedSiteCapacity);
+    }
+    current->typedSites[current->typedSiteCount++] = currentChunk()->count;
+    emitByte(instruction);
+}
+
+static uint8_t checkedVariant(uint8_t instruction) {
+    switch (instruction) {
+        case OP_GREATER_NN:     return OP_GREATER;
+        case OP_LESS_NN:        return OP_LESS;
+        case OP_ADD_NN:
+        case OP_ADD_SS:         return OP_ADD;
+        case OP_SUBTRACT_NN:    return OP_SUBTRACT;
+        case OP_MULTIPLY_NN:    return OP_MULTIPLY;
+        case OP_DIVIDE_NN:      return OP_DIVIDE;
+        default:                return instruction;
+    }
+}
+
+/*
+    Called when a local stops holding a single known type (it got assigned something else, or a closure captured it).
+    Since loops can jump back over code we already emitted, every unchecked instruction in the function is 
+    downgraded and no local is trusted anymore. Both variants have the same size so this is patched in place.
+*/
+static void forgetTypes(Compiler* compiler) {
+    Chunk* chunk = &compiler->function->chunk;
+    for (int i = 0; i < compiler->typedSiteCount; ++i) {
+        int offset = compiler->typedSites[i];
+        chunk->code[offset] = checkedVariant(chunk->code[offset]);
+    }
+    compiler->typedSiteCount = 0;
+
+    for (int i = 0; i < compiler->localCount; ++i) {
+        compiler->locals[i].type = STATIC_UNKNOWN;
+    }
+    ++compiler->typeEpoch;
+}
+
 static void emitConstant(Value value) {
     emitBytes(OP_CONSTANT, makeConstant(value));
 }
@@ -202,21 +334,34 @@ static void patchJump(int offset) {
     currentChunk()->code[offset + 1] = jump & 0xFF;
 }
 
-static void initCompiler(Compiler* compiler, FunctionType type) {
+/*
+    `function` is the object to compile into. It is NULL unless we're filling in the body of a lazily compiled function.
+*/
+static void initCompiler(Compiler* compiler, FunctionType type, ObjFunction* function) {
     /* Initialize the new Compiler fields */
 
     compiler->enclosing = current; /* When initializing a new Compiler, we capture the about-to-no-longer-be-current one in that pointer. */
     compiler->function = NULL;
     compiler->type = type;
+    compiler->captures = NULL;
 
     compiler->localCount = 0;
     compiler->scopeDepth = 0;
+
+    for (int i = 0; i < LOCAL_BUCKETS; ++i) compiler->localBuckets[i] = -1;
+    memset(compiler->constantSlots, 0, sizeof(compiler->constantSlots));
+
+    compiler->exprType = STATIC_UNKNOWN;
+    compiler->typeEpoch = 0;
+    compiler->typedSites = NULL;
+    compiler->typedSiteCount = 0;
+    compiler->typedSiteCapacity = 0;
     
-    compiler->function = newFunction(); /* Then we allocate a new function object to compile into */
+    compiler->function = function != NULL ? function : newFunction(); /* Then we allocate a new function object to compile into */
 
     current = compiler;
 
-    if (type != TYPE_SCRIPT) {
+    if (type != TYPE_SCRIPT && current->function->name == NULL) {
         current->function->name = copyString(parser.previous.start, parser.previous.length);
     }
 
@@ -228,8 +373,11 @@ static void initCompiler(Compiler* compiler, FunctionType type) {
     Local* local = &current->locals[current->localCount++];
     local->depth = 0;
     local->isCaptured = false;
+    local->type = STATIC_UNKNOWN;
+    local->next = -1;   /* Slot zero can't be named, so it never goes into a bucket */
     local->name.start = "";
     local->name.length = 0;
+    local->name.hash = 0;
 }
 
 static ObjFunction* endCompiler() { 
@@ -240,6 +388,7 @@ static ObjFunction* endCompiler() {
     Now that the compiler creates the function object itself, we return that function.
 */
     ObjFunction* function = current->function;
+    FREE_ARRAY(int, current->typedSites, current->typedSiteCapacity);
 
 #ifdef DEBUG_PRINT_CODE
     if(!parser.hadError) {
@@ -261,11 +410,13 @@ static void endScope() {
 
     /* Deleting (discarding) the local variables in a specific scope aftr it ends */
     while (current->localCount > 0 && current->locals[current->localCount - 1].depth > current->scopeDepth) {
-        if (current->locals[current->localCount - 1].isCaptured) {
+        Local* local = &current->locals[current->localCount - 1];
+        if (local->isCaptured) {
             emitByte(OP_CLOSE_UPVALUE);
         } else {
             emitByte(OP_POP);
         }
+        current->localBuckets[local->name.hash % LOCAL_BUCKETS] = local->next;
         --current->localCount;
     }
 }
@@ -281,25 +432,58 @@ static void defineVariable(uint8_t global);
 static int resolveLocal(Compiler* compiler, Token* name);
 static void and_(bool canAssign);
 static void markInitialized();
+static void addLocal(Token name);
 static uint8_t argumentList();
 static int resolveUpvalue(Compiler* compiler, Token* name);
 
+/*
+    Emits `unchecked` when both operands are proven numbers and `checked` otherwise.
+*/
+static void emitArithmetic(bool numbers, uint8_t unchecked, uint8_t checked) {
+    if (numbers) emitTyped(unchecked);
+    else emitByte(checked);
+}
+
 static void binary(bool canAssign) {
     TokenType operatorType = parser.previous.type;
     ParseRule* rule = getRule(operatorType);
+
+    /* The left operand has already been compiled, its type is whatever the last expression left */
+    StaticType leftType = current->exprType;
+    int epoch = current->typeEpoch;
     parsePrecedence((Precedence)(rule->precedence + 1));
+    StaticType rightType = current->exprType;
+
+    /* If the right operand made us forget the local types, whatever we knew about the left one is stale */
+    if (epoch != current->typeEpoch) leftType = STATIC_UNKNOWN;
+
+    bool numbers = leftType == STATIC_NUMBER && rightType == STATIC_NUMBER;
+
+/*
+    The checked arithmetic instructions either produce a number or abort with a runtime error, 
+    so their result is a number no matter what we knew about the operands.
+*/
+    current->exprType = STATIC_NUMBER;
 
     switch (operatorType) {
-        case TOKEN_BANG_EQUAL:      emitBytes(OP_EQUAL, OP_NOT); break;
-        case TOKEN_EQUAL_EQUAL:     emitByte(OP_EQUAL); break;
-        case TOKEN_GREATER:         emitByte(OP_GREATER); break;
-        case TOKEN_GREATER_EQUAL:   emitBytes(OP_LESS, OP_NOT); break;
-        case TOKEN_LESS:            emitByte(OP_LESS); break;
-        case TOKEN_LESS_EQUAL:      emitBytes(OP_GREATER, OP_NOT); break;
-        case TOKEN_PLUS:            emitByte(OP_ADD); break;
-        case TOKEN_MINUS:           emitByte(OP_SUBTRACT); break;
-        case TOKEN_STAR:            emitByte(OP_MULTIPLY); break;
-        case TOKEN_SLASH:           emitByte(OP_DIVIDE); break;
+        case TOKEN_BANG_EQUAL:      emitBytes(OP_EQUAL, OP_NOT); current->exprType = STATIC_BOOL; break;
+        case TOKEN_EQUAL_EQUAL:     emitByte(OP_EQUAL); current->exprType = STATIC_BOOL; break;
+        case TOKEN_GREATER:         emitArithmetic(numbers, OP_GREATER_NN, OP_GREATER); current->exprType = STATIC_BOOL; break;
+        case TOKEN_GREATER_EQUAL:   emitArithmetic(numbers, OP_LESS_NN, OP_LESS); emitByte(OP_NOT); current->exprType = STATIC_BOOL; break;
+        case TOKEN_LESS:            emitArithmetic(numbers, OP_LESS_NN, OP_LESS); current->exprType = STATIC_BOOL; break;
+        case TOKEN_LESS_EQUAL:      emitArithmetic(numbers, OP_GREATER_NN, OP_GREATER); emitByte(OP_NOT); current->exprType = STATIC_BOOL; break;
+        case TOKEN_PLUS:
+            if (leftType == STATIC_STRING && rightType == STATIC_STRING) {
+                emitTyped(OP_ADD_SS);
+                current->exprType = STATIC_STRING;
+            } else {
+                emitArithmetic(numbers, OP_ADD_NN, OP_ADD);
+                current->exprType = numbers ? STATIC_NUMBER : STATIC_UNKNOWN;
+            }
+            break;
+        case TOKEN_MINUS:           emitArithmetic(numbers, OP_SUBTRACT_NN, OP_SUBTRACT); break;
+        case TOKEN_STAR:            emitArithmetic(numbers, OP_MULTIPLY_NN, OP_MULTIPLY); break;
+        case TOKEN_SLASH:           emitArithmetic(numbers, OP_DIVIDE_NN, OP_DIVIDE); break;
         case TOKEN_BACKSLASH:       emitByte(OP_INT_DIVIDE); break;
         case TOKEN_PERCENT:         emitByte(OP_MODULUS); break;
         default:                    return; // Unreachable
@@ -310,6 +494,7 @@ static void call(bool canAssign) {
     /* We’ve already consumed the ( token, so next we compile the arguments using a separate `argumentList()` helper. */
     uint8_t argCount = argumentList();
     emitBytes(OP_CALL, argCount);
+    current->exprType = STATIC_UNKNOWN;
 }
 
 /*
@@ -317,9 +502,9 @@ static void call(bool canAssign) {
 */
 static void literal(bool canAssign) {
     switch (parser.previous.type) {
-        case TOKEN_FALSE:           emitByte(OP_FALSE); break;
-        case TOKEN_NIL:             emitByte(OP_NIL); break;
-        case TOKEN_TRUE:            emitByte(OP_TRUE); break;
+        case TOKEN_FALSE:           emitByte(OP_FALSE); current->exprType = STATIC_BOOL; break;
+        case TOKEN_NIL:             emitByte(OP_NIL); current->exprType = STATIC_UNKNOWN; break;
+        case TOKEN_TRUE:            emitByte(OP_TRUE); current->exprType = STATIC_BOOL; break;
         default:                    return; // Unreachable
     }
 }
@@ -336,11 +521,10 @@ static void block() {
     consume(TOKEN_RIGHT_BRACE, "Expect '}' after block.");
 }
 
-static void function(FunctionType type) {
-    Compiler compiler;
-    initCompiler(&compiler, type);
-    beginScope();
-
+/*
+    Compiles the parameter list and the body of a function into the current compiler
+*/
+static void functionBody() {
     consume(TOKEN_LEFT_PAREN, "Expect '(' after function name.");
     
     /* Compiling the function parameters */
@@ -358,8 +542,9 @@ static void function(FunctionType type) {
     consume(TOKEN_RIGHT_PAREN, "Expect ')' after parameters.");
     consume(TOKEN_LEFT_BRACE, "Expect '{' before function body.");
     block();
+}
 
-    ObjFunction* function = endCompiler();
+static void emitClosure(ObjFunction* function, Upvalue* upvalues) {
     emitBytes(OP_CLOSURE, makeConstant(OBJ_VAL(function)));
 
     for (int i = 0; i < function->upvalueCount; ++i) {
@@ -367,9 +552,88 @@ static void function(FunctionType type) {
         Each pair of operands specifies what that upvalue captures. If the first byte is one, it captures a local variable 
         in the enclosing function. If zero, it captures one of the function’s upvalues. The next byte is the local slot or upvalue index to capture.
     */
-        emitByte(compiler.upvalues[i].isLocal ? 1 : 0);
-        emitByte(compiler.upvalues[i].index);
+        emitByte(upvalues[i].isLocal ? 1 : 0);
+        emitByte(upvalues[i].index);
+    }
+}
+
+/*
+    If the identifier we are looking at names a variable of an enclosing function, the function being skipped gets an upvalue for it.
+*/
+static void captureIdentifier(ObjString** captures) {
+    if (!check(TOKEN_IDENTIFIER)) return;
+
+    int upvalue = resolveUpvalue(current, &parser.current);
+    if (upvalue != -1) {
+        captures[upvalue] = copyString(parser.current.start, parser.current.length);
+    }
+}
+
+/*
+    In lazy mode a function body is only skimmed over. We match braces to find where it ends and resolve every identifier 
+    in it against the enclosing scopes, so the closure captures everything the body might need once it is compiled. 
+    Capturing a name the body ends up shadowing is harmless, it only costs an unused upvalue.
+*/
+static void skipFunction(FunctionType type) {
+    Compiler compiler;
+    initCompiler(&compiler, type, NULL);
+    ObjFunction* function = compiler.function;
+
+    ObjString* captures[UINT8_COUNT];
+    const char* start = parser.current.start;
+    int line = parser.current.line;
+
+    consume(TOKEN_LEFT_PAREN, "Expect '(' after function name.");
+    while (!check(TOKEN_RIGHT_PAREN) && !check(TOKEN_EOF)) {
+        captureIdentifier(captures);
+        advance();
+    }
+    consume(TOKEN_RIGHT_PAREN, "Expect ')' after parameters.");
+    consume(TOKEN_LEFT_BRACE, "Expect '{' before function body.");
+
+    int depth = 1;
+    while (!check(TOKEN_EOF)) {
+        if (check(TOKEN_LEFT_BRACE)) ++depth;
+        if (check(TOKEN_RIGHT_BRACE) && --depth == 0) break;
+        captureIdentifier(captures);
+        advance();
+    }
+    const char* end = parser.current.start + parser.current.length;
+    consume(TOKEN_RIGHT_BRACE, "Expect '}' after block.");
+
+    LazyBody* lazy = ALLOCATE(LazyBody, 1);
+    lazy->length = (int)(end - start);
+    lazy->source = ALLOCATE(char, lazy->length + 1);
+    memcpy(lazy->source, start, lazy->length);
+    lazy->source[lazy->length] = '\0';
+    lazy->line = line;
+    lazy->captures = NULL;
+    if (function->upvalueCount > 0) {
+        lazy->captures = ALLOCATE(ObjString*, function->upvalueCount);
+        memcpy(lazy->captures, captures, sizeof(ObjString*) * function->upvalueCount);
     }
+    function->lazy = lazy;
+
+    /* Nothing was emitted into the function, so we just pop the compiler instead of ending it */
+    FREE_ARRAY(int, compiler.typedSites, compiler.typedSiteCapacity);
+    current = compiler.enclosing;
+
+    emitClosure(function, compiler.upvalues);
+}
+
+static void function(FunctionType type) {
+    if (lazyCompilation) {
+        skipFunction(type);
+        return;
+    }
+
+    Compiler compiler;
+    initCompiler(&compiler, type, NULL);
+    beginScope();
+    functionBody();
+
+    ObjFunction* function = endCompiler();
+    emitClosure(function, compiler.upvalues);
 }
 
 static void funDeclaration() {
@@ -394,13 +658,18 @@ static void varDecleration() {
     Then we look for an = followed by an initializer expression. If the user doesn’t initialize the variable, 
     the compiler implicitly initializes it to nil by emitting an OP_NIL instruction.
 */
+    StaticType type = STATIC_UNKNOWN;
     if (match(TOKEN_EQUAL)) {
         expression();
+        type = current->exprType;
     } else {
         emitByte(OP_NIL);
     }
 
     consume(TOKEN_SEMICOLON, "Expect ';' after variable declaration."); /* statement should be terminated using a semicolon */
+
+    /* A local starts out with the type of its initializer */
+    if (current->scopeDepth > 0) current->locals[current->localCount - 1].type = type;
     defineVariable(global);
 }
 
@@ -524,6 +793,47 @@ static void whileStatement() {
     emitByte(OP_POP);
 }
 
+/*
+    Nothing is emitted to enter or leave the try block, it only gets an entry in the chunk's handler table.
+    Running into the catch block is a throw, so the code the try ends with jumps over it.
+*/
+static void tryStatement() {
+    Handler handler;
+    handler.depth = current->localCount;
+    handler.start = currentChunk()->count;
+    consume(TOKEN_LEFT_BRACE, "Expect '{' after 'try'.");
+    beginScope();
+    block();
+    endScope();
+    handler.end = currentChunk()->count;
+    int exitJump = emitJump(OP_JUMP);
+
+    /* The thrown value is on top of the stack right where the catch's variable goes */
+    consume(TOKEN_CATCH, "Expect 'catch' after try block.");
+    consume(TOKEN_LEFT_PAREN, "Expect '(' after 'catch'.");
+    consume(TOKEN_IDENTIFIER, "Expect a name for the caught value.");
+    Token name = parser.previous;
+    consume(TOKEN_RIGHT_PAREN, "Expect ')' after the caught value's name.");
+    consume(TOKEN_LEFT_BRACE, "Expect '{' after catch.");
+
+    handler.handler = currentChunk()->count;
+    beginScope();
+    addLocal(name);
+    markInitialized();
+    block();
+    endScope();
+    patchJump(exitJump);
+
+    /* Added last, so a try nested in this one comes first in the table */
+    addHandler(currentChunk(), handler);
+}
+
+static void throwStatement() {
+    expression();
+    consume(TOKEN_SEMICOLON, "Expect ';' after the thrown value.");
+    emitByte(OP_THROW);
+}
+
 /*
     If we hit a compile error while parsing the previous statement, we enter panic mode. 
     When that happens, after the statement we start synchronizing
@@ -546,6 +856,8 @@ static void synchronize() {
             case TOKEN_WHILE:
             case TOKEN_PRINT:
             case TOKEN_RETURN:
+            case TOKEN_TRY:
+            case TOKEN_THROW:
                 return;
 
             default: 
@@ -578,6 +890,10 @@ static void statement() {
         returnStatement();
     } else if (match(TOKEN_WHILE)) {
         whileStatement();
+    } else if (match(TOKEN_TRY)) {
+        tryStatement();
+    } else if (match(TOKEN_THROW)) {
+        throwStatement();
     } else if (match(TOKEN_LEFT_BRACE)) {
         beginScope();
         block();
@@ -593,8 +909,9 @@ static void grouping(bool canAssign) {
 }
 
 static void number(bool canAssign) {
-    double value = strtod(parser.previous.start, NULL);
+    double value = parseNumber(parser.previous.start, NULL);
     emitConstant(NUMBER_VAL(value));
+    current->exprType = STATIC_NUMBER;
 }
 
 static void or_(bool canAssign) {
@@ -612,10 +929,12 @@ static void or_(bool canAssign) {
 
     parsePrecedence(PREC_OR);
     patchJump(endJump);
+    current->exprType = STATIC_UNKNOWN;
 }
  
 static void string(bool canAssign) {
     emitConstant(OBJ_VAL(copyString(parser.previous.start + 1, parser.previous.length - 2)));
+    current->exprType = STATIC_STRING;
 }
 
 static void namedVariable(Token name, bool canAssign) {
@@ -643,8 +962,15 @@ static void namedVariable(Token name, bool canAssign) {
     if (canAssign && match(TOKEN_EQUAL)) {
         expression();
         emitBytes(setOp, (uint8_t)arg);
+
+        /* Storing a value of a different type into a typed local invalidates everything we assumed about it */
+        if (setOp == OP_SET_LOCAL) {
+            StaticType type = current->locals[arg].type;
+            if (type != STATIC_UNKNOWN && type != current->exprType) forgetTypes(current);
+        }
     } else {
         emitBytes(getOp, (uint8_t)arg);
+        current->exprType = getOp == OP_GET_LOCAL ? current->locals[arg].type : STATIC_UNKNOWN;
     }
 }
 
@@ -660,12 +986,57 @@ static void unary(bool canAssign) {
 
     // Emit the operator instruction
     switch (operatorType) {
-        case TOKEN_BANG:            emitByte(OP_NOT); break;
-        case TOKEN_MINUS:           emitByte(OP_NEGATE); break;
+        case TOKEN_BANG:            emitByte(OP_NOT); current->exprType = STATIC_BOOL; break;
+        case TOKEN_MINUS:           emitByte(OP_NEGATE); current->exprType = STATIC_NUMBER; break;
         default:                    return; // Unreachable
     }
 }
 
+/*
+    `resume(fiber)` or `resume(fiber, value)` runs the fiber until it yields or returns and evaluates to that value.
+    It looks like a call but it's an instruction of its own, switching fibers never goes through a native.
+*/
+static void resume_(bool canAssign) {
+    consume(TOKEN_LEFT_PAREN, "Expect '(' after 'resume'.");
+    expression();
+    if (match(TOKEN_COMMA)) expression();
+    else emitByte(OP_NIL);
+    consume(TOKEN_RIGHT_PAREN, "Expect ')' after resume arguments.");
+
+    emitByte(OP_RESUME);
+    current->exprType = STATIC_UNKNOWN;
+}
+
+/* `yield value` hands the value to whoever resumed the fiber and evaluates to what the next `resume` passes in */
+static void yield_(bool canAssign) {
+    if (check(TOKEN_SEMICOLON) || check(TOKEN_RIGHT_PAREN) || check(TOKEN_COMMA)) emitByte(OP_NIL);
+    else expression();
+
+    emitByte(OP_YIELD);
+    current->exprType = STATIC_UNKNOWN;
+}
+
+/*
+    `import "path"` evaluates to the module at the path, its body runs the first time the VM imports it.
+    The path is a literal so the modules a script needs are known before it runs (see module.h).
+*/
+static void import_(bool canAssign) {
+    consume(TOKEN_STRING, "Expect a module path after 'import'.");
+    ObjString* path = copyString(parser.previous.start + 1, parser.previous.length - 2);
+    if (imports != NULL) writeValueArray(imports, OBJ_VAL(path));
+
+    emitBytes(OP_IMPORT, makeConstant(OBJ_VAL(path)));
+    emitByte(OP_POP); /* What the body returned, the module stays */
+    current->exprType = STATIC_UNKNOWN;
+}
+
+/* `module.name` reads one of a module's globals, they can't be assigned from outside */
+static void dot(bool canAssign) {
+    consume(TOKEN_IDENTIFIER, "Expect a name after '.'.");
+    emitBytes(OP_GET_PROPERTY, identifierConstant(&parser.previous));
+    current->exprType = STATIC_UNKNOWN;
+}
+
 /* The table that drives our whole parser is an array of ParseRules */
 ParseRule rules[] = {
     [TOKEN_LEFT_PAREN]    = {grouping,  call,         PREC_CALL},
@@ -673,7 +1044,7 @@ ParseRule rules[] = {
     [TOKEN_LEFT_BRACE]    = {NULL,      NULL,         PREC_NONE}, 
     [TOKEN_RIGHT_BRACE]   = {NULL,      NULL,         PREC_NONE},
     [TOKEN_COMMA]         = {NULL,      NULL,         PREC_NONE},
-    [TOKEN_DOT]           = {NULL,      NULL,         PREC_NONE},
+    [TOKEN_DOT]           = {NULL,      dot,          PREC_CALL},
     [TOKEN_MINUS]         = {unary,     binary,       PREC_TERM},
     [TOKEN_PLUS]          = {NULL,      binary,       PREC_TERM},
     [TOKEN_SEMICOLON]     = {NULL,      NULL,         PREC_NONE},
@@ -693,21 +1064,27 @@ ParseRule rules[] = {
     [TOKEN_STRING]        = {string,    NULL,         PREC_NONE},
     [TOKEN_NUMBER]        = {number,    NULL,         PREC_NONE},
     [TOKEN_AND]           = {NULL,      and_,          PREC_AND},
+    [TOKEN_CATCH]         = {NULL,      NULL,         PREC_NONE},
     [TOKEN_CLASS]         = {NULL,      NULL,         PREC_NONE},
     [TOKEN_ELSE]          = {NULL,      NULL,         PREC_NONE},
     [TOKEN_FALSE]         = {literal,   NULL,         PREC_NONE},
     [TOKEN_FOR]           = {NULL,      NULL,         PREC_NONE},
     [TOKEN_FUN]           = {NULL,      NULL,         PREC_NONE},
     [TOKEN_IF]            = {NULL,      NULL,         PREC_NONE},
+    [TOKEN_IMPORT]        = {import_,   NULL,         PREC_NONE},
     [TOKEN_NIL]           = {literal,   NULL,         PREC_NONE},
     [TOKEN_OR]            = {NULL,      or_,            PREC_OR},
     [TOKEN_PRINT]         = {NULL,      NULL,         PREC_NONE},
+    [TOKEN_RESUME]        = {resume_,   NULL,         PREC_NONE},
     [TOKEN_RETURN]        = {NULL,      NULL,         PREC_NONE},
     [TOKEN_SUPER]         = {NULL,      NULL,         PREC_NONE},
     [TOKEN_THIS]          = {NULL,      NULL,         PREC_NONE},
+    [TOKEN_THROW]         = {NULL,      NULL,         PREC_NONE},
     [TOKEN_TRUE]          = {literal,   NULL,         PREC_NONE},
+    [TOKEN_TRY]           = {NULL,      NULL,         PREC_NONE},
     [TOKEN_VAR]           = {NULL,      NULL,         PREC_NONE},
     [TOKEN_WHILE]         = {NULL,      NULL,         PREC_NONE},
+    [TOKEN_YIELD]         = {yield_,    NULL,         PREC_NONE},
     [TOKEN_ERROR]         = {NULL,      NULL,         PREC_NONE},
     [TOKEN_EOF]           = {NULL,      NULL,         PREC_NONE},
 };
@@ -720,6 +1097,7 @@ static void parsePrecedence(Precedence precedence) {
     ParseFn prefixRule = getRule(parser.previous.type)->prefix;
     if (prefixRule == NULL) {
         error("Expect expression.");
+        current->exprType = STATIC_UNKNOWN;
         return;
     }
     bool canAssign = precedence <= PREC_ASSIGNMENT;
@@ -740,28 +1118,33 @@ static void parsePrecedence(Precedence precedence) {
     This function takes the given token and adds its lexeme to the chunk’s constant table as a string. It then returns the index of that constant in the constant table.
 */
 static uint8_t identifierConstant(Token* name) {
-    return makeConstant(OBJ_VAL(copyString(name->start, name->length)));
+    return makeConstant(OBJ_VAL(copyStringWithHash(name->start, name->length, name->hash)));
 }
 
 static bool identifiersEqual(Token* a, Token* b) {
-    if (a->length != b->length) return false;
+    if (a->hash != b->hash || a->length != b->length) return false;
     return memcmp(a->start, b->start, a->length) == 0;
 }
 
+/* Finds the newest local with the given name without complaining about uninitialized ones */
+static int resolveLocalQuiet(Compiler* compiler, Token* name) {
+    /* The chain is newest first, so the innermost declaration wins like it should */
+    for (int i = compiler->localBuckets[name->hash % LOCAL_BUCKETS]; i != -1; i = compiler->locals[i].next) {
+        if (identifiersEqual(name, &compiler->locals[i].name)) return i;
+    }
+    return -1;
+}
+
 /*
     We resolve local variables using this function
 */
 static int resolveLocal(Compiler* compiler, Token* name) {
-    for (int i = compiler->localCount - 1; i >= 0; --i) {
-        Local* local = &compiler->locals[i];
-        if (identifiersEqual(name, &local->name)) {
-            /* When we resolve a reference to a local variable, we check the scope depth to see if it’s fully defined. */
-            if (local->depth == -1) 
-                error("Can't read local variable in its own initializer.");
-           return i; 
-        }
-    }
-    return -1;
+    int local = resolveLocalQuiet(compiler, name);
+
+    /* When we resolve a reference to a local variable, we check the scope depth to see if it’s fully defined. */
+    if (local != -1 && compiler->locals[local].depth == -1) 
+        error("Can't read local variable in its own initializer.");
+    return local;
 }
 
 static int addUpvalue(Compiler* compiler, uint8_t index, bool isLocal) {
@@ -788,20 +1171,38 @@ static int addUpvalue(Compiler* compiler, uint8_t index, bool isLocal) {
     return compiler->function->upvalueCount++;
 }
 
+static int resolveCapture(Compiler* compiler, Token* name) {
+    if (compiler->captures == NULL) return -1;
+
+    for (int i = 0; i < compiler->function->upvalueCount; ++i) {
+        ObjString* capture = compiler->captures[i];
+        if (capture->hash == name->hash && capture->length == name->length && memcmp(capture->chars, name->start, name->length) == 0) {
+            return i;
+        }
+    }
+    return -1;
+}
+
 /*
     This new `resolveUpvalue` function looks for a local variable declared in any of the surrounding functions. 
     If it finds one, it returns an “upvalue index” for that variable. Otherwise it returns `-1` to indicate the
     variable wasnt found.
 */
 static int resolveUpvalue(Compiler* compiler, Token* name) {
-    /* If the enclosing compiler is `NULL` we know we reached the outermost function without finding the local variable */
-    if (compiler->enclosing == NULL) return -1;
+/*
+    If the enclosing compiler is `NULL` we know we reached the outermost function without finding the local variable. 
+    A lazily compiled body has no enclosing compiler anymore, instead it knows the names its upvalues were captured for.
+*/
+    if (compiler->enclosing == NULL) return resolveCapture(compiler, name);
     
     /* Otherwise, we try to resolve the identifier as a local variable in the enclosing compiler */
     int local = resolveLocal(compiler->enclosing, name);
     if (local != -1) {
         /* If we found the local we add it to the current compiler */
         compiler->enclosing->locals[local].isCaptured = true;
+
+        /* The closure may store anything into a captured local behind the enclosing function's back */
+        if (compiler->enclosing->locals[local].type != STATIC_UNKNOWN) forgetTypes(compiler->enclosing);
         return addUpvalue(compiler, (uint8_t)local, true);
     }
     
@@ -827,10 +1228,16 @@ static void addLocal(Token name) {
         return;
     }
 
-    Local* local = &current->locals[current->localCount++];
+    int index = current->localCount++;
+    Local* local = &current->locals[index];
     local->name = name;
     local->depth = -1; /* -1 indicates uninitialized state of the variable */
     local->isCaptured = false;
+    local->type = STATIC_UNKNOWN;
+
+    int* bucket = &current->localBuckets[name.hash % LOCAL_BUCKETS];
+    local->next = *bucket;
+    *bucket = index;
 }
 
 /*
@@ -840,11 +1247,12 @@ static void declareVariable() {
     if (current->scopeDepth == 0) return;
 
     Token* name = &parser.previous;
-    for (int i = current->localCount - 1; i >= 0; --i) {
-        Local* local = &current->locals[i];
-        if (local->depth != -1 && local->depth < current->scopeDepth)
-            break;
-        if (identifiersEqual(name, &local->name))
+
+    /* Only the newest local with this name can be in the current scope, older ones are in enclosing scopes */
+    int existing = resolveLocalQuiet(current, name);
+    if (existing != -1) {
+        Local* local = &current->locals[existing];
+        if (local->depth == -1 || local->depth >= current->scopeDepth)
             error("Redeclaration of the variable at the same scope.");
     }
     addLocal(*name);
@@ -907,6 +1315,7 @@ static void and_(bool canAssign) {
     parsePrecedence(PREC_AND);
 
     patchJump(endJump);
+    current->exprType = STATIC_UNKNOWN;
 }
 
 static ParseRule* getRule(TokenType type) {
@@ -914,9 +1323,14 @@ static ParseRule* getRule(TokenType type) {
 }
 
 ObjFunction* compile(const char* source) {
-    initScanner(source);
+    return compileWithImports(source, NULL);
+}
+
+ObjFunction* compileWithImports(const char* source, ValueArray* paths) {
+    imports = paths;
+    initScanner(source, strlen(source));
     Compiler compiler;
-    initCompiler(&compiler, TYPE_SCRIPT);
+    initCompiler(&compiler, TYPE_SCRIPT, NULL);
 
     parser.hadError = false;
     parser.panicMode = false;
@@ -929,5 +1343,37 @@ ObjFunction* compile(const char* source) {
     }
 
     ObjFunction* function = endCompiler();
+    imports = NULL;
     return parser.hadError ? NULL : function;
 }
+
+bool compileLazy(ObjFunction* function) {
+    LazyBody* lazy = function->lazy;
+    initScannerAt(lazy->source, (size_t)lazy->length, lazy->line);
+
+    Compiler compiler;
+    initCompiler(&compiler, TYPE_FUNCTION, function);
+    compiler.captures = lazy->captures;
+
+    parser.hadError = false;
+    parser.panicMode = false;
+
+    advance();
+    beginScope();
+    functionBody();
+    endCompiler();
+
+    if (parser.hadError) {
+        /* Throw away the half-compiled chunk, the next call will try (and report the errors) again */
+        freeChunk(&function->chunk);
+        function->arity = 0;
+        return false;
+    }
+
+    freeLazyBody(function);
+    return true;
+}
+
+void setLazyCompilation(bool enabled) {
+    lazyCompilation = enabled;
+}
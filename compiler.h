@@ -6,4 +6,13 @@
 
 ObjFunction* compile(const char* source);
 
+/* Like `compile()`, and the path of every module the source imports is added to `imports` */
+ObjFunction* compileWithImports(const char* source, ValueArray* imports);
+
+/* Compiles the body of a function that was skipped by lazy compilation. Returns false on a compile error. */
+bool compileLazy(ObjFunction* function);
+
+/* Turns lazy compilation of function bodies on or off for the following calls to `compile()` */
+void setLazyCompilation(bool enabled);
+
 #endif
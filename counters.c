@@ -0,0 +1,278 @@
+#include <errno.h>
+#include <linux/perf_event.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/ioctl.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+
+#include "counters.h"
+#include "output.h"
+
+/* The per function table only prints the ones that took the most cycles */
+#define TOP_FUNCTIONS 10
+
+typedef enum {
+    COUNTER_CYCLES,
+    COUNTER_INSTRUCTIONS,
+    COUNTER_BRANCH_MISSES,
+    COUNTER_L1D_MISSES,
+    COUNTER_LLC_MISSES,
+    COUNTER_DTLB_MISSES,
+    COUNTER_COUNT
+} Counter;
+
+typedef struct {
+    const char* name;
+    uint32_t type;
+    uint64_t config;
+} Event;
+
+#define CACHE_READ_MISSES(cache) \
+    ((cache) | (PERF_COUNT_HW_CACHE_OP_READ << 8) | (PERF_COUNT_HW_CACHE_RESULT_MISS << 16))
+
+static const Event events[COUNTER_COUNT] = {
+    [COUNTER_CYCLES] = {"cycles", PERF_TYPE_HARDWARE, PERF_COUNT_HW_CPU_CYCLES},
+    [COUNTER_INSTRUCTIONS] = {"instructions", PERF_TYPE_HARDWARE, PERF_COUNT_HW_INSTRUCTIONS},
+    [COUNTER_BRANCH_MISSES] = {"branch", PERF_TYPE_HARDWARE, PERF_COUNT_HW_BRANCH_MISSES},
+    [COUNTER_L1D_MISSES] = {"L1d", PERF_TYPE_HW_CACHE, CACHE_READ_MISSES(PERF_COUNT_HW_CACHE_L1D)},
+    [COUNTER_LLC_MISSES] = {"LLC", PERF_TYPE_HARDWARE, PERF_COUNT_HW_CACHE_MISSES},
+    [COUNTER_DTLB_MISSES] = {"dTLB", PERF_TYPE_HW_CACHE, CACHE_READ_MISSES(PERF_COUNT_HW_CACHE_DTLB)},
+};
+
+typedef struct {
+    double counts[COUNTER_COUNT];
+} Counts;
+
+typedef struct {
+    ObjFunction* function;  /* Only a key, the function may be long gone by the time we print */
+    char name[32];
+    int line;
+    Counts counts;
+} FunctionCounts;
+
+_Thread_local bool countingCalls = false;
+
+static struct {
+    int leader;                     /* The cycles counter, the others are in its group and read with it */
+    int positions[COUNTER_COUNT];   /* Where each is in what a read gives back, -1 for one the CPU doesn't have */
+    int opened;
+
+    /* What the last read gave, the next one is counted from there */
+    uint64_t values[COUNTER_COUNT];
+    uint64_t enabled;
+    uint64_t running;
+    bool multiplexed;               /* The kernel shared the hardware with others, the counts are scaled up */
+
+    CounterPhase phase;
+    Counts phases[PHASE_COUNT];
+
+    /* Open addressing on the function's address, `current` is an index into it or -1 */
+    FunctionCounts* functions;
+    int functionCount;
+    int functionCapacity;
+    int current;
+} counters;
+
+static void addCounts(Counts* to, const Counts* from) {
+    for (int i = 0; i < COUNTER_COUNT; ++i) to->counts[i] += from->counts[i];
+}
+
+/* Reads the group and hands what it counted since the last read to the phase and the function running */
+static void sample() {
+    uint64_t group[3 + COUNTER_COUNT];
+    size_t size = sizeof(uint64_t) * (3 + counters.opened);
+    if (read(counters.leader, group, size) != (ssize_t)size) return;
+
+    uint64_t enabled = group[1] - counters.enabled;
+    uint64_t running = group[2] - counters.running;
+    counters.enabled = group[1];
+    counters.running = group[2];
+    if (running < enabled) counters.multiplexed = true;
+    double scale = running > 0 ? (double)enabled / (double)running : 0.0;
+
+    Counts delta;
+    for (int i = 0; i < COUNTER_COUNT; ++i) {
+        int position = counters.positions[i];
+        if (position < 0) {
+            delta.counts[i] = 0.0;
+            continue;
+        }
+        delta.counts[i] = (double)(group[3 + position] - counters.values[position]) * scale;
+        counters.values[position] = group[3 + position];
+    }
+
+    if (counters.phase != PHASE_NONE) addCounts(&counters.phases[counters.phase], &delta);
+    if (counters.phase == PHASE_RUN && counters.current >= 0) {
+        addCounts(&counters.functions[counters.current].counts, &delta);
+    }
+}
+
+static uint32_t hashFunction(ObjFunction* function) {
+    uintptr_t address = (uintptr_t)function;
+    return (uint32_t)((address >> 4) ^ (address >> 20));
+}
+
+static int findFunction(ObjFunction* function) {
+    uint32_t index = hashFunction(function) & (counters.functionCapacity - 1);
+    for (;;) {
+        FunctionCounts* entry = &counters.functions[index];
+        if (entry->function == function || entry->function == NULL) return (int)index;
+        index = (index + 1) & (counters.functionCapacity - 1);
+    }
+}
+
+static void growFunctions() {
+    FunctionCounts* old = counters.functions;
+    int oldCapacity = counters.functionCapacity;
+    counters.functionCapacity = oldCapacity < 64 ? 64 : oldCapacity * 2;
+    counters.functions = calloc(counters.functionCapacity, sizeof(FunctionCounts));
+    if (counters.functions == NULL) exit(1);
+
+    for (int i = 0; i < oldCapacity; ++i) {
+        if (old[i].function != NULL) counters.functions[findFunction(old[i].function)] = old[i];
+    }
+    free(old);
+}
+
+/* The entry for `function`, made on its first call with the name copied, since the string may be collected */
+static int functionEntry(ObjFunction* function) {
+    if (counters.functionCount + 1 > counters.functionCapacity * 3 / 4) growFunctions();
+
+    int index = findFunction(function);
+    FunctionCounts* entry = &counters.functions[index];
+    if (entry->function == NULL) {
+        entry->function = function;
+        snprintf(entry->name, sizeof(entry->name), "%s", function->name != NULL ? function->name->chars : "script");
+        entry->line = function->chunk.count > 0 ? function->chunk.lines[0] : 0;
+        ++counters.functionCount;
+    }
+    return index;
+}
+
+CounterPhase setCounterPhase(CounterPhase phase) {
+    if (!countingCalls) return PHASE_NONE;
+    sample();
+    CounterPhase previous = counters.phase;
+    counters.phase = phase;
+    return previous;
+}
+
+void switchCounters(ObjFunction* function) {
+    sample();
+    counters.current = function != NULL ? functionEntry(function) : -1;
+}
+
+static void printRow(const char* name, const Counts* counts) {
+    double cycles = counts->counts[COUNTER_CYCLES];
+    double instructions = counts->counts[COUNTER_INSTRUCTIONS];
+    fprintf(stderr, "%-28s %14.0f %14.0f", name, cycles, instructions);
+    if (cycles > 0 && counters.positions[COUNTER_INSTRUCTIONS] >= 0) fprintf(stderr, " %6.2f", instructions / cycles);
+    else fprintf(stderr, " %6s", "-");
+
+    /* Misses per thousand instructions, so phases and functions of any length compare */
+    for (int i = COUNTER_BRANCH_MISSES; i < COUNTER_COUNT; ++i) {
+        if (counters.positions[i] >= 0 && instructions > 0) {
+            fprintf(stderr, " %7.2f", counts->counts[i] * 1000.0 / instructions);
+        } else {
+            fprintf(stderr, " %7s", "-");
+        }
+    }
+    fputs("\n", stderr);
+}
+
+static void printHeader(const char* title) {
+    fprintf(stderr, "%-28s %14s %14s %6s", title, "cycles", "instructions", "IPC");
+    for (int i = COUNTER_BRANCH_MISSES; i < COUNTER_COUNT; ++i) fprintf(stderr, " %7s", events[i].name);
+    fputs("\n", stderr);
+}
+
+static int compareCycles(const void* a, const void* b) {
+    double left = ((const FunctionCounts*)a)->counts.counts[COUNTER_CYCLES];
+    double right = ((const FunctionCounts*)b)->counts.counts[COUNTER_CYCLES];
+    return left < right ? 1 : left > right ? -1 : 0;
+}
+
+static void printCounters() {
+    sample();
+    flushOutput(); /* So what the script printed comes first */
+
+    if (counters.running == 0) {
+        fprintf(stderr, "The performance counters never got onto the CPU, it may not have room for all of them.\n");
+        return;
+    }
+
+    fprintf(stderr, "\nPerformance counters, misses are per 1000 instructions%s\n",
+            counters.multiplexed ? " (scaled, the counters were shared with others)" : "");
+    printHeader("phase");
+    printRow("compile", &counters.phases[PHASE_COMPILE]);
+    printRow("run", &counters.phases[PHASE_RUN]);
+
+    /* Packing the entries to the front to sort them, the table isn't used after this */
+    int count = 0;
+    for (int i = 0; i < counters.functionCapacity; ++i) {
+        if (counters.functions[i].function != NULL) counters.functions[count++] = counters.functions[i];
+    }
+    if (count == 0) return;
+    qsort(counters.functions, count, sizeof(FunctionCounts), compareCycles);
+
+    fputs("\n", stderr);
+    printHeader("function");
+    for (int i = 0; i < count && i < TOP_FUNCTIONS; ++i) {
+        FunctionCounts* entry = &counters.functions[i];
+        char name[64];
+        snprintf(name, sizeof(name), "%s:%d", entry->name, entry->line);
+        printRow(name, &entry->counts);
+    }
+}
+
+static int openEvent(const Event* event, int group) {
+    struct perf_event_attr attr;
+    memset(&attr, 0, sizeof(attr));
+    attr.size = sizeof(attr);
+    attr.type = event->type;
+    attr.config = event->config;
+    attr.disabled = group == -1;    /* The whole group starts together once it's complete */
+    attr.exclude_kernel = 1;        /* User space only is what perf_event_paranoid 2 allows */
+    attr.exclude_hv = 1;
+    attr.read_format = PERF_FORMAT_GROUP | PERF_FORMAT_TOTAL_TIME_ENABLED | PERF_FORMAT_TOTAL_TIME_RUNNING;
+    return (int)syscall(SYS_perf_event_open, &attr, 0, -1, group, PERF_FLAG_FD_CLOEXEC);
+}
+
+static void explain(int error) {
+    fprintf(stderr, "Could not open the performance counters: %s.", strerror(error));
+
+    int paranoid;
+    FILE* file = fopen("/proc/sys/kernel/perf_event_paranoid", "r");
+    if (file != NULL && fscanf(file, "%d", &paranoid) == 1 && (error == EACCES || error == EPERM)) {
+        fprintf(stderr, " perf_event_paranoid is %d, counting without privileges needs it at 2 or below.", paranoid);
+    } else if (error == ENOENT || error == EOPNOTSUPP || error == ENODEV) {
+        fprintf(stderr, " The CPU, or the virtual machine it's in, has no hardware counters for us.");
+    }
+    if (file != NULL) fclose(file);
+    fputs("\n", stderr);
+}
+
+bool startCounters() {
+    /* Without cycles there's nothing to lead the group, the others are fine to be missing */
+    counters.leader = openEvent(&events[COUNTER_CYCLES], -1);
+    if (counters.leader < 0) {
+        explain(errno);
+        return false;
+    }
+    counters.positions[COUNTER_CYCLES] = 0;
+    counters.opened = 1;
+    for (int i = COUNTER_CYCLES + 1; i < COUNTER_COUNT; ++i) {
+        counters.positions[i] = openEvent(&events[i], counters.leader) >= 0 ? counters.opened++ : -1;
+    }
+
+    counters.phase = PHASE_NONE;
+    counters.current = -1;
+    ioctl(counters.leader, PERF_EVENT_IOC_RESET, PERF_IOC_FLAG_GROUP);
+    ioctl(counters.leader, PERF_EVENT_IOC_ENABLE, PERF_IOC_FLAG_GROUP);
+    countingCalls = true;
+    atexit(printCounters);
+    return true;
+}
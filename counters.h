@@ -0,0 +1,40 @@
+#ifndef clox_counters_h
+#define clox_counters_h
+
+/*
+    Hardware performance counters for `--perf-counters`, through perf_event_open. They count cycles, instructions,
+    branch misses, L1d, LLC and dTLB misses of the thread that started them, only in user space so that it works
+    unprivileged with perf_event_paranoid at 2. The counts are split between compiling, lazy bodies included, and
+    running, and what was counted while running goes to the function that was on top of the call stack: every
+    call, return, fiber switch and catch reads the counters. That read is a system call, so the per function
+    numbers include some of its cost.
+
+    Modules compiled on the loader threads and whatever the workers run are on other threads, they aren't counted.
+*/
+
+#include "common.h"
+#include "object.h"
+
+typedef enum {
+    PHASE_NONE,     /* Counted in no phase, between scripts say */
+    PHASE_COMPILE,
+    PHASE_RUN,
+    PHASE_COUNT
+} CounterPhase;
+
+/* Set on the thread that started the counters, the VM only tells us about calls while it is */
+extern _Thread_local bool countingCalls;
+
+/*
+    Opens and starts the counters, and prints what they counted when the process exits. Returns false after
+    saying why when the kernel won't let us have them.
+*/
+bool startCounters();
+
+/* Returns the phase it was in, to go back to after a lazy body is compiled say */
+CounterPhase setCounterPhase(CounterPhase phase);
+
+/* `function` is the one running from now on, NULL when it's none of the script's */
+void switchCounters(ObjFunction* function);
+
+#endif
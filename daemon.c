@@ -0,0 +1,278 @@
+#include <errno.h>
+#include <limits.h>
+#include <signal.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/prctl.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <sys/wait.h>
+#include <unistd.h>
+
+#include "daemon.h"
+#include "gc.h"
+#include "module.h"
+#include "output.h"
+#include "source.h"
+#include "vm.h"
+
+/* The client's stdin, stdout and stderr come along with every request */
+#define REQUEST_FDS 3
+
+static bool sendAll(int fd, const void* data, size_t length) {
+    const char* next = data;
+    while (length > 0) {
+        ssize_t sent = send(fd, next, length, MSG_NOSIGNAL); /* A client that left must not kill a worker */
+        if (sent < 0) {
+            if (errno == EINTR) continue;
+            return false;
+        }
+        next += sent;
+        length -= (size_t)sent;
+    }
+    return true;
+}
+
+static bool receiveAll(int fd, void* data, size_t length) {
+    char* next = data;
+    while (length > 0) {
+        ssize_t received = read(fd, next, length);
+        if (received < 0 && errno == EINTR) continue;
+        if (received <= 0) return false;
+        next += received;
+        length -= (size_t)received;
+    }
+    return true;
+}
+
+static int openSocket(const char* path, bool listening) {
+    struct sockaddr_un address = {.sun_family = AF_UNIX};
+    if (strlen(path) >= sizeof(address.sun_path)) {
+        errno = ENAMETOOLONG;
+        return -1;
+    }
+    strcpy(address.sun_path, path);
+
+    int fd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+    if (fd < 0) return -1;
+    if (listening) {
+        unlink(path); /* Left behind by an earlier daemon */
+        if (bind(fd, (struct sockaddr*)&address, sizeof(address)) == 0 && listen(fd, SOMAXCONN) == 0) return fd;
+    } else if (connect(fd, (struct sockaddr*)&address, sizeof(address)) == 0) {
+        return fd;
+    }
+
+    int error = errno;
+    close(fd);
+    errno = error;
+    return -1;
+}
+
+/* The first part of a request is its length, the descriptors ride along with it */
+static bool receiveHeader(int connection, uint32_t* length, int fds[REQUEST_FDS]) {
+    char control[CMSG_SPACE(sizeof(int) * REQUEST_FDS)];
+    struct iovec part = {.iov_base = length, .iov_len = sizeof(*length)};
+    struct msghdr message = {
+        .msg_iov = &part,
+        .msg_iovlen = 1,
+        .msg_control = control,
+        .msg_controllen = sizeof(control),
+    };
+
+    ssize_t received;
+    do {
+        received = recvmsg(connection, &message, MSG_CMSG_CLOEXEC);
+    } while (received < 0 && errno == EINTR);
+
+    struct cmsghdr* header = received > 0 ? CMSG_FIRSTHDR(&message) : NULL;
+    if (header == NULL || header->cmsg_level != SOL_SOCKET || header->cmsg_type != SCM_RIGHTS) return false;
+    int count = (int)((header->cmsg_len - CMSG_LEN(0)) / sizeof(int));
+    int* passed = (int*)CMSG_DATA(header);
+    if (count != REQUEST_FDS || received != sizeof(*length)) {
+        for (int i = 0; i < count; ++i) close(passed[i]);
+        return false;
+    }
+    memcpy(fds, passed, sizeof(int) * REQUEST_FDS);
+    return true;
+}
+
+/* A request is '\0' terminated strings: the working directory, the script, then its arguments */
+static char** splitRequest(char* request, uint32_t length, int* count) {
+    if (length == 0 || request[length - 1] != '\0') return NULL;
+    *count = 0;
+    for (uint32_t i = 0; i < length; ++i) {
+        if (request[i] == '\0') ++*count;
+    }
+    if (*count < 2) return NULL;
+
+    char** strings = malloc(sizeof(char*) * *count);
+    if (strings == NULL) exit(1);
+    char* next = request;
+    for (int i = 0; i < *count; ++i) {
+        strings[i] = next;
+        next += strlen(next) + 1;
+    }
+    return strings;
+}
+
+static int32_t exitStatus(int status) {
+    if (WIFEXITED(status)) return WEXITSTATUS(status);
+    if (WIFSIGNALED(status)) return 128 + WTERMSIG(status); /* What a shell reports for it */
+    return 70;
+}
+
+/* Serves one connection. Returns the script's path in the child that runs it, NULL in the worker. */
+static const char* serveRequest(int listener, int connection) {
+    uint32_t length;
+    int fds[REQUEST_FDS];
+    if (!receiveHeader(connection, &length, fds)) return NULL;
+
+    int32_t status = 64; /* A request we can't make sense of is a usage error */
+    char* request = length <= DAEMON_REQUEST_MAX ? malloc(length) : NULL;
+    int count;
+    char** strings;
+    if (request != NULL && receiveAll(connection, request, length) &&
+        (strings = splitRequest(request, length, &count)) != NULL) {
+        pid_t child = fork();
+        if (child == 0) {
+            close(listener);
+            close(connection);
+            for (int i = 0; i < REQUEST_FDS; ++i) {
+                dup2(fds[i], i);
+                close(fds[i]);
+            }
+            if (chdir(strings[0]) != 0) {
+                fprintf(stderr, "Could not change to '%s': %s.\n", strings[0], strerror(errno));
+                exit(74);
+            }
+            setScriptArguments(count - 2, strings + 2);
+            /* Line buffered when the client's stdout is a terminal, like a run of its own */
+            setOutputBuffering(isatty(STDOUT_FILENO), OUTPUT_BUFFER_SIZE);
+            return strings[1];
+        }
+
+        status = 71;
+        int result;
+        if (child > 0 && waitpid(child, &result, 0) == child) status = exitStatus(result);
+        free(strings);
+    }
+
+    for (int i = 0; i < REQUEST_FDS; ++i) close(fds[i]);
+    free(request);
+    sendAll(connection, &status, sizeof(status));
+    return NULL;
+}
+
+static const char* runWorker(pid_t daemon, int listener) {
+    /* Killing the daemon takes its workers along */
+    prctl(PR_SET_PDEATHSIG, SIGTERM);
+    if (getppid() != daemon) exit(0);
+
+    for (;;) {
+        int connection = accept(listener, NULL, NULL);
+        if (connection < 0) continue;
+        const char* script = serveRequest(listener, connection);
+        if (script != NULL) return script;
+        close(connection);
+    }
+}
+
+const char* serveScripts(const char* path, const char* prelude, int forks) {
+    if (forks <= 0) {
+        long cores = sysconf(_SC_NPROCESSORS_ONLN);
+        forks = cores > 0 ? (int)cores : 1;
+    }
+
+    int listener = openSocket(path, true);
+    if (listener < 0) {
+        fprintf(stderr, "Could not listen on '%s': %s.\n", path, strerror(errno));
+        exit(74);
+    }
+
+    if (prelude != NULL) {
+        /* No helper threads, the children wouldn't have them */
+        setCollectorSize(1);
+        setLoaderSize(1);
+
+        Source source;
+        if (!loadSource(prelude, &source)) exit(74);
+        setModuleRoot(prelude);
+        InterpretResult result = interpret(source.chars);
+        unloadSource(&source);
+
+        if (result == INTERPRET_COMPILE_ERROR) exit(65);
+        if (result == INTERPRET_RUNTIME_ERROR) exit(70);
+    }
+    flushOutput();
+
+    pid_t daemon = getpid();
+    pid_t* workers = calloc(forks, sizeof(pid_t));
+    if (workers == NULL) exit(1);
+    for (;;) {
+        for (int i = 0; i < forks; ++i) {
+            if (workers[i] > 0) continue;
+            workers[i] = fork();
+            if (workers[i] == 0) return runWorker(daemon, listener);
+            if (workers[i] < 0) {
+                perror("Could not fork a worker");
+                sleep(1);
+            }
+        }
+
+        int status;
+        pid_t dead = wait(&status);
+        for (int i = 0; i < forks; ++i) {
+            if (workers[i] == dead) workers[i] = 0;
+        }
+    }
+}
+
+int requestScript(const char* path, const char* script, int argumentCount, char** arguments) {
+    int fd = openSocket(path, false);
+    if (fd < 0) return -1;
+
+    char directory[PATH_MAX];
+    if (getcwd(directory, sizeof(directory)) == NULL) strcpy(directory, "/");
+
+    size_t sizes[argumentCount + 2];
+    const char* strings[argumentCount + 2];
+    strings[0] = directory;
+    strings[1] = script;
+    for (int i = 0; i < argumentCount; ++i) strings[i + 2] = arguments[i];
+
+    uint32_t length = 0;
+    for (int i = 0; i < argumentCount + 2; ++i) {
+        sizes[i] = strlen(strings[i]) + 1;
+        length += (uint32_t)sizes[i];
+    }
+
+    int fds[REQUEST_FDS] = {STDIN_FILENO, STDOUT_FILENO, STDERR_FILENO};
+    char control[CMSG_SPACE(sizeof(fds))];
+    memset(control, 0, sizeof(control));
+    struct iovec part = {.iov_base = &length, .iov_len = sizeof(length)};
+    struct msghdr message = {
+        .msg_iov = &part,
+        .msg_iovlen = 1,
+        .msg_control = control,
+        .msg_controllen = sizeof(control),
+    };
+    struct cmsghdr* header = CMSG_FIRSTHDR(&message);
+    header->cmsg_level = SOL_SOCKET;
+    header->cmsg_type = SCM_RIGHTS;
+    header->cmsg_len = CMSG_LEN(sizeof(fds));
+    memcpy(CMSG_DATA(header), fds, sizeof(fds));
+
+    int32_t status = -1;
+    ssize_t sent;
+    do {
+        sent = sendmsg(fd, &message, MSG_NOSIGNAL);
+    } while (sent < 0 && errno == EINTR);
+
+    bool ok = sent == sizeof(length);
+    for (int i = 0; ok && i < argumentCount + 2; ++i) ok = sendAll(fd, strings[i], sizes[i]);
+    if (ok && !receiveAll(fd, &status, sizeof(status))) status = -1;
+    close(fd);
+    return status;
+}
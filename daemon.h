@@ -0,0 +1,36 @@
+#ifndef clox_daemon_h
+#define clox_daemon_h
+
+/*
+    This module keeps warm interpreters around, so running a script doesn't cost starting a process:
+
+        ./qamar --daemon=/tmp/qamar.sock --prelude=lib.qmr --forks=4 &
+        ./qamar --connect=/tmp/qamar.sock job.qmr one two
+
+    The daemon runs the prelude once, which defines its globals and compiles the modules it imports (see
+    module.h), then forks the workers. They share that heap with the daemon copy-on-write and all wait in
+    accept() on the same Unix socket. A request carries the client's working directory, the script and its
+    arguments, along with the client's stdin, stdout and stderr. The worker forks again to run it, the child
+    starts out from the warm heap with those three in place, so the output goes straight to the client and a
+    script that changes the prelude's globals, exits or crashes takes nothing with it. The worker sends back
+    the status the script would have exited with on its own. The daemon forks a new worker for any that dies.
+
+    A forked process only gets the thread that forked it, so the prelude should stick to defining things. It
+    runs with the collector and the module loaders on the one thread, tasks, parallelMap and the event loop
+    started from the prelude are gone in the children.
+*/
+
+/* Requests bigger than this are turned down */
+#define DAEMON_REQUEST_MAX (64 * 1024)
+
+/*
+    Serves scripts on the Unix socket at `path`, forever. It only returns in a child forked for a request, with
+    the client's working directory, standard streams and script arguments set up. The caller then runs the
+    script whose path we hand back and exits with its status.
+*/
+const char* serveScripts(const char* path, const char* prelude, int forks);
+
+/* Runs `script` on the daemon at `path`. Returns its exit status, or -1 when there's no daemon to talk to. */
+int requestScript(const char* path, const char* script, int argumentCount, char** arguments);
+
+#endif
@@ -2,36 +2,37 @@
 #include "debug.h"
 #include "chunk.h"
 #include "object.h"
+#include "output.h"
 
 void disassembleChunk(Chunk* chunk, const char *name) {
-    printf("== %s ==\n", name); 
+    formatOutput("== %s ==\n", name); 
     for (int offset = 0; offset < chunk->count;) 
         offset = disassembleInstruction(chunk, offset);
 }
 
 static int simpleInstruction(const char* name, int offset) {
-    printf("%s\n", name);
+    formatOutput("%s\n", name);
     return offset + 1;
 }
 
 static int byteInstruction(const char* name, Chunk* chunk, int offset) {
     uint8_t slot = chunk->code[offset + 1];
-    printf("%-16s %4d\n", name, slot);
+    formatOutput("%-16s %4d\n", name, slot);
     return offset + 2;
 }
 
 static int jumpInstruction(const char* name, int sign, Chunk* chunk, int offset) {
     uint16_t jump = (uint16_t)(chunk->code[offset + 1] << 8);
     jump |= chunk->code[offset + 2];
-    printf("%-16s %4d -> %d\n", name, offset, offset + 3 + sign * jump);
+    formatOutput("%-16s %4d -> %d\n", name, offset, offset + 3 + sign * jump);
     return offset + 3;
 }
 
 static int constantInstruction(const char* name, Chunk* chunk, int offset) {
     uint8_t constant = chunk->code[offset + 1]; // accessing index of the constant
-    printf("%-16s %d '", name, constant);
+    formatOutput("%-16s %d '", name, constant);
     printValue(chunk->constants.values[constant]);
-    printf("'\n");
+    formatOutput("'\n");
 
     return offset + 2;
 }
@@ -41,11 +42,11 @@ static int constantInstruction(const char* name, Chunk* chunk, int offset) {
     offset of the beginning of the next instruction
 */
 int disassembleInstruction(Chunk* chunk, int offset) {
-    printf("%04d ", offset); // prints the byte offset of each instruction
+    formatOutput("%04d ", offset); // prints the byte offset of each instruction
     
     if (offset > 0 && chunk->lines[offset] == chunk->lines[offset - 1])
-        printf("    | "); // we show a '|' for any instruction that comes from the same source line as the preceding one
-    else printf("%4d ", chunk->lines[offset]);
+        formatOutput("    | "); // we show a '|' for any instruction that comes from the same source line as the preceding one
+    else formatOutput("%4d ", chunk->lines[offset]);
 
     uint8_t instruction = chunk->code[offset]; // reads single byte from bytecode
     switch (instruction) {
@@ -91,6 +92,20 @@ int disassembleInstruction(Chunk* chunk, int offset) {
             return simpleInstruction("OP_NOT", offset);
         case OP_NEGATE:
             return simpleInstruction("OP_NEGATE", offset);
+        case OP_GREATER_NN:
+            return simpleInstruction("OP_GREATER_NN", offset);
+        case OP_LESS_NN:
+            return simpleInstruction("OP_LESS_NN", offset);
+        case OP_ADD_NN:
+            return simpleInstruction("OP_ADD_NN", offset);
+        case OP_ADD_SS:
+            return simpleInstruction("OP_ADD_SS", offset);
+        case OP_SUBTRACT_NN:
+            return simpleInstruction("OP_SUBTRACT_NN", offset);
+        case OP_MULTIPLY_NN:
+            return simpleInstruction("OP_MULTIPLY_NN", offset);
+        case OP_DIVIDE_NN:
+            return simpleInstruction("OP_DIVIDE_NN", offset);
         case OP_PRINT:
             return simpleInstruction("OP_PRINT", offset);
         case OP_JUMP:
@@ -104,9 +119,9 @@ int disassembleInstruction(Chunk* chunk, int offset) {
         case OP_CLOSURE: {
             offset++;
             uint8_t constant = chunk->code[offset++];
-            printf("%-16s %4d ", "OP_CLOSURE", constant);
+            formatOutput("%-16s %4d ", "OP_CLOSURE", constant);
             printValue(chunk->constants.values[constant]);
-            printf("\n");
+            formatOutput("\n");
 
             ObjFunction* function = AS_FUNCTION(
                 chunk->constants.values[constant]
@@ -115,7 +130,7 @@ int disassembleInstruction(Chunk* chunk, int offset) {
             for (int j = 0; j < function->upvalueCount; ++j) {
                 int isLocal = chunk->code[offset++];
                 int index = chunk->code[offset++];
-                printf("%04d        |                 %s %d\n",
+                formatOutput("%04d        |                 %s %d\n",
                         offset - 2, isLocal ? "local" : "upvalue",
                         index);
             }
@@ -126,8 +141,18 @@ int disassembleInstruction(Chunk* chunk, int offset) {
             return simpleInstruction("OP_CLOSE_UPVALUE", offset);
         case OP_RETURN:
             return simpleInstruction("OP_RETURN", offset);
+        case OP_RESUME:
+            return simpleInstruction("OP_RESUME", offset);
+        case OP_YIELD:
+            return simpleInstruction("OP_YIELD", offset);
+        case OP_IMPORT:
+            return constantInstruction("OP_IMPORT", chunk, offset);
+        case OP_GET_PROPERTY:
+            return constantInstruction("OP_GET_PROPERTY", chunk, offset);
+        case OP_THROW:
+            return simpleInstruction("OP_THROW", offset);
         default:
-            printf("Unknown opcode %d\n", instruction);
+            formatOutput("Unknown opcode %d\n", instruction);
             return offset + 1;
     }
 }
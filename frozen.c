@@ -0,0 +1,446 @@
+#include <stdatomic.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "channel.h"
+#include "compiler.h"
+#include "frozen.h"
+#include "intern.h"
+#include "memory.h"
+#include "thread.h"
+#include "verifier.h"
+#include "vm.h"
+
+struct Frozen {
+    atomic_int references;
+    Obj** objects;      /* Everything frozen into the region */
+    int count;
+    int capacity;
+    Frozen** uses;      /* Other regions our objects point into, each retained once */
+    int useCount;
+    int useCapacity;
+};
+
+/*
+    The regions the current VM holds, see `holdFrozen`. A set, since freezing a string that's frozen already
+    asks it again every time.
+*/
+static _Thread_local struct {
+    Frozen** regions;
+    int count;
+    int capacity;
+} held;
+
+/* Maps the objects we've frozen already to their copies, so sharing and cycles come out the same */
+typedef struct {
+    Obj* original;
+    Obj* frozen;
+} Seen;
+
+typedef struct {
+    Frozen* region;
+    Seen* seen;
+    int seenCount;
+    int seenCapacity;
+    const char* error;
+} Freezer;
+
+/* Every frozen object has a pointer to its region right in front of it */
+static Obj* allocateFrozen(Frozen* region, size_t size, ObjType type) {
+    Frozen** header = malloc(sizeof(Frozen*) + size);
+    if (header == NULL) exit(1);
+    *header = region;
+
+    Obj* object = (Obj*)(header + 1);
+    object->type = type;
+    object->frozen = true;
+    atomic_init(&object->marked, false);
+
+    if (region->count == region->capacity) {
+        region->capacity = GROW_CAPACITY(region->capacity);
+        region->objects = realloc(region->objects, sizeof(Obj*) * region->capacity);
+        if (region->objects == NULL) exit(1);
+    }
+    region->objects[region->count++] = object;
+    return object;
+}
+
+Frozen* frozenRegion(Obj* object) {
+    return ((Frozen**)object)[-1];
+}
+
+void retainFrozen(Frozen* region) {
+    atomic_fetch_add_explicit(&region->references, 1, memory_order_relaxed);
+}
+
+/* Retains a region that may be on its way out, false if it already is */
+static bool tryRetainFrozen(Frozen* region) {
+    int references = atomic_load_explicit(&region->references, memory_order_relaxed);
+    while (references > 0) {
+        if (atomic_compare_exchange_weak_explicit(&region->references, &references, references + 1,
+                                                  memory_order_relaxed, memory_order_relaxed)) return true;
+    }
+    return false;
+}
+
+static void freeRegion(Frozen* region) {
+    bool removed = false;
+    for (int i = 0; i < region->count; ++i) {
+        if (region->objects[i]->type != OBJ_STRING) continue;
+        removeSharedString((ObjString*)region->objects[i]);
+        removed = true;
+    }
+    if (removed) waitForSharedReaders();
+
+    for (int i = 0; i < region->count; ++i) {
+        Obj* object = region->objects[i];
+        switch (object->type) {
+            case OBJ_STRING:
+                free(((ObjString*)object)->chars);
+                break;
+            case OBJ_FUNCTION: {
+                Chunk* chunk = &((ObjFunction*)object)->chunk;
+                free(chunk->code);
+                free(chunk->lines);
+                free(chunk->constants.values);
+                free(chunk->handlers);
+                break;
+            }
+            case OBJ_CLOSURE:
+                free(((ObjClosure*)object)->upvalues);
+                break;
+            case OBJ_CHANNEL:
+                releaseChannel(((ObjChannel*)object)->channel);
+                break;
+            case OBJ_THREAD:
+                releaseThread(((ObjThread*)object)->thread);
+                break;
+            default:
+                break;
+        }
+        free((Frozen**)object - 1);
+    }
+    for (int i = 0; i < region->useCount; ++i) releaseFrozen(region->uses[i]);
+
+    free(region->objects);
+    free(region->uses);
+    free(region);
+}
+
+void releaseFrozen(Frozen* region) {
+    if (atomic_fetch_sub_explicit(&region->references, 1, memory_order_acq_rel) == 1) freeRegion(region);
+}
+
+static Frozen** findHeld(Frozen* region) {
+    uint32_t index = (uint32_t)(((uintptr_t)region >> 4) * 2654435761u) & (held.capacity - 1);
+    for (;;) {
+        Frozen** slot = &held.regions[index];
+        if (*slot == region || *slot == NULL) return slot;
+        index = (index + 1) & (held.capacity - 1);
+    }
+}
+
+static bool isHeld(Frozen* region) {
+    return held.capacity > 0 && *findHeld(region) == region;
+}
+
+void holdFrozen(Frozen* region) {
+    if (isHeld(region)) return;
+    if ((held.count + 1) * 2 > held.capacity) {
+        Frozen** old = held.regions;
+        int oldCapacity = held.capacity;
+        held.capacity = GROW_CAPACITY(oldCapacity);
+        held.regions = calloc(held.capacity, sizeof(Frozen*));
+        if (held.regions == NULL) exit(1);
+        for (int i = 0; i < oldCapacity; ++i) {
+            if (old[i] != NULL) *findHeld(old[i]) = old[i];
+        }
+        free(old);
+    }
+    retainFrozen(region);
+    *findHeld(region) = region;
+    ++held.count;
+}
+
+void releaseHeldFrozen() {
+    for (int i = 0; i < held.capacity; ++i) {
+        if (held.regions[i] != NULL) releaseFrozen(held.regions[i]);
+    }
+    free(held.regions);
+    held.regions = NULL;
+    held.count = 0;
+    held.capacity = 0;
+}
+
+/* Makes the region being frozen point into `region`. `retained` says whether we hold a reference for it already. */
+static void useRegion(Freezer* freezer, Frozen* region, bool retained) {
+    Frozen* self = freezer->region;
+    bool known = region == self;
+    for (int i = 0; i < self->useCount && !known; ++i) known = self->uses[i] == region;
+    if (known) {
+        if (retained) releaseFrozen(region);
+        return;
+    }
+
+    if (self->useCount == self->useCapacity) {
+        self->useCapacity = GROW_CAPACITY(self->useCapacity);
+        self->uses = realloc(self->uses, sizeof(Frozen*) * self->useCapacity);
+        if (self->uses == NULL) exit(1);
+    }
+    if (!retained) retainFrozen(region);
+    self->uses[self->useCount++] = region;
+}
+
+static Seen* findSeen(Freezer* freezer, Obj* object) {
+    uint32_t index = (uint32_t)(((uintptr_t)object >> 4) * 2654435761u) & (freezer->seenCapacity - 1);
+    for (;;) {
+        Seen* seen = &freezer->seen[index];
+        if (seen->original == object || seen->original == NULL) return seen;
+        index = (index + 1) & (freezer->seenCapacity - 1);
+    }
+}
+
+static void remember(Freezer* freezer, Obj* original, Obj* frozen) {
+    if ((freezer->seenCount + 1) * 2 > freezer->seenCapacity) {
+        Seen* old = freezer->seen;
+        int oldCapacity = freezer->seenCapacity;
+        freezer->seenCapacity = GROW_CAPACITY(oldCapacity) * 2;
+        freezer->seen = calloc(freezer->seenCapacity, sizeof(Seen));
+        if (freezer->seen == NULL) exit(1);
+        for (int i = 0; i < oldCapacity; ++i) {
+            if (old[i].original != NULL) *findSeen(freezer, old[i].original) = old[i];
+        }
+        free(old);
+    }
+    *findSeen(freezer, original) = (Seen){original, frozen};
+    ++freezer->seenCount;
+}
+
+/*
+    Takes a frozen string the shared table found. One in a region this VM holds is safe as it is, any other
+    needs retaining first and may turn out to be going away.
+*/
+static bool claimFrozenString(ObjString* string, void* retained) {
+    Frozen* region = frozenRegion((Obj*)string);
+    if (isHeld(region)) {
+        *(bool*)retained = false;
+        return true;
+    }
+    return *(bool*)retained = tryRetainFrozen(region);
+}
+
+/* Lines from a reader never got hashed */
+static uint32_t stringHash(ObjString* string) {
+    return string->interned ? string->hash : hashString(string->chars, string->length);
+}
+
+static ObjString* freezeString(Freezer* freezer, ObjString* string) {
+    uint32_t hash = stringHash(string);
+    bool retained;
+    ObjString* frozen = findSharedString(string->chars, string->length, hash, claimFrozenString, &retained);
+    if (frozen != NULL) {
+        useRegion(freezer, frozenRegion((Obj*)frozen), retained);
+        return frozen;
+    }
+
+    /* Slices don't own their characters and may not end in a '\0', the copy does both */
+    Frozen* region = freezer->region;
+    ObjString* copy = (ObjString*)allocateFrozen(region, sizeof(ObjString), OBJ_STRING);
+    copy->chars = malloc(string->length + 1);
+    if (copy->chars == NULL) exit(1);
+    memcpy(copy->chars, string->chars, string->length);
+    copy->chars[string->length] = '\0';
+    copy->length = string->length;
+    copy->hash = hash;
+    copy->interned = true;
+    copy->ownsChars = true;
+    copy->owner = NULL;
+
+    frozen = addSharedString(copy, claimFrozenString, &retained);
+    if (frozen == copy) return copy;
+
+    /* Another thread froze the same characters in the meantime, ours is the last object in the region */
+    --region->count;
+    free(copy->chars);
+    free((Frozen**)copy - 1);
+    useRegion(freezer, frozenRegion((Obj*)frozen), retained);
+    return frozen;
+}
+
+static Value freezeValue(Freezer* freezer, Value value);
+
+/* A region starts out with the one reference its maker holds */
+static Frozen* newRegion() {
+    Frozen* region = calloc(1, sizeof(Frozen));
+    if (region == NULL) exit(1);
+    atomic_init(&region->references, 1);
+    return region;
+}
+
+static ObjFunction* freezeFunction(Freezer* freezer, ObjFunction* function) {
+    /* The body can't be compiled later, that would change the function under the other VMs' feet */
+    if (function->lazy != NULL && (!compileLazy(function) || !verifyFunction(function))) {
+        if (freezer->error == NULL) freezer->error = "Could not compile a function to freeze it.";
+        return function;
+    }
+
+    ObjFunction* frozen = (ObjFunction*)allocateFrozen(freezer->region, sizeof(ObjFunction), OBJ_FUNCTION);
+    remember(freezer, (Obj*)function, (Obj*)frozen);
+    frozen->arity = function->arity;
+    frozen->upvalueCount = function->upvalueCount;
+    frozen->maxStack = function->maxStack;
+    frozen->lazy = NULL;
+    frozen->name = function->name != NULL ? AS_STRING(freezeValue(freezer, OBJ_VAL(function->name))) : NULL;
+
+    Chunk* chunk = &function->chunk;
+    Chunk* copy = &frozen->chunk;
+    copy->count = copy->capacity = chunk->count;
+    copy->code = malloc(chunk->count);
+    copy->lines = malloc(sizeof(int) * chunk->count);
+    copy->constants.count = copy->constants.capacity = chunk->constants.count;
+    copy->constants.values = malloc(sizeof(Value) * chunk->constants.count);
+    if (copy->code == NULL || copy->lines == NULL || copy->constants.values == NULL) exit(1);
+    memcpy(copy->code, chunk->code, chunk->count);
+    memcpy(copy->lines, chunk->lines, sizeof(int) * chunk->count);
+    for (int i = 0; i < chunk->constants.count; ++i) {
+        copy->constants.values[i] = freezeValue(freezer, chunk->constants.values[i]);
+    }
+
+    copy->handlerCount = copy->handlerCapacity = chunk->handlerCount;
+    copy->handlers = NULL;
+    if (chunk->handlerCount > 0) {
+        copy->handlers = malloc(sizeof(Handler) * chunk->handlerCount);
+        if (copy->handlers == NULL) exit(1);
+        memcpy(copy->handlers, chunk->handlers, sizeof(Handler) * chunk->handlerCount);
+    }
+    return frozen;
+}
+
+static Value freezeValue(Freezer* freezer, Value value) {
+    if (!IS_OBJ(value)) return value;
+
+    Obj* object = AS_OBJ(value);
+    if (object->frozen) {
+        useRegion(freezer, frozenRegion(object), false);
+        return value;
+    }
+    Seen* seen = freezer->seenCapacity > 0 ? findSeen(freezer, object) : NULL;
+    if (seen != NULL && seen->original != NULL) return OBJ_VAL(seen->frozen);
+
+    Frozen* region = freezer->region;
+    switch (object->type) {
+        case OBJ_STRING:
+            return OBJ_VAL(freezeString(freezer, (ObjString*)object));
+        case OBJ_FUNCTION:
+            return OBJ_VAL(freezeFunction(freezer, (ObjFunction*)object));
+        case OBJ_CLOSURE: {
+            /* The closure is remembered before its upvalues, one of them may well point back at it */
+            ObjClosure* closure = (ObjClosure*)object;
+            ObjClosure* frozen = (ObjClosure*)allocateFrozen(region, sizeof(ObjClosure), OBJ_CLOSURE);
+            remember(freezer, object, (Obj*)frozen);
+            frozen->upvalueCount = closure->upvalueCount;
+            frozen->module = NULL; /* A module's globals belong to its VM, frozen closures use the caller's */
+            frozen->upvalues = malloc(sizeof(ObjUpvalue*) * (closure->upvalueCount + 1));
+            if (frozen->upvalues == NULL) exit(1);
+            frozen->function = AS_FUNCTION(freezeValue(freezer, OBJ_VAL(closure->function)));
+            for (int i = 0; i < closure->upvalueCount; ++i) {
+                frozen->upvalues[i] = (ObjUpvalue*)AS_OBJ(freezeValue(freezer, OBJ_VAL(closure->upvalues[i])));
+            }
+            return OBJ_VAL(frozen);
+        }
+        case OBJ_UPVALUE: {
+            /* Open or closed, the frozen one is closed over the variable's current value */
+            ObjUpvalue* upvalue = (ObjUpvalue*)object;
+            ObjUpvalue* frozen = (ObjUpvalue*)allocateFrozen(region, sizeof(ObjUpvalue), OBJ_UPVALUE);
+            remember(freezer, object, (Obj*)frozen);
+            frozen->location = &frozen->closed;
+            frozen->next = NULL;
+            frozen->closed = NIL_VAL;
+            frozen->closed = freezeValue(freezer, *upvalue->location);
+            return OBJ_VAL(frozen);
+        }
+        case OBJ_NATIVE: {
+            ObjNative* frozen = (ObjNative*)allocateFrozen(region, sizeof(ObjNative), OBJ_NATIVE);
+            frozen->function = ((ObjNative*)object)->function;
+            return OBJ_VAL(frozen);
+        }
+        case OBJ_CHANNEL: {
+            ObjChannel* frozen = (ObjChannel*)allocateFrozen(region, sizeof(ObjChannel), OBJ_CHANNEL);
+            frozen->channel = ((ObjChannel*)object)->channel;
+            retainChannel(frozen->channel);
+            return OBJ_VAL(frozen);
+        }
+        case OBJ_THREAD: {
+            ObjThread* frozen = (ObjThread*)allocateFrozen(region, sizeof(ObjThread), OBJ_THREAD);
+            frozen->thread = ((ObjThread*)object)->thread;
+            retainThread(frozen->thread);
+            return OBJ_VAL(frozen);
+        }
+        case OBJ_READER:
+            if (freezer->error == NULL) freezer->error = "A reader can't be frozen.";
+            return NIL_VAL;
+        case OBJ_FIBER:
+            if (freezer->error == NULL) freezer->error = "A fiber can't be frozen.";
+            return NIL_VAL;
+        case OBJ_MODULE:
+            if (freezer->error == NULL) freezer->error = "A module can't be frozen.";
+            return NIL_VAL;
+    }
+    return NIL_VAL; /* Unreachable */
+}
+
+static Value freezeNative(int argCount, Value* args) {
+    if (argCount != 1) return nativeError("freeze() expects a value.");
+    if (!IS_OBJ(args[0]) || AS_OBJ(args[0])->frozen) return args[0];
+
+    /* The common case of a string that's been frozen before needs no region of its own */
+    if (IS_STRING(args[0])) {
+        ObjString* string = AS_STRING(args[0]);
+        bool retained;
+        ObjString* frozen = findSharedString(string->chars, string->length, stringHash(string),
+                                             claimFrozenString, &retained);
+        if (frozen != NULL) {
+            if (retained) {
+                holdFrozen(frozenRegion((Obj*)frozen));
+                releaseFrozen(frozenRegion((Obj*)frozen));
+            }
+            return OBJ_VAL(frozen);
+        }
+    }
+
+    Frozen* region = newRegion();
+    Freezer freezer = {region, NULL, 0, 0, NULL};
+    Value frozen = freezeValue(&freezer, args[0]);
+    free(freezer.seen);
+    if (freezer.error != NULL) {
+        releaseFrozen(region);
+        return nativeError("%s", freezer.error);
+    }
+
+    /* The reference we made it with goes to this VM */
+    holdFrozen(region);
+    releaseFrozen(region);
+    return frozen;
+}
+
+ObjFunction* freezeCompiled(ObjFunction* function) {
+    Frozen* region = newRegion();
+    Freezer freezer = {region, NULL, 0, 0, NULL};
+    Value frozen = freezeValue(&freezer, OBJ_VAL(function));
+    free(freezer.seen);
+    if (freezer.error != NULL) {
+        releaseFrozen(region);
+        return NULL;
+    }
+    return AS_FUNCTION(frozen);
+}
+
+static Value isFrozenNative(int argCount, Value* args) {
+    if (argCount != 1) return nativeError("isFrozen() expects a value.");
+    return BOOL_VAL(!IS_OBJ(args[0]) || AS_OBJ(args[0])->frozen);
+}
+
+void defineFrozenNatives() {
+    defineNative("freeze", freezeNative);
+    defineNative("isFrozen", isFrozenNative);
+}
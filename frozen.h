@@ -0,0 +1,46 @@
+#ifndef clox_frozen_h
+#define clox_frozen_h
+
+/*
+    This module implements frozen values, read-only object graphs that every VM shares instead of copying:
+
+        var words = freeze(readChunk(openFile("words.txt"), 100000000));
+        for (var i = 0; i < 8; i = i + 1) spawn(worker, words);    // Every thread reads the same one
+
+    `freeze(value)` copies the value and everything it reaches into a region that belongs to no VM and hands
+    back the copy, the original stays as it was. Sending a frozen value anywhere (channels, spawn, tasks, the
+    worker pool) only sends a pointer. A region is reference counted: every VM that holds a value from it
+    counts once until the VM goes away, and so does every message carrying one and every region pointing into it.
+
+    Nothing in a region ever changes, so it's read without locks. Functions are compiled when they're frozen,
+    and assigning to a variable a frozen closure captured is a runtime error. Frozen strings are interned
+    process-wide in the shared table (see intern.h): two frozen strings with the same characters are the same
+    object, whichever VM froze them, and freezing a string that's frozen already only costs a lookup.
+    Readers, fibers and modules belong to a VM and can't be frozen.
+*/
+
+#include "object.h"
+
+typedef struct Frozen Frozen;
+
+/* The region a frozen object lives in */
+Frozen* frozenRegion(Obj* object);
+
+void retainFrozen(Frozen* region);
+void releaseFrozen(Frozen* region);
+
+/* Keeps the region alive for as long as the current VM is, for values from it that the VM got hold of */
+void holdFrozen(Frozen* region);
+
+/* Lets go of every region the current VM held on to, before the VM is freed */
+void releaseHeldFrozen();
+
+/*
+    Freezes a compiled function into a region of its own, for the module cache (see module.h). The caller
+    gets the region's one reference. NULL if some function in it doesn't compile.
+*/
+ObjFunction* freezeCompiled(ObjFunction* function);
+
+void defineFrozenNatives();
+
+#endif
@@ -0,0 +1,502 @@
+#include <pthread.h>
+#include <sched.h>
+#include <stdatomic.h>
+#include <stdlib.h>
+#include <unistd.h>
+
+#include "gc.h"
+#include "loop.h"
+#include "memory.h"
+#include "module.h"
+#include "reader.h"
+#include "scheduler.h"
+#include "vm.h"
+
+#define CACHE_LINE 64
+
+#define GRAY_INITIAL_CAPACITY 1024
+#define MAX_COLLECTORS 64
+
+#define LOST_RACE ((Obj*)-1)
+
+typedef struct GrayRing {
+    long capacity;
+    struct GrayRing* outgrown;  /* The ring this one replaced, thieves may still be reading it until the mark is over */
+    _Atomic(Obj*) objects[];
+} GrayRing;
+
+/*
+    What one thread taking part in a collection works with. The gray stack is a Chase-Lev deque like the
+    scheduler's (see scheduler.c), the owner marks off the bottom and the others steal from the top.
+*/
+typedef struct {
+    _Alignas(CACHE_LINE) atomic_long top;
+    _Alignas(CACHE_LINE) atomic_long bottom;
+    _Atomic(GrayRing*) ring;
+
+    /* What the sweep found, handed over to the collecting thread */
+    ObjReader** readers;
+    int readerCount;
+    int readerCapacity;
+    size_t freed;
+    unsigned long seen;     /* The last phase a helper joined */
+} Marker;
+
+typedef enum {
+    PHASE_MARK,
+    PHASE_SWEEP
+} Phase;
+
+/* One collection of one VM's heap */
+typedef struct {
+    Marker* markers;            /* One for each thread taking part, the collecting thread's first */
+    int participants;
+    atomic_int idle;            /* Participants that found nothing to mark or steal */
+    HeapPage** pages;
+    int pageCount;
+    atomic_int nextPage;        /* The next page to sweep */
+} Collection;
+
+/*
+    The helper threads, shared by every VM. One collection at a time gets them, a VM that finds them busy
+    collects on its own.
+*/
+static struct {
+    pthread_mutex_t busy;       /* Held by the collection the helpers work for */
+    int size;                   /* Threads per collection, the collecting one included */
+    int helperCount;
+    Marker* markers;            /* One for each, the collecting thread's first */
+
+    pthread_mutex_t lock;       /* Guards the hand-over below */
+    pthread_cond_t start;
+    pthread_cond_t finished;
+    unsigned long generation;   /* Bumped for every phase the helpers join */
+    Collection* current;
+    Phase phase;
+    int done;                   /* Helpers through with the phase */
+} collector = {
+    .busy = PTHREAD_MUTEX_INITIALIZER,
+    .lock = PTHREAD_MUTEX_INITIALIZER,
+    .start = PTHREAD_COND_INITIALIZER,
+    .finished = PTHREAD_COND_INITIALIZER,
+};
+
+/* The marker of the current thread, gray objects go on its stack */
+static _Thread_local Marker* marker = NULL;
+
+static GrayRing* newGrayRing(long capacity) {
+    GrayRing* ring = malloc(sizeof(GrayRing) + sizeof(_Atomic(Obj*)) * capacity);
+    if (ring == NULL) exit(1);
+    ring->capacity = capacity;
+    ring->outgrown = NULL;
+    return ring;
+}
+
+static void pushGray(Marker* self, Obj* object) {
+    long bottom = atomic_load_explicit(&self->bottom, memory_order_relaxed);
+    long top = atomic_load_explicit(&self->top, memory_order_acquire);
+    GrayRing* ring = atomic_load_explicit(&self->ring, memory_order_relaxed);
+
+    if (bottom - top > ring->capacity - 1) {
+        GrayRing* bigger = newGrayRing(ring->capacity * 2);
+        for (long i = top; i < bottom; ++i) {
+            Obj* moved = atomic_load_explicit(&ring->objects[i & (ring->capacity - 1)], memory_order_relaxed);
+            atomic_store_explicit(&bigger->objects[i & (bigger->capacity - 1)], moved, memory_order_relaxed);
+        }
+        bigger->outgrown = ring;
+        atomic_store_explicit(&self->ring, bigger, memory_order_release);
+        ring = bigger;
+    }
+
+    atomic_store_explicit(&ring->objects[bottom & (ring->capacity - 1)], object, memory_order_relaxed);
+    atomic_thread_fence(memory_order_release);
+    atomic_store_explicit(&self->bottom, bottom + 1, memory_order_relaxed);
+}
+
+static Obj* popGray(Marker* self) {
+    long bottom = atomic_load_explicit(&self->bottom, memory_order_relaxed) - 1;
+    GrayRing* ring = atomic_load_explicit(&self->ring, memory_order_relaxed);
+    atomic_store_explicit(&self->bottom, bottom, memory_order_relaxed);
+    atomic_thread_fence(memory_order_seq_cst);
+    long top = atomic_load_explicit(&self->top, memory_order_relaxed);
+
+    if (top > bottom) {
+        atomic_store_explicit(&self->bottom, bottom + 1, memory_order_relaxed);
+        return NULL;
+    }
+
+    Obj* object = atomic_load_explicit(&ring->objects[bottom & (ring->capacity - 1)], memory_order_relaxed);
+    if (top == bottom) {
+        /* The last one, a thief may be after it too */
+        if (!atomic_compare_exchange_strong_explicit(&self->top, &top, top + 1,
+                                                     memory_order_seq_cst, memory_order_relaxed)) object = NULL;
+        atomic_store_explicit(&self->bottom, bottom + 1, memory_order_relaxed);
+    }
+    return object;
+}
+
+static Obj* stealGray(Marker* victim) {
+    long top = atomic_load_explicit(&victim->top, memory_order_acquire);
+    atomic_thread_fence(memory_order_seq_cst);
+    long bottom = atomic_load_explicit(&victim->bottom, memory_order_acquire);
+    if (top >= bottom) return NULL;
+
+    GrayRing* ring = atomic_load_explicit(&victim->ring, memory_order_acquire);
+    Obj* object = atomic_load_explicit(&ring->objects[top & (ring->capacity - 1)], memory_order_relaxed);
+    if (!atomic_compare_exchange_strong_explicit(&victim->top, &top, top + 1,
+                                                 memory_order_seq_cst, memory_order_relaxed)) return LOST_RACE;
+    return object;
+}
+
+static bool grayEmpty(Marker* self) {
+    return atomic_load(&self->bottom) <= atomic_load(&self->top);
+}
+
+static void initMarker(Marker* self) {
+    atomic_init(&self->top, 0);
+    atomic_init(&self->bottom, 0);
+    atomic_init(&self->ring, newGrayRing(GRAY_INITIAL_CAPACITY));
+    self->readers = NULL;
+    self->readerCount = 0;
+    self->readerCapacity = 0;
+    self->freed = 0;
+    self->seen = 0;
+}
+
+static void freeMarker(Marker* self) {
+    free(atomic_load_explicit(&self->ring, memory_order_relaxed));
+    free(self->readers);
+}
+
+/* Once the mark is over nobody can be reading the rings the stack outgrew */
+static void dropOutgrown(Marker* self) {
+    GrayRing* ring = atomic_load_explicit(&self->ring, memory_order_relaxed);
+    while (ring->outgrown != NULL) {
+        GrayRing* outgrown = ring->outgrown;
+        ring->outgrown = outgrown->outgrown;
+        free(outgrown);
+    }
+}
+
+void trackObject(Obj* object) {
+    while (vm.fillingPage < vm.pageCount && vm.pages[vm.fillingPage]->count == HEAP_PAGE_OBJECTS) ++vm.fillingPage;
+    if (vm.fillingPage == vm.pageCount) {
+        if (vm.pageCount == vm.pageCapacity) {
+            vm.pageCapacity = GROW_CAPACITY(vm.pageCapacity);
+            vm.pages = realloc(vm.pages, sizeof(HeapPage*) * vm.pageCapacity);
+            if (vm.pages == NULL) exit(1);
+        }
+        HeapPage* page = malloc(sizeof(HeapPage));
+        if (page == NULL) exit(1);
+        page->count = 0;
+        vm.pages[vm.pageCount++] = page;
+    }
+    HeapPage* page = vm.pages[vm.fillingPage];
+    page->objects[page->count++] = object;
+}
+
+void markObject(Obj* object) {
+    if (object == NULL || object->frozen) return;
+    if (atomic_exchange_explicit(&object->marked, true, memory_order_relaxed)) return;
+    pushGray(marker, object);
+}
+
+void markValue(Value value) {
+    if (IS_OBJ(value)) markObject(AS_OBJ(value));
+}
+
+static void markFiber(ObjFiber* fiber) {
+    for (Value* slot = fiber->stack; slot < fiber->stackTop; ++slot) markValue(*slot);
+    for (int i = 0; i < fiber->frameCount; ++i) markObject((Obj*)fiber->frames[i].closure);
+    for (ObjUpvalue* upvalue = fiber->openUpvalues; upvalue != NULL; upvalue = upvalue->next) {
+        markObject((Obj*)upvalue);
+    }
+    markObject((Obj*)fiber->caller);
+}
+
+/* Marks what the object points to */
+static void blackenObject(Obj* object) {
+    switch (object->type) {
+        case OBJ_CLOSURE: {
+            ObjClosure* closure = (ObjClosure*)object;
+            markObject((Obj*)closure->function);
+            markObject((Obj*)closure->module);
+            for (int i = 0; i < closure->upvalueCount; ++i) markObject((Obj*)closure->upvalues[i]);
+            break;
+        }
+        case OBJ_FUNCTION: {
+            ObjFunction* function = (ObjFunction*)object;
+            markObject((Obj*)function->name);
+            for (int i = 0; i < function->chunk.constants.count; ++i) markValue(function->chunk.constants.values[i]);
+            if (function->lazy != NULL) {
+                for (int i = 0; i < function->upvalueCount; ++i) markObject((Obj*)function->lazy->captures[i]);
+            }
+            break;
+        }
+        case OBJ_UPVALUE:
+            /* Open ones too, a fiber that dies gets its upvalues closed over what they point to */
+            markValue(*((ObjUpvalue*)object)->location);
+            break;
+        case OBJ_FIBER:
+            markFiber((ObjFiber*)object);
+            break;
+        case OBJ_MODULE: {
+            ObjModule* module = (ObjModule*)object;
+            markObject((Obj*)module->path);
+            markTable(&module->globals);
+            break;
+        }
+        case OBJ_STRING:
+            markObject(((ObjString*)object)->owner);
+            break;
+        case OBJ_NATIVE:
+        case OBJ_READER:
+        case OBJ_CHANNEL:
+        case OBJ_THREAD:
+            break;
+    }
+}
+
+/* Blackens gray objects until there are none left anywhere */
+static void drain(Collection* collection) {
+    int participants = collection->participants;
+    for (;;) {
+        Obj* object;
+        while ((object = popGray(marker)) != NULL) blackenObject(object);
+        if (participants == 1) return;
+
+        int index = (int)(marker - collection->markers);
+        for (int i = 1; i < participants && object == NULL; ++i) {
+            while ((object = stealGray(&collection->markers[(index + i) % participants])) == LOST_RACE);
+        }
+        if (object != NULL) {
+            blackenObject(object);
+            continue;
+        }
+
+        /* Only a participant that isn't idle makes gray objects, so once all of us are idle we're done */
+        atomic_fetch_add(&collection->idle, 1);
+        for (;;) {
+            if (atomic_load(&collection->idle) == participants) return;
+            bool found = false;
+            for (int i = 0; i < participants && !found; ++i) found = !grayEmpty(&collection->markers[i]);
+            if (found) {
+                atomic_fetch_sub(&collection->idle, 1);
+                break;
+            }
+            sched_yield();
+        }
+    }
+}
+
+static void sweepPage(HeapPage* page) {
+    int kept = 0;
+    for (int i = 0; i < page->count; ++i) {
+        Obj* object = page->objects[i];
+        if (atomic_load_explicit(&object->marked, memory_order_relaxed)) {
+            atomic_store_explicit(&object->marked, false, memory_order_relaxed);
+            page->objects[kept++] = object;
+        } else if (object->type == OBJ_READER) {
+            /* Only the collecting thread knows its sockets. A mapped one has no lines left, they'd have marked it */
+            if (marker->readerCount == marker->readerCapacity) {
+                marker->readerCapacity = GROW_CAPACITY(marker->readerCapacity);
+                marker->readers = realloc(marker->readers, sizeof(ObjReader*) * marker->readerCapacity);
+                if (marker->readers == NULL) exit(1);
+            }
+            marker->readers[marker->readerCount++] = (ObjReader*)object;
+        } else {
+            freeObject(object);
+        }
+    }
+    page->count = kept;
+}
+
+static void sweep(Collection* collection) {
+    int index;
+    while ((index = atomic_fetch_add(&collection->nextPage, 1)) < collection->pageCount) {
+        sweepPage(collection->pages[index]);
+    }
+}
+
+/*
+    Helpers free through `reallocate` like everyone, which counts on their own `vm`. They hand what it
+    counted over to the collecting thread's VM.
+*/
+static void* runHelper(void* argument) {
+    marker = argument;
+    for (;;) {
+        pthread_mutex_lock(&collector.lock);
+        while (collector.generation == marker->seen) pthread_cond_wait(&collector.start, &collector.lock);
+        marker->seen = collector.generation;
+        Collection* collection = collector.current;
+        Phase phase = collector.phase;
+        pthread_mutex_unlock(&collector.lock);
+        if (marker - collection->markers >= collection->participants) continue;
+
+        if (phase == PHASE_MARK) {
+            drain(collection);
+        } else {
+            size_t before = vm.bytesAllocated;
+            sweep(collection);
+            marker->freed = before - vm.bytesAllocated;
+            vm.bytesAllocated = before;
+        }
+
+        pthread_mutex_lock(&collector.lock);
+        if (++collector.done == collection->participants - 1) pthread_cond_signal(&collector.finished);
+        pthread_mutex_unlock(&collector.lock);
+    }
+    return NULL;
+}
+
+void setCollectorSize(int size) {
+    pthread_mutex_lock(&collector.busy);
+    collector.size = size < MAX_COLLECTORS ? size : MAX_COLLECTORS;
+    pthread_mutex_unlock(&collector.busy);
+}
+
+/* Starts whatever helpers the size asks for and we don't have yet. Called holding `busy`. */
+static void startHelpers() {
+    if (collector.size <= 0) collector.size = (int)sysconf(_SC_NPROCESSORS_ONLN);
+    if (collector.size <= 0) collector.size = 1;
+    if (collector.size > MAX_COLLECTORS) collector.size = MAX_COLLECTORS;
+
+    if (collector.markers == NULL) {
+        /* Never moved, the helpers keep pointers into it */
+        collector.markers = aligned_alloc(CACHE_LINE, sizeof(Marker) * MAX_COLLECTORS);
+        if (collector.markers == NULL) exit(1);
+        initMarker(&collector.markers[0]);
+    }
+
+    while (collector.helperCount < collector.size - 1) {
+        Marker* helper = &collector.markers[++collector.helperCount];
+        initMarker(helper);
+        helper->seen = collector.generation; /* Phases before it started aren't its business */
+
+        pthread_t thread;
+        if (pthread_create(&thread, NULL, runHelper, helper) != 0) {
+            --collector.helperCount;
+            collector.size = collector.helperCount + 1;
+            return;
+        }
+        pthread_detach(thread);
+    }
+}
+
+/* Runs a phase on the helpers and on this thread, returns once everyone is through with it */
+static void runPhase(Collection* collection, Phase phase) {
+    pthread_mutex_lock(&collector.lock);
+    collector.current = collection;
+    collector.phase = phase;
+    collector.done = 0;
+    ++collector.generation;
+    pthread_cond_broadcast(&collector.start);
+    pthread_mutex_unlock(&collector.lock);
+
+    if (phase == PHASE_MARK) drain(collection);
+    else sweep(collection);
+
+    pthread_mutex_lock(&collector.lock);
+    while (collector.done < collection->participants - 1) pthread_cond_wait(&collector.finished, &collector.lock);
+    pthread_mutex_unlock(&collector.lock);
+}
+
+static void markRoots() {
+    markObject((Obj*)vm.mainFiber);
+    markObject((Obj*)vm.fiber);
+    markTable(&vm.globals);
+    markTable(&vm.modules);
+    markTable(&vm.checkpointGlobals);
+    markTable(&vm.checkpointModules);
+    markReaderRoots();
+    markLoopRoots();
+    markSchedulerRoots();
+}
+
+/* The upvalues a dying fiber left open would point into a stack that's about to go, the live ones get closed */
+static void forgetDeadFibers() {
+    ObjFiber** link = &vm.fibers;
+    while (*link != NULL) {
+        ObjFiber* fiber = *link;
+        if (atomic_load_explicit(&fiber->obj.marked, memory_order_relaxed)) {
+            link = &fiber->nextFiber;
+            continue;
+        }
+        for (ObjUpvalue* upvalue = fiber->openUpvalues; upvalue != NULL; upvalue = upvalue->next) {
+            if (!atomic_load_explicit(&upvalue->obj.marked, memory_order_relaxed)) continue;
+            upvalue->closed = *upvalue->location;
+            upvalue->location = &upvalue->closed;
+        }
+        *link = fiber->nextFiber;
+    }
+}
+
+/* Frees what the sweep left to us and drops the pages it emptied */
+static void finishSweep(Collection* collection) {
+    for (int i = 0; i < collection->participants; ++i) {
+        Marker* done = &collection->markers[i];
+        for (int j = 0; j < done->readerCount; ++j) freeObject((Obj*)done->readers[j]);
+        done->readerCount = 0;
+        vm.bytesAllocated -= done->freed;
+        done->freed = 0;
+    }
+
+    int kept = 0;
+    for (int i = 0; i < vm.pageCount; ++i) {
+        if (vm.pages[i]->count == 0) free(vm.pages[i]);
+        else vm.pages[kept++] = vm.pages[i];
+    }
+    vm.pageCount = kept;
+    vm.fillingPage = 0;
+}
+
+void collectGarbage() {
+    /* The running fiber's registers live in the VM, the helpers trace it from its own fields */
+    vm.fiber->frameCount = vm.frameCount;
+    vm.fiber->stackTop = vm.stackTop;
+    vm.fiber->openUpvalues = vm.openUpvalues;
+
+    bool parallel = (size_t)vm.pageCount * HEAP_PAGE_OBJECTS >= GC_PARALLEL_OBJECTS &&
+                    pthread_mutex_trylock(&collector.busy) == 0;
+    if (parallel) {
+        startHelpers();
+        if (collector.size <= 1) {
+            pthread_mutex_unlock(&collector.busy);
+            parallel = false;
+        }
+    }
+
+    Marker local;
+    Collection collection = {.pages = vm.pages, .pageCount = vm.pageCount};
+    if (parallel) {
+        collection.markers = collector.markers;
+        collection.participants = collector.size;
+    } else {
+        initMarker(&local);
+        collection.markers = &local;
+        collection.participants = 1;
+    }
+    atomic_init(&collection.idle, 0);
+    atomic_init(&collection.nextPage, 0);
+    marker = collection.markers;
+
+    markRoots();
+    if (parallel) runPhase(&collection, PHASE_MARK);
+    else drain(&collection);
+    for (int i = 0; i < collection.participants; ++i) dropOutgrown(&collection.markers[i]);
+
+    tableRemoveWhite(&vm.strings);
+    forgetDeadFibers();
+
+    if (parallel) runPhase(&collection, PHASE_SWEEP);
+    else sweep(&collection);
+
+    finishSweep(&collection);
+    if (parallel) pthread_mutex_unlock(&collector.busy);
+    else freeMarker(&local);
+    marker = NULL;
+
+    vm.nextGC = vm.bytesAllocated * GC_HEAP_GROW_FACTOR;
+    if (vm.nextGC < GC_MIN_HEAP) vm.nextGC = GC_MIN_HEAP;
+    if (vm.nextGC > vm.heapLimit) vm.nextGC = vm.heapLimit;
+}
@@ -0,0 +1,52 @@
+#ifndef clox_gc_h
+#define clox_gc_h
+
+/*
+    This module implements the garbage collector, a stop-the-world mark and sweep over one VM's heap.
+
+    The VM only collects at safepoints, right after an instruction that allocated, once `vm.bytesAllocated`
+    went past `vm.nextGC`. Everything live is then on a fiber's stack, in the globals or in a frame, so natives
+    never have to protect what they allocate. C code that holds values across a call back into the VM keeps them on
+    the stack, and modules that park fibers outside the heap (the scheduler, the event loop) mark them.
+
+    Marking starts from the roots on the collecting thread. On a big heap helper threads join in: every one
+    drains a gray stack of its own and steals from the others once it runs dry, and the mark bit is set with
+    an atomic exchange so each object is traced once. The objects are kept in pages of pointers, the sweep
+    then hands out whole pages. Readers are freed by the collecting thread afterwards, sockets are known to
+    its event loop. A line sliced out of a mapped file marks the reader it came from through its `owner`, so
+    the mapping is only unmapped once the reader and every one of its lines are garbage.
+
+    Interned strings nobody marked are taken out of `vm.strings` before the sweep, frozen objects belong to
+    no VM's heap and are never marked (see frozen.h).
+*/
+
+#include "object.h"
+#include "value.h"
+
+/* How many objects a heap page points to */
+#define HEAP_PAGE_OBJECTS 1024
+
+/* A heap never collects below this, and grows to this many times what survived before it does again */
+#define GC_MIN_HEAP (1024 * 1024)
+#define GC_HEAP_GROW_FACTOR 2
+
+/* Heaps with fewer objects are marked and swept by the collecting thread alone, waking the helpers costs more */
+#define GC_PARALLEL_OBJECTS (64 * 1024)
+
+typedef struct {
+    int count;
+    Obj* objects[HEAP_PAGE_OBJECTS];
+} HeapPage;
+
+/* Puts a new object on the current VM's heap */
+void trackObject(Obj* object);
+
+void markValue(Value value);
+void markObject(Obj* object);
+
+void collectGarbage();
+
+/* How many threads mark and sweep a big heap, the collecting one included. Defaults to the number of cores. */
+void setCollectorSize(int size);
+
+#endif
@@ -0,0 +1,200 @@
+#include <pthread.h>
+#include <sched.h>
+#include <stdatomic.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "intern.h"
+
+#define CACHE_LINE 64
+
+#define SHARDS (1 << SHARED_STRING_SHARD_BITS)
+#define SHARD_INITIAL_CAPACITY 64
+
+/* A slot whose string was removed. Lookups go on past it, adds may reuse it. */
+#define REMOVED ((ObjString*)-1)
+
+typedef struct {
+    int capacity;
+    _Atomic(ObjString*) strings[];
+} Slots;
+
+typedef struct {
+    _Alignas(CACHE_LINE) pthread_mutex_t lock;  /* Taken to add and remove, never to look up */
+    _Atomic(Slots*) slots;                      /* NULL until the first string */
+    int used;                                   /* Slots that aren't empty, removed ones included */
+} Shard;
+
+/*
+    Every thread that looks strings up gets one of these, on a cache line of its own. The count is odd while
+    one of its lookups runs. Records are never freed, a thread that ends gives its record back for the next one.
+*/
+typedef struct Reader {
+    _Alignas(CACHE_LINE) atomic_ulong lookups;
+    atomic_bool taken;
+    struct Reader* next;
+} Reader;
+
+static Shard shards[SHARDS];
+static _Atomic(Reader*) readers = NULL;
+
+static pthread_once_t setUp = PTHREAD_ONCE_INIT;
+static pthread_key_t readerKey; /* Only there so the record is given back when the thread ends */
+static _Thread_local Reader* self = NULL;
+
+static void giveBackReader(void* reader) {
+    atomic_store(&((Reader*)reader)->taken, false);
+}
+
+static void setUpTable() {
+    for (int i = 0; i < SHARDS; ++i) {
+        pthread_mutex_init(&shards[i].lock, NULL);
+        atomic_init(&shards[i].slots, NULL);
+        shards[i].used = 0;
+    }
+    pthread_key_create(&readerKey, giveBackReader);
+}
+
+static Reader* currentReader() {
+    if (self != NULL) return self;
+    pthread_once(&setUp, setUpTable);
+
+    for (Reader* reader = atomic_load(&readers); reader != NULL && self == NULL; reader = reader->next) {
+        bool taken = false;
+        if (atomic_compare_exchange_strong(&reader->taken, &taken, true)) self = reader;
+    }
+    if (self == NULL) {
+        self = aligned_alloc(CACHE_LINE, sizeof(Reader));
+        if (self == NULL) exit(1);
+        atomic_init(&self->lookups, 0);
+        atomic_init(&self->taken, true);
+        self->next = atomic_load(&readers);
+        while (!atomic_compare_exchange_weak(&readers, &self->next, self));
+    }
+    pthread_setspecific(readerKey, self);
+    return self;
+}
+
+static Shard* shardFor(uint32_t hash) {
+    return &shards[hash >> (32 - SHARED_STRING_SHARD_BITS)];
+}
+
+static bool sameChars(ObjString* string, const char* chars, int length, uint32_t hash) {
+    return string->hash == hash && string->length == length && memcmp(string->chars, chars, length) == 0;
+}
+
+ObjString* findSharedString(const char* chars, int length, uint32_t hash, StringClaim claim, void* context) {
+    Reader* reader = currentReader();
+    unsigned long lookups = atomic_load_explicit(&reader->lookups, memory_order_relaxed);
+    atomic_store_explicit(&reader->lookups, lookups + 1, memory_order_relaxed);
+    atomic_thread_fence(memory_order_seq_cst); /* Pairs with the one in `waitForSharedReaders` */
+
+    ObjString* found = NULL;
+    Slots* slots = atomic_load_explicit(&shardFor(hash)->slots, memory_order_acquire);
+    if (slots != NULL) {
+        for (uint32_t index = hash & (slots->capacity - 1);; index = (index + 1) & (slots->capacity - 1)) {
+            ObjString* string = atomic_load_explicit(&slots->strings[index], memory_order_acquire);
+            if (string == NULL) break;
+            if (string != REMOVED && sameChars(string, chars, length, hash) && claim(string, context)) {
+                found = string;
+                break;
+            }
+        }
+    }
+
+    atomic_store_explicit(&reader->lookups, lookups + 2, memory_order_release);
+    return found;
+}
+
+/* Moves the live strings over to a new array, sized to have room again. Called with the shard locked. */
+static Slots* resizeShard(Shard* shard) {
+    Slots* old = atomic_load_explicit(&shard->slots, memory_order_relaxed);
+    int live = 0;
+    for (int i = 0; old != NULL && i < old->capacity; ++i) {
+        ObjString* string = atomic_load_explicit(&old->strings[i], memory_order_relaxed);
+        if (string != NULL && string != REMOVED) ++live;
+    }
+
+    int capacity = SHARD_INITIAL_CAPACITY;
+    while (capacity < (live + 1) * 2) capacity *= 2;
+    Slots* slots = calloc(1, sizeof(Slots) + sizeof(_Atomic(ObjString*)) * capacity);
+    if (slots == NULL) exit(1);
+    slots->capacity = capacity;
+
+    for (int i = 0; old != NULL && i < old->capacity; ++i) {
+        ObjString* string = atomic_load_explicit(&old->strings[i], memory_order_relaxed);
+        if (string == NULL || string == REMOVED) continue;
+        uint32_t index = string->hash & (capacity - 1);
+        while (atomic_load_explicit(&slots->strings[index], memory_order_relaxed) != NULL) {
+            index = (index + 1) & (capacity - 1);
+        }
+        atomic_store_explicit(&slots->strings[index], string, memory_order_relaxed);
+    }
+    shard->used = live;
+
+    atomic_store_explicit(&shard->slots, slots, memory_order_release);
+    if (old != NULL) {
+        waitForSharedReaders(); /* Lookups may still be going through the old array */
+        free(old);
+    }
+    return slots;
+}
+
+ObjString* addSharedString(ObjString* string, StringClaim claim, void* context) {
+    currentReader();
+    Shard* shard = shardFor(string->hash);
+    pthread_mutex_lock(&shard->lock);
+
+    /* Nothing in the table gets freed while we hold the lock, it has to be removed first */
+    Slots* slots = atomic_load_explicit(&shard->slots, memory_order_relaxed);
+    if (slots == NULL || (shard->used + 1) * 4 > slots->capacity * 3) slots = resizeShard(shard);
+
+    _Atomic(ObjString*)* reuse = NULL;
+    for (uint32_t index = string->hash & (slots->capacity - 1);; index = (index + 1) & (slots->capacity - 1)) {
+        _Atomic(ObjString*)* slot = &slots->strings[index];
+        ObjString* existing = atomic_load_explicit(slot, memory_order_relaxed);
+        if (existing == NULL) {
+            if (reuse == NULL) {
+                reuse = slot;
+                ++shard->used;
+            }
+            break;
+        }
+        if (existing == REMOVED) {
+            if (reuse == NULL) reuse = slot;
+        } else if (sameChars(existing, string->chars, string->length, string->hash) && claim(existing, context)) {
+            pthread_mutex_unlock(&shard->lock);
+            return existing;
+        }
+    }
+
+    atomic_store_explicit(reuse, string, memory_order_release);
+    pthread_mutex_unlock(&shard->lock);
+    return string;
+}
+
+void removeSharedString(ObjString* string) {
+    Shard* shard = shardFor(string->hash);
+    pthread_mutex_lock(&shard->lock);
+
+    Slots* slots = atomic_load_explicit(&shard->slots, memory_order_relaxed);
+    for (uint32_t index = string->hash & (slots->capacity - 1);; index = (index + 1) & (slots->capacity - 1)) {
+        ObjString* existing = atomic_load_explicit(&slots->strings[index], memory_order_relaxed);
+        if (existing == NULL) break;
+        if (existing == string) {
+            atomic_store_explicit(&slots->strings[index], REMOVED, memory_order_release);
+            break;
+        }
+    }
+    pthread_mutex_unlock(&shard->lock);
+}
+
+void waitForSharedReaders() {
+    atomic_thread_fence(memory_order_seq_cst);
+    for (Reader* reader = atomic_load(&readers); reader != NULL; reader = reader->next) {
+        if (reader == self) continue;
+        unsigned long lookups = atomic_load_explicit(&reader->lookups, memory_order_acquire);
+        if ((lookups & 1) == 0) continue;
+        while (atomic_load_explicit(&reader->lookups, memory_order_acquire) == lookups) sched_yield();
+    }
+}
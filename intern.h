@@ -0,0 +1,39 @@
+#ifndef clox_intern_h
+#define clox_intern_h
+
+/*
+    This module implements the shared intern table, the one every thread's frozen strings go into (see frozen.h).
+    Each VM still interns its own strings in `vm.strings`, this table is for the strings all of them share.
+
+    Looking a string up takes no locks: a lookup only reads the slots and announces itself to the threads that
+    free strings by bumping a counter of its own. Adding and removing lock one of the table's shards, picked by
+    the top bits of the hash, so threads adding different strings rarely meet.
+
+    The entries are weak, the table doesn't keep its strings alive. Whoever frees a string takes it out with
+    `removeSharedString` first and then `waitForSharedReaders` before the memory goes, since a lookup that
+    started earlier may still be comparing against it. Several strings can be removed before one wait.
+*/
+
+#include "object.h"
+
+/* The table has 1 << SHARED_STRING_SHARD_BITS shards */
+#define SHARED_STRING_SHARD_BITS 6
+
+/*
+    Whether the string the table found can be handed out, the owner may be freeing it. Called from inside the
+    lookup so the string is safe to look at, `context` is passed through.
+*/
+typedef bool (*StringClaim)(ObjString* string, void* context);
+
+/* A string with these characters that `claim` accepted, NULL if there's none */
+ObjString* findSharedString(const char* chars, int length, uint32_t hash, StringClaim claim, void* context);
+
+/* Adds `string` unless the table has one with the same characters that `claim` accepts, returns the one in the table */
+ObjString* addSharedString(ObjString* string, StringClaim claim, void* context);
+
+void removeSharedString(ObjString* string);
+
+/* Returns once no lookup that could have seen the strings removed so far is still running */
+void waitForSharedReaders();
+
+#endif
@@ -0,0 +1,480 @@
+/* For accept4() */
+#define _GNU_SOURCE
+
+#include <errno.h>
+#include <fcntl.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <poll.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/epoll.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/timerfd.h>
+#include <sys/uio.h>
+#include <sys/un.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "gc.h"
+#include "loop.h"
+#include "memory.h"
+#include "output.h"
+#include "reader.h"
+#include "vm.h"
+
+typedef struct {
+    ObjFiber* fiber;
+    bool timedOut;  /* It was asleep, so the `sleep` it makes again is over */
+} Ready;
+
+typedef struct {
+    Ready* fibers;
+    int count;
+    int capacity;
+} ReadyList;
+
+/* The fibers parked on one fd, there's a slot for each direction */
+typedef struct {
+    ObjFiber* reading;
+    ObjFiber* writing;
+} Waiters;
+
+typedef struct {
+    double deadline;
+    ObjFiber* fiber;
+} Sleeper;
+
+/* Every VM has a loop of its own, like it has a heap of its own */
+static _Thread_local struct {
+    bool polling;       /* Whether `epoll` and `timer` were made yet, it happens when the first fiber parks */
+    int epoll;
+    int timer;
+
+    ReadyList ready;    /* Fibers to run on the next turn */
+    ReadyList turn;     /* The ones we're running now, new ones wait for the next turn */
+    Ready current;      /* The fiber we resumed, NULL between resumes */
+
+    Waiters* fds;       /* Indexed by fd */
+    int fdCapacity;
+    int waiting;        /* Fibers parked in `fds` */
+
+    Sleeper* sleepers;  /* A min-heap on the deadline */
+    int sleeperCount;
+    int sleeperCapacity;
+} loop;
+
+static double now() {
+    struct timespec time;
+    clock_gettime(CLOCK_MONOTONIC, &time);
+    return time.tv_sec + time.tv_nsec / 1e9;
+}
+
+static void queueFiber(ReadyList* list, ObjFiber* fiber, bool timedOut) {
+    if (list->count == list->capacity) {
+        list->capacity = GROW_CAPACITY(list->capacity);
+        list->fibers = realloc(list->fibers, sizeof(Ready) * list->capacity);
+        if (list->fibers == NULL) exit(1);
+    }
+    list->fibers[list->count++] = (Ready){fiber, timedOut};
+}
+
+static void startPolling() {
+    if (loop.polling) return;
+    loop.epoll = epoll_create1(EPOLL_CLOEXEC);
+    loop.timer = timerfd_create(CLOCK_MONOTONIC, TFD_NONBLOCK | TFD_CLOEXEC);
+    if (loop.epoll < 0 || loop.timer < 0) exit(1);
+
+    struct epoll_event event = {.events = EPOLLIN, .data.fd = loop.timer};
+    epoll_ctl(loop.epoll, EPOLL_CTL_ADD, loop.timer, &event);
+    loop.polling = true;
+}
+
+/* Forgets every fiber, they belong to a heap that's going away or to a loop that failed */
+static void clearLoop() {
+    loop.ready.count = 0;
+    loop.turn.count = 0;
+    loop.current = (Ready){NULL, false};
+    if (loop.fds != NULL) memset(loop.fds, 0, sizeof(Waiters) * loop.fdCapacity);
+    loop.waiting = 0;
+    loop.sleeperCount = 0;
+}
+
+static bool canParkLoop() {
+    return loop.current.fiber != NULL && vm.fiber == loop.current.fiber && canPark();
+}
+
+/* Asks epoll for whatever the fibers parked on `fd` wait for. One-shot, so we only hear about it once per park. */
+static void watchFd(int fd) {
+    Waiters* waiters = &loop.fds[fd];
+    if (waiters->reading == NULL && waiters->writing == NULL) return;
+
+    struct epoll_event event = {.events = EPOLLONESHOT, .data.fd = fd};
+    if (waiters->reading != NULL) event.events |= EPOLLIN | EPOLLRDHUP;
+    if (waiters->writing != NULL) event.events |= EPOLLOUT;
+    if (epoll_ctl(loop.epoll, EPOLL_CTL_MOD, fd, &event) < 0 && errno == ENOENT) {
+        epoll_ctl(loop.epoll, EPOLL_CTL_ADD, fd, &event);
+    }
+}
+
+bool waitFd(int fd, bool writing) {
+    if (!canParkLoop()) {
+        struct pollfd ready = {fd, writing ? POLLOUT : POLLIN, 0};
+        while (poll(&ready, 1, -1) < 0 && errno == EINTR);
+        return true;
+    }
+
+    startPolling();
+    if (fd >= loop.fdCapacity) {
+        int capacity = loop.fdCapacity;
+        while (capacity <= fd) capacity = GROW_CAPACITY(capacity);
+        loop.fds = realloc(loop.fds, sizeof(Waiters) * capacity);
+        if (loop.fds == NULL) exit(1);
+        memset(loop.fds + loop.fdCapacity, 0, sizeof(Waiters) * (capacity - loop.fdCapacity));
+        loop.fdCapacity = capacity;
+    }
+
+    ObjFiber** slot = writing ? &loop.fds[fd].writing : &loop.fds[fd].reading;
+    if (*slot != NULL) {
+        nativeError("Two fibers can't wait on the same socket at once.");
+        return false;
+    }
+    *slot = loop.current.fiber;
+    ++loop.waiting;
+    watchFd(fd);
+    parkFiber();
+    return false;
+}
+
+void forgetFd(int fd) {
+    if (fd >= loop.fdCapacity) return;
+    Waiters* waiters = &loop.fds[fd];
+    if (waiters->reading != NULL) {
+        queueFiber(&loop.ready, waiters->reading, false);
+        --loop.waiting;
+    }
+    if (waiters->writing != NULL) {
+        queueFiber(&loop.ready, waiters->writing, false);
+        --loop.waiting;
+    }
+    *waiters = (Waiters){NULL, NULL};
+}
+
+void markLoopRoots() {
+    for (int i = 0; i < loop.ready.count; ++i) markObject((Obj*)loop.ready.fibers[i].fiber);
+    for (int i = 0; i < loop.turn.count; ++i) markObject((Obj*)loop.turn.fibers[i].fiber);
+    markObject((Obj*)loop.current.fiber);
+    for (int fd = 0; fd < loop.fdCapacity && loop.waiting > 0; ++fd) {
+        markObject((Obj*)loop.fds[fd].reading);
+        markObject((Obj*)loop.fds[fd].writing);
+    }
+    for (int i = 0; i < loop.sleeperCount; ++i) markObject((Obj*)loop.sleepers[i].fiber);
+}
+
+static void wakeFd(int fd, uint32_t events) {
+    if (fd >= loop.fdCapacity) return;
+    Waiters* waiters = &loop.fds[fd];
+    if (waiters->reading != NULL && (events & (EPOLLIN | EPOLLRDHUP | EPOLLHUP | EPOLLERR))) {
+        queueFiber(&loop.ready, waiters->reading, false);
+        waiters->reading = NULL;
+        --loop.waiting;
+    }
+    if (waiters->writing != NULL && (events & (EPOLLOUT | EPOLLHUP | EPOLLERR))) {
+        queueFiber(&loop.ready, waiters->writing, false);
+        waiters->writing = NULL;
+        --loop.waiting;
+    }
+    watchFd(fd); /* The other direction is still waiting */
+}
+
+static void addSleeper(double deadline, ObjFiber* fiber) {
+    if (loop.sleeperCount == loop.sleeperCapacity) {
+        loop.sleeperCapacity = GROW_CAPACITY(loop.sleeperCapacity);
+        loop.sleepers = realloc(loop.sleepers, sizeof(Sleeper) * loop.sleeperCapacity);
+        if (loop.sleepers == NULL) exit(1);
+    }
+
+    int i = loop.sleeperCount++;
+    for (; i > 0 && loop.sleepers[(i - 1) / 2].deadline > deadline; i = (i - 1) / 2) {
+        loop.sleepers[i] = loop.sleepers[(i - 1) / 2];
+    }
+    loop.sleepers[i] = (Sleeper){deadline, fiber};
+}
+
+static void removeFirstSleeper() {
+    Sleeper last = loop.sleepers[--loop.sleeperCount];
+    int i = 0;
+    for (;;) {
+        int child = 2 * i + 1;
+        if (child >= loop.sleeperCount) break;
+        if (child + 1 < loop.sleeperCount && loop.sleepers[child + 1].deadline < loop.sleepers[child].deadline) ++child;
+        if (last.deadline <= loop.sleepers[child].deadline) break;
+        loop.sleepers[i] = loop.sleepers[child];
+        i = child;
+    }
+    loop.sleepers[i] = last;
+}
+
+static void wakeSleepers() {
+    uint64_t expirations;
+    while (read(loop.timer, &expirations, sizeof(expirations)) < 0 && errno == EINTR);
+
+    double time = now();
+    while (loop.sleeperCount > 0 && loop.sleepers[0].deadline <= time) {
+        queueFiber(&loop.ready, loop.sleepers[0].fiber, true);
+        removeFirstSleeper();
+    }
+}
+
+/* Blocks until some parked fiber can go on. The timer is set for the earliest deadline first. */
+static void waitForEvents() {
+    flushOutput();
+
+    if (loop.sleeperCount > 0) {
+        double deadline = loop.sleepers[0].deadline;
+        struct itimerspec timer = {0};
+        timer.it_value.tv_sec = (time_t)deadline;
+        timer.it_value.tv_nsec = (long)((deadline - (double)timer.it_value.tv_sec) * 1e9);
+        if (timer.it_value.tv_sec == 0 && timer.it_value.tv_nsec == 0) timer.it_value.tv_nsec = 1; /* Zero would disarm it */
+        timerfd_settime(loop.timer, TFD_TIMER_ABSTIME, &timer, NULL);
+    }
+
+    struct epoll_event events[LOOP_EVENTS];
+    int count = epoll_wait(loop.epoll, events, LOOP_EVENTS, -1);
+    for (int i = 0; i < count; ++i) {
+        if (events[i].data.fd == loop.timer) {
+            wakeSleepers();
+        } else {
+            wakeFd(events[i].data.fd, events[i].events);
+        }
+    }
+}
+
+static Value goNative(int argCount, Value* args) {
+    if (argCount < 1 || !IS_CLOSURE(args[0])) return nativeError("go() expects a function and its arguments.");
+
+    /* The arguments go on the fiber's stack after the function, `resumeFiber` passes them along */
+    ObjFiber* fiber = newFiber(AS_CLOSURE(args[0]), argCount > FIBER_STACK ? argCount : FIBER_STACK, FIBER_FRAMES);
+    for (int i = 1; i < argCount; ++i) *fiber->stackTop++ = args[i];
+    queueFiber(&loop.ready, fiber, false);
+    return NIL_VAL;
+}
+
+static Value runLoopNative(int argCount, Value* args) {
+    if (vm.fiber != vm.mainFiber) return nativeError("runLoop() can only be called from the main fiber.");
+
+    while (loop.ready.count > 0 || loop.waiting > 0 || loop.sleeperCount > 0) {
+        if (loop.ready.count == 0) {
+            waitForEvents();
+            continue;
+        }
+
+        ReadyList turn = loop.turn;
+        loop.turn = loop.ready;
+        loop.ready = turn;
+        loop.ready.count = 0;
+
+        for (int i = 0; i < loop.turn.count; ++i) {
+            loop.current = loop.turn.fibers[i];
+            if (resumeFiber(loop.current.fiber) != INTERPRET_OK) {
+                clearLoop();
+                return nativeError("A fiber run by the loop failed.");
+            }
+            /* One that yielded goes again next turn, a parked one is waiting on an fd or a timer already */
+            if (loop.current.fiber->state == FIBER_SUSPENDED) queueFiber(&loop.ready, loop.current.fiber, false);
+        }
+        loop.turn.count = 0;
+        loop.current = (Ready){NULL, false};
+    }
+    return NIL_VAL;
+}
+
+static Value sleepNative(int argCount, Value* args) {
+    if (argCount != 1 || !IS_NUMBER(args[0])) return nativeError("sleep() expects a number of seconds.");
+    double seconds = AS_NUMBER(args[0]);
+
+    if (canParkLoop()) {
+        if (loop.current.timedOut) {
+            loop.current.timedOut = false;
+            return NIL_VAL;
+        }
+        startPolling();
+        addSleeper(now() + seconds, loop.current.fiber);
+        parkFiber();
+        return NIL_VAL;
+    }
+
+    if (seconds <= 0) return NIL_VAL;
+    struct timespec time = {(time_t)seconds, (long)((seconds - (double)(time_t)seconds) * 1e9)};
+    while (nanosleep(&time, &time) < 0 && errno == EINTR);
+    return NIL_VAL;
+}
+
+typedef union {
+    struct sockaddr any;
+    struct sockaddr_in inet;
+    struct sockaddr_un local;
+} Address;
+
+/* A port is TCP, on every address to listen and on 127.0.0.1 to connect. A path is a Unix socket. */
+static bool makeAddress(Value where, bool listening, Address* address, socklen_t* length) {
+    memset(address, 0, sizeof(Address));
+    if (IS_NUMBER(where)) {
+        double port = AS_NUMBER(where);
+        if (port < 0 || port > 65535) return false;
+        address->inet.sin_family = AF_INET;
+        address->inet.sin_port = htons((uint16_t)port);
+        address->inet.sin_addr.s_addr = htonl(listening ? INADDR_ANY : INADDR_LOOPBACK);
+        *length = sizeof(struct sockaddr_in);
+        return true;
+    }
+
+    ObjString* path = AS_STRING(where);
+    if (path->length >= (int)sizeof(address->local.sun_path)) return false;
+    address->local.sun_family = AF_UNIX;
+    memcpy(address->local.sun_path, path->chars, path->length);
+    *length = sizeof(struct sockaddr_un);
+    return true;
+}
+
+/* Small writes go out right away, the loop answers one request at a time */
+static void setNoDelay(int fd) {
+    int on = 1;
+    setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &on, sizeof(on)); /* Fails on Unix sockets, that's fine */
+}
+
+static Value listenNative(int argCount, Value* args) {
+    Address address;
+    socklen_t length;
+    if (argCount != 1 || !(IS_NUMBER(args[0]) || IS_STRING(args[0])) || !makeAddress(args[0], true, &address, &length)) {
+        return nativeError("listen() expects a port or a path.");
+    }
+
+    int fd = socket(address.any.sa_family, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+    if (fd < 0) return nativeError("Could not make a socket: %s.", strerror(errno));
+
+    if (address.any.sa_family == AF_INET) {
+        int on = 1;
+        setsockopt(fd, SOL_SOCKET, SO_REUSEADDR, &on, sizeof(on));
+    } else {
+        /* A socket left behind by an earlier run would be in the way */
+        struct stat info;
+        if (stat(address.local.sun_path, &info) == 0 && S_ISSOCK(info.st_mode)) unlink(address.local.sun_path);
+    }
+
+    if (bind(fd, &address.any, length) < 0 || listen(fd, SOMAXCONN) < 0) {
+        int error = errno;
+        close(fd);
+        return nativeError("Could not listen: %s.", strerror(error));
+    }
+
+    /* Nothing is ever read from a listener, so it goes without a buffer */
+    ObjReader* listener = newReader(fd);
+    listener->socket = true;
+    return OBJ_VAL(listener);
+}
+
+static Value connectNative(int argCount, Value* args) {
+    Address address;
+    socklen_t length;
+    if (argCount != 1 || !(IS_NUMBER(args[0]) || IS_STRING(args[0])) || !makeAddress(args[0], false, &address, &length)) {
+        return nativeError("connect() expects a port or a path.");
+    }
+
+    int fd = socket(address.any.sa_family, SOCK_STREAM | SOCK_CLOEXEC, 0);
+    if (fd < 0) return nativeError("Could not make a socket: %s.", strerror(errno));
+    if (connect(fd, &address.any, length) < 0) {
+        int error = errno;
+        close(fd);
+        return nativeError("Could not connect: %s.", strerror(error));
+    }
+
+    setNoDelay(fd);
+    fcntl(fd, F_SETFL, fcntl(fd, F_GETFL) | O_NONBLOCK);
+    return OBJ_VAL(newSocketReader(fd));
+}
+
+static bool checkSocket(int argCount, Value* args, const char* name) {
+    if (argCount < 1 || !IS_READER(args[0]) || !AS_READER(args[0])->socket) {
+        nativeError("%s() expects a socket.", name);
+        return false;
+    }
+    if (AS_READER(args[0])->fd == -1) {
+        nativeError("%s() on a closed socket.", name);
+        return false;
+    }
+    return true;
+}
+
+static Value acceptNative(int argCount, Value* args) {
+    if (!checkSocket(argCount, args, "accept")) return NIL_VAL;
+    int listener = AS_READER(args[0])->fd;
+
+    for (;;) {
+        int fd = accept4(listener, NULL, NULL, SOCK_NONBLOCK | SOCK_CLOEXEC);
+        if (fd >= 0) {
+            setNoDelay(fd);
+            return OBJ_VAL(newSocketReader(fd));
+        }
+        if (errno == EINTR || errno == ECONNABORTED) continue;
+        if (errno != EAGAIN) return nativeError("accept() failed: %s.", strerror(errno));
+        if (!waitFd(listener, false)) return NIL_VAL;
+    }
+}
+
+/*
+    Sends the string, and a '\n' after it for `writeLine`. Returns false when the other end is gone, a server
+    shouldn't go down because one client did.
+*/
+static Value sendString(int argCount, Value* args, const char* name, bool newline) {
+    if (!checkSocket(argCount, args, name)) return NIL_VAL;
+    if (argCount != 2 || !IS_STRING(args[1])) return nativeError("%s() expects a socket and a string.", name);
+
+    ObjReader* socket = AS_READER(args[0]);
+    ObjString* string = AS_STRING(args[1]);
+    size_t length = (size_t)string->length + (newline ? 1 : 0);
+    while (socket->sent < length) {
+        struct iovec parts[2];
+        int partCount = 0;
+        if (socket->sent < (size_t)string->length) {
+            parts[partCount++] = (struct iovec){(char*)string->chars + socket->sent, string->length - socket->sent};
+        }
+        if (newline) parts[partCount++] = (struct iovec){"\n", 1};
+
+        struct msghdr message = {.msg_iov = parts, .msg_iovlen = partCount};
+        ssize_t count = sendmsg(socket->fd, &message, MSG_NOSIGNAL);
+        if (count >= 0) {
+            socket->sent += (size_t)count;
+            continue;
+        }
+        if (errno == EINTR) continue;
+        if (errno != EAGAIN) {
+            socket->sent = 0;
+            return BOOL_VAL(false);
+        }
+        if (!waitFd(socket->fd, true)) return NIL_VAL;
+    }
+    socket->sent = 0;
+    return BOOL_VAL(true);
+}
+
+static Value writeNative(int argCount, Value* args) {
+    return sendString(argCount, args, "write", false);
+}
+
+static Value writeLineNative(int argCount, Value* args) {
+    return sendString(argCount, args, "writeLine", true);
+}
+
+void defineLoopNatives() {
+    clearLoop();
+    defineNative("go", goNative);
+    defineNative("runLoop", runLoopNative);
+    defineNative("sleep", sleepNative);
+    defineNative("listen", listenNative);
+    defineNative("connect", connectNative);
+    defineNative("accept", acceptNative);
+    defineNative("write", writeNative);
+    defineNative("writeLine", writeLineNative);
+}
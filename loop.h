@@ -0,0 +1,49 @@
+#ifndef clox_loop_h
+#define clox_loop_h
+
+/*
+    This module implements the event loop, so one VM can serve thousands of connections on a single thread:
+
+        fun serve(conn) {
+            var line;
+            while ((line = readLine(conn)) != nil) writeLine(conn, line);
+            close(conn);
+        }
+        fun server(listener) {
+            for (;;) go(serve, accept(listener));
+        }
+        go(server, listen(8080));
+        runLoop();
+
+    `go(function, args...)` puts a call on a fiber of its own and queues it, `runLoop()` runs the queued fibers
+    until every one of them is done. A fiber run by the loop that would block on a socket or in `sleep` parks
+    instead: the native registers what it waits for with epoll and returns to `run()`, the loop resumes the
+    fiber once that's ready and the call is made again. Timers all share one timerfd set for the earliest one.
+
+    `listen(port)` and `connect(port)` make TCP sockets, the listener on every address and the connection to
+    127.0.0.1, a path instead of a port makes a Unix socket. Connections are readers, so `readLine` and
+    `readChunk` work on them, `readChunk` handing back whatever arrived rather than waiting to fill up.
+    `write(conn, string)` and `writeLine(conn, string)` send, they return false once the other end is gone.
+    Anywhere outside of the loop the same natives just block. `connect` always does, which is quick on localhost.
+*/
+
+#include "object.h"
+
+/* How many epoll events the loop takes in one go */
+#define LOOP_EVENTS 256
+
+/*
+    Waits for `fd` to become readable, or writable. Returns true once it is, unless the running fiber is one of
+    the loop's: then it's parked and we return false right away, the native has to give up and is called again.
+*/
+bool waitFd(int fd, bool writing);
+
+/* Wakes the fibers waiting on `fd` before it's closed, their calls find it closed once they're made again */
+void forgetFd(int fd);
+
+/* Marks the fibers the loop holds for the collector, queued, parked on an fd or asleep */
+void markLoopRoots();
+
+void defineLoopNatives();
+
+#endif
@@ -5,6 +5,17 @@
 
 #include "vm.h"
 #include "common.h"
+#include "compiler.h"
+#include "counters.h"
+#include "daemon.h"
+#include "gc.h"
+#include "module.h"
+#include "object.h"
+#include "output.h"
+#include "pool.h"
+#include "reader.h"
+#include "scheduler.h"
+#include "source.h"
 
 static bool checkOpenBraceAtEnd(char* input) {
     int len = strlen(input) - 1;
@@ -123,61 +134,150 @@ static void repl() {
 
 #endif
 
-static char* readFile(const char* path) {
-    FILE* file = fopen(path, "rb");
-    if (file == NULL) {
-        fprintf(stderr, "Could not open file \"%s\".\n", path);
-        exit (74);
-    }
-     
-    /* Figuring out the size of the file (in Bytes) */
-    fseek(file, 0L, SEEK_END);
-    size_t fileSize = ftell(file);
-    rewind(file);
-    
-    /* Allocating memory for the file buffer */
-    char* buffer = (char*)malloc(fileSize + 1);
-    if (buffer == NULL) {
-        fprintf(stderr, "Not enough memory to read \"%s\".\n", path);
-        exit(74);
-    }
-    size_t bytesRead = fread(buffer, sizeof(char), fileSize, file);
-    if (bytesRead < fileSize) {
-        fprintf(stderr, "Could not read file \"%s\".\n", path);
-        exit(74);
+static void runFile(const char* path) {
+    Source source;
+    if (!loadSource(path, &source)) exit(74);
+    setModuleRoot(path); /* Its imports are relative to where it is */
+    InterpretResult result = interpret(source.chars);
+    unloadSource(&source);
+
+    if (result == INTERPRET_COMPILE_ERROR) exit(65);
+    if (result == INTERPRET_RUNTIME_ERROR) exit(70);
+}
+
+/*
+    With -n or -p we run the script once, then call its handler function with every line of stdin. The VM and
+    the compiled handler are reused for all of them. With -p whatever the handler returns gets printed, unless
+    it's nil, so a handler can both filter and transform.
+*/
+static void runRecords(const char* path, const char* handlerName, bool printResults) {
+    runFile(path);
+
+    Value handler;
+    if (!tableGet(&vm.globals, copyString(handlerName, (int)strlen(handlerName)), &handler)) {
+        fprintf(stderr, "The script has no '%s' function to call for each record.\n", handlerName);
+        exit(70);
     }
-    buffer[bytesRead] = '\0';
 
-    fclose(file);
-    return buffer;
+    push(handler); /* The script may assign something else to it, the collector still has to see it */
+
+    ObjString* record;
+    while ((record = readStdinString()) != NULL) {
+        push(handler);
+        push(OBJ_VAL(record));
+        if (callFunction(1) != INTERPRET_OK) exit(70);
+
+        Value result = pop();
+        if (printResults && !IS_NIL(result)) {
+            printValue(result);
+            writeOutput("\n", 1);
+        }
+    }
+    flushOutput();
 }
 
-static void runFile(const char* path) {
-    char* source = readFile(path);
-    InterpretResult result = interpret(source);
-    free(source);
+static void usage() {
+    fprintf(stderr, "Usage: ./qamar [--lazy] [--line-buffered] [--output-buffer=bytes] [--heap-limit=bytes] [--workers=n] [--perf-counters] [-n | -p] [--handler=name] [path [arguments]]\n"
+                    "       ./qamar --daemon=socket [--prelude=path] [--forks=n] [--workers=n] [--lazy]\n"
+                    "       ./qamar --connect=socket path [arguments]\n");
+    exit(64);
+}
 
-    if (result == INTERPRET_COMPILE_ERROR) exit(65);
-    if (result == INTERPRET_RUNTIME_ERROR) exit(70);
+static void checkExtension(const char* path) {
+    const char* extention = strrchr(path, '.');
+    if (extention == NULL || strcmp(extention + 1, "qmr") != 0) {
+        fprintf(stderr, "Unexpected file format <%s>\nExpected <.qmr>", path);
+        exit(64);
+    }
 }
 
 int main(int argc, char** argv) {
     initVM();
-    
-    if (argc == 1) repl(); // Read, Evaluate, Print, Loop
-    else if (argc == 2) {
-        char* extention = strrchr(argv[1], '.');
-        if (strcmp(extention + 1, "qmr") != 0) {
-            fprintf(stderr, "Unexpected file format <%s>\nExpected <.qmr>", extention);
-            exit(64);
+
+    /* Options come before the script path, the script's arguments after it */
+    const char* handler = "record";
+    const char* daemon = NULL;
+    const char* client = NULL;
+    const char* prelude = NULL;
+    int forks = 0;
+    int workers = 0;
+    bool records = false;
+    bool printResults = false;
+    int arg = 1;
+    for (; arg < argc && argv[arg][0] == '-'; ++arg) {
+        if (strcmp(argv[arg], "--lazy") == 0) {
+            setLazyCompilation(true); /* Compile function bodies on their first call */
+        } else if (strcmp(argv[arg], "-n") == 0 || strcmp(argv[arg], "-p") == 0) {
+            records = true; /* Call the handler for every line of stdin */
+            printResults = argv[arg][1] == 'p';
+        } else if (strncmp(argv[arg], "--handler=", 10) == 0) {
+            handler = argv[arg] + 10;
+        } else if (strcmp(argv[arg], "--line-buffered") == 0) {
+            setOutputBuffering(true, OUTPUT_BUFFER_SIZE);
+        } else if (strncmp(argv[arg], "--output-buffer=", 16) == 0) {
+            long size = atol(argv[arg] + 16);
+            if (size <= 0) usage();
+            setOutputBuffering(false, (size_t)size);
+        } else if (strncmp(argv[arg], "--workers=", 10) == 0) {
+            workers = atoi(argv[arg] + 10);
+            if (workers <= 0) usage();
+            setPoolSize(workers); /* Threads behind parallelMap() and parallelReduce() */
+            setSchedulerSize(workers); /* And the ones running tasks */
+            setCollectorSize(workers); /* And the ones marking a big heap */
+            setLoaderSize(workers);    /* And the ones compiling modules */
+        } else if (strncmp(argv[arg], "--heap-limit=", 13) == 0) {
+            long bytes = atol(argv[arg] + 13);
+            if (bytes <= 0) usage();
+            setHeapLimit((size_t)bytes); /* For every VM, each thread's and worker's has its own heap */
+        } else if (strncmp(argv[arg], "--daemon=", 9) == 0) {
+            daemon = argv[arg] + 9; /* Serve scripts from warm processes on this socket */
+        } else if (strncmp(argv[arg], "--prelude=", 10) == 0) {
+            prelude = argv[arg] + 10;
+        } else if (strncmp(argv[arg], "--forks=", 8) == 0) {
+            forks = atoi(argv[arg] + 8);
+            if (forks <= 0) usage();
+        } else if (strncmp(argv[arg], "--connect=", 10) == 0) {
+            client = argv[arg] + 10; /* Have the daemon on this socket run the script */
+        } else if (strcmp(argv[arg], "--perf-counters") == 0) {
+            startCounters(); /* The script runs either way, without counts if the kernel said no */
+        } else {
+            usage();
         }
-        runFile(argv[1]); // Read source file
     }
-    else {
-        fprintf(stderr, "Usage: ./qamar [path]\n");
-        exit(64);
+
+    if (client != NULL) {
+        if (arg == argc) usage();
+        checkExtension(argv[arg]);
+        int status = requestScript(client, argv[arg], argc - arg - 1, argv + arg + 1);
+        if (status < 0) {
+            fprintf(stderr, "No daemon answered on '%s'.\n", client);
+            exit(69);
+        }
+        exit(status);
     }
 
+    if (daemon != NULL) {
+        if (arg != argc || records) usage();
+        const char* path = serveScripts(daemon, prelude, forks);
+
+        /* We're the child running a request, the prelude ran with no helper threads */
+        setCollectorSize(workers);
+        setLoaderSize(workers);
+        checkExtension(path);
+        runFile(path);
+        freeVM();
+        return 0;
+    }
+    
+    if (arg == argc && !records) repl(); // Read, Evaluate, Print, Loop
+    else if (arg < argc) {
+        checkExtension(argv[arg]);
+        setScriptArguments(argc - arg - 1, argv + arg + 1);
+        if (records) runRecords(argv[arg], handler, printResults);
+        else runFile(argv[arg]); // Read source file
+    }
+    else usage();
+
     freeVM();
     return 0;
-} 
+}
@@ -1,5 +1,9 @@
 #include <stdlib.h>
+#include "channel.h"
 #include "memory.h"
+#include "module.h"
+#include "reader.h"
+#include "thread.h"
 #include "vm.h"
 
 /*
@@ -15,17 +19,31 @@ parameters:
     Non‑zero	    Larger than oldSize	    Grow existing allocation.
 */
 void* reallocate(void* pointer, size_t oldSize, size_t newSize) {
+    vm.bytesAllocated += newSize - oldSize;
     if (newSize == 0) {
         free(pointer);
         return NULL;
     }
 
     void* result = realloc(pointer, newSize);
+    if (result == NULL && vm.reserve != NULL) {
+        free(vm.reserve);
+        vm.reserve = NULL;
+        vm.outOfMemory = true;
+        vm.nextGC = 0; /* The next safepoint reports it */
+        result = realloc(pointer, newSize);
+    }
     if (result == NULL) exit(1);
     return result;
 }
 
-static void freeObject(Obj* object) {
+void* tryReallocate(void* pointer, size_t oldSize, size_t newSize) {
+    void* result = realloc(pointer, newSize);
+    if (result != NULL) vm.bytesAllocated += newSize - oldSize;
+    return result;
+}
+
+void freeObject(Obj* object) {
     switch (object->type) {
         case OBJ_CLOSURE: {
         /*
@@ -43,6 +61,7 @@ static void freeObject(Obj* object) {
         */
             ObjFunction* function = (ObjFunction*)object;
             freeChunk(&function->chunk);
+            if (function->lazy != NULL) freeLazyBody(function);
             FREE(OBJ_FUNCTION, object);
             break;
         }
@@ -51,21 +70,49 @@ static void freeObject(Obj* object) {
             break;
         case OBJ_STRING: {
             ObjString* string = (ObjString*)object;
-            FREE_ARRAY(char, string->chars, string->length + 1);
+            if (string->ownsChars) FREE_ARRAY(char, string->chars, string->length + 1);
             FREE(ObjString, object);
             break;
         }
         case OBJ_UPVALUE:
             FREE(ObjUpvalue, object);
             break;
+        case OBJ_READER:
+            freeReader((ObjReader*)object);
+            FREE(ObjReader, object);
+            break;
+        case OBJ_CHANNEL:
+            releaseChannel(((ObjChannel*)object)->channel);
+            FREE(ObjChannel, object);
+            break;
+        case OBJ_THREAD:
+            releaseThread(((ObjThread*)object)->thread);
+            FREE(ObjThread, object);
+            break;
+        case OBJ_FIBER: {
+            ObjFiber* fiber = (ObjFiber*)object;
+            FREE_ARRAY(CallFrame, fiber->frames, fiber->frameCapacity);
+            FREE_ARRAY(Value, fiber->stack, fiber->stackCapacity);
+            FREE(ObjFiber, object);
+            break;
+        }
+        case OBJ_MODULE:
+            freeTable(&((ObjModule*)object)->globals);
+            FREE(ObjModule, object);
+            break;
     }
 }
 
 void freeObjects() {
-    Obj* object = vm.objects;
-    while (object != NULL) {
-        Obj* next = object->next;
-        freeObject(object);
-        object = next;
+    for (int i = 0; i < vm.pageCount; ++i) {
+        HeapPage* page = vm.pages[i];
+        for (int j = 0; j < page->count; ++j) freeObject(page->objects[j]);
+        free(page);
     }
+    free(vm.pages);
+    vm.pages = NULL;
+    vm.pageCount = 0;
+    vm.pageCapacity = 0;
+    vm.fillingPage = 0;
+    vm.fibers = NULL;
 }
@@ -20,7 +20,17 @@
 #define FREE_ARRAY(type, pointer, oldCount) \
     reallocate(pointer, sizeof(type) * (oldCount), 0)
 
+/*
+    Every VM keeps this much in reserve. When malloc fails we let go of it and try again, so the VM can still
+    get to its next safepoint and report that it ran out of memory.
+*/
+#define MEMORY_RESERVE (256 * 1024)
+
 void* reallocate(void* pointer, size_t oldSize, size_t newSize);
+
+/* The same, but it hands back NULL when malloc fails, for the big blocks a script can ask for */
+void* tryReallocate(void* pointer, size_t oldSize, size_t newSize);
+void freeObject(Obj* object);
 void freeObjects();
 
 #endif
@@ -0,0 +1,455 @@
+#include <stdlib.h>
+#include <string.h>
+
+#include "channel.h"
+#include "frozen.h"
+#include "memory.h"
+#include "message.h"
+#include "module.h"
+#include "thread.h"
+#include "vm.h"
+
+typedef enum {
+    TAG_NIL,
+    TAG_TRUE,
+    TAG_FALSE,
+    TAG_NUMBER,
+    TAG_STRING,
+    TAG_FUNCTION,
+    TAG_CLOSURE,
+    TAG_UPVALUE,
+    TAG_NATIVE,
+    TAG_CHANNEL,
+    TAG_THREAD,
+    TAG_MODULE,
+    TAG_FROZEN,     /* Followed by the object itself, every VM reads it where it is */
+    TAG_SEEN,       /* An object that is already in the message, followed by its index */
+} Tag;
+
+struct Message {
+    uint8_t* bytes;
+    size_t count;
+    size_t capacity;
+    int valueCount;
+    int objectCount;    /* How many objects got an index, so unpacking can size its table up front */
+
+    /* The channels, threads and frozen objects the message holds a reference to */
+    void** shared;
+    Tag* sharedTags;
+    int sharedCount;
+    int sharedCapacity;
+};
+
+/* Maps objects we've packed already to their index, so shared objects and cycles come out the same */
+typedef struct {
+    Obj* object;
+    int index;
+} Seen;
+
+typedef struct {
+    Message* message;
+    Seen* seen;
+    int seenCapacity;
+    const char* error;
+} Packer;
+
+static void packBytes(Packer* packer, const void* bytes, size_t count) {
+    if (count == 0) return; /* `bytes` may be NULL then, an empty array that was never allocated */
+    Message* message = packer->message;
+    if (message->count + count > message->capacity) {
+        size_t capacity = message->capacity * 2 + count;
+        message->bytes = realloc(message->bytes, capacity);
+        if (message->bytes == NULL) exit(1);
+        message->capacity = capacity;
+    }
+    memcpy(message->bytes + message->count, bytes, count);
+    message->count += count;
+}
+
+static void packByte(Packer* packer, uint8_t byte) { packBytes(packer, &byte, 1); }
+
+static void packInt(Packer* packer, int value) { packBytes(packer, &value, sizeof(value)); }
+
+static void releaseShared(void* shared, Tag tag) {
+    switch (tag) {
+        case TAG_CHANNEL: releaseChannel(shared); break;
+        case TAG_THREAD:  releaseThread(shared); break;
+        default:          releaseFrozen(frozenRegion(shared)); break;
+    }
+}
+
+static void packShared(Packer* packer, void* shared, Tag tag) {
+    Message* message = packer->message;
+    if (message->sharedCount == message->sharedCapacity) {
+        message->sharedCapacity = GROW_CAPACITY(message->sharedCapacity);
+        message->shared = realloc(message->shared, sizeof(void*) * message->sharedCapacity);
+        message->sharedTags = realloc(message->sharedTags, sizeof(Tag) * message->sharedCapacity);
+        if (message->shared == NULL || message->sharedTags == NULL) exit(1);
+    }
+    message->shared[message->sharedCount] = shared;
+    message->sharedTags[message->sharedCount++] = tag;
+
+    switch (tag) {
+        case TAG_CHANNEL: retainChannel(shared); break;
+        case TAG_THREAD:  retainThread(shared); break;
+        default:          retainFrozen(frozenRegion(shared)); break;
+    }
+    packByte(packer, tag);
+    packBytes(packer, &shared, sizeof(shared));
+}
+
+static Seen* findSeen(Packer* packer, Obj* object) {
+    uint32_t index = (uint32_t)(((uintptr_t)object >> 4) * 2654435761u) & (packer->seenCapacity - 1);
+    for (;;) {
+        Seen* seen = &packer->seen[index];
+        if (seen->object == object || seen->object == NULL) return seen;
+        index = (index + 1) & (packer->seenCapacity - 1);
+    }
+}
+
+/*
+    Writes a TAG_SEEN and returns true if `object` was packed before. Otherwise gives it the next index,
+    the unpacker hands them out in the same order.
+*/
+static bool packSeen(Packer* packer, Obj* object) {
+    Message* message = packer->message;
+    if ((message->objectCount + 1) * 2 > packer->seenCapacity) {
+        Seen* old = packer->seen;
+        int oldCapacity = packer->seenCapacity;
+        packer->seenCapacity = GROW_CAPACITY(oldCapacity) * 2;
+        packer->seen = calloc(packer->seenCapacity, sizeof(Seen));
+        if (packer->seen == NULL) exit(1);
+        for (int i = 0; i < oldCapacity; ++i) {
+            if (old[i].object != NULL) *findSeen(packer, old[i].object) = old[i];
+        }
+        free(old);
+    }
+
+    Seen* seen = findSeen(packer, object);
+    if (seen->object != NULL) {
+        packByte(packer, TAG_SEEN);
+        packInt(packer, seen->index);
+        return true;
+    }
+    seen->object = object;
+    seen->index = message->objectCount++;
+    return false;
+}
+
+static void packString(Packer* packer, ObjString* string) {
+    packByte(packer, TAG_STRING);
+    packInt(packer, string->length);
+    packBytes(packer, string->chars, string->length);
+}
+
+static void packValue(Packer* packer, Value value);
+
+static void packFunction(Packer* packer, ObjFunction* function) {
+    if (packSeen(packer, (Obj*)function)) return;
+    packByte(packer, TAG_FUNCTION);
+    packInt(packer, function->arity);
+    packInt(packer, function->upvalueCount);
+    packInt(packer, function->maxStack);
+    packValue(packer, function->name != NULL ? OBJ_VAL(function->name) : NIL_VAL);
+
+    Chunk* chunk = &function->chunk;
+    packInt(packer, chunk->count);
+    packBytes(packer, chunk->code, chunk->count);
+    packBytes(packer, chunk->lines, sizeof(int) * chunk->count);
+    packInt(packer, chunk->constants.count);
+    for (int i = 0; i < chunk->constants.count; ++i) packValue(packer, chunk->constants.values[i]);
+    packInt(packer, chunk->handlerCount);
+    packBytes(packer, chunk->handlers, sizeof(Handler) * chunk->handlerCount);
+
+    /* A body that wasn't compiled yet travels as source, the other side compiles it on the first call */
+    LazyBody* lazy = function->lazy;
+    packByte(packer, lazy != NULL);
+    if (lazy != NULL) {
+        packInt(packer, lazy->length);
+        packBytes(packer, lazy->source, lazy->length);
+        packInt(packer, lazy->line);
+        for (int i = 0; i < function->upvalueCount; ++i) packString(packer, lazy->captures[i]);
+    }
+}
+
+/* Natives every VM has already, readers and fibers can't go */
+static bool isSendableGlobal(Entry* entry) {
+    return entry->key != NULL && !IS_NATIVE(entry->value) && !IS_READER(entry->value) && !IS_FIBER(entry->value);
+}
+
+static void packValue(Packer* packer, Value value) {
+    switch (value.type) {
+        case VAL_NIL:    packByte(packer, TAG_NIL); return;
+        case VAL_BOOL:   packByte(packer, AS_BOOL(value) ? TAG_TRUE : TAG_FALSE); return;
+        case VAL_NUMBER: {
+            double number = AS_NUMBER(value);
+            packByte(packer, TAG_NUMBER);
+            packBytes(packer, &number, sizeof(number));
+            return;
+        }
+        case VAL_OBJ: break;
+    }
+
+    if (AS_OBJ(value)->frozen) {
+        packShared(packer, AS_OBJ(value), TAG_FROZEN);
+        return;
+    }
+
+    switch (OBJ_TYPE(value)) {
+        case OBJ_STRING:
+            packString(packer, AS_STRING(value));
+            break;
+        case OBJ_FUNCTION:
+            packFunction(packer, AS_FUNCTION(value));
+            break;
+        case OBJ_CLOSURE: {
+            ObjClosure* closure = AS_CLOSURE(value);
+            if (packSeen(packer, (Obj*)closure)) return;
+            packByte(packer, TAG_CLOSURE);
+            packValue(packer, OBJ_VAL(closure->function)); /* The body of a module is frozen, that one isn't copied */
+            packValue(packer, closure->module != NULL ? OBJ_VAL(closure->module) : NIL_VAL);
+            for (int i = 0; i < closure->upvalueCount; ++i) packValue(packer, OBJ_VAL(closure->upvalues[i]));
+            break;
+        }
+        case OBJ_UPVALUE: {
+            /* Open or closed, the other side gets a closed copy of the variable's current value */
+            ObjUpvalue* upvalue = (ObjUpvalue*)AS_OBJ(value);
+            if (packSeen(packer, (Obj*)upvalue)) return;
+            packByte(packer, TAG_UPVALUE);
+            packValue(packer, *upvalue->location);
+            break;
+        }
+        case OBJ_NATIVE: {
+            /* Natives are plain C functions, every VM can call them */
+            NativeFn function = AS_NATIVE(value);
+            packByte(packer, TAG_NATIVE);
+            packBytes(packer, &function, sizeof(function));
+            break;
+        }
+        case OBJ_CHANNEL:
+            packShared(packer, AS_CHANNEL(value), TAG_CHANNEL);
+            break;
+        case OBJ_THREAD:
+            packShared(packer, AS_THREAD(value), TAG_THREAD);
+            break;
+        case OBJ_READER:
+            if (packer->error == NULL) packer->error = "A reader can't be sent to another thread.";
+            packByte(packer, TAG_NIL);
+            break;
+        case OBJ_FIBER:
+            /* Its frames point into the VM it was made on */
+            if (packer->error == NULL) packer->error = "A fiber can't be sent to another thread.";
+            packByte(packer, TAG_NIL);
+            break;
+        case OBJ_MODULE: {
+            /* Its globals go along like the main script's do (see packCall), for a VM that didn't import it yet */
+            ObjModule* module = AS_MODULE(value);
+            if (packSeen(packer, (Obj*)module)) return;
+            packByte(packer, TAG_MODULE);
+            packString(packer, module->path);
+
+            Table* globals = &module->globals;
+            int count = 0;
+            for (int i = 0; i < globals->capacity; ++i) count += isSendableGlobal(&globals->entries[i]);
+            packInt(packer, count);
+            for (int i = 0; i < globals->capacity; ++i) {
+                if (!isSendableGlobal(&globals->entries[i])) continue;
+                packString(packer, globals->entries[i].key);
+                packValue(packer, globals->entries[i].value);
+            }
+            break;
+        }
+    }
+}
+
+Message* packValues(Value* values, int count, const char** error) {
+    Message* message = calloc(1, sizeof(Message));
+    if (message == NULL) exit(1);
+    message->valueCount = count;
+
+    Packer packer = {message, NULL, 0, NULL};
+    for (int i = 0; i < count; ++i) packValue(&packer, values[i]);
+    free(packer.seen);
+
+    if (packer.error != NULL) {
+        *error = packer.error;
+        freeMessage(message);
+        return NULL;
+    }
+    return message;
+}
+
+typedef struct {
+    Message* message;
+    size_t position;
+    Obj** objects;      /* Indexed like the packer's Seen entries */
+    int objectCount;
+} Unpacker;
+
+static void unpackBytes(Unpacker* unpacker, void* bytes, size_t count) {
+    if (count == 0) return;
+    memcpy(bytes, unpacker->message->bytes + unpacker->position, count);
+    unpacker->position += count;
+}
+
+static uint8_t unpackByte(Unpacker* unpacker) { return unpacker->message->bytes[unpacker->position++]; }
+
+static int unpackInt(Unpacker* unpacker) {
+    int value;
+    unpackBytes(unpacker, &value, sizeof(value));
+    return value;
+}
+
+static void* unpackPointer(Unpacker* unpacker) {
+    void* pointer;
+    unpackBytes(unpacker, &pointer, sizeof(pointer));
+    return pointer;
+}
+
+static Obj* remember(Unpacker* unpacker, Obj* object) {
+    unpacker->objects[unpacker->objectCount++] = object;
+    return object;
+}
+
+static Value unpackValue(Unpacker* unpacker);
+
+static ObjString* unpackString(Unpacker* unpacker) {
+    unpackByte(unpacker); /* TAG_STRING */
+    int length = unpackInt(unpacker);
+    ObjString* string = copyString((const char*)unpacker->message->bytes + unpacker->position, length);
+    unpacker->position += length;
+    return string;
+}
+
+static ObjFunction* unpackFunction(Unpacker* unpacker) {
+    ObjFunction* function = (ObjFunction*)remember(unpacker, (Obj*)newFunction());
+    function->arity = unpackInt(unpacker);
+    function->upvalueCount = unpackInt(unpacker);
+    function->maxStack = unpackInt(unpacker);
+    Value name = unpackValue(unpacker);
+    function->name = IS_NIL(name) ? NULL : AS_STRING(name);
+
+    Chunk* chunk = &function->chunk;
+    int count = unpackInt(unpacker);
+    reserveChunk(chunk, count);
+    unpackBytes(unpacker, chunk->code, count);
+    unpackBytes(unpacker, chunk->lines, sizeof(int) * count);
+    chunk->count = count;
+
+    int constants = unpackInt(unpacker);
+    for (int i = 0; i < constants; ++i) writeValueArray(&chunk->constants, unpackValue(unpacker));
+    int handlers = unpackInt(unpacker);
+    for (int i = 0; i < handlers; ++i) {
+        Handler handler;
+        unpackBytes(unpacker, &handler, sizeof(handler));
+        addHandler(chunk, handler);
+    }
+
+    if (unpackByte(unpacker)) {
+        LazyBody* lazy = ALLOCATE(LazyBody, 1);
+        lazy->length = unpackInt(unpacker);
+        lazy->source = ALLOCATE(char, lazy->length + 1);
+        unpackBytes(unpacker, lazy->source, lazy->length);
+        lazy->source[lazy->length] = '\0';
+        lazy->line = unpackInt(unpacker);
+        lazy->captures = NULL;
+        if (function->upvalueCount > 0) lazy->captures = ALLOCATE(ObjString*, function->upvalueCount);
+        for (int i = 0; i < function->upvalueCount; ++i) lazy->captures[i] = unpackString(unpacker);
+        function->lazy = lazy;
+    }
+    return function;
+}
+
+static Value unpackValue(Unpacker* unpacker) {
+    Tag tag = unpackByte(unpacker);
+    switch (tag) {
+        case TAG_NIL:   return NIL_VAL;
+        case TAG_TRUE:  return BOOL_VAL(true);
+        case TAG_FALSE: return BOOL_VAL(false);
+        case TAG_NUMBER: {
+            double number;
+            unpackBytes(unpacker, &number, sizeof(number));
+            return NUMBER_VAL(number);
+        }
+        case TAG_STRING:
+            --unpacker->position;
+            return OBJ_VAL(unpackString(unpacker));
+        case TAG_FUNCTION:
+            return OBJ_VAL(unpackFunction(unpacker));
+        case TAG_CLOSURE: {
+            /* The closure is remembered before its upvalues, one of them may well point back at it */
+            int index = unpacker->objectCount++;
+            ObjClosure* closure = newClosure(AS_FUNCTION(unpackValue(unpacker)));
+            unpacker->objects[index] = (Obj*)closure;
+            Value module = unpackValue(unpacker);
+            closure->module = IS_NIL(module) ? NULL : AS_MODULE(module);
+            for (int i = 0; i < closure->upvalueCount; ++i) {
+                closure->upvalues[i] = (ObjUpvalue*)AS_OBJ(unpackValue(unpacker));
+            }
+            return OBJ_VAL(closure);
+        }
+        case TAG_UPVALUE: {
+            ObjUpvalue* upvalue = newUpvalue(NULL);
+            upvalue->location = &upvalue->closed;
+            remember(unpacker, (Obj*)upvalue);
+            upvalue->closed = unpackValue(unpacker);
+            return OBJ_VAL(upvalue);
+        }
+        case TAG_NATIVE: {
+            NativeFn function;
+            unpackBytes(unpacker, &function, sizeof(function));
+            return OBJ_VAL(newNative(function));
+        }
+        case TAG_CHANNEL:
+            return OBJ_VAL(newChannelHandle(unpackPointer(unpacker)));
+        case TAG_THREAD:
+            return OBJ_VAL(newThreadHandle(unpackPointer(unpacker)));
+        case TAG_MODULE: {
+            /* A module this VM imported already stays as it is, the copied globals only fill in a new one */
+            int index = unpacker->objectCount++;
+            ObjString* path = unpackString(unpacker);
+            Value found;
+            bool imported = tableGet(&vm.modules, path, &found);
+            if (!imported) {
+                found = OBJ_VAL(newModule(path));
+                tableSet(&vm.modules, path, found);
+            }
+            ObjModule* module = AS_MODULE(found);
+            unpacker->objects[index] = (Obj*)module;
+
+            int count = unpackInt(unpacker);
+            for (int i = 0; i < count; ++i) {
+                ObjString* name = unpackString(unpacker);
+                Value value = unpackValue(unpacker);
+                if (!imported) tableSet(&module->globals, name, value);
+            }
+            return found;
+        }
+        case TAG_FROZEN: {
+            Obj* object = unpackPointer(unpacker);
+            holdFrozen(frozenRegion(object));
+            return OBJ_VAL(object);
+        }
+        case TAG_SEEN:
+            return OBJ_VAL(unpacker->objects[unpackInt(unpacker)]);
+    }
+    return NIL_VAL; /* Unreachable */
+}
+
+int unpackValues(Message* message, Value* values) {
+    Unpacker unpacker = {message, 0, NULL, 0};
+    unpacker.objects = malloc(sizeof(Obj*) * (message->objectCount + 1));
+    if (unpacker.objects == NULL) exit(1);
+
+    for (int i = 0; i < message->valueCount; ++i) values[i] = unpackValue(&unpacker);
+    free(unpacker.objects);
+    return message->valueCount;
+}
+
+void freeMessage(Message* message) {
+    for (int i = 0; i < message->sharedCount; ++i) releaseShared(message->shared[i], message->sharedTags[i]);
+    free(message->shared);
+    free(message->sharedTags);
+    free(message->bytes);
+    free(message);
+}
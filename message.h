@@ -0,0 +1,31 @@
+#ifndef clox_message_h
+#define clox_message_h
+
+/*
+    This module deep copies values from one VM to another. Each VM has a heap of its own, so a value that
+    crosses over (through a channel or to a spawned thread) is packed into a message, a flat buffer that
+    belongs to no VM, and unpacked again on the other side.
+
+    Strings, functions, closures and their captured variables are copied, sharing and cycles included.
+    Channels, threads and frozen values (see frozen.h) are shared, the message holds a reference to them.
+    Modules are copied with their globals, unless the other VM imported the same one already and keeps its own.
+    Readers and fibers can't be sent.
+*/
+
+#include "object.h"
+
+typedef struct Message Message;
+
+/*
+    Packs `count` values, for example a function and its arguments. Returns NULL when one of them can't be
+    sent, with `error` pointing to the reason.
+*/
+Message* packValues(Value* values, int count, const char** error);
+
+/* Unpacks the values into the current VM, `values` needs room for as many as were packed */
+int unpackValues(Message* message, Value* values);
+
+/* Messages that were never unpacked still have to be freed, they hold references */
+void freeMessage(Message* message);
+
+#endif
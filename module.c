@@ -0,0 +1,288 @@
+#include <limits.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include "compiler.h"
+#include "frozen.h"
+#include "memory.h"
+#include "module.h"
+#include "source.h"
+#include "verifier.h"
+#include "vm.h"
+
+#define CACHE_MAX_LOAD 0.75
+
+/* A file the process compiled, or is compiling right now */
+typedef struct {
+    char* path;                 /* Resolved, NULL marks an empty slot */
+    struct timespec modified;   /* The file's modification time when we started compiling it */
+    ObjFunction* function;      /* The frozen body, NULL if it didn't compile */
+    bool compiling;
+} Compiled;
+
+static struct {
+    pthread_mutex_t lock;
+    pthread_cond_t changed;     /* A module got compiled or more were queued */
+
+    Compiled* entries;          /* Open addressing on the path's hash, entries are only ever replaced */
+    int count;
+    int capacity;
+
+    char** queue;               /* Paths waiting for a thread to compile them, owned by their entries */
+    int queueCount;
+    int queueCapacity;
+    int busy;                   /* Threads compiling a module, any of them may still queue more */
+    int waiting;
+    int helpers;
+    int size;
+} cache = {
+    .lock = PTHREAD_MUTEX_INITIALIZER,
+    .changed = PTHREAD_COND_INITIALIZER,
+};
+
+static char root[PATH_MAX] = ".";
+
+void setModuleRoot(const char* scriptPath) {
+    const char* slash = strrchr(scriptPath, '/');
+    if (slash == NULL) {
+        strcpy(root, ".");
+        return;
+    }
+    int length = slash == scriptPath ? 1 : (int)(slash - scriptPath);
+    if (length >= PATH_MAX) length = PATH_MAX - 1;
+    memcpy(root, scriptPath, length);
+    root[length] = '\0';
+}
+
+void setLoaderSize(int size) {
+    pthread_mutex_lock(&cache.lock);
+    cache.size = size;
+    pthread_mutex_unlock(&cache.lock);
+}
+
+static bool resolvePath(const char* path, char* resolved) {
+    char joined[PATH_MAX];
+    if (path[0] == '/') {
+        snprintf(joined, sizeof(joined), "%s", path);
+    } else if (snprintf(joined, sizeof(joined), "%s/%s", root, path) >= (int)sizeof(joined)) {
+        return false;
+    }
+    return realpath(joined, resolved) != NULL;
+}
+
+static bool sameTime(struct timespec a, struct timespec b) {
+    return a.tv_sec == b.tv_sec && a.tv_nsec == b.tv_nsec;
+}
+
+static Compiled* findSlot(Compiled* entries, int capacity, const char* path) {
+    uint32_t index = hashString(path, (int)strlen(path)) & (capacity - 1);
+    for (;;) {
+        Compiled* entry = &entries[index];
+        if (entry->path == NULL || strcmp(entry->path, path) == 0) return entry;
+        index = (index + 1) & (capacity - 1);
+    }
+}
+
+/* Finds the entry for `path`, or the empty slot it would go in. The lock is held. */
+static Compiled* findCompiled(const char* path) {
+    if (cache.count + 1 > cache.capacity * CACHE_MAX_LOAD) {
+        int capacity = GROW_CAPACITY(cache.capacity);
+        Compiled* entries = calloc(capacity, sizeof(Compiled));
+        if (entries == NULL) exit(1);
+        for (int i = 0; i < cache.capacity; ++i) {
+            if (cache.entries[i].path != NULL) *findSlot(entries, capacity, cache.entries[i].path) = cache.entries[i];
+        }
+        free(cache.entries);
+        cache.entries = entries;
+        cache.capacity = capacity;
+    }
+    return findSlot(cache.entries, cache.capacity, path);
+}
+
+static void* runLoader(void* argument);
+
+/* The importing thread compiles too, so it takes one less helper than the size to keep them all busy */
+static void startHelper() {
+    if (cache.size == 0) {
+        long cores = sysconf(_SC_NPROCESSORS_ONLN);
+        cache.size = cores > 0 ? (int)cores : 1;
+    }
+    if (cache.helpers + 1 >= cache.size) return;
+
+    pthread_t id;
+    pthread_attr_t attributes;
+    pthread_attr_init(&attributes);
+    pthread_attr_setdetachstate(&attributes, PTHREAD_CREATE_DETACHED);
+    if (pthread_create(&id, &attributes, runLoader, NULL) == 0) ++cache.helpers;
+    pthread_attr_destroy(&attributes);
+}
+
+/* Queues the module at the resolved `path` unless it's compiled and unchanged, or being compiled. The lock is held. */
+static void queueModule(const char* path) {
+    struct stat info;
+    if (stat(path, &info) != 0) return;
+
+    Compiled* entry = findCompiled(path);
+    if (entry->path != NULL && (entry->compiling || sameTime(entry->modified, info.st_mtim))) return;
+
+    if (entry->path == NULL) {
+        entry->path = strdup(path);
+        if (entry->path == NULL) exit(1);
+        entry->function = NULL;
+        ++cache.count;
+    }
+    entry->modified = info.st_mtim;
+    entry->compiling = true;
+
+    if (cache.queueCount == cache.queueCapacity) {
+        cache.queueCapacity = GROW_CAPACITY(cache.queueCapacity);
+        cache.queue = realloc(cache.queue, sizeof(char*) * cache.queueCapacity);
+        if (cache.queue == NULL) exit(1);
+    }
+    cache.queue[cache.queueCount++] = entry->path;
+
+    if (cache.queueCount > cache.waiting) startHelper();
+    pthread_cond_broadcast(&cache.changed);
+}
+
+/*
+    Compiles and freezes the module at `path`. The paths it imports come back resolved in `imports`, the ones
+    that can't be found are left out for the import to complain about when it runs.
+*/
+static ObjFunction* compileModule(const char* path, char*** imports, int* importCount) {
+    *imports = NULL;
+    *importCount = 0;
+
+    Source source;
+    if (!loadSource(path, &source)) return NULL;
+
+    ValueArray paths;
+    initValueArray(&paths);
+    ObjFunction* function = compileWithImports(source.chars, &paths);
+    unloadSource(&source);
+
+    ObjFunction* frozen = NULL;
+    if (function != NULL && verifyFunction(function)) frozen = freezeCompiled(function);
+
+    if (paths.count > 0) {
+        *imports = malloc(sizeof(char*) * paths.count);
+        if (*imports == NULL) exit(1);
+    }
+    for (int i = 0; i < paths.count; ++i) {
+        char resolved[PATH_MAX];
+        if (!resolvePath(AS_CSTRING(paths.values[i]), resolved)) continue;
+        if (((*imports)[(*importCount)++] = strdup(resolved)) == NULL) exit(1);
+    }
+    freeValueArray(&paths);
+    return frozen;
+}
+
+/* Compiles queued modules until there are none left and nobody is compiling one. The lock is held. */
+static void drainQueue() {
+    for (;;) {
+        if (cache.queueCount > 0) {
+            char* path = cache.queue[--cache.queueCount];
+            ++cache.busy;
+            pthread_mutex_unlock(&cache.lock);
+
+            char** imports;
+            int importCount;
+            ObjFunction* function = compileModule(path, &imports, &importCount);
+
+            pthread_mutex_lock(&cache.lock);
+            Compiled* entry = findCompiled(path);
+            /* An older version stays alive for as long as some VM still holds it */
+            if (entry->function != NULL) releaseFrozen(frozenRegion((Obj*)entry->function));
+            entry->function = function;
+            entry->compiling = false;
+
+            for (int i = 0; i < importCount; ++i) {
+                queueModule(imports[i]);
+                free(imports[i]);
+            }
+            free(imports);
+            --cache.busy;
+            pthread_cond_broadcast(&cache.changed);
+            continue;
+        }
+        if (cache.busy == 0) return;
+
+        ++cache.waiting;
+        pthread_cond_wait(&cache.changed, &cache.lock);
+        --cache.waiting;
+    }
+}
+
+/* Compiling allocates, so every helper has a VM to do it in */
+static void* runLoader(void* argument) {
+    initVM();
+    pthread_mutex_lock(&cache.lock);
+    drainQueue();
+    --cache.helpers;
+    pthread_mutex_unlock(&cache.lock);
+    freeVM();
+    return NULL;
+}
+
+void preloadModules(ValueArray* paths) {
+    if (paths->count == 0) return;
+
+    pthread_mutex_lock(&cache.lock);
+    for (int i = 0; i < paths->count; ++i) {
+        char resolved[PATH_MAX];
+        if (resolvePath(AS_CSTRING(paths->values[i]), resolved)) queueModule(resolved);
+    }
+    drainQueue();
+    pthread_mutex_unlock(&cache.lock);
+}
+
+/* The compiled body of the module at the resolved `path`, held by the current VM. NULL if it won't compile. */
+static ObjFunction* loadModule(const char* path) {
+    pthread_mutex_lock(&cache.lock);
+    queueModule(path);
+    drainQueue();
+
+    Compiled* entry = findCompiled(path);
+    ObjFunction* function = entry->path != NULL ? entry->function : NULL;
+
+    /* Held before we let go of the lock, a newer version may replace it right after */
+    if (function != NULL) holdFrozen(frozenRegion((Obj*)function));
+    pthread_mutex_unlock(&cache.lock);
+    return function;
+}
+
+ObjModule* importModule(ObjString* path, ObjClosure** body, const char** error) {
+    *body = NULL;
+    Value found;
+    if (tableGet(&vm.modules, path, &found)) return AS_MODULE(found);
+
+    char resolved[PATH_MAX];
+    if (!resolvePath(path->chars, resolved)) {
+        *error = "Can't find module";
+        return NULL;
+    }
+
+    ObjString* key = copyString(resolved, (int)strlen(resolved));
+    if (!tableGet(&vm.modules, key, &found)) {
+        ObjFunction* function = loadModule(resolved);
+        if (function == NULL) {
+            *error = "Can't compile module";
+            return NULL;
+        }
+
+        /* It's registered before the body runs, so a module importing this one back gets it as it is */
+        ObjModule* module = newModule(key);
+        found = OBJ_VAL(module);
+        tableSet(&vm.modules, key, found);
+        *body = newClosure(function);
+        (*body)->module = module;
+    }
+
+    /* The next import spelled the same way doesn't have to resolve anything */
+    tableSet(&vm.modules, path, found);
+    return AS_MODULE(found);
+}
@@ -0,0 +1,45 @@
+#ifndef clox_module_h
+#define clox_module_h
+
+/*
+    This module implements `import`, which runs another script as a module and hands back its globals:
+
+        var math = import "lib/math.qmr";
+        print math.square(12);
+
+    Paths are relative to the directory of the main script (the working directory in the REPL). A module's body
+    runs once per VM, the first time it's imported, and every later import gets the same module. Its globals are
+    its own: definitions and assignments stay in the module, reads that miss fall back to the main script's
+    globals, which is where the natives are. Modules importing each other in a circle see each other half done.
+
+    Compiling happens once per process. The compiled body is frozen (see frozen.h) and cached by the file's
+    resolved path and modification time, so every thread and every worker importing it shares one copy and an
+    edited file gets compiled again. Before a script runs, the modules it imports, and the ones those import,
+    are compiled on a few threads at once.
+*/
+
+#include "object.h"
+#include "table.h"
+
+struct ObjModule {
+    Obj obj;
+    ObjString* path;    /* Resolved, every import of the same file finds the same module */
+    Table globals;
+};
+
+/*
+    Finds the module `path` names in the current VM, loading it if it's new. When its body still has to run
+    `body` is set to the closure to call, NULL otherwise. Returns NULL with `error` set when it can't be loaded.
+*/
+ObjModule* importModule(ObjString* path, ObjClosure** body, const char** error);
+
+/* Compiles the modules a script about to run imports ahead of time, see `compileWithImports` */
+void preloadModules(ValueArray* paths);
+
+/* Where relative module paths start from, the directory `scriptPath` is in */
+void setModuleRoot(const char* scriptPath);
+
+/* How many threads compile modules at once, the importing one included. Defaults to the number of cores. */
+void setLoaderSize(int size);
+
+#endif
@@ -0,0 +1,24 @@
+#ifndef clox_number_h
+#define clox_number_h
+
+/*
+    This module converts between numbers and their text. Both directions are exact: parsing gives the double
+    nearest to the decimal, and formatting gives a decimal that parses back to the same double. That decimal is
+    almost always the shortest one, and at most a digit longer when it isn't (see number.c).
+*/
+
+#include "common.h"
+
+/* Big enough for any number formatNumber() writes, including the terminator */
+#define NUMBER_BUFFER_SIZE 32
+
+/*
+    Parses a number the way strtod() does, skipping leading whitespace and stopping at the first character
+    that isn't part of the number. If `end` isn't NULL it's set to that character.
+*/
+double parseNumber(const char* chars, const char** end);
+
+/* Writes `value` into `buffer` and returns the length, the buffer is NUL terminated */
+int formatNumber(double value, char* buffer);
+
+#endif
@@ -2,7 +2,12 @@
 #include <stdio.h>
 #include <string.h>
 
+#include "channel.h"
+#include "gc.h"
+#include "module.h"
 #include "object.h"
+#include "output.h"
+#include "thread.h"
 #include "vm.h"
 
 #define ALLOCATE_OBJ(type, objectType) \
@@ -11,10 +16,9 @@
 static Obj* allocateObject(size_t size, ObjType type) {
     Obj* object = (Obj*)reallocate(NULL, 0, size);
     object->type = type;
-
-    /* Every time we allocate an Obj we insert it in the head of the list */
-    object->next = vm.objects;
-    vm.objects = object;
+    object->frozen = false;
+    atomic_init(&object->marked, false);
+    trackObject(object);
     return object;
 }
 
@@ -31,6 +35,7 @@ ObjClosure* newClosure(ObjFunction* function) {
     closure->function = function;
     closure->upvalues = upvalues;
     closure->upvalueCount = function->upvalueCount;
+    closure->module = NULL;
     return closure;
 }
 
@@ -39,6 +44,9 @@ static ObjString* allocateString(char* chars, int length, uint32_t hash) {
     string->length = length;
     string->chars = chars;
     string->hash = hash;
+    string->interned = true;
+    string->ownsChars = true;
+    string->owner = NULL;
     tableSet(&vm.strings, string, NIL_VAL);
     return string;
 }
@@ -47,11 +55,24 @@ ObjFunction* newFunction() {
     ObjFunction* function = ALLOCATE_OBJ(ObjFunction, OBJ_FUNCTION);
     function->arity = 0;
     function->upvalueCount = 0;
+    function->maxStack = 0;
     function->name = NULL;
+    function->lazy = NULL;
     initChunk(&function->chunk);
     return function;
 }
 
+/*
+    Releases the skipped-over source of a lazily compiled function, once it was compiled or when the function itself goes away.
+*/
+void freeLazyBody(ObjFunction* function) {
+    LazyBody* lazy = function->lazy;
+    FREE_ARRAY(char, lazy->source, lazy->length + 1);
+    FREE_ARRAY(ObjString*, lazy->captures, function->upvalueCount);
+    FREE(LazyBody, lazy);
+    function->lazy = NULL;
+}
+
 ObjNative* newNative(NativeFn function) {
     ObjNative* native = ALLOCATE_OBJ(ObjNative, OBJ_NATIVE);
     native->function = function;
@@ -61,7 +82,7 @@ ObjNative* newNative(NativeFn function) {
 /*
     This function implements the FNV-1a hash algorithm
 */
-static uint32_t hashString(const char* key, int length) {
+uint32_t hashString(const char* key, int length) {
     uint32_t hash = 2166136261u;  /* Initial hash */
     for (int i = 0; i < length; ++i) {
         hash ^= (uint8_t)key[i];  /* Bitwise XOR */
@@ -83,7 +104,13 @@ ObjString* takeString(char* chars, int length) {
 }
 
 ObjString* copyString(const char* chars, int length) {
-    uint32_t hash = hashString(chars, length);
+    return copyStringWithHash(chars, length, hashString(chars, length));
+}
+
+/*
+    Same as `copyString` for callers that already know the hash of the characters, so they don't get hashed twice.
+*/
+ObjString* copyStringWithHash(const char* chars, int length, uint32_t hash) {
     ObjString* interned = tableFindString(&vm.strings, chars, length, hash);
     
     if (interned != NULL) return interned;
@@ -94,6 +121,83 @@ ObjString* copyString(const char* chars, int length) {
     return allocateString(heapChars, length, hash);
 }
 
+/*
+    The two ways a reader makes strings. Neither goes through the intern table, reading a big file would
+    otherwise spend its time hashing lines and growing the table.
+*/
+ObjString* copyStringUninterned(const char* chars, int length) {
+    ObjString* string = ALLOCATE_OBJ(ObjString, OBJ_STRING);
+    string->length = length;
+    string->chars = ALLOCATE(char, length + 1);
+    memcpy(string->chars, chars, length);
+    string->chars[length] = '\0';
+    string->hash = 0;
+    string->interned = false;
+    string->ownsChars = true;
+    string->owner = NULL;
+    return string;
+}
+
+/* `owner` is marked with the string so that the characters outlive it, readers only hand these out for mapped files */
+ObjString* sliceString(Obj* owner, const char* chars, int length) {
+    ObjString* string = ALLOCATE_OBJ(ObjString, OBJ_STRING);
+    string->length = length;
+    string->chars = (char*)chars;
+    string->hash = 0;
+    string->interned = false;
+    string->ownsChars = false;
+    string->owner = owner;
+    return string;
+}
+
+ObjReader* newReader(int fd) {
+    ObjReader* reader = ALLOCATE_OBJ(ObjReader, OBJ_READER);
+    reader->fd = fd;
+    reader->mapped = false;
+    reader->socket = false;
+    reader->sent = 0;
+    reader->eof = false;
+    reader->data = NULL;
+    reader->capacity = 0;
+    reader->start = 0;
+    reader->end = 0;
+    return reader;
+}
+
+/* Handles take a reference of their own, the VM drops it when it frees the handle */
+ObjChannel* newChannelHandle(Channel* channel) {
+    ObjChannel* handle = ALLOCATE_OBJ(ObjChannel, OBJ_CHANNEL);
+    handle->channel = channel;
+    retainChannel(channel);
+    return handle;
+}
+
+ObjThread* newThreadHandle(Thread* thread) {
+    ObjThread* handle = ALLOCATE_OBJ(ObjThread, OBJ_THREAD);
+    handle->thread = thread;
+    retainThread(thread);
+    return handle;
+}
+
+/* The closure sits in slot zero of the new stack, waiting for the first `resume` to call it */
+ObjFiber* newFiber(ObjClosure* closure, int stackCapacity, int frameCapacity) {
+    ObjFiber* fiber = ALLOCATE_OBJ(ObjFiber, OBJ_FIBER);
+    fiber->state = FIBER_NEW;
+    fiber->frames = ALLOCATE(CallFrame, frameCapacity);
+    fiber->frameCount = 0;
+    fiber->frameCapacity = frameCapacity;
+    fiber->stack = ALLOCATE(Value, stackCapacity);
+    fiber->stackTop = fiber->stack;
+    fiber->stackCapacity = stackCapacity;
+    fiber->openUpvalues = NULL;
+    fiber->caller = NULL;
+    fiber->runDepth = 0;
+    fiber->nextFiber = vm.fibers;
+    vm.fibers = fiber;
+    if (closure != NULL) *fiber->stackTop++ = OBJ_VAL(closure);
+    return fiber;
+}
+
 /*
     `newUpvalue` takes the address of the slot where the closed-over variable lives.
 */
@@ -105,12 +209,19 @@ ObjUpvalue* newUpvalue(Value* slot) {
     return upvalue;
 }
 
+ObjModule* newModule(ObjString* path) {
+    ObjModule* module = ALLOCATE_OBJ(ObjModule, OBJ_MODULE);
+    module->path = path;
+    initTable(&module->globals);
+    return module;
+}
+
 static void printFunction(ObjFunction* function) {
     if (function->name == NULL) {
-        printf("<script>");
+        formatOutput("<script>");
         return;
     }
-    printf("<fn %s>", function->name->chars); 
+    formatOutput("<fn %s>", function->name->chars);
 }
 
 void printObject(Value value) {
@@ -126,13 +237,28 @@ void printObject(Value value) {
             printFunction(AS_FUNCTION(value)); 
             break;
         case OBJ_NATIVE:
-            printf("<native fn>");
+            formatOutput("<native fn>");
             break;
         case OBJ_STRING:   
-            printf("%s", AS_CSTRING(value)); 
+            writeOutput(AS_CSTRING(value), AS_STRING(value)->length);
             break;
         case OBJ_UPVALUE:
-            printf("upvalue");
+            formatOutput("upvalue");
+            break;
+        case OBJ_READER:
+            formatOutput("<reader>");
+            break;
+        case OBJ_CHANNEL:
+            formatOutput("<channel>");
+            break;
+        case OBJ_THREAD:
+            formatOutput("<thread>");
+            break;
+        case OBJ_FIBER:
+            formatOutput("<fiber>");
+            break;
+        case OBJ_MODULE:
+            formatOutput("<module %s>", AS_MODULE(value)->path->chars);
             break;
     }
 }
@@ -6,6 +6,8 @@
     in the language such as strings, instances, functions, etc...
 */
 
+#include <stdatomic.h>
+
 #include "common.h"
 #include "value.h"
 #include "chunk.h"
@@ -16,7 +18,7 @@
 #define IS_CLOSURE(value)   isObjType(value, OBJ_CLOSURE)
 #define AS_CLOSURE(value)   ((ObjClosure*)AS_OBJ(value))
 
-#define IS_FUNCTION(value)  isObjType(value, OBJ_FUNCION)
+#define IS_FUNCTION(value)  isObjType(value, OBJ_FUNCTION)
 #define AS_FUNCTION(value)  ((ObjFunction*)AS_OBJ(value))
 
 #define IS_NATIVE(value)    isObjType(value, OBJ_NATIVE)
@@ -32,25 +34,59 @@
 #define AS_STRING(value)    ((ObjString*)AS_OBJ(value))
 #define AS_CSTRING(value)   (((ObjString*)AS_OBJ(value))->chars)
 
+#define IS_READER(value)    isObjType(value, OBJ_READER)
+#define AS_READER(value)    ((ObjReader*)AS_OBJ(value))
+
+#define IS_CHANNEL(value)   isObjType(value, OBJ_CHANNEL)
+#define AS_CHANNEL(value)   (((ObjChannel*)AS_OBJ(value))->channel)
+
+#define IS_THREAD(value)    isObjType(value, OBJ_THREAD)
+#define AS_THREAD(value)    (((ObjThread*)AS_OBJ(value))->thread)
+
+#define IS_FIBER(value)     isObjType(value, OBJ_FIBER)
+#define AS_FIBER(value)     ((ObjFiber*)AS_OBJ(value))
+
+#define IS_MODULE(value)    isObjType(value, OBJ_MODULE)
+#define AS_MODULE(value)    ((ObjModule*)AS_OBJ(value))
+
 typedef enum {
     OBJ_CLOSURE,
     OBJ_FUNCTION,
     OBJ_NATIVE,
     OBJ_STRING,
-    OBJ_UPVALUE
+    OBJ_UPVALUE,
+    OBJ_READER,
+    OBJ_CHANNEL,
+    OBJ_THREAD,
+    OBJ_FIBER,
+    OBJ_MODULE
 } ObjType;
 
 struct Obj {
     ObjType type;
-    struct Obj* next;   /* The Obj iself will be a linked-list (it helps with garbage collection) */
+    bool frozen;        /* It lives in a region every VM shares and is on no VM's heap (see frozen.h) */
+    atomic_bool marked; /* Set while the collector traces the heap, the helpers race to set it (see gc.h) */
 };
 
+/*
+    With lazy compilation the compiler only skims over a function body and keeps its source around.
+    The body is compiled the first time the function gets called.
+*/
+typedef struct {
+    char* source;           /* Copy of the text from the opening '(' to the closing '}' */
+    int length;
+    int line;               /* The line `source` starts on */
+    ObjString** captures;   /* Name of the enclosing variable behind each upvalue */
+} LazyBody;
+
 typedef struct {
     Obj obj;            
     int arity;          /* Number of parameters the function expects */
     int upvalueCount;
+    int maxStack;       /* The most stack slots a call needs, filled in by the verifier (zero until then) */
     Chunk chunk;        /* Each function will have it's own chunk of Bytecode */
     ObjString* name;
+    LazyBody* lazy;     /* Non-NULL while the body hasn't been compiled yet */
 } ObjFunction;
 
 /*
@@ -68,8 +104,20 @@ struct ObjString {
     int length;
     char* chars;
     uint32_t hash;      /* Each ObjString will store a hash, this will help in the implementation of hash tables*/
+
+/*
+    Lines handed out by a reader skip the intern table, so they have to be compared by content. Lines of a mapped
+    file are slices that point straight into the mapping, those don't own their characters and have no '\0' after them.
+    A slice keeps its reader reachable, the mapping goes once the reader and all of its lines are garbage.
+*/
+    bool interned;
+    bool ownsChars;
+    Obj* owner;         /* The reader a slice points into, NULL for everyone else */
 };
 
+/* Modules keep globals of their own, they're defined with the table in module.h */
+typedef struct ObjModule ObjModule;
+
 /* This is a runtime representation of upvalues */
 typedef struct ObjUpvalue {
     Obj obj;
@@ -91,15 +139,101 @@ typedef struct {
 */
     ObjUpvalue** upvalues;
     int upvalueCount;
+    ObjModule* module;  /* The module whose body made it, its globals are looked up there. NULL for the main script. */
 } ObjClosure;
 
+/*
+    So for each function call that hasn’t returned yet we need to track where on the stack that function’s locals begin, 
+    and where the caller should resume. We’ll put this, along with some other stuff, in a new struct.
+
+    This struct represent a single ongoing function    
+*/
+typedef struct {
+    ObjClosure* closure;
+    uint8_t* ip;
+    Value* slots;   /* This will point the the VM's value stack at the first slot the function can use */
+    struct Table* globals;  /* The closure's module's or the VM's own */
+} CallFrame;
+
+typedef enum {
+    FIBER_NEW,          /* Created but never resumed, its function hasn't started */
+    FIBER_SUSPENDED,    /* Stopped at a `yield` */
+    FIBER_PARKED,       /* Stopped in a native that would have blocked, it makes the call again when resumed */
+    FIBER_RUNNING,      /* Either the one running or one waiting for a fiber it resumed */
+    FIBER_DONE          /* Its function returned, or a runtime error unwound it */
+} FiberState;
+
+/*
+    A fiber is a call stack of its own: a value stack, the frames and the open upvalues pointing into it. The VM
+    runs one fiber at a time, `resume` and `yield` switch which one without copying anything. A fiber's stack
+    starts out small and grows as calls need it, so thousands of them are cheap.
+*/
+typedef struct ObjFiber {
+    Obj obj;
+    FiberState state;
+    CallFrame* frames;
+    int frameCount;
+    int frameCapacity;
+    Value* stack;
+    Value* stackTop;
+    int stackCapacity;
+    ObjUpvalue* openUpvalues;
+    struct ObjFiber* caller;    /* The fiber that resumed this one, it gets control back on `yield` */
+    int runDepth;               /* The `run()` it was resumed in, a `yield` can't cross a call from C */
+    struct ObjFiber* nextFiber; /* Every fiber of the VM is on a list, the collector closes what the dead ones left open */
+} ObjFiber;
+
+/*
+    A buffered reader over a file descriptor. Regular files are mapped into memory whole, everything else
+    (pipes, terminals, sockets) is read through a buffer that grows to fit the longest line.
+*/
+typedef struct {
+    Obj obj;
+    int fd;             /* -1 once closed */
+    bool mapped;
+    bool socket;        /* Non-blocking, made by the event loop (see loop.h) */
+    size_t sent;        /* How much of a `write` a parked fiber already got out, it carries on from there */
+    bool eof;           /* Nothing left to read from `fd`, what's in `data` is all there is */
+    char* data;         /* The mapping or the buffer */
+    size_t capacity;
+    size_t start;       /* First byte we haven't handed out yet */
+    size_t end;         /* One past the last byte we've read */
+} ObjReader;
+
+/*
+    Channels and threads are shared between VMs running on different threads. Each VM only holds a handle, the
+    shared part is reference counted and lives outside of any VM's heap (see channel.h and thread.h).
+*/
+typedef struct Channel Channel;
+typedef struct Thread Thread;
+
+typedef struct {
+    Obj obj;
+    Channel* channel;
+} ObjChannel;
+
+typedef struct {
+    Obj obj;
+    Thread* thread;
+} ObjThread;
+
 ObjClosure*  newClosure(ObjFunction* function);
 ObjFunction* newFunction();
 ObjNative*   newNative(NativeFn function);
 
 ObjString*  takeString(char* chars, int length);
 ObjString*  copyString(const char* chars, int length);
+ObjString*  copyStringWithHash(const char* chars, int length, uint32_t hash);
+ObjString*  copyStringUninterned(const char* chars, int length);
+ObjString*  sliceString(Obj* owner, const char* chars, int length);
+ObjReader*  newReader(int fd);
+ObjChannel* newChannelHandle(Channel* channel);
+ObjThread*  newThreadHandle(Thread* thread);
+ObjFiber*   newFiber(ObjClosure* closure, int stackCapacity, int frameCapacity);
+ObjModule*  newModule(ObjString* path);
+uint32_t    hashString(const char* key, int length);
 ObjUpvalue* newUpvalue(Value* slot);
+void freeLazyBody(ObjFunction* function);
 void printObject(Value value);
 
 static inline bool isObjType(Value value, ObjType type) {
@@ -0,0 +1,186 @@
+#include <errno.h>
+#include <pthread.h>
+#include <sched.h>
+#include <stdarg.h>
+#include <stdatomic.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "number.h"
+#include "output.h"
+
+typedef struct Output {
+    atomic_flag busy;   /* Held by the thread while it writes, and by the exit flush while it empties the buffer */
+    int holds;          /* How deep the thread is in `holdOutput`, only the outermost takes `busy` */
+    char buffer[OUTPUT_BUFFER_SIZE];
+    size_t count;
+    size_t limit;       /* Flush once this many bytes are waiting */
+    bool lineBuffered;
+    bool broken;        /* Set once a write fails, say on a closed pipe, after that we drop the output */
+    bool listed;
+    struct Output* next;
+} Output;
+
+static _Thread_local Output output = {.busy = ATOMIC_FLAG_INIT}; /* Each thread collects its own output */
+
+/* How every thread buffers, set once for the process and picked up by each thread in `initOutput` */
+static struct {
+    bool lineBuffered;
+    size_t limit;
+} policy;
+
+/*
+    Every thread's buffer, so exit() gets all of them out and not only the one of the thread calling it. Threads
+    that are never joined, the scheduler's workers say, may still be printing then, so each buffer has a lock.
+*/
+static pthread_mutex_t outputsLock = PTHREAD_MUTEX_INITIALIZER;
+static Output* outputs = NULL;
+
+static void writeAll(Output* out, const char* chars, size_t length) {
+    while (length > 0 && !out->broken) {
+        ssize_t written = write(STDOUT_FILENO, chars, length);
+        if (written < 0) {
+            if (errno == EINTR) continue;
+            out->broken = true;
+            return;
+        }
+        chars += written;
+        length -= (size_t)written;
+    }
+}
+
+/*
+    Only the exit flush ever competes with the owner for a buffer, so this is a flag rather than a mutex, a mutex
+    costs a print about a third of its time. A `print` holds it once for the value and its newline.
+*/
+static void lockOutput(Output* out) {
+    while (atomic_flag_test_and_set_explicit(&out->busy, memory_order_acquire)) sched_yield();
+}
+
+static void unlockOutput(Output* out) { atomic_flag_clear_explicit(&out->busy, memory_order_release); }
+
+/* The caller holds `out->busy` */
+static void flushLocked(Output* out) {
+    /* Anything the host printed with stdio has to come out first */
+    fflush(stdout);
+    writeAll(out, out->buffer, out->count);
+    out->count = 0;
+}
+
+static void flushAllOutput() {
+    pthread_mutex_lock(&outputsLock);
+    for (Output* out = outputs; out != NULL; out = out->next) {
+        lockOutput(out);
+        flushLocked(out);
+        unlockOutput(out);
+    }
+    pthread_mutex_unlock(&outputsLock);
+}
+
+static void initPolicy() {
+    policy.lineBuffered = isatty(STDOUT_FILENO);
+    policy.limit = OUTPUT_BUFFER_SIZE;
+    atexit(flushAllOutput);
+}
+
+void initOutput() {
+    static pthread_once_t once = PTHREAD_ONCE_INIT;
+    pthread_once(&once, initPolicy);
+    output.lineBuffered = policy.lineBuffered;
+    output.limit = policy.limit;
+
+    if (!output.listed) {
+        pthread_mutex_lock(&outputsLock);
+        output.next = outputs;
+        outputs = &output;
+        output.listed = true;
+        pthread_mutex_unlock(&outputsLock);
+    }
+}
+
+void freeOutput() {
+    flushOutput();
+    if (!output.listed) return;
+
+    pthread_mutex_lock(&outputsLock);
+    for (Output** link = &outputs; *link != NULL; link = &(*link)->next) {
+        if (*link == &output) {
+            *link = output.next;
+            break;
+        }
+    }
+    output.listed = false;
+    pthread_mutex_unlock(&outputsLock);
+}
+
+void setOutputBuffering(bool lineBuffered, size_t size) {
+    flushOutput();
+    policy.lineBuffered = lineBuffered;
+    policy.limit = size == 0 || size > OUTPUT_BUFFER_SIZE ? OUTPUT_BUFFER_SIZE : size;
+    output.lineBuffered = policy.lineBuffered;
+    output.limit = policy.limit;
+}
+
+void holdOutput() {
+    if (output.holds++ == 0) lockOutput(&output);
+}
+
+void releaseOutput() {
+    if (--output.holds == 0) unlockOutput(&output);
+}
+
+void flushOutput() {
+    holdOutput();
+    flushLocked(&output);
+    releaseOutput();
+}
+
+void writeOutput(const char* chars, size_t length) {
+    holdOutput();
+    if (output.count + length > OUTPUT_BUFFER_SIZE) {
+        flushLocked(&output);
+        /* Too big to be worth copying */
+        if (length > OUTPUT_BUFFER_SIZE) {
+            writeAll(&output, chars, length);
+            releaseOutput();
+            return;
+        }
+    }
+
+    memcpy(output.buffer + output.count, chars, length);
+    output.count += length;
+
+    if (output.count >= output.limit || (output.lineBuffered && memchr(chars, '\n', length) != NULL)) {
+        flushLocked(&output);
+    }
+    releaseOutput();
+}
+
+void writeNumber(double number) {
+    holdOutput();
+    if (output.count + NUMBER_BUFFER_SIZE > OUTPUT_BUFFER_SIZE) flushLocked(&output);
+    output.count += formatNumber(number, output.buffer + output.count);
+    if (output.count >= output.limit) flushLocked(&output);
+    releaseOutput();
+}
+
+void formatOutput(const char* format, ...) {
+    char line[256];
+    va_list args, again;
+    va_start(args, format);
+    va_copy(again, args);
+    int length = vsnprintf(line, sizeof(line), format, args);
+    va_end(args);
+
+    if (length >= 0 && (size_t)length < sizeof(line)) {
+        writeOutput(line, (size_t)length);
+    } else if (length >= 0) {
+        char* longer = malloc((size_t)length + 1);
+        vsnprintf(longer, (size_t)length + 1, format, again);
+        writeOutput(longer, (size_t)length);
+        free(longer);
+    }
+    va_end(again);
+}
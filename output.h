@@ -0,0 +1,44 @@
+#ifndef clox_output_h
+#define clox_output_h
+
+/*
+    Everything the VM prints goes through this module. It collects the output in one large buffer and hands
+    it to write(2) in big pieces, instead of making a stdio call for every value and every newline.
+
+    The buffer is flushed when it fills up (or reaches the configured size), at the end of every line when
+    line buffering is on, before input() reads, on errors, after each `interpret()` and on exit.
+*/
+
+#include "common.h"
+
+#define OUTPUT_BUFFER_SIZE (64 * 1024)
+
+/*
+    Sets up the calling thread's buffer with the process's policy. The first call makes the default one: line
+    buffered on a terminal, fully buffered otherwise. `freeOutput` flushes the thread's buffer for the last time.
+*/
+void initOutput();
+void freeOutput();
+
+/*
+    Line buffering flushes after every newline. Otherwise we flush once `size` bytes are waiting. It applies to
+    the calling thread and every thread that sets up its buffer after.
+*/
+void setOutputBuffering(bool lineBuffered, size_t size);
+
+void writeOutput(const char* chars, size_t length);
+void writeNumber(double number);
+
+/* printf() into the buffer, for the rarely used paths like the disassembler */
+void formatOutput(const char* format, ...);
+
+void flushOutput();
+
+/*
+    Holds the calling thread's buffer across several writes, so that they take its lock once. The lock is only
+    there so that exit() can flush threads that are still running. Holds nest.
+*/
+void holdOutput();
+void releaseOutput();
+
+#endif
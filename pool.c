@@ -0,0 +1,358 @@
+#include <pthread.h>
+#include <stdatomic.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+
+#include "channel.h"
+#include "memory.h"
+#include "message.h"
+#include "output.h"
+#include "pool.h"
+#include "thread.h"
+#include "vm.h"
+
+#define CACHE_LINE 64
+
+/* Enough chunks that a worker which falls behind can hand most of its share to the others */
+#define CHUNKS_PER_WORKER 8
+
+/* The results of parallelMap() have to fit a channel */
+#define MAX_ELEMENTS (1 << 24)
+
+#define EMPTY -1
+#define LOST_RACE -2
+
+/*
+    A Chase-Lev work-stealing deque of chunk numbers. The owner pops from the bottom, thieves take from the
+    top, and the two only meet over the very last chunk. All the chunks are pushed before the workers start,
+    so unlike the original the array never has to grow while it's being used.
+*/
+typedef struct {
+    _Alignas(CACHE_LINE) atomic_long top;
+    _Alignas(CACHE_LINE) atomic_long bottom;
+    int* chunks;
+    int capacity;
+} Deque;
+
+typedef struct {
+    Message* call;      /* The function followed by the globals */
+    int valueCount;
+    Message* init;      /* Where every chunk's fold starts, only for parallelReduce() */
+    bool reduce;
+
+    int count;
+    int chunkSize;
+    int chunkCount;
+    Message** results;  /* One per element for parallelMap(), one per chunk for parallelReduce() */
+    Message* result;    /* The final fold, made by the worker that finishes last */
+
+    atomic_int remaining;
+    atomic_bool failed;
+    bool done;
+} Job;
+
+static struct {
+    pthread_mutex_t callLock;   /* Only one job runs at a time, callers from other threads queue up here */
+    pthread_mutex_t lock;
+    pthread_cond_t start;
+    pthread_cond_t finished;
+    int size;
+    bool started;
+    Deque* deques;
+    Job* job;
+    unsigned long generation;   /* Bumped for every job, so workers can tell a new one from the last */
+} pool = {
+    .callLock = PTHREAD_MUTEX_INITIALIZER,
+    .lock = PTHREAD_MUTEX_INITIALIZER,
+    .start = PTHREAD_COND_INITIALIZER,
+    .finished = PTHREAD_COND_INITIALIZER,
+};
+
+/* Which deque belongs to the current thread, -1 outside of the pool */
+static _Thread_local int workerIndex = -1;
+
+static void pushChunk(Deque* deque, int chunk) {
+    long bottom = atomic_load_explicit(&deque->bottom, memory_order_relaxed);
+    deque->chunks[bottom] = chunk;
+    atomic_store_explicit(&deque->bottom, bottom + 1, memory_order_release);
+}
+
+static int popChunk(Deque* deque) {
+    long bottom = atomic_load_explicit(&deque->bottom, memory_order_relaxed) - 1;
+    atomic_store_explicit(&deque->bottom, bottom, memory_order_relaxed);
+    atomic_thread_fence(memory_order_seq_cst);
+    long top = atomic_load_explicit(&deque->top, memory_order_relaxed);
+
+    if (top > bottom) {
+        atomic_store_explicit(&deque->bottom, bottom + 1, memory_order_relaxed);
+        return EMPTY;
+    }
+
+    int chunk = deque->chunks[bottom];
+    if (top == bottom) {
+        /* The last one, a thief may be after it too */
+        if (!atomic_compare_exchange_strong_explicit(&deque->top, &top, top + 1,
+                                                     memory_order_seq_cst, memory_order_relaxed)) chunk = EMPTY;
+        atomic_store_explicit(&deque->bottom, bottom + 1, memory_order_relaxed);
+    }
+    return chunk;
+}
+
+static int stealChunk(Deque* deque) {
+    long top = atomic_load_explicit(&deque->top, memory_order_acquire);
+    atomic_thread_fence(memory_order_seq_cst);
+    long bottom = atomic_load_explicit(&deque->bottom, memory_order_acquire);
+    if (top >= bottom) return EMPTY;
+
+    int chunk = deque->chunks[top];
+    if (!atomic_compare_exchange_strong_explicit(&deque->top, &top, top + 1,
+                                                 memory_order_seq_cst, memory_order_relaxed)) return LOST_RACE;
+    return chunk;
+}
+
+/* Our own chunks first, then the others' in turn. No new chunks show up during a job, so empty means done. */
+static int nextChunk() {
+    int chunk = popChunk(&pool.deques[workerIndex]);
+    if (chunk != EMPTY) return chunk;
+
+    for (int i = 1; i < pool.size; ++i) {
+        Deque* victim = &pool.deques[(workerIndex + i) % pool.size];
+        while ((chunk = stealChunk(victim)) == LOST_RACE);
+        if (chunk != EMPTY) return chunk;
+    }
+    return EMPTY;
+}
+
+static bool callWith(Value function, Value* args, int argCount, Value* result) {
+    push(function);
+    for (int i = 0; i < argCount; ++i) push(args[i]);
+    if (callFunction(argCount) != INTERPRET_OK) return false;
+    *result = pop();
+    return true;
+}
+
+static Message* pack(Value value) {
+    const char* error;
+    Message* message = packValues(&value, 1, &error);
+    if (message == NULL) fprintf(stderr, "%s\n", error);
+    return message;
+}
+
+static bool runChunk(Job* job, Value function, Value init, int chunk) {
+    int start = chunk * job->chunkSize;
+    int end = start + job->chunkSize < job->count ? start + job->chunkSize : job->count;
+
+    if (!job->reduce) {
+        for (int i = start; i < end; ++i) {
+            Value element = NUMBER_VAL(i);
+            Value result;
+            if (!callWith(function, &element, 1, &result)) return false;
+            if ((job->results[i] = pack(result)) == NULL) return false;
+        }
+        return true;
+    }
+
+    Value args[2] = { init };
+    for (int i = start; i < end; ++i) {
+        args[1] = NUMBER_VAL(i);
+        if (!callWith(function, args, 2, &args[0])) return false;
+    }
+    return (job->results[chunk] = pack(args[0])) != NULL;
+}
+
+/* Folds the chunks' results in order, on the VM of the worker that finished last */
+static bool combine(Job* job, Value function, Value init) {
+    Value args[2] = { init };
+    for (int chunk = 0; chunk < job->chunkCount; ++chunk) {
+        unpackValues(job->results[chunk], &args[1]);
+        if (!callWith(function, args, 2, &args[0])) return false;
+    }
+    return (job->result = pack(args[0])) != NULL;
+}
+
+static void runJob(Job* job) {
+    initVM();
+    unpackCall(job->call, 1, job->valueCount);
+    Value function = vm.stackTop[-1];
+    Value init = NIL_VAL;
+    if (job->reduce) unpackValues(job->init, &init);
+    push(init); /* Both stay on the stack for the collector, every call is made above them */
+
+    int chunk;
+    while (!atomic_load_explicit(&job->failed, memory_order_relaxed) && (chunk = nextChunk()) != EMPTY) {
+        if (!runChunk(job, function, init, chunk)) atomic_store(&job->failed, true);
+    }
+
+    /* Once we're counted out the caller may free the job, only the last worker gets to touch it after that */
+    bool last = atomic_fetch_sub(&job->remaining, 1) == 1;
+    if (last && job->reduce && !atomic_load(&job->failed) && !combine(job, function, init)) {
+        atomic_store(&job->failed, true);
+    }
+
+    flushOutput();
+    freeVM();
+
+    if (last) {
+        pthread_mutex_lock(&pool.lock);
+        job->done = true;
+        pthread_cond_signal(&pool.finished);
+        pthread_mutex_unlock(&pool.lock);
+    }
+}
+
+static void* runWorker(void* argument) {
+    workerIndex = (int)(intptr_t)argument;
+    unsigned long generation = 0;
+
+    for (;;) {
+        pthread_mutex_lock(&pool.lock);
+        while (pool.generation == generation) pthread_cond_wait(&pool.start, &pool.lock);
+        generation = pool.generation;
+        Job* job = pool.job;
+        pthread_mutex_unlock(&pool.lock);
+
+        runJob(job);
+    }
+    return NULL;
+}
+
+void setPoolSize(int size) {
+    if (!pool.started) pool.size = size;
+}
+
+static bool startPool() {
+    if (pool.size <= 0) pool.size = (int)sysconf(_SC_NPROCESSORS_ONLN);
+    if (pool.size <= 0) pool.size = 1;
+
+    pool.deques = aligned_alloc(CACHE_LINE, sizeof(Deque) * pool.size);
+    if (pool.deques == NULL) exit(1);
+
+    for (int i = 0; i < pool.size; ++i) {
+        atomic_init(&pool.deques[i].top, 0);
+        atomic_init(&pool.deques[i].bottom, 0);
+        pool.deques[i].chunks = NULL;
+        pool.deques[i].capacity = 0;
+
+        pthread_t id;
+        pthread_attr_t attributes;
+        pthread_attr_init(&attributes);
+        pthread_attr_setdetachstate(&attributes, PTHREAD_CREATE_DETACHED);
+        int status = pthread_create(&id, &attributes, runWorker, (void*)(intptr_t)i);
+        pthread_attr_destroy(&attributes);
+        if (status != 0) return false;
+    }
+    pool.started = true;
+    return true;
+}
+
+/* Deals out contiguous runs of chunks, pushed backwards so every owner works through its run front to back */
+static void dealChunks(Job* job) {
+    for (int i = 0; i < pool.size; ++i) {
+        Deque* deque = &pool.deques[i];
+        int first = (int)((long)job->chunkCount * i / pool.size);
+        int last = (int)((long)job->chunkCount * (i + 1) / pool.size);
+
+        if (deque->capacity < last - first) {
+            deque->capacity = last - first;
+            deque->chunks = realloc(deque->chunks, sizeof(int) * deque->capacity);
+            if (deque->chunks == NULL) exit(1);
+        }
+        atomic_store(&deque->top, 0);
+        atomic_store(&deque->bottom, 0);
+        for (int chunk = last - 1; chunk >= first; --chunk) pushChunk(deque, chunk);
+    }
+}
+
+static void freeJob(Job* job) {
+    int resultCount = job->reduce ? job->chunkCount : job->count;
+    for (int i = 0; i < resultCount; ++i) {
+        if (job->results[i] != NULL) freeMessage(job->results[i]);
+    }
+    free(job->results);
+    freeMessage(job->call);
+    if (job->init != NULL) freeMessage(job->init);
+    if (job->result != NULL) freeMessage(job->result);
+}
+
+static Value runParallel(const char* name, bool reduce, int argCount, Value* args) {
+    if (argCount != (reduce ? 3 : 2) || !(IS_CLOSURE(args[0]) || IS_NATIVE(args[0])) || !IS_NUMBER(args[1])
+        || AS_NUMBER(args[1]) < 0 || AS_NUMBER(args[1]) > MAX_ELEMENTS) {
+        return nativeError(reduce ? "%s() expects a function, a count up to 16777216 and an initial value."
+                                  : "%s() expects a function and a count up to 16777216.", name);
+    }
+    if (workerIndex != -1) return nativeError("%s() can't be called from inside another parallel call.", name);
+
+    Job job;
+    const char* error;
+    job.reduce = reduce;
+    job.init = NULL;
+    job.result = NULL;
+    if ((job.call = packCall(args, 1, &job.valueCount, &error)) == NULL) return nativeError("%s", error);
+    if (reduce && (job.init = packValues(&args[2], 1, &error)) == NULL) {
+        freeMessage(job.call);
+        return nativeError("%s", error);
+    }
+
+    pthread_mutex_lock(&pool.callLock);
+    if (!pool.started && !startPool()) {
+        pthread_mutex_unlock(&pool.callLock);
+        freeMessage(job.call);
+        if (job.init != NULL) freeMessage(job.init);
+        return nativeError("Could not start the worker pool.");
+    }
+
+    job.count = (int)AS_NUMBER(args[1]);
+    int chunks = pool.size * CHUNKS_PER_WORKER;
+    job.chunkSize = job.count > chunks ? (job.count + chunks - 1) / chunks : 1;
+    job.chunkCount = (job.count + job.chunkSize - 1) / job.chunkSize;
+    job.results = calloc(reduce ? job.chunkCount + 1 : job.count + 1, sizeof(Message*));
+    if (job.results == NULL) exit(1);
+    atomic_init(&job.remaining, pool.size);
+    atomic_init(&job.failed, false);
+    job.done = false;
+    dealChunks(&job);
+
+    pthread_mutex_lock(&pool.lock);
+    pool.job = &job;
+    ++pool.generation;
+    pthread_cond_broadcast(&pool.start);
+    while (!job.done) pthread_cond_wait(&pool.finished, &pool.lock);
+    pthread_mutex_unlock(&pool.lock);
+    pthread_mutex_unlock(&pool.callLock);
+
+    if (atomic_load(&job.failed)) {
+        freeJob(&job);
+        return nativeError("%s() failed in a worker.", name);
+    }
+
+    Value value;
+    if (reduce) {
+        unpackValues(job.result, &value);
+    } else {
+        /* The channel is big enough for all of them, so none of these sends waits */
+        Channel* channel = newChannel(job.count > 0 ? job.count : 1);
+        value = OBJ_VAL(newChannelHandle(channel));
+        for (int i = 0; i < job.count; ++i) {
+            sendMessage(channel, job.results[i]);
+            job.results[i] = NULL;
+        }
+        closeChannel(channel);
+    }
+    freeJob(&job);
+    return value;
+}
+
+static Value parallelMapNative(int argCount, Value* args) {
+    return runParallel("parallelMap", false, argCount, args);
+}
+
+static Value parallelReduceNative(int argCount, Value* args) {
+    return runParallel("parallelReduce", true, argCount, args);
+}
+
+void definePoolNatives() {
+    defineNative("parallelMap", parallelMapNative);
+    defineNative("parallelReduce", parallelReduceNative);
+}
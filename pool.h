@@ -0,0 +1,28 @@
+#ifndef clox_pool_h
+#define clox_pool_h
+
+/*
+    This module runs a function over a range of numbers on a fixed pool of worker threads:
+
+        fun square(i) { return i * i; }
+        var squares = parallelMap(square, 1000);     // A closed channel holding 0, 1, 4, ... in order
+        print recv(squares);
+
+        fun add(a, b) { return a + b; }
+        print parallelReduce(add, 1000, 0);           // 499500
+
+    The range 0 to n - 1 is cut into chunks that are dealt out to the workers' deques up front. A worker
+    takes chunks off the bottom of its own deque and, once that runs dry, steals from the top of the others'.
+
+    Every worker runs a VM of its own, like a spawned thread does (see thread.h). The function and the
+    globals are copied into it once per call, not once per element. `parallelReduce` folds every chunk
+    starting from `init` and then folds the chunks' results in order, so `fn` has to be associative with
+    `init` as its identity for the result to match a plain loop.
+*/
+
+/* The number of workers, it only takes effect before the pool's first use. Defaults to the number of cores. */
+void setPoolSize(int size);
+
+void definePoolNatives();
+
+#endif
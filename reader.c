@@ -0,0 +1,261 @@
+#include <errno.h>
+#include <fcntl.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include "channel.h"
+#include "gc.h"
+#include "loop.h"
+#include "memory.h"
+#include "reader.h"
+#include "vm.h"
+
+/* Made on the first use, so scripts that never touch stdin don't allocate a buffer for it */
+static _Thread_local ObjReader* stdinReader = NULL;
+
+/*
+    Regular files get mapped, then every line is a slice of the mapping and nothing is ever copied.
+    Anything else gets a buffer.
+*/
+static void setUpReader(ObjReader* reader) {
+    struct stat info;
+    off_t offset = lseek(reader->fd, 0, SEEK_CUR);
+    if (fstat(reader->fd, &info) == 0 && S_ISREG(info.st_mode) && info.st_size > 0 && offset >= 0) {
+        void* mapping = mmap(NULL, (size_t)info.st_size, PROT_READ, MAP_PRIVATE, reader->fd, 0);
+        if (mapping != MAP_FAILED) {
+            madvise(mapping, (size_t)info.st_size, MADV_SEQUENTIAL);
+            reader->mapped = true;
+            reader->eof = true;
+            reader->data = mapping;
+            reader->capacity = (size_t)info.st_size;
+            reader->start = (size_t)offset; /* stdin may have been read from already */
+            reader->end = (size_t)info.st_size;
+            return;
+        }
+    }
+
+    reader->data = ALLOCATE(char, READER_BUFFER_SIZE);
+    reader->capacity = READER_BUFFER_SIZE;
+}
+
+static ObjReader* openReader(int fd) {
+    ObjReader* reader = newReader(fd);
+    setUpReader(reader);
+    return reader;
+}
+
+ObjReader* newSocketReader(int fd) {
+    ObjReader* reader = newReader(fd);
+    reader->socket = true;
+    reader->data = ALLOCATE(char, SOCKET_BUFFER_SIZE);
+    reader->capacity = SOCKET_BUFFER_SIZE;
+    return reader;
+}
+
+static ObjReader* standardInput() {
+    if (stdinReader == NULL) stdinReader = openReader(STDIN_FILENO);
+    return stdinReader;
+}
+
+/*
+    Makes room at the end of the buffer and reads into it. Returns false once there's nothing more, or when a
+    socket had nothing yet and the fiber got parked, then `vm.parked` is set and the caller has to leave it be.
+*/
+static bool fill(ObjReader* reader) {
+    if (reader->eof) return false;
+
+    /* Slide what's left to the front, the lines before it were copied out already */
+    if (reader->start > 0) {
+        memmove(reader->data, reader->data + reader->start, reader->end - reader->start);
+        reader->end -= reader->start;
+        reader->start = 0;
+    }
+
+    /* Still full, the line is longer than the buffer */
+    if (reader->end == reader->capacity) {
+        size_t capacity = reader->capacity * 2;
+        reader->data = GROW_ARRAY(char, reader->data, reader->capacity, capacity);
+        reader->capacity = capacity;
+    }
+
+    for (;;) {
+        ssize_t count = read(reader->fd, reader->data + reader->end, reader->capacity - reader->end);
+        if (count > 0) {
+            reader->end += (size_t)count;
+            return true;
+        }
+        if (count < 0 && errno == EINTR) continue;
+        if (count < 0 && errno == EAGAIN) {
+            if (waitFd(reader->fd, false)) continue;
+            return false;
+        }
+        reader->eof = true; /* End of file, or an error we treat like one */
+        return false;
+    }
+}
+
+/* Finds the next line in the reader, returns false when there are no more */
+static bool nextLine(ObjReader* reader, const char** line, int* length) {
+    for (size_t searched = reader->start;;) {
+        char* newline = memchr(reader->data + searched, '\n', reader->end - searched);
+        if (newline != NULL) {
+            *line = reader->data + reader->start;
+            *length = (int)(newline - *line);
+            reader->start = (size_t)(newline - reader->data) + 1;
+            return true;
+        }
+
+        /* Don't search the same bytes again after a refill, they just move to the front */
+        size_t pending = reader->end - reader->start;
+        if (!fill(reader)) break;
+        searched = reader->start + pending;
+    }
+    if (vm.parked) return false;
+
+    /* The last line doesn't need a '\n' */
+    if (reader->start == reader->end) return false;
+    *line = reader->data + reader->start;
+    *length = (int)(reader->end - reader->start);
+    reader->start = reader->end;
+    return true;
+}
+
+/* A socket hands back whatever arrived, there may not be more until we answer */
+static bool nextChunk(ObjReader* reader, size_t size, const char** chunk, int* length) {
+    while (reader->end - reader->start < size && !(reader->socket && reader->end > reader->start) && fill(reader));
+    if (vm.parked) return false;
+
+    size_t available = reader->end - reader->start;
+    if (available == 0) return false;
+    if (available > size) available = size;
+
+    *chunk = reader->data + reader->start;
+    *length = (int)available;
+    reader->start += available;
+    return true;
+}
+
+/* Slices are only safe when the bytes stay put, a buffer gets reused so its lines are copied out */
+static Value makeLine(ObjReader* reader, const char* chars, int length) {
+    if (reader->mapped) return OBJ_VAL(sliceString((Obj*)reader, chars, length));
+    return OBJ_VAL(copyStringUninterned(chars, length));
+}
+
+static bool checkReader(int argCount, Value* args, const char* name) {
+    if (argCount < 1 || !IS_READER(args[0])) {
+        nativeError("%s() expects a reader.", name);
+        return false;
+    }
+    if (AS_READER(args[0])->fd == -1 && !AS_READER(args[0])->mapped) {
+        nativeError("%s() on a closed reader.", name);
+        return false;
+    }
+    return true;
+}
+
+static Value openFileNative(int argCount, Value* args) {
+    if (argCount != 1 || !IS_STRING(args[0])) return nativeError("openFile() expects a path.");
+
+    /* The path may be a slice without a terminator */
+    ObjString* path = AS_STRING(args[0]);
+    char* name = ALLOCATE(char, path->length + 1);
+    memcpy(name, path->chars, path->length);
+    name[path->length] = '\0';
+    int fd = open(name, O_RDONLY);
+    FREE_ARRAY(char, name, path->length + 1);
+
+    if (fd < 0) return nativeError("Could not open file \"%.*s\": %s.", path->length, path->chars, strerror(errno));
+    return OBJ_VAL(openReader(fd));
+}
+
+static Value stdinNative(int argCount, Value* args) {
+    return OBJ_VAL(standardInput());
+}
+
+static Value readLineNative(int argCount, Value* args) {
+    if (!checkReader(argCount, args, "readLine")) return NIL_VAL;
+
+    ObjReader* reader = AS_READER(args[0]);
+    const char* line;
+    int length;
+    if (!nextLine(reader, &line, &length)) return NIL_VAL;
+    return makeLine(reader, line, length);
+}
+
+static Value readChunkNative(int argCount, Value* args) {
+    if (!checkReader(argCount, args, "readChunk")) return NIL_VAL;
+    if (argCount != 2 || !IS_NUMBER(args[1]) || AS_NUMBER(args[1]) < 1) {
+        return nativeError("readChunk() expects a reader and a positive size.");
+    }
+
+    ObjReader* reader = AS_READER(args[0]);
+    const char* chunk;
+    int length;
+    if (!nextChunk(reader, (size_t)AS_NUMBER(args[1]), &chunk, &length)) return NIL_VAL;
+    return makeLine(reader, chunk, length);
+}
+
+/*
+    close() works on channels too, see channel.h. Closing a mapped file keeps the mapping, the lines we handed out still point into it. It goes away with
+    the reader itself. A socket's buffer goes right away, servers close lots of them.
+*/
+static Value closeNative(int argCount, Value* args) {
+    if (argCount == 1 && IS_CHANNEL(args[0])) {
+        closeChannel(AS_CHANNEL(args[0]));
+        return NIL_VAL;
+    }
+    if (argCount != 1 || !IS_READER(args[0])) return nativeError("close() expects a reader or a channel.");
+
+    ObjReader* reader = AS_READER(args[0]);
+    if (reader->fd > STDIN_FILENO) {
+        forgetFd(reader->fd);
+        close(reader->fd);
+    }
+    reader->fd = -1;
+    reader->eof = true;
+    if (reader->mapped) reader->start = reader->end;
+    if (reader->socket) {
+        FREE_ARRAY(char, reader->data, reader->capacity);
+        reader->data = NULL;
+        reader->capacity = 0;
+        reader->start = reader->end = 0;
+    }
+    return NIL_VAL;
+}
+
+void defineReaderNatives() {
+    stdinReader = NULL;
+    defineNative("openFile", openFileNative);
+    defineNative("stdin", stdinNative);
+    defineNative("readLine", readLineNative);
+    defineNative("readChunk", readChunkNative);
+    defineNative("close", closeNative);
+}
+
+bool readStdinLine(const char** line, int* length) {
+    return nextLine(standardInput(), line, length);
+}
+
+ObjString* readStdinString() {
+    ObjReader* reader = standardInput();
+    const char* line;
+    int length;
+    if (!nextLine(reader, &line, &length)) return NULL;
+    return AS_STRING(makeLine(reader, line, length));
+}
+
+void freeReader(ObjReader* reader) {
+    if (reader->mapped) {
+        munmap(reader->data, reader->capacity);
+    } else {
+        FREE_ARRAY(char, reader->data, reader->capacity);
+    }
+    if (reader->fd > STDIN_FILENO) close(reader->fd);
+    if (reader == stdinReader) stdinReader = NULL;
+}
+
+void markReaderRoots() {
+    markObject((Obj*)stdinReader);
+}
@@ -0,0 +1,41 @@
+#ifndef clox_reader_h
+#define clox_reader_h
+
+/*
+    This module implements readers, the way scripts read files and stdin:
+
+        var log = openFile("access.log");
+        var line;
+        while ((line = readLine(log)) != nil) { ... }
+        close(log);
+
+    `readLine` returns the next line without its '\n' and nil at the end, `readChunk(reader, size)` returns up to
+    `size` bytes and nil at the end, and `stdin()` gives the reader that `input()` reads from as well.
+*/
+
+#include "object.h"
+
+/* Pipes and terminals are read this much at a time, the buffer only grows for longer lines */
+#define READER_BUFFER_SIZE (1024 * 1024)
+
+/* Sockets start out with less, a server has lots of them open */
+#define SOCKET_BUFFER_SIZE (16 * 1024)
+
+void defineReaderNatives();
+
+/* Wraps a non-blocking socket, see loop.h */
+ObjReader* newSocketReader(int fd);
+
+/* Reads one line from stdin for `input()`, returns false at the end of the input */
+bool readStdinLine(const char** line, int* length);
+
+/* The next line of stdin as a string, the same kind `readLine` makes. NULL at the end of the input. */
+ObjString* readStdinString();
+
+/* Releases the reader's buffer or mapping and closes its file */
+void freeReader(ObjReader* reader);
+
+/* Marks the stdin reader for the collector, it's kept around between uses */
+void markReaderRoots();
+
+#endif
@@ -4,30 +4,99 @@
 #include "common.h"
 #include "scanner.h"
 
+/*
+    The hot loops of the scanner (whitespace, comments and strings) look at a whole block of source at a time.
+    We use 32 byte blocks when the compiler is allowed to emit AVX2 (-mavx2 or -march=native), 16 byte blocks
+    with SSE2 which every x86-64 has, and fall back to a byte at a time everywhere else.
+
+    A block is only loaded while a whole one is left before the end of the source, the last few bytes are
+    looked at one at a time. So the scanner never reads past what it was given, whoever allocated it.
+*/
+#if defined(__AVX2__)
+#include <immintrin.h>
+#define BLOCK_SIZE 32
+typedef __m256i Block;
+
+static inline Block loadBlock(const char* at) { return _mm256_loadu_si256((const __m256i*)at); }
+
+/* One bit per byte of the block that equals `c` */
+static inline uint32_t matchByte(Block block, char c) {
+    return (uint32_t)_mm256_movemask_epi8(_mm256_cmpeq_epi8(block, _mm256_set1_epi8(c)));
+}
+#elif defined(__SSE2__)
+#include <emmintrin.h>
+#define BLOCK_SIZE 16
+typedef __m128i Block;
+
+static inline Block loadBlock(const char* at) { return _mm_loadu_si128((const __m128i*)at); }
+
+static inline uint32_t matchByte(Block block, char c) {
+    return (uint32_t)_mm_movemask_epi8(_mm_cmpeq_epi8(block, _mm_set1_epi8(c)));
+}
+#endif
+
+#ifdef BLOCK_SIZE
+#define BLOCK_BITS ((uint32_t)((1ull << BLOCK_SIZE) - 1))
+
+/* Bits of `mask` below `bit` */
+static inline uint32_t bitsBelow(uint32_t mask, int bit) { return mask & ((1u << bit) - 1); }
+#endif
+
 typedef struct {
     const char* start;   // marks the beginning of the current lexeme
     const char* current; // points to the current character being looked at
+    const char* end;     // the terminating '\0', no block is loaded past it
     int line;
 } Scanner;
 
-Scanner scanner;
+_Thread_local Scanner scanner;
+
+void initScanner(const char* source, size_t length) {
+    initScannerAt(source, length, 1);
+}
 
-void initScanner(const char* source) {
+void initScannerAt(const char* source, size_t length, int line) {
     scanner.start = source;
     scanner.current = source;
-    scanner.line = 1;
+    scanner.end = source + length;
+    scanner.line = line;
 }
 
-static bool isAlpha(char c) {
-    return (c >= 'a' && c <= 'z') ||
-           (c >= 'A' && c <= 'Z') ||
-           c == '_';
-}
+/* Character classes, so telling what a byte is takes one load instead of a chain of comparisons */
+#define CHAR_ALPHA 0x01
+#define CHAR_DIGIT 0x02
+#define CHAR_BLANK 0x04
+
+#define CLASS_OF(c) \
+    ((((c) >= 'a' && (c) <= 'z') || ((c) >= 'A' && (c) <= 'Z') || (c) == '_' ? CHAR_ALPHA : 0) | \
+     ((c) >= '0' && (c) <= '9' ? CHAR_DIGIT : 0) | \
+     ((c) == ' ' || (c) == '\t' || (c) == '\r' || (c) == '\n' ? CHAR_BLANK : 0))
+
+#define CLASS_ROW(c) \
+    CLASS_OF(c),      CLASS_OF(c + 1),  CLASS_OF(c + 2),  CLASS_OF(c + 3), \
+    CLASS_OF(c + 4),  CLASS_OF(c + 5),  CLASS_OF(c + 6),  CLASS_OF(c + 7), \
+    CLASS_OF(c + 8),  CLASS_OF(c + 9),  CLASS_OF(c + 10), CLASS_OF(c + 11), \
+    CLASS_OF(c + 12), CLASS_OF(c + 13), CLASS_OF(c + 14), CLASS_OF(c + 15)
+
+static const uint8_t charClass[256] = {
+    CLASS_ROW(0x00), CLASS_ROW(0x10), CLASS_ROW(0x20), CLASS_ROW(0x30),
+    CLASS_ROW(0x40), CLASS_ROW(0x50), CLASS_ROW(0x60), CLASS_ROW(0x70),
+    CLASS_ROW(0x80), CLASS_ROW(0x90), CLASS_ROW(0xA0), CLASS_ROW(0xB0),
+    CLASS_ROW(0xC0), CLASS_ROW(0xD0), CLASS_ROW(0xE0), CLASS_ROW(0xF0),
+};
+
+static inline bool hasClass(char c, uint8_t classes) { return (charClass[(uint8_t)c] & classes) != 0; }
+
+static bool isAlpha(char c) { return hasClass(c, CHAR_ALPHA); }
 
-static bool isDigit(char c) { return c >= '0' && c <= '9'; }
+static bool isDigit(char c) { return hasClass(c, CHAR_DIGIT); }
 
 static bool isAtEnd() { return *scanner.current == '\0'; }
 
+#ifdef BLOCK_SIZE
+static inline bool wholeBlockLeft() { return scanner.end - scanner.current >= BLOCK_SIZE; }
+#endif
+
 /* This is a Token constructor */
 static Token makeToken(TokenType type) {
     Token token;
@@ -35,6 +104,7 @@ static Token makeToken(TokenType type) {
     token.start = scanner.start;
     token.length = (int)(scanner.current - scanner.start);
     token.line = scanner.line;
+    token.hash = 0;
     return token;
 }
 
@@ -68,82 +138,123 @@ static Token errorToken(const char* message) {
     token.start = message;
     token.length = (int)strlen(message);
     token.line = scanner.line;
+    token.hash = 0;
     return token;
 }
 
+/* Skips spaces, tabs and newlines, counting the newlines as we go */
+static void skipBlanks() {
+    /* Most runs are a single space between two tokens, those aren't worth a block load */
+    while (hasClass(peek(), CHAR_BLANK)) {
+        if (peek() == '\n') ++scanner.line;
+        advance();
+        if (!hasClass(peek(), CHAR_BLANK)) return;
+#ifdef BLOCK_SIZE
+        /* A longer run, most likely indentation, so look at a block at a time */
+        while (wholeBlockLeft()) {
+            Block chars = loadBlock(scanner.current);
+            uint32_t newlines = matchByte(chars, '\n');
+            uint32_t blanks = matchByte(chars, ' ') | matchByte(chars, '\t') | matchByte(chars, '\r') | newlines;
+            uint32_t stops = ~blanks & BLOCK_BITS;
+
+            if (stops != 0) {
+                int stop = __builtin_ctz(stops);
+                scanner.line += __builtin_popcount(bitsBelow(newlines, stop));
+                scanner.current += stop;
+                return;
+            }
+            scanner.line += __builtin_popcount(newlines);
+            scanner.current += BLOCK_SIZE;
+        }
+#endif
+    }
+}
+
+/* Moves to the newline that ends a comment, or to the end of the source */
+static void skipToLineEnd() {
+#ifdef BLOCK_SIZE
+    while (wholeBlockLeft()) {
+        uint32_t stops = matchByte(loadBlock(scanner.current), '\n');
+        if (stops != 0) {
+            scanner.current += __builtin_ctz(stops);
+            return;
+        }
+        scanner.current += BLOCK_SIZE;
+    }
+#endif
+    while (peek() != '\n' && !isAtEnd()) advance();
+}
+
 /*
     This advances the scanner past any leading whitespace. After this call 
     returns, we know the very next character is a meaningful one
 */
 static void skipWhitespace() {
     for (;;) {
-        char c = peek();
-        switch (c) {
-            case ' ':
-            case '\r':
-            case '\t':
-                advance();
-                break;
-            case '\n':
-                ++scanner.line;
-                advance();
-                break;
-            case '/': /* skipping comments */
-                if (peekNext() == '/') {
-                    // A comment does untill the end of the line
-                    while (peek() != '\n' && !isAtEnd()) advance();
-                } else return;
-                break;
-            default: return;
-        }
+        skipBlanks();
+        /* skipping comments, a comment goes until the end of the line */
+        if (peek() == '/' && peekNext() == '/') {
+            skipToLineEnd();
+        } else return;
     }
 }
 
-static TokenType checkKeyword(int start, int length, const char* rest, TokenType type) {
-    if (scanner.current - scanner.start == start + length && memcmp(scanner.start + start, rest, length) == 0) 
-        return type;
-    return TOKEN_IDENTIFIER;
-}
+/*
+    Keywords are found with a perfect hash over the first and last character and the length, there are no
+    collisions between the keywords so it's a single table lookup and one compare.
+*/
+typedef struct {
+    const char* name;
+    int length;
+    TokenType type;
+} Keyword;
 
-static TokenType identifierType() { 
-    switch (scanner.start[0]) {
-        case 'a': return checkKeyword(1, 2, "nd", TOKEN_AND);
-        case 'c': return checkKeyword(1, 4, "lass", TOKEN_CLASS);
-        case 'e': return checkKeyword(1, 3, "lse", TOKEN_ELSE);
-        case 'f':
-            if (scanner.current - scanner.start > 1) {
-                switch (scanner.start[1]) {
-                    case 'a': return checkKeyword(2, 3, "lse", TOKEN_FALSE);
-                    case 'o': return checkKeyword(2, 1, "r", TOKEN_FOR);
-                    case 'u': return checkKeyword(2, 1, "n", TOKEN_FUN);
-                }
-            }
-            break;
-        case 'i': return checkKeyword(1, 1, "f", TOKEN_IF);
-        case 'n': return checkKeyword(1, 2, "il", TOKEN_NIL);
-        case 'o': return checkKeyword(1, 1, "r", TOKEN_OR);
-        case 'p': return checkKeyword(1, 4, "rint", TOKEN_PRINT);
-        case 'r': return checkKeyword(1, 5, "eturn", TOKEN_RETURN);
-        case 's': return checkKeyword(1, 4, "uper", TOKEN_SUPER);
-        case 't':
-            if (scanner.current - scanner.start > 1) {
-                switch (scanner.start[1]) {
-                    case 'h': return checkKeyword(2, 2, "is", TOKEN_THIS);
-                    case 'r': return checkKeyword(2, 2, "ue", TOKEN_TRUE);
-                }
-            }
-            break;
-        case 'v': return checkKeyword(1, 2, "ar", TOKEN_VAR);
-        case 'w': return checkKeyword(1, 4, "hile", TOKEN_WHILE);
-    }
+#define KEYWORD_SLOTS 64
+#define KEYWORD_MIN_LENGTH 2
+#define KEYWORD_MAX_LENGTH 6
+
+static const Keyword keywords[KEYWORD_SLOTS] = {
+    [1] = {"try", 3, TOKEN_TRY},
+    [8] = {"while", 5, TOKEN_WHILE},
+    [9] = {"false", 5, TOKEN_FALSE},
+    [13] = {"nil", 3, TOKEN_NIL},
+    [16] = {"return", 6, TOKEN_RETURN},
+    [17] = {"var", 3, TOKEN_VAR},
+    [21] = {"import", 6, TOKEN_IMPORT},
+    [25] = {"fun", 3, TOKEN_FUN},
+    [26] = {"true", 4, TOKEN_TRUE},
+    [33] = {"for", 3, TOKEN_FOR},
+    [34] = {"catch", 5, TOKEN_CATCH},
+    [36] = {"yield", 5, TOKEN_YIELD},
+    [38] = {"super", 5, TOKEN_SUPER},
+    [39] = {"or", 2, TOKEN_OR},
+    [53] = {"if", 2, TOKEN_IF},
+    [54] = {"this", 4, TOKEN_THIS},
+    [56] = {"class", 5, TOKEN_CLASS},
+    [57] = {"else", 4, TOKEN_ELSE},
+    [58] = {"and", 3, TOKEN_AND},
+    [61] = {"print", 5, TOKEN_PRINT},
+    [62] = {"resume", 6, TOKEN_RESUME},
+    [63] = {"throw", 5, TOKEN_THROW},
+};
+
+static TokenType identifierType() {
+    int length = (int)(scanner.current - scanner.start);
+    if (length < KEYWORD_MIN_LENGTH || length > KEYWORD_MAX_LENGTH) return TOKEN_IDENTIFIER;
+
+    uint8_t first = (uint8_t)scanner.start[0];
+    uint8_t last = (uint8_t)scanner.start[length - 1];
+    const Keyword* keyword = &keywords[(first * 15 + last * 2 + length) & (KEYWORD_SLOTS - 1)];
+
+    if (keyword->length == length && memcmp(scanner.start, keyword->name, length) == 0) return keyword->type;
     return TOKEN_IDENTIFIER;
-} 
+}
 
 /*
     After the first letter, we allow digits too, and we keep consuming alphanumerics until we run out of them.
 */
 static Token identifier() {
-    while (isAlpha(peek()) || isDigit(peek())) advance();
+    while (hasClass(peek(), CHAR_ALPHA | CHAR_DIGIT)) advance();
     return makeToken(identifierType());
 }
 
@@ -160,6 +271,23 @@ static Token number() {
 }
 
 static Token string() {
+#ifdef BLOCK_SIZE
+    /* Find the closing quote a block at a time, counting the newlines in between (supporting multi-line strings) */
+    while (wholeBlockLeft()) {
+        Block chars = loadBlock(scanner.current);
+        uint32_t newlines = matchByte(chars, '\n');
+        uint32_t stops = matchByte(chars, '"');
+
+        if (stops != 0) {
+            int stop = __builtin_ctz(stops);
+            scanner.line += __builtin_popcount(bitsBelow(newlines, stop));
+            scanner.current += stop;
+            break;
+        }
+        scanner.line += __builtin_popcount(newlines);
+        scanner.current += BLOCK_SIZE;
+    }
+#endif
     while (peek() != '"' && !isAtEnd()) {
         if (peek() == '\n') ++scanner.line; /* Tracking lines (supporting multi-line strings) */
         advance();
@@ -1,6 +1,8 @@
 #ifndef clox_scanner_h
 #define clox_scanner_h
 
+#include "common.h"
+
 /*
     This module implements the Scanner, also known as Lexer
 */
@@ -22,11 +24,11 @@ typedef enum {
     // Literals
     TOKEN_IDENTIFIER, TOKEN_STRING, TOKEN_NUMBER,
   
-    // Keywords (16 keywords)
-    TOKEN_AND, TOKEN_CLASS, TOKEN_ELSE, TOKEN_FALSE,
-    TOKEN_FOR, TOKEN_FUN, TOKEN_IF, TOKEN_NIL, TOKEN_OR,
-    TOKEN_PRINT, TOKEN_RETURN, TOKEN_SUPER, TOKEN_THIS,
-    TOKEN_TRUE, TOKEN_VAR, TOKEN_WHILE,
+    // Keywords (22 keywords)
+    TOKEN_AND, TOKEN_CATCH, TOKEN_CLASS, TOKEN_ELSE, TOKEN_FALSE,
+    TOKEN_FOR, TOKEN_FUN, TOKEN_IF, TOKEN_IMPORT, TOKEN_NIL, TOKEN_OR,
+    TOKEN_PRINT, TOKEN_RESUME, TOKEN_RETURN, TOKEN_SUPER, TOKEN_THIS,
+    TOKEN_THROW, TOKEN_TRUE, TOKEN_TRY, TOKEN_VAR, TOKEN_WHILE, TOKEN_YIELD,
 
     TOKEN_ERROR, TOKEN_EOF
 } TokenType;
@@ -36,9 +38,14 @@ typedef struct {
     const char* start;
     int length;
     int line;
+    uint32_t hash;  /* Hash of an identifier's name, the compiler fills it in once per token */
 } Token;
 
-void initScanner(const char* source);
+/* `length` is where the source's '\0' is, the scanner reads nothing past it */
+void initScanner(const char* source, size_t length);
+
+/* Starts scanning a piece of a larger file, `line` is the line the piece starts on */
+void initScannerAt(const char* source, size_t length, int line);
 Token scanToken();
 
 #endif
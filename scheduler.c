@@ -0,0 +1,409 @@
+#include <limits.h>
+#include <linux/futex.h>
+#include <pthread.h>
+#include <stdatomic.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+
+#include "channel.h"
+#include "gc.h"
+#include "memory.h"
+#include "message.h"
+#include "output.h"
+#include "scheduler.h"
+#include "thread.h"
+#include "vm.h"
+
+#define CACHE_LINE 64
+
+#define DEQUE_INITIAL_CAPACITY 64
+
+/* Every so many turns a worker picks up a new task before going on with its fibers, so new ones aren't starved */
+#define TASK_INTERVAL 8
+
+#define LOST_RACE ((Task*)-1)
+
+typedef struct Task {
+    Message* call;      /* The function, its arguments and the globals */
+    int argCount;
+    int valueCount;
+    struct Task* next;  /* Next in the shared queue */
+} Task;
+
+typedef struct Ring {
+    long capacity;
+    struct Ring* outgrown;  /* The ring this one replaced, thieves may still be reading it so it's kept */
+    _Atomic(Task*) tasks[];
+} Ring;
+
+/*
+    A Chase-Lev work-stealing deque of tasks. Unlike the worker pool's (see pool.c) tasks keep coming while it's
+    in use, so it grows: the owner copies everything into a ring twice the size and publishes that.
+*/
+typedef struct {
+    _Alignas(CACHE_LINE) atomic_long top;
+    _Alignas(CACHE_LINE) atomic_long bottom;
+    _Atomic(Ring*) ring;
+} Deque;
+
+typedef struct {
+    Deque deque;
+    int index;
+} Worker;
+
+/* A fiber waiting for a channel to change */
+typedef struct {
+    ObjFiber* fiber;
+    Channel* channel;
+    unsigned int changes;
+} Parked;
+
+/* The fibers a worker can run right away, first in first out */
+typedef struct {
+    ObjFiber** fibers;
+    int capacity;
+    int head;
+    int count;
+} FiberQueue;
+
+static struct {
+    pthread_mutex_t lock;       /* Guards starting up and the shared queue */
+    Task* head;
+    Task* tail;
+    atomic_int queued;          /* Tasks in the shared queue, so workers can look without the lock */
+    int size;
+    atomic_bool started;
+    Worker* workers;
+
+/*
+    Idle workers sleep on `activity`, an eventcount like the channels' (see channel.c). Anyone who makes work
+    bumps it when `sleepers` says somebody is asleep.
+*/
+    _Alignas(CACHE_LINE) atomic_uint activity;
+    atomic_int sleepers;
+} scheduler = {
+    .lock = PTHREAD_MUTEX_INITIALIZER,
+};
+
+/* The worker the current thread is, NULL everywhere else */
+static _Thread_local Worker* currentWorker = NULL;
+
+/* The fibers of the worker the current thread is. Not on the heap, so the collector gets them from here. */
+static _Thread_local struct {
+    FiberQueue ready;
+    Parked* parked;
+    int parkedCount;
+    int parkedCapacity;
+} fibers;
+
+/* What the fiber that just parked is waiting for, picked up by the worker once the fiber is back */
+static _Thread_local Channel* parkedOn;
+static _Thread_local unsigned int parkedChanges;
+
+static Ring* newRing(long capacity) {
+    Ring* ring = malloc(sizeof(Ring) + sizeof(_Atomic(Task*)) * capacity);
+    if (ring == NULL) exit(1);
+    ring->capacity = capacity;
+    ring->outgrown = NULL;
+    return ring;
+}
+
+static void pushTask(Deque* deque, Task* task) {
+    long bottom = atomic_load_explicit(&deque->bottom, memory_order_relaxed);
+    long top = atomic_load_explicit(&deque->top, memory_order_acquire);
+    Ring* ring = atomic_load_explicit(&deque->ring, memory_order_relaxed);
+
+    if (bottom - top > ring->capacity - 1) {
+        Ring* bigger = newRing(ring->capacity * 2);
+        for (long i = top; i < bottom; ++i) {
+            Task* moved = atomic_load_explicit(&ring->tasks[i & (ring->capacity - 1)], memory_order_relaxed);
+            atomic_store_explicit(&bigger->tasks[i & (bigger->capacity - 1)], moved, memory_order_relaxed);
+        }
+        bigger->outgrown = ring;
+        atomic_store_explicit(&deque->ring, bigger, memory_order_release);
+        ring = bigger;
+    }
+
+    atomic_store_explicit(&ring->tasks[bottom & (ring->capacity - 1)], task, memory_order_relaxed);
+    atomic_thread_fence(memory_order_release);
+    atomic_store_explicit(&deque->bottom, bottom + 1, memory_order_relaxed);
+}
+
+static Task* popTask(Deque* deque) {
+    long bottom = atomic_load_explicit(&deque->bottom, memory_order_relaxed) - 1;
+    Ring* ring = atomic_load_explicit(&deque->ring, memory_order_relaxed);
+    atomic_store_explicit(&deque->bottom, bottom, memory_order_relaxed);
+    atomic_thread_fence(memory_order_seq_cst);
+    long top = atomic_load_explicit(&deque->top, memory_order_relaxed);
+
+    if (top > bottom) {
+        atomic_store_explicit(&deque->bottom, bottom + 1, memory_order_relaxed);
+        return NULL;
+    }
+
+    Task* task = atomic_load_explicit(&ring->tasks[bottom & (ring->capacity - 1)], memory_order_relaxed);
+    if (top == bottom) {
+        /* The last one, a thief may be after it too */
+        if (!atomic_compare_exchange_strong_explicit(&deque->top, &top, top + 1,
+                                                     memory_order_seq_cst, memory_order_relaxed)) task = NULL;
+        atomic_store_explicit(&deque->bottom, bottom + 1, memory_order_relaxed);
+    }
+    return task;
+}
+
+static Task* stealTask(Deque* deque) {
+    long top = atomic_load_explicit(&deque->top, memory_order_acquire);
+    atomic_thread_fence(memory_order_seq_cst);
+    long bottom = atomic_load_explicit(&deque->bottom, memory_order_acquire);
+    if (top >= bottom) return NULL;
+
+    Ring* ring = atomic_load_explicit(&deque->ring, memory_order_acquire);
+    Task* task = atomic_load_explicit(&ring->tasks[top & (ring->capacity - 1)], memory_order_relaxed);
+    if (!atomic_compare_exchange_strong_explicit(&deque->top, &top, top + 1,
+                                                 memory_order_seq_cst, memory_order_relaxed)) return LOST_RACE;
+    return task;
+}
+
+static bool dequeEmpty(Deque* deque) {
+    return atomic_load(&deque->bottom) <= atomic_load(&deque->top);
+}
+
+static void wakeWorkers(int count) {
+    atomic_thread_fence(memory_order_seq_cst);
+    if (atomic_load_explicit(&scheduler.sleepers, memory_order_relaxed) == 0) return;
+    atomic_fetch_add(&scheduler.activity, 1);
+    syscall(SYS_futex, &scheduler.activity, FUTEX_WAKE_PRIVATE, count, NULL, NULL, 0);
+}
+
+void notifyScheduler() {
+    if (atomic_load_explicit(&scheduler.started, memory_order_relaxed)) wakeWorkers(INT_MAX);
+}
+
+bool canParkTask() {
+    return currentWorker != NULL && canPark();
+}
+
+void parkTask(Channel* channel, unsigned int changes) {
+    parkedOn = channel;
+    parkedChanges = changes;
+    parkFiber();
+}
+
+/* Our own tasks newest first, then the shared queue, then the oldest tasks of the others */
+static Task* nextTask(Worker* self) {
+    Task* task = popTask(&self->deque);
+    if (task != NULL) return task;
+
+    if (atomic_load(&scheduler.queued) > 0) {
+        pthread_mutex_lock(&scheduler.lock);
+        task = scheduler.head;
+        if (task != NULL) {
+            scheduler.head = task->next;
+            if (scheduler.head == NULL) scheduler.tail = NULL;
+            atomic_fetch_sub(&scheduler.queued, 1);
+        }
+        pthread_mutex_unlock(&scheduler.lock);
+        if (task != NULL) return task;
+    }
+
+    for (int i = 1; i < scheduler.size; ++i) {
+        Deque* victim = &scheduler.workers[(self->index + i) % scheduler.size].deque;
+        while ((task = stealTask(victim)) == LOST_RACE);
+        if (task != NULL) return task;
+    }
+    return NULL;
+}
+
+static bool hasTasks() {
+    if (atomic_load(&scheduler.queued) > 0) return true;
+    for (int i = 0; i < scheduler.size; ++i) {
+        if (!dequeEmpty(&scheduler.workers[i].deque)) return true;
+    }
+    return false;
+}
+
+/* Unpacks the task into our VM and puts it on a fiber of its own, the arguments go on the stack after the function */
+static ObjFiber* startTask(Task* task) {
+    int count = task->argCount + 1;
+    unpackCall(task->call, count, task->valueCount);
+    freeMessage(task->call);
+    free(task);
+
+    Value* values = vm.stackTop - count;
+    ObjFiber* fiber = newFiber(AS_CLOSURE(values[0]), count > FIBER_STACK ? count : FIBER_STACK, FIBER_FRAMES);
+    for (int i = 1; i < count; ++i) *fiber->stackTop++ = values[i];
+    vm.stackTop = values;
+    return fiber;
+}
+
+static void queueFiber(FiberQueue* queue, ObjFiber* fiber) {
+    if (queue->count == queue->capacity) {
+        int capacity = queue->capacity < 8 ? 8 : queue->capacity * 2;
+        ObjFiber** fibers = malloc(sizeof(ObjFiber*) * capacity);
+        if (fibers == NULL) exit(1);
+        for (int i = 0; i < queue->count; ++i) fibers[i] = queue->fibers[(queue->head + i) % queue->capacity];
+        free(queue->fibers);
+        queue->fibers = fibers;
+        queue->capacity = capacity;
+        queue->head = 0;
+    }
+    queue->fibers[(queue->head + queue->count++) % queue->capacity] = fiber;
+}
+
+static ObjFiber* nextFiber(FiberQueue* queue) {
+    if (queue->count == 0) return NULL;
+    ObjFiber* fiber = queue->fibers[queue->head];
+    queue->head = (queue->head + 1) % queue->capacity;
+    --queue->count;
+    return fiber;
+}
+
+/* Moves the parked fibers whose channel changed over to the queue, they make their call again */
+static int wakeParked(Parked* parked, int parkedCount, FiberQueue* ready) {
+    for (int i = 0; i < parkedCount; ) {
+        if (channelChanges(parked[i].channel) == parked[i].changes) {
+            ++i;
+            continue;
+        }
+        unwatchChannel(parked[i].channel);
+        releaseChannel(parked[i].channel);
+        queueFiber(ready, parked[i].fiber);
+        parked[i] = parked[--parkedCount];
+    }
+    return parkedCount;
+}
+
+static void sleepWorker(Parked* parked, int parkedCount) {
+    flushOutput();
+
+    atomic_fetch_add(&scheduler.sleepers, 1);
+    atomic_thread_fence(memory_order_seq_cst);
+    unsigned int activity = atomic_load(&scheduler.activity);
+
+    /* Whatever showed up before we counted ourselves in has to be caught here, nobody will wake us for it */
+    bool ready = hasTasks();
+    for (int i = 0; i < parkedCount && !ready; ++i) {
+        ready = channelChanges(parked[i].channel) != parked[i].changes;
+    }
+    if (!ready) syscall(SYS_futex, &scheduler.activity, FUTEX_WAIT_PRIVATE, activity, NULL, NULL, 0);
+
+    atomic_fetch_sub(&scheduler.sleepers, 1);
+}
+
+void markSchedulerRoots() {
+    FiberQueue* ready = &fibers.ready;
+    for (int i = 0; i < ready->count; ++i) markObject((Obj*)ready->fibers[(ready->head + i) % ready->capacity]);
+    for (int i = 0; i < fibers.parkedCount; ++i) markObject((Obj*)fibers.parked[i].fiber);
+}
+
+static void* runWorker(void* argument) {
+    Worker* self = argument;
+    currentWorker = self;
+    initVM();
+
+    unsigned long turn = 0;
+
+    for (;;) {
+        fibers.parkedCount = wakeParked(fibers.parked, fibers.parkedCount, &fibers.ready);
+
+        ObjFiber* fiber = NULL;
+        if (fibers.ready.count == 0 || ++turn % TASK_INTERVAL == 0) {
+            Task* task = nextTask(self);
+            if (task != NULL) fiber = startTask(task);
+        }
+        if (fiber == NULL) fiber = nextFiber(&fibers.ready);
+        if (fiber == NULL) {
+            sleepWorker(fibers.parked, fibers.parkedCount);
+            continue;
+        }
+
+        resumeFiber(fiber); /* A task that fails reports it and is done, the others carry on */
+
+        if (fiber->state == FIBER_SUSPENDED) {
+            queueFiber(&fibers.ready, fiber); /* It yielded to let the others run */
+        } else if (fiber->state == FIBER_PARKED) {
+            if (fibers.parkedCount == fibers.parkedCapacity) {
+                fibers.parkedCapacity = GROW_CAPACITY(fibers.parkedCapacity);
+                fibers.parked = realloc(fibers.parked, sizeof(Parked) * fibers.parkedCapacity);
+                if (fibers.parked == NULL) exit(1);
+            }
+            retainChannel(parkedOn);
+            fibers.parked[fibers.parkedCount++] = (Parked){fiber, parkedOn, parkedChanges};
+        }
+    }
+    return NULL;
+}
+
+void setSchedulerSize(int size) {
+    if (!atomic_load(&scheduler.started)) scheduler.size = size;
+}
+
+static bool startScheduler() {
+    if (atomic_load_explicit(&scheduler.started, memory_order_acquire)) return true;
+
+    pthread_mutex_lock(&scheduler.lock);
+    bool started = atomic_load(&scheduler.started);
+    if (!started) {
+        if (scheduler.size <= 0) scheduler.size = (int)sysconf(_SC_NPROCESSORS_ONLN);
+        if (scheduler.size <= 0) scheduler.size = 1;
+
+        scheduler.workers = aligned_alloc(CACHE_LINE, sizeof(Worker) * scheduler.size);
+        if (scheduler.workers == NULL) exit(1);
+        for (int i = 0; i < scheduler.size; ++i) {
+            Worker* worker = &scheduler.workers[i];
+            worker->index = i;
+            atomic_init(&worker->deque.top, 0);
+            atomic_init(&worker->deque.bottom, 0);
+            atomic_init(&worker->deque.ring, newRing(DEQUE_INITIAL_CAPACITY));
+        }
+
+        started = true;
+        for (int i = 0; i < scheduler.size && started; ++i) {
+            pthread_t id;
+            pthread_attr_t attributes;
+            pthread_attr_init(&attributes);
+            pthread_attr_setdetachstate(&attributes, PTHREAD_CREATE_DETACHED);
+            started = pthread_create(&id, &attributes, runWorker, &scheduler.workers[i]) == 0;
+            pthread_attr_destroy(&attributes);
+        }
+        atomic_store_explicit(&scheduler.started, started, memory_order_release);
+    }
+    pthread_mutex_unlock(&scheduler.lock);
+    return started;
+}
+
+static Value taskNative(int argCount, Value* args) {
+    if (argCount < 1 || !IS_CLOSURE(args[0])) return nativeError("task() expects a function and its arguments.");
+    if (!startScheduler()) return nativeError("Could not start the scheduler.");
+
+    Task* task = malloc(sizeof(Task));
+    if (task == NULL) exit(1);
+
+    const char* error;
+    task->call = packCall(args, argCount, &task->valueCount, &error);
+    if (task->call == NULL) {
+        free(task);
+        return nativeError("%s", error);
+    }
+    task->argCount = argCount - 1;
+    task->next = NULL;
+
+    if (currentWorker != NULL) {
+        pushTask(&currentWorker->deque, task);
+    } else {
+        pthread_mutex_lock(&scheduler.lock);
+        if (scheduler.tail != NULL) scheduler.tail->next = task;
+        else scheduler.head = task;
+        scheduler.tail = task;
+        atomic_fetch_add(&scheduler.queued, 1);
+        pthread_mutex_unlock(&scheduler.lock);
+    }
+    wakeWorkers(1);
+    return NIL_VAL;
+}
+
+void defineSchedulerNatives() {
+    defineNative("task", taskNative);
+}
@@ -0,0 +1,39 @@
+#ifndef clox_scheduler_h
+#define clox_scheduler_h
+
+/*
+    This module runs tasks, lots of small functions multiplexed onto a few OS threads:
+
+        fun handle(id, results) { send(results, id * 2); }
+        var results = channel();
+        for (var i = 0; i < 100000; i = i + 1) task(handle, i, results);
+
+    `task(function, args...)` queues a call and returns right away. Every worker thread runs a VM of its own and
+    each task runs on a fiber in the VM of the worker that picked it up. A task that waits on a channel parks its
+    fiber and the worker moves on to another one, so thousands of them can be blocked at the same time.
+
+    New tasks go onto the deque of the worker that made them, or a shared queue when the main script made them.
+    Idle workers steal from the others' deques. Only tasks that haven't started can move, since a fiber lives on
+    its worker's heap. Like with `spawn` the function, its arguments and the globals are copied.
+*/
+
+#include "object.h"
+
+/* The number of workers, it only takes effect before the first task. Defaults to the number of cores. */
+void setSchedulerSize(int size);
+
+/* Whether the running fiber is a task that can be parked, rather than blocking its worker */
+bool canParkTask();
+
+/* Parks the running task until `channel` changes from what `changes` says */
+void parkTask(Channel* channel, unsigned int changes);
+
+/* Wakes up idle workers, a channel some of their fibers may be parked on changed */
+void notifyScheduler();
+
+/* Marks the fibers of the current worker for the collector, the ready ones and the parked ones */
+void markSchedulerRoots();
+
+void defineSchedulerNatives();
+
+#endif
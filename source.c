@@ -0,0 +1,94 @@
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include "source.h"
+
+bool readSource(const char* path, Source* source) {
+    FILE* file = fopen(path, "rb");
+    if (file == NULL) {
+        fprintf(stderr, "Could not open file \"%s\".\n", path);
+        return false;
+    }
+
+    /* Figuring out the size of the file (in Bytes) */
+    fseek(file, 0L, SEEK_END);
+    size_t fileSize = ftell(file);
+    rewind(file);
+
+    /* Allocating memory for the file buffer */
+    char* buffer = (char*)malloc(fileSize + 1);
+    if (buffer == NULL) {
+        fprintf(stderr, "Not enough memory to read \"%s\".\n", path);
+        fclose(file);
+        return false;
+    }
+    size_t bytesRead = fread(buffer, sizeof(char), fileSize, file);
+    if (bytesRead < fileSize) {
+        fprintf(stderr, "Could not read file \"%s\".\n", path);
+        free(buffer);
+        fclose(file);
+        return false;
+    }
+    buffer[bytesRead] = '\0';
+    fclose(file);
+
+    source->chars = buffer;
+    source->length = bytesRead;
+    source->size = fileSize + 1;
+    source->mapped = false;
+    return true;
+}
+
+/*
+    The bytes between the end of a file and the end of its last page read as zeros, so most files come with
+    their '\0' for free. When the file fills its last page exactly we reserve one more page of anonymous
+    zeros first and map the file over the front of it.
+*/
+static bool mapSource(int fd, size_t length, Source* source) {
+    size_t page = (size_t)sysconf(_SC_PAGESIZE);
+    size_t size = (length / page + 1) * page;
+
+    char* base = mmap(NULL, size, PROT_READ, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (base == MAP_FAILED) return false;
+
+    if (mmap(base, length, PROT_READ, MAP_PRIVATE | MAP_FIXED, fd, 0) == MAP_FAILED) {
+        munmap(base, size);
+        return false;
+    }
+    madvise(base, length, MADV_SEQUENTIAL);
+
+    source->chars = base;
+    source->length = length;
+    source->size = size;
+    source->mapped = true;
+    return true;
+}
+
+bool loadSource(const char* path, Source* source) {
+    int fd = open(path, O_RDONLY);
+    if (fd < 0) {
+        fprintf(stderr, "Could not open file \"%s\".\n", path);
+        return false;
+    }
+
+    /* Pipes, devices and empty files go through read() */
+    struct stat info;
+    bool mapped = fstat(fd, &info) == 0 && S_ISREG(info.st_mode) && info.st_size > 0 &&
+                  mapSource(fd, (size_t)info.st_size, source);
+    close(fd);
+
+    return mapped || readSource(path, source);
+}
+
+void unloadSource(Source* source) {
+    if (source->mapped) {
+        munmap(source->chars, source->size);
+    } else {
+        free(source->chars);
+    }
+    source->chars = NULL;
+}
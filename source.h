@@ -0,0 +1,27 @@
+#ifndef clox_source_h
+#define clox_source_h
+
+/*
+    This module loads script files for the compiler. Regular files are mapped into memory instead of being
+    read into a copy, and the mapping always ends in a '\0' so the scanner sees the end of the source
+    the way it does for any other string.
+*/
+
+#include "common.h"
+
+typedef struct {
+    char* chars;    /* The source, followed by a '\0' */
+    size_t length;
+    size_t size;    /* How much we mapped or allocated */
+    bool mapped;
+} Source;
+
+/* Loads `path` into `source`, on failure it reports the problem on stderr and returns false */
+bool loadSource(const char* path, Source* source);
+
+/* The same, but always through read(), for files that can't be mapped */
+bool readSource(const char* path, Source* source);
+
+void unloadSource(Source* source);
+
+#endif
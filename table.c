@@ -2,6 +2,7 @@
 #include <stdlib.h>
 #include <string.h>
 
+#include "gc.h"
 #include "table.h"
 #include "memory.h"
 #include "value.h"
@@ -40,6 +41,10 @@ static Entry* findEntry(Entry* entries, int capacity, ObjString* key) {
         } else if (entry->key == key) {
             // We found the key.
             return entry;
+        } else if (entry->key->obj.frozen != key->obj.frozen && entry->key->hash == key->hash &&
+                   entry->key->length == key->length && memcmp(entry->key->chars, key->chars, key->length) == 0) {
+            // The same name interned by the VM and frozen, a frozen function's globals are the VM's too.
+            return entry;
         }
     index = (index + 1) % capacity;
   }
@@ -59,7 +64,8 @@ static void adjustCapacity(Table* table, int capacity) {
 
         Entry* dest = findEntry(entries, capacity, entry->key);
         dest->key = entry->key;
-        dest->value = dest->value;
+        dest->value = entry->value;
+        ++table->count; /* Tombstones aren't copied over, so we recount the live entries */
     }
     
     FREE_ARRAY(Entry, table->entries, table->capacity);
@@ -70,7 +76,12 @@ static void adjustCapacity(Table* table, int capacity) {
 bool tableSet(Table* table, ObjString* key, Value value) {
     /* We grow the array when it becomes at least 75% full */
     if (table->count + 1 > table->capacity * TABLE_MAX_LOAD) {
-        int capacity = GROW_CAPACITY(table->capacity);
+        /* When it's mostly tombstones, like the collector leaves in `vm.strings`, dropping them is enough */
+        int live = 0;
+        for (int i = 0; i < table->capacity; ++i) {
+            if (table->entries[i].key != NULL) ++live;
+        }
+        int capacity = live + 1 > table->capacity * TABLE_MAX_LOAD / 2 ? GROW_CAPACITY(table->capacity) : table->capacity;
         adjustCapacity(table, capacity);
     }
 
@@ -84,6 +95,14 @@ bool tableSet(Table* table, ObjString* key, Value value) {
     return isNewKey;
 }
 
+void tableClear(Table* table) {
+    for (int i = 0; i < table->capacity; ++i) {
+        table->entries[i].key = NULL;
+        table->entries[i].value = NIL_VAL;
+    }
+    table->count = 0;
+}
+
 bool tableDelete(Table* table, ObjString* key) {
     if (table->count == 0) return false;
 
@@ -131,3 +150,23 @@ ObjString* tableFindString(Table* table, const char* chars, int length, uint32_t
         index = (index + 1) % table->capacity;
     }
 }
+
+void markTable(Table* table) {
+    for (int i = 0; i < table->capacity; ++i) {
+        Entry* entry = &table->entries[i];
+        markObject((Obj*)entry->key);
+        markValue(entry->value);
+    }
+}
+
+void tableRemoveWhite(Table* table) {
+    for (int i = 0; i < table->capacity; ++i) {
+        Entry* entry = &table->entries[i];
+        if (entry->key == NULL || entry->key->obj.frozen) continue;
+        if (!atomic_load_explicit(&entry->key->obj.marked, memory_order_relaxed)) {
+            /* A tombstone, like `tableDelete` leaves */
+            entry->key = NULL;
+            entry->value = BOOL_VAL(true);
+        }
+    }
+}
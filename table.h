@@ -11,7 +11,7 @@ typedef struct {
     Value value;
 } Entry;
 
-typedef struct {
+typedef struct Table {
     int count;
     int capacity;
     Entry* entries;
@@ -32,6 +32,9 @@ bool tableGet(Table* table, ObjString* key, Value* value);
 */
 bool tableSet(Table* table, ObjString* key, Value value);
 
+/* Empties the table and keeps its capacity */
+void tableClear(Table* table);
+
 /*
     This function deletes an entry from the table
 */
@@ -43,4 +46,10 @@ bool tableDelete(Table* table, ObjString* key);
 void tableAddAll(Table* from, Table* to);
 ObjString* tableFindString(Table* table, const char* chars, int length, uint32_t hash);
 
+/* Marks the keys and values for the collector */
+void markTable(Table* table);
+
+/* Drops the entries whose key the collector didn't mark, `vm.strings` doesn't keep its strings alive */
+void tableRemoveWhite(Table* table);
+
 #endif
@@ -0,0 +1,165 @@
+#include <pthread.h>
+#include <stdatomic.h>
+#include <stdio.h>
+#include <stdlib.h>
+
+#include "memory.h"
+#include "message.h"
+#include "output.h"
+#include "thread.h"
+#include "vm.h"
+
+struct Thread {
+    atomic_int references;
+    pthread_mutex_t lock;
+    pthread_cond_t finished;
+    bool done;
+    bool failed;
+    Message* call;      /* The function, its arguments and then the globals, freed once the thread unpacked it */
+    int argCount;
+    int valueCount;
+    Message* result;
+};
+
+void retainThread(Thread* thread) {
+    atomic_fetch_add_explicit(&thread->references, 1, memory_order_relaxed);
+}
+
+void releaseThread(Thread* thread) {
+    if (atomic_fetch_sub_explicit(&thread->references, 1, memory_order_acq_rel) != 1) return;
+
+    if (thread->call != NULL) freeMessage(thread->call);
+    if (thread->result != NULL) freeMessage(thread->result);
+    pthread_mutex_destroy(&thread->lock);
+    pthread_cond_destroy(&thread->finished);
+    free(thread);
+}
+
+static void* runThread(void* argument) {
+    Thread* thread = argument;
+    initVM();
+
+    unpackCall(thread->call, thread->argCount + 1, thread->valueCount);
+    freeMessage(thread->call);
+    thread->call = NULL;
+
+    bool failed = callFunction(thread->argCount) != INTERPRET_OK;
+
+    Message* result = NULL;
+    if (!failed) {
+        const char* error;
+        Value value = pop();
+        result = packValues(&value, 1, &error);
+        if (result == NULL) {
+            fprintf(stderr, "%s\n", error);
+            failed = true;
+        }
+    }
+
+    flushOutput();
+    freeVM();
+
+    pthread_mutex_lock(&thread->lock);
+    thread->result = result;
+    thread->failed = failed;
+    thread->done = true;
+    pthread_cond_broadcast(&thread->finished);
+    pthread_mutex_unlock(&thread->lock);
+
+    releaseThread(thread);
+    return NULL;
+}
+
+Message* packCall(Value* values, int count, int* valueCount, const char** error) {
+    /*
+        The new VM starts out with a copy of our globals, so the function can call the others the script
+        declared. Natives it has already, and readers and fibers can't be copied.
+    */
+    int capacity = count + vm.globals.count * 2;
+    Value* all = ALLOCATE(Value, capacity);
+    *valueCount = 0;
+    for (int i = 0; i < count; ++i) all[(*valueCount)++] = values[i];
+    for (int i = 0; i < vm.globals.capacity; ++i) {
+        Entry* entry = &vm.globals.entries[i];
+        if (entry->key == NULL || IS_NATIVE(entry->value) || IS_READER(entry->value)
+            || IS_FIBER(entry->value)) continue;
+        all[(*valueCount)++] = OBJ_VAL(entry->key);
+        all[(*valueCount)++] = entry->value;
+    }
+
+    Message* message = packValues(all, *valueCount, error);
+    FREE_ARRAY(Value, all, capacity);
+    return message;
+}
+
+void unpackCall(Message* message, int count, int valueCount) {
+    Value* values = ALLOCATE(Value, valueCount);
+    unpackValues(message, values);
+
+    /* The globals come in name and value pairs after the call */
+    for (int i = count; i < valueCount; i += 2) {
+        tableSet(&vm.globals, AS_STRING(values[i]), values[i + 1]);
+    }
+    for (int i = 0; i < count; ++i) push(values[i]);
+    FREE_ARRAY(Value, values, valueCount);
+}
+
+static Value spawnNative(int argCount, Value* args) {
+    if (argCount < 1 || !(IS_CLOSURE(args[0]) || IS_NATIVE(args[0]))) {
+        return nativeError("spawn() expects a function and its arguments.");
+    }
+
+    int valueCount;
+    const char* error;
+    Message* call = packCall(args, argCount, &valueCount, &error);
+    if (call == NULL) return nativeError("%s", error);
+
+    Thread* thread = malloc(sizeof(Thread));
+    if (thread == NULL) exit(1);
+    atomic_init(&thread->references, 1); /* The running thread's own reference */
+    pthread_mutex_init(&thread->lock, NULL);
+    pthread_cond_init(&thread->finished, NULL);
+    thread->done = false;
+    thread->failed = false;
+    thread->call = call;
+    thread->argCount = argCount - 1;
+    thread->valueCount = valueCount;
+    thread->result = NULL;
+
+    /* Made before the thread starts, so it can't finish and free itself under us */
+    ObjThread* handle = newThreadHandle(thread);
+
+    pthread_t id;
+    pthread_attr_t attributes;
+    pthread_attr_init(&attributes);
+    pthread_attr_setdetachstate(&attributes, PTHREAD_CREATE_DETACHED);
+    int status = pthread_create(&id, &attributes, runThread, thread);
+    pthread_attr_destroy(&attributes);
+
+    if (status != 0) {
+        releaseThread(thread);
+        return nativeError("Could not start a thread.");
+    }
+    return OBJ_VAL(handle);
+}
+
+static Value joinNative(int argCount, Value* args) {
+    if (argCount != 1 || !IS_THREAD(args[0])) return nativeError("join() expects a thread.");
+    Thread* thread = AS_THREAD(args[0]);
+
+    pthread_mutex_lock(&thread->lock);
+    while (!thread->done) pthread_cond_wait(&thread->finished, &thread->lock);
+    pthread_mutex_unlock(&thread->lock);
+
+    if (thread->failed) return nativeError("The joined thread failed.");
+
+    /* The result stays packed, every join gets a copy of its own */
+    Value value;
+    unpackValues(thread->result, &value);
+    return value;
+}
+
+void defineThreadNatives() {
+    defineNative("spawn", spawnNative);
+    defineNative("join", joinNative);
+}
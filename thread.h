@@ -0,0 +1,31 @@
+#ifndef clox_thread_h
+#define clox_thread_h
+
+/*
+    This module implements `spawn(function, args...)`, which runs a function on a new OS thread, and
+    `join(thread)`, which waits for it and returns what it returned.
+
+    Every thread runs its own VM with its own heap, nothing on one VM's heap is ever reachable from another.
+    The function, its arguments and a snapshot of the globals are deep copied into the new VM, the result is
+    copied back on `join`. Changes to globals on either side aren't seen by the other.
+    Threads still running when the main script ends are cut off with it.
+*/
+
+#include "message.h"
+#include "object.h"
+
+/*
+    Packs `count` values, usually a function and its arguments, followed by a snapshot of the current
+    VM's globals. `valueCount` is set to the number of values in the message, see packValues for errors.
+*/
+Message* packCall(Value* values, int count, int* valueCount, const char** error);
+
+/* Defines the packed globals in the current VM and pushes the `count` values that came before them */
+void unpackCall(Message* message, int count, int valueCount);
+
+void retainThread(Thread* thread);
+void releaseThread(Thread* thread);
+
+void defineThreadNatives();
+
+#endif
@@ -2,6 +2,7 @@
 #include <string.h>
 
 #include "memory.h"
+#include "output.h"
 #include "value.h"
 #include "object.h"
 
@@ -28,9 +29,9 @@ void freeValueArray(ValueArray* array) {
 
 void printValue(Value value) { 
     switch (value.type) {
-        case VAL_BOOL:   printf(AS_BOOL(value) ? "true" : "false"); break;
-        case VAL_NIL:    printf("nil"); break;
-        case VAL_NUMBER: printf("%g", AS_NUMBER(value)); break;
+        case VAL_BOOL:   formatOutput(AS_BOOL(value) ? "true" : "false"); break;
+        case VAL_NIL:    writeOutput("nil", 3); break;
+        case VAL_NUMBER: writeNumber(AS_NUMBER(value)); break;
         case VAL_OBJ:    printObject(value); break;
     }
 }
@@ -41,7 +42,18 @@ bool valuesEqual(Value a, Value b) {
         case VAL_BOOL:      return AS_BOOL(a) == AS_BOOL(b);
         case VAL_NIL:       return true;
         case VAL_NUMBER:    return AS_NUMBER(a) == AS_NUMBER(b);
-        case VAL_OBJ:       return AS_OBJ(a) == AS_OBJ(b);
+        case VAL_OBJ: {
+            if (AS_OBJ(a) == AS_OBJ(b)) return true;
+            /*
+                Interned strings are equal only when they're the same object, lines from a reader aren't interned.
+                Frozen strings are interned too but in a table of their own, the VM's strings may have their twins.
+            */
+            if (!IS_STRING(a) || !IS_STRING(b)) return false;
+            ObjString* left = AS_STRING(a);
+            ObjString* right = AS_STRING(b);
+            if (left->interned && right->interned && left->obj.frozen == right->obj.frozen) return false;
+            return left->length == right->length && memcmp(left->chars, right->chars, left->length) == 0;
+        }
         default:            return false; // Unreachable
     }
 }
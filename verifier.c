@@ -0,0 +1,326 @@
+#include <stdio.h>
+#include <stdlib.h>
+
+#include "memory.h"
+#include "verifier.h"
+#include "vm.h"
+
+/* Everything we need to know about one instruction to follow it */
+typedef struct {
+    int length;     /* Size of the instruction including its operands */
+    int pops;       /* How many values it takes off the stack */
+    int pushes;     /* How many values it leaves on the stack */
+} Instruction;
+
+typedef struct {
+    ObjFunction* function;
+    Chunk* chunk;
+    int* depths;        /* Stack height on entry to every offset, -1 when we haven't reached it yet */
+    bool* starts;       /* Marks the offsets where an instruction begins */
+    int* worklist;
+    int worklistCount;
+} Verifier;
+
+static bool fail(Verifier* verifier, int offset, const char* message) {
+    ObjFunction* function = verifier->function;
+    fprintf(stderr, "Invalid bytecode in %s at offset %d: %s\n",
+            function->name != NULL ? function->name->chars : "<script>", offset, message);
+    return false;
+}
+
+/*
+    Decodes the instruction at `offset` into `instruction`. This only looks at the opcode and
+    the operand count, the operands themselves are checked once we know the stack height.
+*/
+static bool decode(Verifier* verifier, int offset, Instruction* instruction) {
+    Chunk* chunk = verifier->chunk;
+    instruction->length = 1;
+    instruction->pops = 0;
+    instruction->pushes = 0;
+
+    switch (chunk->code[offset]) {
+        case OP_NIL:
+        case OP_TRUE:
+        case OP_FALSE:
+            instruction->pushes = 1;
+            break;
+        case OP_POP:
+        case OP_PRINT:
+        case OP_CLOSE_UPVALUE:
+        case OP_RETURN:
+        case OP_THROW:
+            instruction->pops = 1;
+            break;
+        case OP_CONSTANT:
+        case OP_GET_LOCAL:
+        case OP_GET_GLOBAL:
+        case OP_GET_UPVALUE:
+            instruction->length = 2;
+            instruction->pushes = 1;
+            break;
+        case OP_SET_LOCAL:
+        case OP_SET_GLOBAL:
+        case OP_SET_UPVALUE:
+            /* These peek at the top of the stack without removing it */
+            instruction->length = 2;
+            instruction->pops = 1;
+            instruction->pushes = 1;
+            break;
+        case OP_DEFINE_GLOBAL:
+            instruction->length = 2;
+            instruction->pops = 1;
+            break;
+        case OP_IMPORT:
+            /* The module and what its body returned */
+            instruction->length = 2;
+            instruction->pushes = 2;
+            break;
+        case OP_GET_PROPERTY:
+            instruction->length = 2;
+            instruction->pops = 1;
+            instruction->pushes = 1;
+            break;
+        case OP_EQUAL:
+        case OP_GREATER:
+        case OP_LESS:
+        case OP_ADD:
+        case OP_SUBTRACT:
+        case OP_MULTIPLY:
+        case OP_DIVIDE:
+        case OP_INT_DIVIDE:
+        case OP_MODULUS:
+        case OP_GREATER_NN:
+        case OP_LESS_NN:
+        case OP_ADD_NN:
+        case OP_ADD_SS:
+        case OP_SUBTRACT_NN:
+        case OP_MULTIPLY_NN:
+        case OP_DIVIDE_NN:
+        case OP_RESUME:
+            instruction->pops = 2;
+            instruction->pushes = 1;
+            break;
+        case OP_NOT:
+        case OP_NEGATE:
+        case OP_YIELD:
+            instruction->pops = 1;
+            instruction->pushes = 1;
+            break;
+        case OP_JUMP:
+        case OP_LOOP:
+            instruction->length = 3;
+            break;
+        case OP_JUMP_IF_FALSE:
+            /* The condition stays on the stack, the compiler pops it on both paths */
+            instruction->length = 3;
+            instruction->pops = 1;
+            instruction->pushes = 1;
+            break;
+        case OP_CALL:
+            if (offset + 1 >= chunk->count) return fail(verifier, offset, "Truncated instruction.");
+            instruction->length = 2;
+            instruction->pops = chunk->code[offset + 1] + 1; /* The arguments and the callee */
+            instruction->pushes = 1;
+            break;
+        case OP_CLOSURE: {
+            if (offset + 1 >= chunk->count) return fail(verifier, offset, "Truncated instruction.");
+            uint8_t constant = chunk->code[offset + 1];
+            if (constant >= chunk->constants.count || !IS_FUNCTION(chunk->constants.values[constant])) {
+                return fail(verifier, offset, "Closure operand is not a function constant.");
+            }
+            ObjFunction* function = AS_FUNCTION(chunk->constants.values[constant]);
+            instruction->length = 2 + function->upvalueCount * 2;
+            instruction->pushes = 1;
+            break;
+        }
+        default:
+            return fail(verifier, offset, "Unknown opcode.");
+    }
+
+    if (offset + instruction->length > chunk->count) {
+        return fail(verifier, offset, "Truncated instruction.");
+    }
+    return true;
+}
+
+static bool isTerminator(uint8_t instruction) {
+    return instruction == OP_RETURN || instruction == OP_JUMP || instruction == OP_LOOP || instruction == OP_THROW;
+}
+
+/*
+    Records the stack height we arrive at `target` with. Every path into an instruction must agree on it,
+    otherwise the slots the compiler assigned to locals would be wrong on one of them.
+*/
+static bool reach(Verifier* verifier, int from, int target, int depth) {
+    if (target < 0 || target >= verifier->chunk->count || !verifier->starts[target]) {
+        return fail(verifier, from, "Jump into the middle of an instruction or out of the chunk.");
+    }
+
+    if (verifier->depths[target] == -1) {
+        verifier->depths[target] = depth;
+        verifier->worklist[verifier->worklistCount++] = target;
+        return true;
+    }
+
+    if (verifier->depths[target] != depth) {
+        return fail(verifier, from, "Inconsistent stack height at jump target.");
+    }
+    return true;
+}
+
+/* Checks the operands that index into the constants, the stack window or the upvalues */
+static bool checkOperands(Verifier* verifier, int offset, int depth) {
+    Chunk* chunk = verifier->chunk;
+    uint8_t* code = chunk->code;
+
+    switch (code[offset]) {
+        case OP_CONSTANT:
+            if (code[offset + 1] >= chunk->constants.count) {
+                return fail(verifier, offset, "Constant index out of range.");
+            }
+            break;
+        case OP_GET_GLOBAL:
+        case OP_SET_GLOBAL:
+        case OP_DEFINE_GLOBAL:
+            if (code[offset + 1] >= chunk->constants.count || !IS_STRING(chunk->constants.values[code[offset + 1]])) {
+                return fail(verifier, offset, "Global name is not a string constant.");
+            }
+            break;
+        case OP_IMPORT:
+        case OP_GET_PROPERTY:
+            if (code[offset + 1] >= chunk->constants.count || !IS_STRING(chunk->constants.values[code[offset + 1]])) {
+                return fail(verifier, offset, "Module path or name is not a string constant.");
+            }
+            break;
+        case OP_GET_LOCAL:
+        case OP_SET_LOCAL:
+            if (code[offset + 1] >= depth) {
+                return fail(verifier, offset, "Local slot out of range.");
+            }
+            break;
+        case OP_GET_UPVALUE:
+        case OP_SET_UPVALUE:
+            if (code[offset + 1] >= verifier->function->upvalueCount) {
+                return fail(verifier, offset, "Upvalue index out of range.");
+            }
+            break;
+        case OP_CLOSURE: {
+            ObjFunction* function = AS_FUNCTION(chunk->constants.values[code[offset + 1]]);
+            for (int i = 0; i < function->upvalueCount; ++i) {
+                uint8_t isLocal = code[offset + 2 + i * 2];
+                uint8_t index = code[offset + 3 + i * 2];
+
+                if (isLocal > 1) return fail(verifier, offset, "Malformed closure operand.");
+                if (isLocal && index >= depth) return fail(verifier, offset, "Captured local slot out of range.");
+                if (!isLocal && index >= verifier->function->upvalueCount) {
+                    return fail(verifier, offset, "Captured upvalue index out of range.");
+                }
+            }
+            break;
+        }
+    }
+    return true;
+}
+
+static bool verifyChunk(Verifier* verifier) {
+    Chunk* chunk = verifier->chunk;
+    Instruction instruction;
+
+    if (chunk->count == 0) return fail(verifier, 0, "Empty chunk.");
+
+    /* A linear pass first, so jumps can be checked against instruction boundaries */
+    for (int offset = 0; offset < chunk->count; offset += instruction.length) {
+        if (!decode(verifier, offset, &instruction)) return false;
+        verifier->starts[offset] = true;
+    }
+
+    /* Slot zero holds the callee, followed by the parameters */
+    int maxDepth = verifier->function->arity + 1;
+    if (!reach(verifier, 0, 0, maxDepth)) return false;
+
+    /* A catch block starts with the try's locals and the thrown value, whatever path threw */
+    for (int i = 0; i < chunk->handlerCount; ++i) {
+        Handler* handler = &chunk->handlers[i];
+        if (handler->start < 0 || handler->start > handler->end || handler->end > chunk->count ||
+            (handler->start < chunk->count && !verifier->starts[handler->start]) ||
+            (handler->end < chunk->count && !verifier->starts[handler->end])) {
+            return fail(verifier, handler->start, "Try block out of the chunk or in the middle of an instruction.");
+        }
+        if (handler->depth < 1 || handler->depth >= STACK_MAX) return fail(verifier, handler->start, "Bad try block height.");
+        if (!reach(verifier, handler->start, handler->handler, handler->depth + 1)) return false;
+        if (handler->depth + 1 > maxDepth) maxDepth = handler->depth + 1;
+    }
+
+    while (verifier->worklistCount > 0) {
+        int offset = verifier->worklist[--verifier->worklistCount];
+        int depth = verifier->depths[offset];
+        decode(verifier, offset, &instruction);
+
+        if (!checkOperands(verifier, offset, depth)) return false;
+
+        /* A throw cuts the stack back to the try's height, so nothing in the try may be below it */
+        for (int i = 0; i < chunk->handlerCount; ++i) {
+            Handler* handler = &chunk->handlers[i];
+            if (offset >= handler->start && offset < handler->end && depth < handler->depth) {
+                return fail(verifier, offset, "Stack below the height of its try block.");
+            }
+        }
+
+        /* Slot zero belongs to the VM, nothing is allowed to pop it */
+        if (depth - instruction.pops < 1) return fail(verifier, offset, "Stack underflow.");
+        depth += instruction.pushes - instruction.pops;
+        if (depth > maxDepth) maxDepth = depth;
+
+        uint8_t opcode = chunk->code[offset];
+        int next = offset + instruction.length;
+
+        if (opcode == OP_JUMP || opcode == OP_JUMP_IF_FALSE || opcode == OP_LOOP) {
+            int jump = (chunk->code[offset + 1] << 8) | chunk->code[offset + 2];
+            int target = opcode == OP_LOOP ? next - jump : next + jump;
+            if (!reach(verifier, offset, target, depth)) return false;
+        }
+
+        if (!isTerminator(opcode)) {
+            if (next >= chunk->count) return fail(verifier, offset, "Execution falls off the end of the chunk.");
+            if (!reach(verifier, offset, next, depth)) return false;
+        }
+    }
+
+    if (maxDepth > STACK_MAX) return fail(verifier, 0, "Function needs too much stack.");
+    verifier->function->maxStack = maxDepth;
+    return true;
+}
+
+bool verifyFunction(ObjFunction* function) {
+    /* A function that was already verified has its stack size set. Lazy ones get verified once they're compiled. */
+    if (function->maxStack > 0 || function->lazy != NULL) return true;
+
+    Chunk* chunk = &function->chunk;
+    Verifier verifier;
+    verifier.function = function;
+    verifier.chunk = chunk;
+    verifier.depths = ALLOCATE(int, chunk->count + 1);
+    verifier.starts = ALLOCATE(bool, chunk->count + 1);
+    verifier.worklist = ALLOCATE(int, chunk->count + 1);
+    verifier.worklistCount = 0;
+
+    for (int i = 0; i < chunk->count; ++i) {
+        verifier.depths[i] = -1;
+        verifier.starts[i] = false;
+    }
+
+    bool valid = verifyChunk(&verifier);
+
+    FREE_ARRAY(int, verifier.depths, chunk->count + 1);
+    FREE_ARRAY(bool, verifier.starts, chunk->count + 1);
+    FREE_ARRAY(int, verifier.worklist, chunk->count + 1);
+
+    if (!valid) return false;
+
+    /* Functions declared inside this one live in its constant table */
+    for (int i = 0; i < chunk->constants.count; ++i) {
+        Value constant = chunk->constants.values[i];
+        if (IS_FUNCTION(constant) && !verifyFunction(AS_FUNCTION(constant))) return false;
+    }
+    return true;
+}
@@ -0,0 +1,18 @@
+#ifndef clox_verifier_h
+#define clox_verifier_h
+
+/*
+    This module checks a function's bytecode before the VM runs it, so that `run()` never has to.
+    It walks every path through the chunk keeping track of the stack height and rejects anything that
+    would make the VM read or write outside of its stack window, its constants or its upvalues.
+*/
+
+#include "object.h"
+
+/*
+    Verifies `function` and every function nested in its constant table. On success each of them has its
+    `maxStack` filled in. On failure it reports the problem on stderr and returns false.
+*/
+bool verifyFunction(ObjFunction* function);
+
+#endif
@@ -1,16 +1,31 @@
+#include <limits.h>
 #include <stdio.h>
 #include <stdarg.h>
 #include <string.h>
 #include <stdlib.h>
 #include <time.h>
 
+#include "channel.h"
 #include "compiler.h"
+#include "counters.h"
 #include "vm.h"
 #include "debug.h"
+#include "frozen.h"
+#include "gc.h"
+#include "loop.h"
+#include "module.h"
+#include "number.h"
+#include "output.h"
+#include "pool.h"
+#include "reader.h"
+#include "scheduler.h"
+#include "thread.h"
+#include "verifier.h"
 
-VM vm;
+_Thread_local VM vm;
 
 static void runtimeError(const char* format, ...);
+static void closeUpvalues(Value* last);
 
 /*
     This native function returns the elapsed time since the program started running, in seconds.
@@ -20,57 +35,258 @@ static Value clockNative(int argCount, Value* args) {
 }
 
 static Value inputNative(int argCount, Value* args) {
-    char input[2048];
-    printf("%s", AS_CSTRING(args[0]));
-    fgets(input, sizeof(input), stdin);
-    ObjString* str = copyString(input, strlen(input));
-    return OBJ_VAL(str);
+    writeOutput(AS_CSTRING(args[0]), AS_STRING(args[0])->length);
+    flushOutput(); /* The prompt has to be out before we wait for an answer */
+
+    /* Shares the stdin reader, so lines of any length come through whole. At the end of the input we get "". */
+    const char* line = "";
+    int length = 0;
+    readStdinLine(&line, &length);
+    return OBJ_VAL(copyString(line, length));
+}
+
+/* The words after the script's path on the command line, shared by every thread */
+static int scriptArgumentCount = 0;
+static char** scriptArguments = NULL;
+
+void setScriptArguments(int count, char** arguments) {
+    scriptArgumentCount = count;
+    scriptArguments = arguments;
+}
+
+static Value argumentNative(int argCount, Value* args) {
+    if (argCount != 1 || !IS_NUMBER(args[0])) return nativeError("argument() expects a number.");
+    double index = AS_NUMBER(args[0]);
+    if (index < 0 || index >= scriptArgumentCount || index != (int)index) return NIL_VAL;
+    const char* argument = scriptArguments[(int)index];
+    return OBJ_VAL(copyString(argument, (int)strlen(argument)));
 }
 
 static Value numNative(int argCount, Value* args) {
-    char* ptr;
-    double number = strtod(AS_CSTRING(args[0]), &ptr);
+    ObjString* string = AS_STRING(args[0]);
+    if (string->ownsChars) return NUMBER_VAL(parseNumber(string->chars, NULL));
+
+    /* A slice of a file has no terminator, the parser needs one */
+    char* chars = ALLOCATE(char, string->length + 1);
+    memcpy(chars, string->chars, string->length);
+    chars[string->length] = '\0';
+    double number = parseNumber(chars, NULL);
+    FREE_ARRAY(char, chars, string->length + 1);
     return NUMBER_VAL(number);
 }
 
+/* Writes the stack registers back into the running fiber */
+static void saveFiber() {
+    vm.fiber->frameCount = vm.frameCount;
+    vm.fiber->stackTop = vm.stackTop;
+    vm.fiber->openUpvalues = vm.openUpvalues;
+}
+
+/* Tells the counters which function runs now, whenever that changes other than by a call */
+static void countTopFrame() {
+    if (countingCalls) switchCounters(vm.frameCount > 0 ? vm.frames[vm.frameCount - 1].closure->function : NULL);
+}
+
+static void loadFiber(ObjFiber* fiber) {
+    vm.fiber = fiber;
+    vm.frames = fiber->frames;
+    vm.frameCount = fiber->frameCount;
+    vm.stack = fiber->stack;
+    vm.stackTop = fiber->stackTop;
+    vm.openUpvalues = fiber->openUpvalues;
+    countTopFrame();
+}
+
+static void switchFiber(ObjFiber* fiber) {
+    saveFiber();
+    loadFiber(fiber);
+}
+
+static Value fiberNative(int argCount, Value* args) {
+    if (argCount != 1 || !IS_CLOSURE(args[0])) return nativeError("fiber() expects a function.");
+    return OBJ_VAL(newFiber(AS_CLOSURE(args[0]), FIBER_STACK, FIBER_FRAMES));
+}
+
+static Value isDoneNative(int argCount, Value* args) {
+    if (argCount != 1 || !IS_FIBER(args[0])) return nativeError("isDone() expects a fiber.");
+    return BOOL_VAL(AS_FIBER(args[0])->state == FIBER_DONE);
+}
+
+/* Hands control back to the fiber that resumed the running one, `value` is what its `resume` evaluates to */
+static void leaveFiber(FiberState state, Value value) {
+    ObjFiber* fiber = vm.fiber;
+    ObjFiber* caller = fiber->caller;
+    fiber->caller = NULL;
+    fiber->state = state;
+    switchFiber(caller);
+    push(value);
+}
+
 static void resetStack() { 
-    vm.stackTop = vm.stack;
-    vm.frameCount = 0;
-    vm.openUpvalues = NULL;
+    /* An error unwinds the running fiber and every fiber waiting on it, none of them can be resumed again */
+    for (ObjFiber* fiber = vm.fiber; fiber != NULL && fiber != vm.mainFiber; ) {
+        ObjFiber* caller = fiber->caller;
+        fiber->state = FIBER_DONE;
+        fiber->caller = NULL;
+        fiber = caller;
+    }
+
+    ObjFiber* main = vm.mainFiber;
+    main->stackTop = main->stack;
+    main->frameCount = 0;
+    main->openUpvalues = NULL;
+    loadFiber(main);
 }
 
+/*
+    Finds the try block a throw lands in: the innermost one around the instruction each frame is at, going out
+    through the frames and then the fibers that resumed the one that threw. It doesn't go past where the running
+    `execute` started, the frames below belong to whatever called it. Nothing changes until one is found, so an
+    error nobody catches still has the whole stack for its trace.
+*/
+static Handler* findCatch(ObjFiber** fiberOut, int* frameOut) {
+    if (vm.catchDepth != vm.runDepth) return NULL;
+
+    saveFiber();
+    ObjFiber* fiber = vm.fiber;
+    int frameCount = fiber->frameCount;
+    for (;;) {
+        if (fiber == vm.catchFiber && frameCount == vm.catchFrame) return NULL;
+        if (frameCount == 0) {
+            fiber = fiber->caller;
+            if (fiber == NULL) return NULL;
+            frameCount = fiber->frameCount;
+            continue;
+        }
+
+        CallFrame* frame = &fiber->frames[frameCount - 1];
+        Chunk* chunk = &frame->closure->function->chunk;
+        int offset = (int)(frame->ip - chunk->code) - 1;
+        for (int i = 0; i < chunk->handlerCount; ++i) {
+            Handler* handler = &chunk->handlers[i];
+            if (offset >= handler->start && offset < handler->end) {
+                *fiberOut = fiber;
+                *frameOut = frameCount;
+                return handler;
+            }
+        }
+        --frameCount;
+    }
+}
+
+/* Unwinds to the frame `findCatch` found and starts its catch block with `exception` on top */
+static void catchAt(ObjFiber* fiber, int frameCount, Handler* handler, Value exception) {
+    /* The fibers the throw went out of are finished, like an error nobody catches finishes them */
+    while (vm.fiber != fiber) {
+        closeUpvalues(vm.stack);
+        ObjFiber* caller = vm.fiber->caller;
+        vm.fiber->caller = NULL;
+        vm.fiber->state = FIBER_DONE;
+        switchFiber(caller);
+    }
+
+    vm.frameCount = frameCount;
+    countTopFrame();
+    CallFrame* frame = &vm.frames[frameCount - 1];
+    closeUpvalues(frame->slots + handler->depth);
+    vm.stackTop = frame->slots + handler->depth;
+    push(exception);
+    frame->ip = frame->closure->function->chunk.code + handler->handler;
+    vm.parked = false;
+    vm.caught = true;
+}
+
+/* Throws what a `throw` statement evaluated to */
+static void throwValue(Value value) {
+    ObjFiber* fiber;
+    int frameCount;
+    Handler* handler = findCatch(&fiber, &frameCount);
+    if (handler != NULL) {
+        catchAt(fiber, frameCount, handler, value);
+        return;
+    }
+
+    /* Nobody caught it, it ends the script like any runtime error */
+    if (IS_STRING(value)) {
+        /* Lines from a mapped reader are slices of the file with no NUL after them */
+        ObjString* string = AS_STRING(value);
+        runtimeError("%.*s", string->length, string->chars);
+    } else if (IS_NUMBER(value)) {
+        char number[NUMBER_BUFFER_SIZE];
+        formatNumber(AS_NUMBER(value), number);
+        runtimeError("Uncaught %s.", number);
+    } else if (IS_BOOL(value)) {
+        runtimeError("Uncaught %s.", AS_BOOL(value) ? "true" : "false");
+    } else if (IS_NIL(value)) {
+        runtimeError("Uncaught nil.");
+    } else {
+        runtimeError("Uncaught exception.");
+    }
+}
+
+/*
+    Runtime errors are thrown like a `throw` of their message. Only when nothing catches it does the message go
+    to stderr, with the trace.
+*/
 static void runtimeError(const char* format, ...) {
     va_list args;
+    ObjFiber* fiber;
+    int frameCount;
+    Handler* handler = findCatch(&fiber, &frameCount);
+    if (handler != NULL) {
+        char message[512];
+        va_start(args, format);
+        vsnprintf(message, sizeof(message), format, args);
+        va_end(args);
+        catchAt(fiber, frameCount, handler, OBJ_VAL(copyString(message, (int)strlen(message))));
+        return;
+    }
+
+    flushOutput(); /* So what the script printed comes before the error */
+
     va_start(args, format);
     vfprintf(stderr, format, args);
     va_end(args);
     fputs("\n", stderr);
     
 /*
-    Implementing stack traces that print out each function that was still executing when the program died
+    Implementing stack traces that print out each function that was still executing when the program died,
+    through the fibers that were waiting on the one that failed
 */
-    for (int i = vm.frameCount - 1; i >= 0; --i) {
-        CallFrame* frame = &vm.frames[i];
-        ObjFunction* function = frame->closure->function;
-        
-        size_t instruction = frame->ip - function->chunk.code - 1;
-        fprintf(stderr, "[line %d] in ", function->chunk.lines[instruction]);
-        
-        if (function->name == NULL) {
-            fprintf(stderr, "script\n");
-        } else {
-            fprintf(stderr, "%s()\n", function->name->chars);
+    saveFiber();
+    for (ObjFiber* fiber = vm.fiber; fiber != NULL; fiber = fiber->caller) {
+        for (int i = fiber->frameCount - 1; i >= 0; --i) {
+            CallFrame* frame = &fiber->frames[i];
+            ObjFunction* function = frame->closure->function;
+            
+            size_t instruction = frame->ip - function->chunk.code - 1;
+            fprintf(stderr, "[line %d] in ", function->chunk.lines[instruction]);
+            
+            if (function->name == NULL) {
+                fprintf(stderr, "script\n");
+            } else {
+                fprintf(stderr, "%s()\n", function->name->chars);
+            }
         }
     }
 
     resetStack();
 }
 
+Value nativeError(const char* format, ...) {
+    va_list args;
+    va_start(args, format);
+    vsnprintf(vm.nativeError, sizeof(vm.nativeError), format, args);
+    va_end(args);
+    vm.nativeFailed = true;
+    return NIL_VAL;
+}
+
 /*
     This is a helper to define a new native function exposed to the users of the language
     It takes a pointer to a C function and a name it will be known as in the language.
 */
-static void defineNative(const char* name, NativeFn function) {
+void defineNative(const char* name, NativeFn function) {
     push(OBJ_VAL(copyString(name, (int)strlen(name))));
     push(OBJ_VAL(newNative(function)));
     tableSet(&vm.globals, AS_STRING(vm.stack[0]), vm.stack[1]);
@@ -78,22 +294,102 @@ static void defineNative(const char* name, NativeFn function) {
     pop();
 }
 
+/* What `initVM` gives a new VM, set through `setHeapLimit` */
+static size_t defaultHeapLimit = SIZE_MAX;
+
+void setHeapLimit(size_t bytes) {
+    defaultHeapLimit = bytes > 0 ? bytes : SIZE_MAX;
+    vm.heapLimit = defaultHeapLimit;
+    if (vm.nextGC > vm.heapLimit) vm.nextGC = vm.heapLimit;
+}
+
 void initVM() {
+    initOutput();
+    vm.pages = NULL;
+    vm.pageCount = 0;
+    vm.pageCapacity = 0;
+    vm.fillingPage = 0;
+    vm.fibers = NULL;
+    vm.bytesAllocated = 0;
+    vm.heapLimit = defaultHeapLimit;
+    vm.nextGC = GC_MIN_HEAP < vm.heapLimit ? GC_MIN_HEAP : vm.heapLimit;
+    vm.outOfMemory = false;
+    vm.reserve = malloc(MEMORY_RESERVE);
+    vm.fiber = NULL;
+    vm.mainFiber = newFiber(NULL, STACK_MAX, FRAMES_MAX);
+    vm.runDepth = 0;
+    vm.catchFiber = NULL;
+    vm.catchFrame = 0;
+    vm.catchDepth = -1;
+    vm.caught = false;
     resetStack();
-    vm.objects = NULL;
+    vm.nativeFailed = false;
+    vm.parked = false;
+    vm.budget = 0;
+    vm.fuel = LONG_MAX;
+    atomic_init(&vm.interrupted, false);
+    vm.yieldable = false;
+    vm.suspended = false;
     initTable(&vm.globals);
     initTable(&vm.strings);
+    initTable(&vm.modules);
 
     /* Using the `defineNative` helper interface to define a new native function */
     defineNative("clock", clockNative); 
     defineNative("input", inputNative);
     defineNative("num", numNative);
+    defineNative("argument", argumentNative);
+    defineNative("fiber", fiberNative);
+    defineNative("isDone", isDoneNative);
+    defineReaderNatives();
+    defineChannelNatives();
+    defineThreadNatives();
+    definePoolNatives();
+    defineSchedulerNatives();
+    defineLoopNatives();
+    defineFrozenNatives();
+
+    initTable(&vm.checkpointGlobals);
+    initTable(&vm.checkpointModules);
+    checkpointVM();
+}
+
+void checkpointVM() {
+    tableClear(&vm.checkpointGlobals);
+    tableAddAll(&vm.globals, &vm.checkpointGlobals);
+    tableClear(&vm.checkpointModules);
+    tableAddAll(&vm.modules, &vm.checkpointModules);
+}
+
+void resetVM() {
+    resetStack();
+    vm.suspended = false;
+    vm.fuel = vm.budget > 0 ? vm.budget : LONG_MAX;
+    atomic_store(&vm.interrupted, false);
+    vm.runDepth = 0;
+    vm.nativeFailed = false;
+    vm.parked = false;
+
+    tableClear(&vm.globals);
+    tableAddAll(&vm.checkpointGlobals, &vm.globals);
+    tableClear(&vm.modules);
+    tableAddAll(&vm.checkpointModules, &vm.modules);
+
+    /* Nothing but the checkpoint is reachable now */
+    collectGarbage();
 }
 
 void freeVM() {
     freeTable(&vm.globals);
     freeTable(&vm.strings);
+    freeTable(&vm.modules);
+    freeTable(&vm.checkpointGlobals);
+    freeTable(&vm.checkpointModules);
     freeObjects();
+    releaseHeldFrozen();
+    free(vm.reserve);
+    vm.reserve = NULL;
+    freeOutput();
 }
 
 void push(Value value) {
@@ -110,6 +406,61 @@ static Value peek(int distance) {
     return vm.stackTop[-1 - distance];
 }
 
+/* A lazily compiled function gets its body on the first call */
+static bool ensureCompiled(ObjFunction* function) {
+    if (function->lazy == NULL) return true;
+
+    /* Compiling a body on its first call is compile time, not time the caller ran */
+    CounterPhase phase = setCounterPhase(PHASE_COMPILE);
+    bool compiled = compileLazy(function) && verifyFunction(function);
+    setCounterPhase(phase);
+    if (!compiled) {
+        runtimeError("Could not compile '%s'.", function->name->chars);
+        return false;
+    }
+    return true;
+}
+
+static bool growFrames() {
+    ObjFiber* fiber = vm.fiber;
+    if (fiber->frameCapacity == FRAMES_MAX) return false;
+
+    int capacity = fiber->frameCapacity * 2 < FRAMES_MAX ? fiber->frameCapacity * 2 : FRAMES_MAX;
+    fiber->frames = GROW_ARRAY(CallFrame, fiber->frames, fiber->frameCapacity, capacity);
+    fiber->frameCapacity = capacity;
+    vm.frames = fiber->frames;
+    return true;
+}
+
+/*
+    Moving the stack leaves everything that points into it behind: the frames' windows, the open upvalues and
+    the top. They all get rebased onto the new array. Only `call()` grows the stack, and everyone who holds on
+    to a frame pointer across a call picks it up again from `vm.frames` afterwards.
+*/
+static bool growStack(int needed) {
+    ObjFiber* fiber = vm.fiber;
+    if (needed > STACK_MAX) return false;
+
+    int capacity = fiber->stackCapacity;
+    while (capacity < needed) capacity *= 2;
+    if (capacity > STACK_MAX) capacity = STACK_MAX;
+
+    Value* old = fiber->stack;
+    Value* stack = GROW_ARRAY(Value, old, fiber->stackCapacity, capacity);
+    for (int i = 0; i < vm.frameCount; ++i) {
+        vm.frames[i].slots = stack + (vm.frames[i].slots - old);
+    }
+    for (ObjUpvalue* upvalue = vm.openUpvalues; upvalue != NULL; upvalue = upvalue->next) {
+        upvalue->location = stack + (upvalue->location - old);
+    }
+    vm.stackTop = stack + (vm.stackTop - old);
+
+    fiber->stack = stack;
+    fiber->stackCapacity = capacity;
+    vm.stack = stack;
+    return true;
+}
+
 static bool call(ObjClosure* closure, int argCount) {
 /*
     This simply initializes the next CallFrame on the stack. It stores a pointer to the function being called 
@@ -118,14 +469,26 @@ static bool call(ObjClosure* closure, int argCount) {
     Finally, it sets up the slots pointer to give the frame its window into the stack
 */
 
+    if (!ensureCompiled(closure->function)) return false;
+
     /* Handling error of passing too many or too less arguments */
     if (argCount != closure->function->arity) {
         runtimeError("Expected %d arguments but got %d.", closure->function->arity, argCount);
         return false;
     }
     
-    /* There’s another error we need to report.  Because the CallFrame array has a fixed size, we need to ensure a deep call chain doesn’t overflow */
-    if (vm.frameCount == FRAMES_MAX) {
+    /* There’s another error we need to report. Fibers only grow so far, we need to ensure a deep call chain doesn’t overflow */
+    if (vm.frameCount == vm.fiber->frameCapacity && !growFrames()) {
+        runtimeError("Stack overflow.");
+        return false;
+    }
+
+/*
+    The verifier worked out how many slots the function can ever use, so this one check 
+    covers every push the function makes and `push()` itself never has to look.
+*/
+    int needed = (int)(vm.stackTop - vm.stack) - argCount - 1 + closure->function->maxStack;
+    if (needed > vm.fiber->stackCapacity && !growStack(needed)) {
         runtimeError("Stack overflow.");
         return false;
     }
@@ -134,9 +497,76 @@ static bool call(ObjClosure* closure, int argCount) {
     frame->closure = closure;
     frame->ip = closure->function->chunk.code;
     frame->slots = vm.stackTop - argCount - 1; /* The `-1` is to account for stack slot zero which the compiler set aside for when we add methods later. */
+    frame->globals = closure->module != NULL ? &closure->module->globals : &vm.globals;
+    if (countingCalls) switchCounters(closure->function);
     return true;
 }
 
+/*
+    The safepoints come right after the instructions that allocate, closures, concatenation and native calls.
+    Whatever they made is on the stack by then, where the collector looks for it. A safepoint that can't get the
+    heap back under its limit fails, and so does the instruction.
+*/
+#ifdef DEBUG_STRESS_GC
+#define SAFEPOINT() reclaim()
+#else
+#define SAFEPOINT() (vm.bytesAllocated <= vm.nextGC || reclaim())
+#endif
+
+static void outOfMemory() {
+    if (vm.outOfMemory || vm.bytesAllocated <= vm.heapLimit) runtimeError("Out of memory.");
+    else runtimeError("Out of memory, the heap is past its limit of %zu bytes.", vm.heapLimit);
+
+    /* Until the next collection what the script left behind still counts, which is right away */
+    vm.nextGC = 0;
+    if (vm.reserve == NULL) vm.reserve = malloc(MEMORY_RESERVE);
+    vm.outOfMemory = vm.reserve == NULL;
+}
+
+/* Collects, then fails with a runtime error if the heap is still past its limit or malloc failed */
+static bool reclaim() {
+    collectGarbage();
+    if (vm.bytesAllocated <= vm.heapLimit && !vm.outOfMemory) return true;
+    outOfMemory();
+    return false;
+}
+
+/* Whether `bytes` more fit under the limit, for an instruction about to make something big. Collects if they don't. */
+static bool makeRoom(size_t bytes) {
+    if (vm.bytesAllocated + bytes <= vm.heapLimit) return true;
+    collectGarbage(); /* What the instruction works on is still on the stack */
+    if (vm.bytesAllocated + bytes <= vm.heapLimit) return true;
+    runtimeError("Out of memory, the heap would go past its limit of %zu bytes.", vm.heapLimit);
+    return false;
+}
+
+/*
+    Checked at every backward jump and every call, it costs a decrement and a load. `outOfFuel` decides whether
+    the script really stops there.
+*/
+#define CHECK_BUDGET() \
+    (--vm.fuel <= 0 || atomic_load_explicit(&vm.interrupted, memory_order_relaxed))
+
+static bool outOfFuel() {
+    if (!vm.yieldable || vm.runDepth != 1) {
+        /* A native is in between, we look again at every loop and call until we're back in the script */
+        if (vm.fuel < 0) vm.fuel = 0;
+        return false;
+    }
+    vm.fuel = vm.budget > 0 ? vm.budget : LONG_MAX;
+    atomic_store_explicit(&vm.interrupted, false, memory_order_relaxed);
+    return true;
+}
+
+void setBudget(long budget) {
+    vm.budget = budget > 0 ? budget : 0;
+    vm.fuel = vm.budget > 0 ? vm.budget : LONG_MAX;
+}
+
+void interruptVM(VM* target) {
+    atomic_store(&target->interrupted, true);
+}
+
 static bool callValue(Value callee, int argCount) {
     if (IS_OBJ(callee)) {
         switch (OBJ_TYPE(callee)) {
@@ -149,9 +579,15 @@ static bool callValue(Value callee, int argCount) {
             */
                 NativeFn native = AS_NATIVE(callee);
                 Value result = native(argCount, vm.stackTop - argCount);
+                if (vm.nativeFailed) {
+                    vm.nativeFailed = false;
+                    runtimeError("%s", vm.nativeError);
+                    return false;
+                }
+                if (vm.parked) return true; /* The callee and the arguments stay for the retry */
                 vm.stackTop -= argCount + 1;
                 push(result);
-                return true;
+                return SAFEPOINT();
             }
             default:
                 break; /* Non-callable object type. */
@@ -201,18 +637,31 @@ static bool isFalsey(Value value) {
     return IS_NIL(value) || (IS_BOOL(value) && !AS_BOOL(value));
 }
 
-static void concatenate() {
-    ObjString* b = AS_STRING(pop());
-    ObjString* a = AS_STRING(pop());
+static bool concatenate() {
+    ObjString* b = AS_STRING(peek(0));
+    ObjString* a = AS_STRING(peek(1));
 
-    int length = a->length + b->length;
-    char* chars = ALLOCATE(char, length);
+    size_t length = (size_t)a->length + b->length;
+    if (length >= INT_MAX) {
+        runtimeError("The string would be too long.");
+        return false;
+    }
+    if (!makeRoom(length + 1)) return false;
+
+    /* The one allocation a script can make as big as it likes, so it fails softly */
+    char* chars = tryReallocate(NULL, 0, length + 1);
+    if (chars == NULL) {
+        outOfMemory();
+        return false;
+    }
     memcpy(chars, a->chars, a->length);
     memcpy(chars + a->length, b->chars, b->length);
     chars[length] = '\0';
+    vm.stackTop -= 2;
 
     ObjString* result = takeString(chars, length);
     push(OBJ_VAL(result));
+    return SAFEPOINT();
 }
 
 static InterpretResult modulus() {
@@ -239,7 +688,12 @@ static InterpretResult intDivison() {
     return INTERPRET_OK;
 }
 
-static InterpretResult run() {
+/*
+    Runs until the frame count of `baseFiber` drops back to `baseFrame`, which is zero for a whole script and the
+    caller's frame count for a call from C. The value the last frame returned is left on top of the stack.
+    Other fibers may run in between, when C resumes a fiber that's all that runs until control is back.
+*/
+static InterpretResult dispatch(ObjFiber* baseFiber, int baseFrame) {
     CallFrame* frame = &vm.frames[vm.frameCount - 1];
 
 #define READ_BYTE() (*frame->ip++) // This macro reads the byte currently pointed at by the instruction pointer and then it increments it
@@ -264,17 +718,25 @@ static InterpretResult run() {
         push(valueType(a op b)); \
     } while (false)
 
+/* The compiler already proved both operands are numbers, so there is nothing to check */
+#define BINARY_OP_NN(valueType, op) \
+    do { \
+        double b = AS_NUMBER(pop()); \
+        double a = AS_NUMBER(pop()); \
+        push(valueType(a op b)); \
+    } while (false)
+
     for (;;) {
 
 #ifdef DEBUG_TRACE_EXECUTION
         // Stack Tracing (Printing contents of the VM's stack from bottom up)
-        printf("            ");
+        formatOutput("            ");
         for (Value* slot = vm.stack; slot < vm.stackTop; ++slot) {
-            printf("[");
+            formatOutput("[");
             printValue(*slot);
-            printf("]");
+            formatOutput("]");
         }
-        printf("\n");
+        formatOutput("\n");
 
         // When this flag is defined the VM disassembles and prints each instruction right before executing it    
         disassembleInstruction(&frame->closure->function->chunk, 
@@ -307,7 +769,9 @@ static InterpretResult run() {
             case OP_GET_GLOBAL: {
                 ObjString* name = READ_STRING();
                 Value value;
-                if (!tableGet(&vm.globals, name, &value)) {
+                /* A module's code falls back to the main script's globals, that's where the natives are */
+                if (!tableGet(frame->globals, name, &value) &&
+                    (frame->globals == &vm.globals || !tableGet(&vm.globals, name, &value))) {
                     runtimeError("Undefined variable '%s'.", name->chars);
                     return INTERPRET_RUNTIME_ERROR;
                 }
@@ -316,14 +780,14 @@ static InterpretResult run() {
             }
             case OP_DEFINE_GLOBAL: {
                 ObjString* name = READ_STRING(); /* We get the name of the variable from the constants table */
-                tableSet(&vm.globals, name, peek(0));
+                tableSet(frame->globals, name, peek(0));
                 pop();
                 break;
             }
             case OP_SET_GLOBAL: {
                 ObjString* name = READ_STRING();
-                if (tableSet(&vm.globals, name, peek(0))) {
-                    tableDelete(&vm.globals, name);
+                if (tableSet(frame->globals, name, peek(0))) {
+                    tableDelete(frame->globals, name);
                     runtimeError("Undefined variable '%s'.", name->chars);
                     return INTERPRET_RUNTIME_ERROR;
                 }
@@ -336,7 +800,12 @@ static InterpretResult run() {
             }
             case OP_SET_UPVALUE: {
                 uint8_t slot = READ_BYTE();
-                *frame->closure->upvalues[slot]->location = peek(0);
+                ObjUpvalue* upvalue = frame->closure->upvalues[slot];
+                if (upvalue->obj.frozen) {
+                    runtimeError("Can't assign to a variable captured by a frozen function.");
+                    return INTERPRET_RUNTIME_ERROR;
+                }
+                *upvalue->location = peek(0);
                 break;
             }
             case OP_EQUAL: {
@@ -348,9 +817,9 @@ static InterpretResult run() {
             case OP_GREATER:    BINARY_OP(BOOL_VAL, >); break;
             case OP_LESS:       BINARY_OP(BOOL_VAL, <); break;
             case OP_ADD: {
-                if (IS_STRING(peek(0)) && IS_STRING(peek(1))) 
-                    concatenate();
-                else if (IS_NUMBER(peek(0)) && IS_NUMBER(peek(1))) {
+                if (IS_STRING(peek(0)) && IS_STRING(peek(1))) {
+                    if (!concatenate()) return INTERPRET_RUNTIME_ERROR;
+                } else if (IS_NUMBER(peek(0)) && IS_NUMBER(peek(1))) {
                     double b = AS_NUMBER(pop());
                     double a = AS_NUMBER(pop());
                     push(NUMBER_VAL(a + b));
@@ -383,9 +852,20 @@ static InterpretResult run() {
                 }
                 push(NUMBER_VAL(-AS_NUMBER(pop())));
                 break;
+            case OP_GREATER_NN:     BINARY_OP_NN(BOOL_VAL, >); break;
+            case OP_LESS_NN:        BINARY_OP_NN(BOOL_VAL, <); break;
+            case OP_ADD_NN:         BINARY_OP_NN(NUMBER_VAL, +); break;
+            case OP_ADD_SS:
+                if (!concatenate()) return INTERPRET_RUNTIME_ERROR;
+                break;
+            case OP_SUBTRACT_NN:    BINARY_OP_NN(NUMBER_VAL, -); break;
+            case OP_MULTIPLY_NN:    BINARY_OP_NN(NUMBER_VAL, *); break;
+            case OP_DIVIDE_NN:      BINARY_OP_NN(NUMBER_VAL, /); break;
             case OP_PRINT: {
+                holdOutput();
                 printValue(pop());
-                printf("\n");
+                writeOutput("\n", 1);
+                releaseOutput();
                 break;
             }
             case OP_JUMP: {
@@ -402,6 +882,8 @@ static InterpretResult run() {
             case OP_LOOP: {
                 uint16_t offset = READ_SHORT();
                 frame->ip -= offset;
+                /* Everything is where it would be before the next instruction, so we can stop right here */
+                if (CHECK_BUDGET() && outOfFuel()) return INTERPRET_YIELD;
                 break;
             }
             case OP_CALL: {
@@ -409,12 +891,21 @@ static InterpretResult run() {
                 if (!callValue(peek(argCount), argCount)) {
                     return INTERPRET_RUNTIME_ERROR;
                 }
+                if (vm.parked) {
+                    /* A native would have blocked, we step back onto the call so it's retried on the next resume */
+                    vm.parked = false;
+                    frame->ip -= 2;
+                    leaveFiber(FIBER_PARKED, NIL_VAL);
+                    if (vm.fiber == baseFiber && vm.frameCount == baseFrame) return INTERPRET_OK;
+                }
                 frame = &vm.frames[vm.frameCount - 1];
+                if (CHECK_BUDGET() && outOfFuel()) return INTERPRET_YIELD;
                 break;
             }
             case OP_CLOSURE: {
                 ObjFunction* function = AS_FUNCTION(READ_CONSTANT());
                 ObjClosure* closure = newClosure(function);
+                closure->module = frame->closure->module;
                 push(OBJ_VAL(closure));
                 
                 /*
@@ -433,6 +924,7 @@ static InterpretResult run() {
                         closure->upvalues[i] = frame->closure->upvalues[index];
                     }
                 }
+                if (!SAFEPOINT()) return INTERPRET_RUNTIME_ERROR;
                 break;
             }
             case OP_CLOSE_UPVALUE:
@@ -446,12 +938,24 @@ static InterpretResult run() {
                 /* Discarding the function's CallFrame */
                 closeUpvalues(frame->slots);
                 vm.frameCount--;
+                countTopFrame();
 
-                if (vm.frameCount == 0) {
+                if (vm.frameCount == 0 && vm.fiber->caller != NULL) {
+                    /* A fiber's function returned. The fiber is done and the value goes to whoever resumed it. */
+                    vm.stackTop = vm.stack;
+                    leaveFiber(FIBER_DONE, result);
+                    if (vm.fiber == baseFiber && vm.frameCount == baseFrame) return INTERPRET_OK;
+                    frame = &vm.frames[vm.frameCount - 1];
+                    break;
+                }
+
+                if (vm.frameCount == baseFrame && vm.fiber == baseFiber) {
                 /* 
-                    If it was the ver last CallFrame, this means we finished executing top-level code/script 
+                    If it was the ver last CallFrame, this means we finished executing top-level code/script,
+                    or the function C asked us to call
                 */
-                    pop();
+                    vm.stackTop = frame->slots;
+                    push(result);
                     return INTERPRET_OK;
                 }
 
@@ -460,6 +964,98 @@ static InterpretResult run() {
                 frame = &vm.frames[vm.frameCount - 1]; /* Update the `run` function's  cached pointer */
                 break;
             }
+            case OP_RESUME: {
+                Value value = pop();
+                if (!IS_FIBER(peek(0))) {
+                    runtimeError("Can only resume fibers.");
+                    return INTERPRET_RUNTIME_ERROR;
+                }
+                ObjFiber* fiber = AS_FIBER(pop());
+                if (fiber->state == FIBER_RUNNING || fiber->state == FIBER_DONE) {
+                    runtimeError(fiber->state == FIBER_DONE ? "Can't resume a finished fiber." : "Can't resume a running fiber.");
+                    return INTERPRET_RUNTIME_ERROR;
+                }
+
+                fiber->caller = vm.fiber;
+                fiber->runDepth = vm.runDepth;
+                switchFiber(fiber);
+
+                if (fiber->state == FIBER_NEW) {
+                    /* The first value is the function's argument, if it takes one */
+                    ObjClosure* closure = AS_CLOSURE(vm.stack[0]);
+                    fiber->state = FIBER_RUNNING;
+                    if (!ensureCompiled(closure->function)) return INTERPRET_RUNTIME_ERROR;
+                    if (closure->function->arity > 1) {
+                        runtimeError("A fiber's function takes at most one argument.");
+                        return INTERPRET_RUNTIME_ERROR;
+                    }
+                    if (closure->function->arity == 1) push(value);
+                    if (!call(closure, closure->function->arity)) return INTERPRET_RUNTIME_ERROR;
+                } else {
+                    /* What the `yield` it's stopped at evaluates to, a parked fiber just makes its call again */
+                    if (fiber->state == FIBER_SUSPENDED) push(value);
+                    fiber->state = FIBER_RUNNING;
+                }
+                frame = &vm.frames[vm.frameCount - 1];
+                break;
+            }
+            case OP_YIELD: {
+                ObjFiber* fiber = vm.fiber;
+                if (fiber->caller == NULL) {
+                    runtimeError("Can't yield from the main fiber.");
+                    return INTERPRET_RUNTIME_ERROR;
+                }
+                if (fiber->runDepth != vm.runDepth) {
+                    /* The native that called back into the VM is still on the C stack, we can't leave it behind */
+                    runtimeError("Can't yield from a function called by a native.");
+                    return INTERPRET_RUNTIME_ERROR;
+                }
+
+                leaveFiber(FIBER_SUSPENDED, pop());
+                if (vm.fiber == baseFiber && vm.frameCount == baseFrame) return INTERPRET_OK;
+                frame = &vm.frames[vm.frameCount - 1];
+                break;
+            }
+            case OP_IMPORT: {
+                ObjString* path = READ_STRING();
+                ObjClosure* body;
+                const char* error;
+                ObjModule* module = importModule(path, &body, &error);
+                if (module == NULL) {
+                    runtimeError("%s '%s'.", error, path->chars);
+                    return INTERPRET_RUNTIME_ERROR;
+                }
+
+                /* The module stays below whatever its body returns, the compiler pops that */
+                push(OBJ_VAL(module));
+                if (body == NULL) {
+                    push(NIL_VAL);
+                    break;
+                }
+                push(OBJ_VAL(body));
+                if (!call(body, 0)) return INTERPRET_RUNTIME_ERROR;
+                frame = &vm.frames[vm.frameCount - 1];
+                break;
+            }
+            case OP_THROW:
+                throwValue(pop());
+                return INTERPRET_RUNTIME_ERROR;
+            case OP_GET_PROPERTY: {
+                ObjString* name = READ_STRING();
+                if (!IS_MODULE(peek(0))) {
+                    runtimeError("Only modules have properties.");
+                    return INTERPRET_RUNTIME_ERROR;
+                }
+                ObjModule* module = AS_MODULE(peek(0));
+                Value value;
+                if (!tableGet(&module->globals, name, &value)) {
+                    runtimeError("Module '%s' has no '%s'.", module->path->chars, name->chars);
+                    return INTERPRET_RUNTIME_ERROR;
+                }
+                pop();
+                push(value);
+                break;
+            }
         }
     }
 
@@ -468,18 +1064,143 @@ static InterpretResult run() {
 #undef READ_CONSTANT
 #undef READ_CONSTANT
 #undef BINARY_OP
+#undef BINARY_OP_NN
+}
+
+/*
+    An error the script catches comes out of `dispatch` like any other, with the catch block all set to run.
+    Going back in is all that's left, nothing on the way there had to know about try blocks.
+*/
+static InterpretResult execute(ObjFiber* baseFiber, int baseFrame) {
+    ObjFiber* catchFiber = vm.catchFiber;
+    int catchFrame = vm.catchFrame;
+    int catchDepth = vm.catchDepth;
+    vm.catchFiber = baseFiber;
+    vm.catchFrame = baseFrame;
+    vm.catchDepth = vm.runDepth;
+
+    InterpretResult result;
+    while ((result = dispatch(baseFiber, baseFrame)) == INTERPRET_RUNTIME_ERROR && vm.caught) {
+        vm.caught = false;
+    }
+
+    vm.catchFiber = catchFiber;
+    vm.catchFrame = catchFrame;
+    vm.catchDepth = catchDepth;
+    return result;
+}
+
+static InterpretResult run(int baseFrame) {
+    ++vm.runDepth;
+    InterpretResult result = execute(vm.fiber, baseFrame);
+    --vm.runDepth;
+    return result;
+}
+
+InterpretResult resumeFiber(ObjFiber* fiber) {
+    ObjFiber* main = vm.mainFiber;
+    int baseFrame = vm.frameCount;
+    fiber->caller = main;
+    fiber->runDepth = vm.runDepth + 1;
+    switchFiber(fiber);
+
+    if (fiber->state == FIBER_NEW) {
+        /* Whatever was put on the fiber's stack after the function are its arguments */
+        fiber->state = FIBER_RUNNING;
+        int argCount = (int)(vm.stackTop - vm.stack) - 1;
+        int catchDepth = vm.catchDepth;
+        vm.catchDepth = -1; /* See `callFunction` */
+        bool called = call(AS_CLOSURE(vm.stack[0]), argCount);
+        vm.catchDepth = catchDepth;
+        if (!called) return INTERPRET_RUNTIME_ERROR;
+    } else {
+        if (fiber->state == FIBER_SUSPENDED) push(NIL_VAL);
+        fiber->state = FIBER_RUNNING;
+    }
+
+    ++vm.runDepth;
+    InterpretResult result = execute(main, baseFrame);
+    --vm.runDepth;
+    if (result == INTERPRET_OK) pop(); /* What it yielded or returned */
+    return result;
+}
+
+bool canPark() {
+    ObjFiber* fiber = vm.fiber;
+    return fiber->caller == vm.mainFiber && fiber->runDepth == vm.runDepth;
+}
+
+void parkFiber() {
+    vm.parked = true;
+}
+
+/* Runs the script on the main fiber until it's done, fails or runs out of budget */
+static InterpretResult runScript() {
+    setCounterPhase(PHASE_RUN);
+    vm.yieldable = true;
+    ++vm.runDepth;
+    InterpretResult result = execute(vm.mainFiber, 0);
+    --vm.runDepth;
+    vm.yieldable = false;
+    setCounterPhase(PHASE_NONE);
+
+    vm.suspended = result == INTERPRET_YIELD;
+    if (result == INTERPRET_OK) pop(); /* The script's own return value */
+    flushOutput();
+    return result;
+}
+
+InterpretResult resumeVM() {
+    if (!vm.suspended) return INTERPRET_OK;
+    return runScript();
 }
 
 InterpretResult interpret(const char* source) {
-    ObjFunction* function = compile(source);
-    if (function == NULL) return INTERPRET_COMPILE_ERROR;
+    /* A script nobody resumed is dropped, the new one starts on an empty stack */
+    if (vm.suspended) {
+        resetStack();
+        vm.suspended = false;
+    }
+
+    setCounterPhase(PHASE_COMPILE);
+    ValueArray imports;
+    initValueArray(&imports);
+    ObjFunction* function = compileWithImports(source, &imports);
+
+    /* Nothing reaches `run()` without going through the verifier first */
+    if (function == NULL || !verifyFunction(function)) {
+        freeValueArray(&imports);
+        setCounterPhase(PHASE_NONE);
+        return INTERPRET_COMPILE_ERROR;
+    }
+
+    /* The modules it imports are compiled before it starts, several at once */
+    preloadModules(&imports);
+    freeValueArray(&imports);
 
     push(OBJ_VAL(function));
     ObjClosure* closure = newClosure(function);
     pop();
     push(OBJ_VAL(closure));
     call(closure, 0);
+    return runScript();
+}
+
+InterpretResult callFunction(int argCount) {
+    int baseFrame = vm.frameCount;
+
+    /*
+        An error making the call is for C to deal with. A try around the native that called us mustn't catch it,
+        the native is still running.
+    */
+    int catchDepth = vm.catchDepth;
+    vm.catchDepth = -1;
+    bool called = callValue(peek(argCount), argCount);
+    vm.catchDepth = catchDepth;
+    if (!called) return INTERPRET_RUNTIME_ERROR;
 
-    return run();
+    /* Natives are done already and left their result on the stack */
+    if (vm.frameCount == baseFrame) return INTERPRET_OK;
+    return run(baseFrame);
 }
 
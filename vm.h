@@ -2,38 +2,75 @@
 #define clox_vm_h
 
 #include "chunk.h"
+#include "gc.h"
+#include "object.h"
 #include "value.h"
 #include "table.h"
 
+/* The most any fiber's stack can grow to, the main fiber starts out with all of it */
 #define FRAMES_MAX 64
 #define STACK_MAX (FRAMES_MAX * UINT8_COUNT)
 
-/*
-    So for each function call that hasn’t returned yet we need to track where on the stack that function’s locals begin, 
-    and where the caller should resume. We’ll put this, along with some other stuff, in a new struct.
-
-    This struct represent a single ongoing function    
-*/
-typedef struct {
-    ObjClosure* closure;
-    uint8_t* ip;
-    Value* slots;   /* This will point the the VM's value stack at the first slot the function can use */
-} CallFrame;
+/* Where the stack of a fiber made by `fiber()` starts out */
+#define FIBER_FRAMES 8
+#define FIBER_STACK 64
 
 typedef struct {
 /*
+    The stack registers of the running fiber. They're copies of the fiber's own fields so that `push()` and `pop()`
+    don't have to go through the fiber, and they get written back whenever we switch to another one.
+
     This array replaces the `chunk` and `ip` fields we used to have directly in the VM. Now each CallFrame has its own `ip` 
     and its own pointer to the ObjFunction that it’s executing. From there, we can get to the function’s chunk.
 */
-    CallFrame frames[FRAMES_MAX];
+    CallFrame* frames;
     int frameCount; /* Stores the current height of the `CallFrame` stak */
 
-    Value stack[STACK_MAX];
+    Value* stack;
     Value* stackTop;
+    ObjUpvalue* openUpvalues;
+
+    ObjFiber* fiber;        /* The one running */
+    ObjFiber* mainFiber;    /* The one scripts start on, it has no caller to yield to */
+    int runDepth;           /* How many `run()`s are nested, natives calling back into the VM add one each */
+
+    /* A throw only unwinds as far as where the innermost `execute` started, see `findCatch` */
+    ObjFiber* catchFiber;
+    int catchFrame;
+    int catchDepth;         /* The `runDepth` of that `execute`, -1 while C is getting a call going */
+    bool caught;            /* The error was caught, `execute` carries on in the catch block */
+
     Table globals;
     Table strings;
-    ObjUpvalue* openUpvalues;
-    Obj* objects;   /* The VM stors a pointer to the head of the Obj's list */
+    Table modules;  /* Every module imported so far, by its resolved path and by the paths it was imported as */
+
+    /* What the globals and the modules were at the last checkpoint, `resetVM` puts them back */
+    Table checkpointGlobals;
+    Table checkpointModules;
+
+    /* Every object on the heap, in pages the collector sweeps in parallel. New ones go in the first page with room. */
+    HeapPage** pages;
+    int pageCount;
+    int pageCapacity;
+    int fillingPage;
+    ObjFiber* fibers;       /* Linked through `nextFiber` */
+    size_t bytesAllocated;  /* Everything `reallocate` handed out and didn't get back yet */
+    size_t nextGC;          /* The collector runs at the next safepoint once `bytesAllocated` is past this */
+    size_t heapLimit;       /* `nextGC` never goes past it, see `setHeapLimit` */
+    void* reserve;          /* MEMORY_RESERVE bytes to let go of when malloc fails */
+    bool outOfMemory;       /* It did, the next safepoint fails */
+
+    /* A native that fails sets these through `nativeError`, the VM turns them into a runtime error */
+    bool nativeFailed;
+    char nativeError[256];
+    bool parked;    /* Set through `parkFiber` */
+
+    /* Loops and calls count against the budget, see `setBudget` */
+    long budget;            /* How many a slice gets, 0 for no limit */
+    long fuel;              /* What's left of the current slice */
+    atomic_bool interrupted;
+    bool yieldable;         /* The run in progress is a script's, which can stop and be resumed */
+    bool suspended;         /* The script stopped with INTERPRET_YIELD and waits for `resumeVM` */
 } VM;
 
 /*
@@ -42,20 +79,87 @@ typedef struct {
 typedef enum {
     INTERPRET_OK,
     INTERPRET_COMPILE_ERROR,
-    INTERPRET_RUNTIME_ERROR
+    INTERPRET_RUNTIME_ERROR,
+    INTERPRET_YIELD         /* Out of budget or interrupted, `resumeVM` carries on */
 } InterpretResult;
 
-extern VM vm;
+/* Every thread runs a VM of its own */
+extern _Thread_local VM vm;
 
 void initVM();
 void freeVM();
 
+/*
+    Running many short scripts doesn't need a fresh VM for each. `initVM` takes a checkpoint once the natives
+    are defined, `checkpointVM` takes another, after a prelude say. `resetVM` puts the globals and modules back
+    the way they were at the checkpoint, in the tables they already have, and collects: what the script left
+    behind is freed, the heap pages, the main fiber's stack and the natives stay. Objects the checkpoint kept
+    aren't rolled back, a script that assigns to a prelude's module or closes over its upvalues leaves that behind.
+*/
+void checkpointVM();
+void resetVM();
+
 /*
     The 'interpret' function will be the VM's entrypoint. 
     The VM runs the chunk and then responds with an enum value.
 */
 InterpretResult interpret(const char* source); 
 
+/*
+    A VM's heap can be given a limit in bytes, so one script can't take all the memory of a host running many.
+    Once an instruction takes the heap past it, the next safepoint collects, and if that didn't get it back
+    under the limit the script fails with a runtime error. One instruction can go past the limit by what it
+    allocates itself, a concatenation or a native's result. The same error comes when malloc fails, the VM
+    has a reserve to let go of to get that far.
+
+    Sets the limit of the current VM and of every VM made after, threads and workers included. 0 is no limit.
+*/
+void setHeapLimit(size_t bytes);
+
+/*
+    Hosts running scripts they don't trust give them a budget: every backward jump and every call uses up one,
+    and once a slice of `budget` is gone the script stops where it is and `interpret` returns INTERPRET_YIELD.
+    Its stack, frames and fibers stay as they are until `resumeVM` gives it another slice and carries on, or
+    `resetVM` drops it. `interruptVM` stops it the same way at its next loop or call, it only stores a flag so
+    a signal handler or another thread can call it, with the `&vm` of the thread running the script.
+
+    Only the script itself stops. Running inside a native that called back into the VM it keeps going until it's
+    back in the script, a function called from C with `callFunction` never stops. A budget of 0 is no limit.
+*/
+void setBudget(long budget);
+void interruptVM(VM* target);
+InterpretResult resumeVM();
+
+/*
+    Calls a function from C. Push the function and then its `argCount` arguments, on success the function's
+    return value replaces them on top of the stack.
+*/
+InterpretResult callFunction(int argCount);
+
+/*
+    Runs a fiber from C until it yields, parks or returns, and drops whatever it handed back. The fiber's state
+    tells which of those it was. Used by the scheduler and the event loop, which resume their fibers from the main one.
+*/
+InterpretResult resumeFiber(ObjFiber* fiber);
+
+/*
+    A native that would block can park the running fiber instead, if `canPark()` says it was resumed by the main
+    fiber and no native is in between. Only the scheduler and the event loop do that. After `parkFiber()` whatever the native returns is dropped, the fiber stops in state
+    FIBER_PARKED and the whole call is made again the next time it's resumed.
+*/
+bool canPark();
+void parkFiber();
+
+/*
+    Natives are plain C functions the scripts can call, `defineNative` makes one a global. A native reports a
+    problem by returning `nativeError(...)`, the call then fails with a runtime error carrying that message.
+*/
+void defineNative(const char* name, NativeFn function);
+Value nativeError(const char* format, ...);
+
+/* What `argument(n)` hands the script, the strings have to outlive every VM */
+void setScriptArguments(int count, char** arguments);
+
 /* Defining the stack protocol for the VM */
 void push(Value value);
 Value pop();